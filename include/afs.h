@@ -8,6 +8,7 @@ extern "C"
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "vfs.h"
 
 #ifndef VIFS_OS
@@ -47,6 +48,11 @@ Block Calculation
 
 #define AFS_DEFAULT_BLOCK_SIZE 4096
 #define AFS_MAX_NAME_SIZE 50
+#define AFS_INODE_SLAB_COUNT 256
+#define AFS_DIRECTORY_ENTRIES 256	// index slots in a directory block
+
+// Gap (in bytes) between readv segments that is read through rather than split into two disk reads
+#define AFS_READV_MAX_GAP AFS_DEFAULT_BLOCK_SIZE
 
 #define AFS_BLOCK_TYPE_UNKNOWN 0
 #define AFS_BLOCK_TYPE_FILE 1
@@ -100,7 +106,7 @@ typedef struct {
 
 typedef struct {
 	uint32_t 	type;			// Type, always AFS_BLOCK_TYPE_DIRECTORY
-	uint32_t	index[256];		// Block index for things in this directory
+	uint32_t	index[AFS_DIRECTORY_ENTRIES];	// Block index for things in this directory
 	uint32_t	next_index;		// next index free
 	uint32_t	reserved_1;
 	uint32_t	reserved_2;
@@ -112,32 +118,49 @@ typedef struct {
 	uint32_t	reserved_8;
 } __attribute__((packed)) afs_block_directory;
 
+typedef struct {
+	uint8_t fs_id;
+	uint64_t blockdev;						// drive number of the image
+	afs_drive *drive;
+	afs_block_meta_data *block_meta_data;
+	afs_block_directory *root_dir;
+	vfs_lock alloc_lock;					// block allocation and the drive info
+} afs_volume;
+
 typedef struct {
 	inode_id vfs_id;
 	uint32_t block_id;
-	bool open;
-	void *next;
+	uint32_t open;							// handles open on it
+	afs_volume *volume;
 } afs_inode;
 
 int afs_initalize( void );
 int afs_mount( inode_id id, char *path, uint8_t *data_root );
-int afs_load_directory_as_inodes( inode_id parent_inode, afs_block_directory *dir );
-int afs_load_block_as_inode( afs_block_meta_data *meta );
-vfs_directory_list *afs_dir_list( inode_id id, vfs_directory_list *list );
-inode_id afs_find_inode_from_block_id( uint32_t block_id );
+vfs_inode *afs_load_inode( inode_id id );
+void afs_evict_inode( vfs_inode *node );
+int afs_opendir( inode_id id, vfs_dir_iter *it );
+int afs_readdir( vfs_dir_iter *it );
 afs_inode *afs_lookup_by_inode_id( inode_id id );
 int afs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset );
-int afs_create( inode_id parent, uint8_t type, char *path, char *name );
+int afs_read_ref( inode_id id, uint64_t offset, uint64_t size, vfs_page_ref *ref );
+int afs_create( inode_id parent, uint8_t type, char *name );
 int afs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset );
-int afs_open( inode_id id );
+int afs_open( inode_id id, vfs_handle *h );
+void afs_close( vfs_handle *h );
+int afs_read_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset );
+int afs_write_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset );
+void afs_handle_load_extents( vfs_handle *h );
+int afs_readv( inode_id id, vfs_iovec *iov, uint32_t count );
+int afs_writev( inode_id id, vfs_iovec *iov, uint32_t count );
+int afs_reserve( afs_inode *inode, uint64_t end );
 int afs_stat( inode_id id, vfs_stat_data *stat );
-uint8_t *afs_read_block( uint32_t block_id, uint64_t size, uint8_t *data );
-uint8_t *afs_write_block( uint32_t block_id, uint64_t size, uint8_t *data );
-int afs_write_meta( uint32_t block_id );
-int afs_write_directory( uint32_t block_id, afs_block_directory *dir );
-int afs_write_drive_info( afs_drive *drive_info );
+uint8_t *afs_read_block( afs_volume *vol, uint32_t block_id, uint64_t size, uint8_t *data );
+uint8_t *afs_write_block( afs_volume *vol, uint32_t block_id, uint64_t size, uint8_t *data );
+int afs_write_meta( afs_volume *vol, uint32_t block_id );
+int afs_write_directory( afs_volume *vol, uint32_t block_id, afs_block_directory *dir );
+int afs_write_drive_info( afs_volume *vol );
 
-void afs_dump_diagnostic_data( void );
+void afs_dump_diagnostic_data( uint64_t blockdev );
 
 #ifdef VIFS_DEV
 	void afs_bootstrap( FILE *fp, uint64_t size );
@@ -21,6 +21,16 @@ extern "C"
 #define RFS_FILE_TYPE_LINK 2
 #define RFS_FILE_TYPE_DEVICE 3
 
+#define RFS_SLAB_COUNT 64
+#define RFS_GENERATED_MAX (32 * 1024)	// largest generated file, longer text is cut off
+
+/**
+ * @brief Writes a generated file's contents into buffer
+ * 
+ * @return uint64_t length of the full text, may be past size like snprintf
+ */
+typedef uint64_t (*rfs_generator)( char *buffer, uint64_t size );
+
 typedef struct {
     inode_id vfs_inode_id;
     inode_id vfs_parent_inode_id;
@@ -29,6 +39,7 @@ typedef struct {
     char name[VFS_NAME_MAX];
     uint8_t *data;
     uint64_t size;
+    rfs_generator generate;    // set for files whose contents are made on open, read only
 
     void *dir_list;
 } rfs_file;
@@ -56,13 +67,21 @@ typedef struct {
 
 int rfs_initalize( void );
 rfs_file *rfs_lookup_by_inode_id( inode_id id );
-int rfs_open( inode_id id );
+int rfs_open( inode_id id, vfs_handle *h );
+int rfs_read_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset );
+int rfs_write_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset );
+int rfs_readv( inode_id id, vfs_iovec *iov, uint32_t count );
+int rfs_writev( inode_id id, vfs_iovec *iov, uint32_t count );
+int rfs_read_file( rfs_file *f, uint8_t *data, uint64_t size, uint64_t offset );
+int rfs_write_file( rfs_file *f, uint8_t *data, uint64_t size, uint64_t offset );
 int rfs_mount( inode_id id, char *path, uint8_t *data_root );
-int rfs_create( inode_id parent, uint8_t type, char *path, char *name );
+int rfs_create( inode_id parent, uint8_t type, char *name );
+int rfs_create_generated( inode_id parent, char *name, rfs_generator generate );
 int rfs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset );
 int rfs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset );
 int rfs_stat( inode_id id, vfs_stat_data *stat );
-vfs_directory_list *rfs_dir_list( inode_id id, vfs_directory_list *list );
+int rfs_opendir( inode_id id, vfs_dir_iter *it );
+int rfs_readdir( vfs_dir_iter *it );
 
 #ifdef __cplusplus
 }
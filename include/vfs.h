@@ -6,6 +6,10 @@ extern "C"
 {
 #endif
 
+#if !defined(VIFS_OS_ENV) && !defined(_GNU_SOURCE)
+	#define _GNU_SOURCE				// O_DIRECT for the host image backends, before any libc header
+#endif
+
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -27,6 +31,8 @@ extern "C"
 	#define vfs_disk_read_no_cache vfs_disk_read_test_no_cache
 	#define vfs_disk_write vfs_disk_write_test
 	#define vfs_disk_write_no_cache vfs_disk_write_test_no_cache
+	#define vfs_disk_sync vfs_disk_sync_test
+	#define vfs_disk_size vfs_disk_size_test
 	#define vfs_strlen strlen
 #else
 	#include <kernel_common.h>
@@ -41,13 +47,131 @@ extern "C"
 	#define vfs_strlen kstrlen
 #endif
 
+// Locking. The host build runs the vfs from many threads, the kernel from one for now
+#ifdef VIFS_DEV
+	#include <pthread.h>
+
+	typedef pthread_mutex_t vfs_lock;
+	typedef pthread_rwlock_t vfs_rwlock;
+
+	#define vfs_lock_initalize( l ) pthread_mutex_init( (l), NULL )
+	#define vfs_lock_acquire( l ) pthread_mutex_lock( l )
+	#define vfs_lock_release( l ) pthread_mutex_unlock( l )
+	#define vfs_rwlock_initalize( l ) pthread_rwlock_init( (l), NULL )
+	#define vfs_rwlock_read( l ) pthread_rwlock_rdlock( l )
+	#define vfs_rwlock_write( l ) pthread_rwlock_wrlock( l )
+	#define vfs_rwlock_release( l ) pthread_rwlock_unlock( l )
+	#define VFS_THREAD_LOCAL __thread
+#else
+	typedef int vfs_lock;
+	typedef int vfs_rwlock;
+
+	#define vfs_lock_initalize( l ) ((void)(l))
+	#define vfs_lock_acquire( l ) ((void)(l))
+	#define vfs_lock_release( l ) ((void)(l))
+	#define vfs_rwlock_initalize( l ) ((void)(l))
+	#define vfs_rwlock_read( l ) ((void)(l))
+	#define vfs_rwlock_write( l ) ((void)(l))
+	#define vfs_rwlock_release( l ) ((void)(l))
+	#define VFS_THREAD_LOCAL
+#endif
+
+// Counters and reference counts shared between threads
+#define vfs_atomic_add( p, v ) __atomic_add_fetch( (p), (v), __ATOMIC_RELAXED )
+#define vfs_atomic_inc( p ) __atomic_add_fetch( (p), 1, __ATOMIC_ACQ_REL )
+#define vfs_atomic_dec( p ) __atomic_sub_fetch( (p), 1, __ATOMIC_ACQ_REL )
+#define vfs_atomic_load( p ) __atomic_load_n( (p), __ATOMIC_ACQUIRE )
+#define vfs_atomic_store( p, v ) __atomic_store_n( (p), (v), __ATOMIC_RELEASE )
+
 typedef uint64_t inode_id;
 
 #define VFS_VERSION 2
 #define VFS_NAME_MAX 50
 
+#define VFS_INODE_TABLE_INITIAL_BITS 8
+#define VFS_INODE_SLAB_COUNT 256
+#define VFS_INODE_UNUSED_MAX 1024		// unreferenced inodes kept before the LRU one is evicted
+#define VFS_INODE_ID_FS_SHIFT 24		// ids below 1 << 24 are handed out by vfs_allocate_inode
+#define VFS_DCACHE_INITIAL_BITS 8
+#define VFS_DCACHE_SLAB_COUNT 128
+#define VFS_DCACHE_MAX 4096
+#define VFS_SCRATCH_SIZE (64 * 1024)
+#define VFS_PAGE_SHIFT 12
+#define VFS_PAGE_SIZE (1 << VFS_PAGE_SHIFT)
+#define VFS_PAGE_SLAB_COUNT 64
+#define VFS_PAGE_CACHE_INITIAL_BITS 4	// buckets per shard to start with
+#define VFS_PAGE_CACHE_MAX_PAGES 1024	// default budget, 4 MiB of page data
+#define VFS_PAGE_CACHE_MIN_PAGES VFS_CACHE_SHARDS	// one page per shard
+#define VFS_PAGE_GHOST_BITS 6			// 2Q ghost buckets per shard
+#define VFS_CACHE_SHARD_BITS 4
+#define VFS_CACHE_SHARDS (1 << VFS_CACHE_SHARD_BITS)	// page cache partitions, picked by the top bits of the page hash
+
+#define VFS_FLUSH_INTERVAL_MS 500		// background flusher period
+#define VFS_DIRTY_EXPIRE_TICKS 6		// pages dirty for this many flusher ticks get written back
+#define VFS_DIRTY_BACKGROUND_RATIO 10	// percent of max_pages dirty before the flusher writes back everything
+#define VFS_DIRTY_RATIO 40				// percent of max_pages dirty before writers write back themselves
+#define VFS_FLUSH_RUN_PAGES 64			// most pages merged into one disk write, 256 KiB
+#define VFS_FLUSH_BATCH_PAGES 1024		// most pages taken per write back pass
+#define VFS_READAHEAD_STREAMS 8			// sequential readers tracked at once
+#define VFS_READAHEAD_MIN_PAGES 4		// first window once a stream looks sequential
+#define VFS_READAHEAD_MAX_PAGES 64		// window stops doubling here, 256 KiB
+#define VFS_READAHEAD_QUEUE 16			// windows waiting for the readahead thread
+
+#define VFS_IO_CLASS_OTHER 0			// anything issued without a hint, write back from the flusher included
+#define VFS_IO_CLASS_META 1
+#define VFS_IO_CLASS_DIRECTORY 2
+#define VFS_IO_CLASS_FILE 3
+#define VFS_IO_CLASS_MAX 4
+
+#define VFS_METRIC_HIT 0				// cache read or write served without the disk
+#define VFS_METRIC_MISS 1				// cache read or write that went to the disk
+#define VFS_METRIC_DISK_READ 2
+#define VFS_METRIC_DISK_WRITE 3
+#define VFS_METRIC_MAX 4
+
+#define VFS_METRICS_MOUNTS 8			// fs ids below this get their own metrics, the rest share slot 0
+#define VFS_LATENCY_BUCKETS 24			// bucket n counts latencies below 2^n ns, the last one everything slower
+#define VFS_METRICS_ALL 0xFF			// wildcard for vfs_metrics_sum
+#define VFS_METRICS_HIT_SAMPLE 64		// one cache call in this many is timed from its start, misses are always timed
+
+#define VFS_CACHE_CLASS_NORMAL 0		// file data, left to the replacement policy
+#define VFS_CACHE_CLASS_PINNED 1		// metadata and directories, evicted only past VFS_CACHE_PINNED_PERCENT or when nothing else is left
+#define VFS_CACHE_CLASS_STREAM 2		// bulk sequential copies, evicted before anything else so they don't push out other pages
+#define VFS_CACHE_CLASS_MAX 3
+#define VFS_CACHE_PINNED_PERCENT 50		// most of a shard pinned pages keep to themselves
+
+#define VFS_WRITE_BACK 0				// writes dirty the cache, the flusher or vfs_fsync takes them to the disk
+#define VFS_WRITE_THROUGH 1				// writes go to the disk and the drive is synced before they return, the cache keeps a clean copy
+#define VFS_WRITE_AROUND 2				// writes go to the disk, only pages already cached are updated
+#define VFS_WRITE_POLICY_MAX 3
+
+#define VFS_DISK_BACKEND_STDIO 0		// host image through fseek and fread/fwrite on fp, one request at a time
+#define VFS_DISK_BACKEND_MMAP 1			// host image mapped shared, requests are memcpys and run side by side
+#define VFS_DISK_BACKEND_PREAD 2		// pread/pwrite on a private fd, no shared file position so requests run side by side
+#define VFS_DISK_BACKEND_DIRECT 3		// as PREAD but opened O_DIRECT, bypassing the host page cache
+#define VFS_DISK_BACKEND_URING 4		// as PREAD, plus an io_uring so submitted requests are in flight together
+#define VFS_DISK_BACKEND_MAX 5
+
+#define VFS_DISK_DIRECT_ALIGN 4096		// O_DIRECT offset, length and buffer alignment, unaligned requests are bounced
+#define VFS_DISK_QUEUE_DEPTH 32			// default requests in flight on an io_uring backend
+#define VFS_DISK_QUEUE_DEPTH_MAX 4096
+#define VFS_DISK_SPLIT_PAGES 4			// smallest piece a read window is split into to fill the queue
+#define VFS_DISK_MERGE_MAX_PAGES 256	// largest request vfs_disk_io merges neighbours into without a queue, 1 MiB
+#define VFS_DISK_PLUG_RANGES 32			// page ranges a plug holds before writing them out early
+
+#define VFS_CACHE_POLICY_CLOCK 0
+#define VFS_CACHE_POLICY_2Q 1
+#define VFS_CACHE_POLICY_MAX 2
+
+#define VFS_PAGE_QUEUE_NONE 0
+#define VFS_PAGE_QUEUE_A1IN 1			// 2Q: seen once, FIFO
+#define VFS_PAGE_QUEUE_AM 2				// 2Q: seen again after leaving A1in
+
 #define FS_TYPE_RFS 0
 #define FS_TYPE_AFS 1
+#define FS_TYPE_MAX 8
+
+#define VFS_PROC_PATH "/proc"			// an RFS mounted here gets the metrics files
 
 #define VFS_INODE_TYPE_FILE 1
 #define VFS_INODE_TYPE_DIR 2
@@ -65,6 +189,23 @@ typedef uint64_t inode_id;
 #define VFS_ERROR_UNKNOWN_FS -7
 #define VFS_ERROR_FILE_NOT_FOUND -8
 #define VFS_ERROR_NOT_A_DEVICE -9
+#define VFS_ERROR_BAD_HANDLE -10
+#define VFS_ERROR_NO_SPACE -11
+#define VFS_ERROR_BAD_NAME -12
+#define VFS_ERROR_READ_ONLY -13
+
+/**
+ * Inode ids a file system can rebuild on demand carry the fs id above
+ * VFS_INODE_ID_FS_SHIFT, the lower bits are the fs's own object number.
+ */
+#define VFS_INODE_ID( fs_id, n ) ( ((inode_id)(fs_id) << VFS_INODE_ID_FS_SHIFT) | (inode_id)(n) )
+#define VFS_INODE_ID_FS( id ) ( (uint8_t)((id) >> VFS_INODE_ID_FS_SHIFT) )
+#define VFS_INODE_ID_LOCAL( id ) ( (id) & ((1ULL << VFS_INODE_ID_FS_SHIFT) - 1) )
+
+#define VFS_MAX_HANDLES 256
+#define VFS_MAX_DRIVES 16				// block devices in the registry, the drive argument of vfs_disk_ indexes it
+#define VFS_HANDLE_MAX_EXTENTS 4
+#define VFS_IOV_STACK_COUNT 16
 
 /**
  * @brief Directory list
@@ -79,23 +220,183 @@ typedef struct {
 	void *data; // Pointer to the device structure for the represented device
 } vfs_device;
 
+/**
+ * @brief A registered block device, its drive number is its place in the registry
+ * 
+ * Pages in the cache are keyed by drive number, so every block device has
+ * its own part of the cache.
+ */
+typedef struct {
+	char name[VFS_NAME_MAX];	// what a file system's mount data names it by, empty for a free slot
+	void *data;					// the driver's, a vfs_disk_image on the host
+} vfs_blockdev;
+
+#ifdef VIFS_DEV
+/**
+ * @brief Host image file standing in for a drive
+ * 
+ */
+typedef struct {
+	FILE *fp;
+	uint8_t backend;		// VFS_DISK_BACKEND_
+	uint8_t *map;			// the whole image, VFS_DISK_BACKEND_MMAP only
+	uint64_t map_size;
+	int fd;					// own open of the image, VFS_DISK_BACKEND_PREAD, _DIRECT and _URING only
+	vfs_lock lock;			// stdio's file position, O_DIRECT's read-modify-writes and backend switches
+} vfs_disk_image;
+#endif
+
+struct vfs_operations;
+struct vfs_page_ref;
+
 /**
  * @brief Inode structure, representing a file/dir/etc on disk
  * 
+ * Wide members first, byte-sized members packed at the end to avoid padding.
+ * 
+ * Open handles, positive dentries and mounts hold references. An inode
+ * with no references whose fs can load it again sits on the unused LRU
+ * and is evicted once that list grows past its limit.
+ * 
+ * lock is held for reading around fs reads, stats and readdir, and for
+ * writing around fs writes and creates in the directory.
  */
 typedef struct {
-	uint8_t type;   		// Type of inode
-	uint8_t fs_type;		// File system that controls this inode
-	uint8_t fs_id;			// File system id for the inode
 	inode_id id;			// inode id
-	bool is_mount_point;	// true if this is a mount point for a fs
+	struct vfs_operations *op;	// operations of the fs that controls this inode, NULL if none
 	vfs_directory *dir_inodes;	// used for directory listing
 
 	vfs_device *dev;		// for use if inode is a device
 
 	void *next_inode;		// for vfs management
+	void *fs_data;			// owning fs's in memory state for the inode
+	inode_id parent;		// directory this inode was last reached from, 0 if never walked to
+
+	void *lru_prev;			// unused LRU, only valid while on_lru
+	void *lru_next;
+	uint32_t refcount;
+
+	vfs_rwlock lock;
+
+	uint8_t type;   		// Type of inode
+	uint8_t fs_type;		// File system that controls this inode
+	uint8_t fs_id;			// File system id for the inode
+	bool is_mount_point;	// true if this is a mount point for a fs
+	bool on_lru;
+	bool referenced;		// looked up since it joined the unused LRU, gets a second chance
 } vfs_inode;
 
+/**
+ * @brief Fixed size object allocator
+ * 
+ * Objects are carved out of slabs of objects_per_slab entries. Free objects
+ * are chained through their first word, so object_size must be at least
+ * sizeof(void *).
+ */
+typedef struct {
+	char *name;
+	uint32_t object_size;
+	uint32_t objects_per_slab;
+	void *free_list;		// next free object
+	void *slabs;			// chain of slab chunks, linked through their first word
+	uint64_t slab_count;
+	uint64_t in_use;
+	uint64_t allocs;		// objects handed out over the slab's lifetime
+	vfs_lock lock;
+
+	void *next;				// registry of every slab, for diagnostics
+} vfs_slab;
+
+/**
+ * @brief Bump allocator for temporary buffers that die with the operation
+ * 
+ * Save a mark when an operation starts and restore it when the operation
+ * ends, everything allocated in between is released at once. Requests
+ * that don't fit fall back to vfs_malloc and are freed on restore.
+ */
+typedef struct {
+	uint8_t *base;
+	uint64_t size;
+	uint64_t used;
+	uint64_t high_water;
+	void *overflow;			// chain of oversized allocations, newest first
+	uint64_t overflow_count;
+} vfs_arena;
+
+/**
+ * @brief Position in an arena to roll back to
+ * 
+ */
+typedef struct {
+	uint64_t used;
+	void *overflow;
+} vfs_arena_mark;
+
+/**
+ * @brief Open addressed (linear probe) index of inode id to vfs_inode
+ * 
+ * Lookups take lock for reading. lru_lock covers the unused LRU and is
+ * always taken before lock.
+ */
+typedef struct {
+	vfs_rwlock lock;
+	vfs_lock lru_lock;
+	vfs_lock load_lock;		// one fs load_inode at a time, so an id is never loaded twice
+
+	vfs_inode **slot;
+	uint8_t bits;			// table holds 1 << bits slots
+	uint64_t count;
+
+	vfs_inode *lru_head;	// most recently used unreferenced inode
+	vfs_inode *lru_tail;	// next to be evicted
+	uint64_t unused;
+	uint64_t unused_max;
+
+	uint64_t loads;
+	uint64_t evictions;
+} vfs_inode_table;
+
+/**
+ * @brief Dentry cache entry, maps (parent inode, name) to an inode id
+ * 
+ * An id of 0 is a negative entry: the name is known not to exist in parent.
+ */
+typedef struct {
+	inode_id parent;
+	inode_id id;
+	vfs_inode *node;		// referenced inode, NULL for a negative entry
+	uint32_t hash;
+	bool referenced;		// hit since it was last considered for eviction
+	char name[VFS_NAME_MAX];
+
+	void *next;				// hash chain
+	void *lru_prev;
+	void *lru_next;
+} vfs_dentry;
+
+/**
+ * @brief Chained hash table of dentries
+ * 
+ * Lookups take lock for reading and only mark the hit dentry referenced,
+ * adds, evictions and invalidations take it for writing.
+ */
+typedef struct {
+	vfs_rwlock lock;
+	vfs_dentry **bucket;
+	uint8_t bits;			// table holds 1 << bits buckets
+	uint64_t count;
+
+	uint64_t max;
+
+	vfs_dentry *lru_head;	// most recently used
+	vfs_dentry *lru_tail;	// next to be evicted
+
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+	uint64_t evictions;
+} vfs_dentry_cache;
+
 /**
  * @brief Lists directory item names with associated inode ptr. 
  * 
@@ -116,9 +417,36 @@ typedef struct {
  */
 typedef struct {
 	vfs_directory_item *entry;
-	uint16_t count;
+	uint32_t count;
 } vfs_directory_list;
 
+/**
+ * @brief Directory entry returned by vfs_readdir
+ * 
+ */
+typedef struct {
+	inode_id id;
+	uint8_t type;			// VFS_INODE_TYPE_ of the entry
+	char name[VFS_NAME_MAX];
+} vfs_dirent;
+
+/**
+ * @brief Directory cursor, filled in by vfs_opendir
+ * 
+ * Lives wherever the caller puts it (usually the stack), readdir only
+ * updates it in place.
+ */
+typedef struct {
+	inode_id dir;
+	vfs_inode *node;		// the directory, referenced until vfs_closedir
+	struct vfs_operations *op;
+	uint64_t position;		// index of the next entry
+	uint64_t count;			// entries in the directory when it was opened
+	void *fs_data;			// fs private cursor state
+	uint64_t fs_offset;		// fs private cursor state
+	vfs_dirent entry;		// most recently read entry
+} vfs_dir_iter;
+
 /**
  * @brief Stat structure, representing a file
  * 
@@ -127,109 +455,515 @@ typedef struct {
 	uint32_t size;
 } vfs_stat_data;
 
+/**
+ * @brief Contiguous run of a file on disk
+ * 
+ */
+typedef struct {
+	uint64_t file_offset;	// offset in the file where this run starts
+	uint64_t disk_offset;	// byte offset on disk of file_offset
+	uint64_t length;		// length of the run, in bytes
+} vfs_extent;
+
+/**
+ * @brief One segment of a vectored read or write
+ * 
+ */
+typedef struct {
+	uint8_t *data;			// buffer to read into or write from
+	uint64_t size;			// bytes to transfer
+	uint64_t offset;		// offset in the file
+} vfs_iovec;
+
+/**
+ * @brief Open file handle, holds everything resolved at open time
+ * 
+ * A handle's cursor belongs to one thread at a time, open separate handles
+ * to read a file from several threads.
+ */
+typedef struct {
+	bool in_use;
+	inode_id id;
+	vfs_inode *node;
+	struct vfs_operations *op;
+	void *fs_data;			// fs private: afs_inode, rfs_file
+	uint64_t cursor;		// current position for handle reads and writes
+	uint64_t size;			// file size, kept current by the fs
+	uint32_t extent_count;
+	vfs_extent extent[VFS_HANDLE_MAX_EXTENTS];
+} vfs_handle;
+
 /**
  * @brief Operations to use for the given VFS
  * 
- * inode_number create( char *name, uint8_t type, vfs_directory * )   Creates an inode of type in the given directory
+ * int create( int parent_inode_number, uint8_t type, char *name )   Creates an inode of type in the given directory, returns its inode_number
  * int read( int inode_number, uint8_t *buffer, uint64_t size )   Reads size bytes into buffer from inode_number
  * int write( int inode_number, uint8_t *buffer, uint64_t size, uint64_t offset )   Writes size bytes from buffer into inode_number
- * inode_number open( char *path )  Opens an inode at path
- * void close( int inode_number )  Closes the inode number
+ * int open( int inode_number, vfs_handle * )  Fills in fs state for a new handle on inode_number
+ * void close( vfs_handle * )  Releases fs state held by the handle
+ * int opendir( int inode_number, vfs_dir_iter * )  Positions a directory cursor at the first entry
+ * int readdir( vfs_dir_iter * )  Fills in the cursor's entry, returns 1 for an entry, 0 at the end
+ * void closedir( vfs_dir_iter * )  Releases fs state held by the cursor
+ * int readv( int inode_number, vfs_iovec *, uint32_t count )  Reads a batch of segments, returns total bytes
+ * int writev( int inode_number, vfs_iovec *, uint32_t count )  Writes a batch of segments, returns total bytes
+ * int read_handle( vfs_handle *, uint8_t *buffer, uint64_t size, uint64_t offset )  Reads using state cached in the handle
+ * int read_ref( int inode_number, uint64_t offset, uint64_t size, vfs_page_ref * )  Lends the cached page holding offset, returns bytes lent
+ * int write_handle( vfs_handle *, uint8_t *buffer, uint64_t size, uint64_t offset )  Writes using state cached in the handle
  */
 
-typedef struct {
-	void (*close)( inode_id );
-	int (*create)( inode_id, uint8_t, char *, char * );
-	vfs_directory_list * (*get_dir_list)( inode_id, vfs_directory_list * );
+typedef struct vfs_operations {
+	void (*close)( vfs_handle * );
+	void (*closedir)( vfs_dir_iter * );
+	int (*create)( inode_id, uint8_t, char * );
+	void (*evict_inode)( vfs_inode * );
+	vfs_inode *(*load_inode)( inode_id );
 	int (*mount)( inode_id, char *, uint8_t * );
-	int (*open)( inode_id );
+	int (*open)( inode_id, vfs_handle * );
+	int (*opendir)( inode_id, vfs_dir_iter * );
 	int (*read)( inode_id, uint8_t *, uint64_t, uint64_t );
+	int (*read_handle)( vfs_handle *, uint8_t *, uint64_t, uint64_t );
+	int (*read_ref)( inode_id, uint64_t, uint64_t, struct vfs_page_ref * );
+	int (*readdir)( vfs_dir_iter * );
+	int (*readv)( inode_id, vfs_iovec *, uint32_t );
 	int (*stat)( inode_id, vfs_stat_data * );
 	int (*write)( inode_id, uint8_t *, uint64_t, uint64_t );
+	int (*write_handle)( vfs_handle *, uint8_t *, uint64_t, uint64_t );
+	int (*writev)( inode_id, vfs_iovec *, uint32_t );
 } vfs_operations;
 
+/**
+ * @brief Who the calling thread's disk I/O is for, set by a file system before it touches the disk
+ * 
+ */
+typedef struct {
+	uint8_t fs_id;
+	uint8_t io_class;		// VFS_IO_CLASS_
+	uint8_t cache_class;	// VFS_CACHE_CLASS_ of the pages it brings into the cache
+	inode_id inode;			// file the I/O is for, 0 for the mount's own, vfs_fsync writes back by it
+} vfs_io_hint;
+
+/**
+ * @brief Counters, byte total and latency histogram of one kind of I/O
+ * 
+ */
+typedef struct {
+	uint64_t count;
+	uint64_t bytes;
+	uint64_t ns;			// summed latency of the timed ones
+	uint64_t bucket[VFS_LATENCY_BUCKETS];
+} vfs_metric;
+
+/**
+ * @brief Metrics registry, indexed by mount (fs id), I/O class and VFS_METRIC_
+ * 
+ * Every thread counts into its own block so hits on different CPUs don't
+ * share a cache line, readers add the blocks up. A reader sees each counter
+ * whole but not all of them at the same instant.
+ */
+typedef struct vfs_metrics {
+	vfs_metric metric[VFS_METRICS_MOUNTS][VFS_IO_CLASS_MAX][VFS_METRIC_MAX];
+	struct vfs_metrics *next;	// registered thread blocks
+} vfs_metrics;
+
 /**
  * @brief File system representation 
  * 
  */
 typedef struct {
 	uint8_t type;			// type of fs
-	uint8_t id;				// assigned fs id
-	inode_id mount_inode;	// inode id of where the file system is mounted
 	vfs_operations op;
-	void *next_fs; 			// used in vfs code to link to the next FS
 } vfs_filesystem;
 
 /**
- * @brief Cache item
+ * @brief One VFS_PAGE_SIZE aligned page of a drive
  * 
+ * Only the bytes in [valid_start, valid_end) mirror the drive, the range is
+ * always contiguous. A partial write to an uncached page just allocates it,
+ * and the rest is read in only if something asks for it. Dirty bytes are
+ * always inside the valid range.
  */
 typedef struct {
-	uint64_t address;
-	uint32_t size;
+	uint64_t drive;
+	uint64_t index;			// page number, byte offset >> VFS_PAGE_SHIFT
 	uint8_t *data;
 	bool dirty;
+	uint32_t valid_start;	// first byte that holds drive data
+	uint32_t valid_end;		// one past the last, equal to valid_start when nothing is
+	uint32_t pins;			// lock dropped to read in the rest of it, can't be evicted
+	uint32_t refs;			// lent out by vfs_cache_get_page, off the replacement lists until the last put
 
 	uint64_t read_count;
 	uint64_t write_count;
 
-	void *next;
-} vfs_cache_item;
+	bool referenced;		// hit since the policy last looked at it
+	bool promote;			// touched by a VFS_CACHE_CLASS_PINNED reader, moves to the pinned list instead of being evicted
+	bool writeback;			// picked by a write back pass, can't be evicted until it's done
+	uint8_t cache_class;	// VFS_CACHE_CLASS_, which list the page is on
+	uint64_t dirty_epoch;	// cache epoch when the page went from clean to dirty
+	uint8_t queue;			// policy private, which list the page is on
+	vfs_io_hint owner;		// hint of the last reader or writer, write back is counted for it
+	void *hash_next;		// hash chain
+	void *lru_prev;			// policy list
+	void *lru_next;
+} vfs_page;
 
 /**
- * @brief List of cache items
+ * @brief File data lent out by vfs_read_ref, valid until vfs_read_unref
+ * 
+ * data points into a cached page when the fs can lend one, otherwise into
+ * a private copy.
+ */
+typedef struct vfs_page_ref {
+	uint8_t *data;
+	uint64_t size;			// bytes at data
+	vfs_page *page;			// lent page, NULL for a copy
+} vfs_page_ref;
+
+struct vfs_cache_shard;
+
+/**
+ * @brief Page replacement policy, its state lives in each shard
+ * 
+ * Only VFS_CACHE_CLASS_NORMAL pages are handed to the policy, pinned and
+ * stream pages are kept on the shard's own lists. insert and remove are
+ * called with the shard lock held for writing. hit
+ * runs under the read lock, so it may only touch the page's referenced flag.
+ * victim picks the shard's next page to evict without removing it or
+ * changing any other state, the cache may still keep the page. evict may
+ * be NULL.
+ * 
+ * void insert( vfs_cache_shard *, vfs_page * )  A page was just added to the shard
+ * void hit( vfs_page * )  A cached page was read or written
+ * void remove( vfs_cache_shard *, vfs_page * )  A page is leaving the shard
+ * vfs_page *victim( vfs_cache_shard * )  Chooses a page to evict
+ * void evict( vfs_cache_shard *, vfs_page * )  The page is out of the shard's hash and about to be freed, remove follows
+ */
+typedef struct vfs_cache_policy {
+	char *name;
+
+	void (*insert)( struct vfs_cache_shard *, vfs_page * );
+	void (*hit)( vfs_page * );
+	void (*remove)( struct vfs_cache_shard *, vfs_page * );
+	vfs_page *(*victim)( struct vfs_cache_shard * );
+	void (*evict)( struct vfs_cache_shard *, vfs_page * );
+} vfs_cache_policy;
+
+/**
+ * @brief One sequential reader seen by the disk read path, each thread tracks its own
+ * 
+ * A read that starts on the page the stream last read, or the one after,
+ * continues it. Anything else starts a new stream with no window, so a
+ * reader that seeks around drops back to plain demand reads.
+ */
+typedef struct {
+	uint64_t drive;
+	uint64_t last;			// last page read
+	uint64_t ahead;			// first page not asked for yet
+	uint64_t window;		// pages the last readahead asked for, 0 until the stream is sequential
+	bool live;
+} vfs_readahead_stream;
+
+/**
+ * @brief A readahead window waiting for the readahead thread
+ * 
+ */
+typedef struct {
+	uint64_t drive;
+	uint64_t first;
+	uint64_t count;
+	vfs_io_hint hint;		// the reader's, so the thread's disk reads are counted for it
+} vfs_readahead_request;
+
+/**
+ * @brief One disk read or write for vfs_disk_submit, owned by the caller until vfs_disk_wait returns
+ * 
+ */
+typedef struct {
+	uint64_t drive;
+	uint64_t offset;
+	uint64_t length;
+	uint8_t *data;
+	bool write;
+	bool queued;			// on a queue, done and transferred are set when it completes
+	bool done;
+	int64_t transferred;	// bytes moved by the queue, negative errno if it failed
+	int result;				// VFS_ERROR_NONE once vfs_disk_wait returns, otherwise VFS_ERROR_
+	uint64_t start;			// vfs_now_ns at submit
+	vfs_io_hint hint;		// the submitter's, the I/O is counted for it whoever waits
+} vfs_disk_request;
+
+/**
+ * @brief Neighbouring pages on a drive written under a plug
+ * 
+ */
+typedef struct {
+	uint64_t drive;
+	uint64_t first;			// first page
+	uint64_t last;			// last page
+} vfs_disk_plug_range;
+
+/**
+ * @brief A thread's plug, see vfs_disk_plug
  * 
  */
 typedef struct {
-	vfs_cache_item *head;
-	vfs_cache_item *tail;
-} vfs_cache_list;
+	uint32_t depth;			// nested plugs, only the outermost unplug writes out
+	uint32_t count;			// ranges in use
+	int error;			// first failed write out of a full plug, reported at the unplug
+	bool sync[VFS_MAX_DRIVES];	// drives a write was held for, synced at the unplug
+	vfs_disk_plug_range range[VFS_DISK_PLUG_RANGES];
+} vfs_disk_plug_state;
+
+/**
+ * @brief Key of a page recently evicted from 2Q's A1in queue
+ * 
+ */
+typedef struct {
+	uint64_t drive;
+	uint64_t index;
+	bool live;				// still in the ghost hash, cleared when it's taken back
+	void *hash_next;
+	void *fifo_next;
+} vfs_page_ghost;
+
+/**
+ * @brief Page cache counters, kept per shard and added up by vfs_cache_sum
+ * 
+ * Counters bumped under a shard's read lock are atomic, the rest only
+ * change with the shard lock held for writing.
+ */
+typedef struct {
+	uint64_t pages;			// gauge, only filled in by vfs_cache_sum
+	uint64_t dirty;			// gauge, only filled in by vfs_cache_sum
+	uint64_t pinned;		// gauge, only filled in by vfs_cache_sum
+	uint64_t streaming;		// gauge, only filled in by vfs_cache_sum
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t dirty_evictions;	// evictions that had to write the page back first
+	uint64_t promotions;	// pages moved to a longer lived class when they came up for eviction
+	uint64_t lends;			// vfs_cache_get_page calls
+	uint64_t fills;			// pages read in from disk
+	uint64_t partial_fills;	// partly valid pages completed by reading just the missing bytes
+	uint64_t write_allocs;	// pages created by a write without reading them in
+	uint64_t writebacks;	// dirty pages written out
+	uint64_t flush_writes;	// disk writes issued by write back passes, counted in the first page's shard
+	uint64_t readahead_windows;	// readahead disk reads issued, counted in the first page's shard
+	uint64_t readahead_pages;	// pages inserted by readahead
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t disk_read_calls;	// counted in the first page's shard
+	uint64_t disk_write_calls;
+} vfs_cache_counters;
+
+/**
+ * @brief One partition of the page cache, a chained hash table keyed by (drive, page number)
+ * 
+ * Hits take lock for reading, inserting a filled page and modifying page
+ * data take it for writing. Holds at most max_pages pages, the policy
+ * picks which one goes when it is full. Aligned so neighbouring shards'
+ * locks don't share a cache line.
+ */
+typedef struct vfs_cache_shard {
+	vfs_rwlock lock;
+	vfs_page **bucket;
+	uint8_t bits;			// table holds 1 << bits buckets
+	uint64_t count;
+	uint64_t dirty;
+	uint64_t max_pages;		// this shard's part of the budget
+	uint64_t generation;		// bumped when a write reaches the disk under this shard's pages, a fill read before it may be stale
+
+	// CLOCK state, pages form a ring through lru_prev/lru_next
+	vfs_page *clock_hand;
+
+	// 2Q state
+	vfs_page *a1in_head;
+	vfs_page *a1in_tail;
+	uint64_t a1in_count;
+	vfs_page *am_head;
+	vfs_page *am_tail;
+	uint64_t am_count;
+	vfs_page_ghost *ghost_bucket[1 << VFS_PAGE_GHOST_BITS];
+	vfs_page_ghost *ghost_fifo_head;	// oldest
+	vfs_page_ghost *ghost_fifo_tail;
+	uint64_t ghost_count;
+
+	// Class lists, most recently inserted at the head
+	vfs_page *pinned_head;
+	vfs_page *pinned_tail;
+	uint64_t pinned_count;
+	vfs_page *stream_head;
+	vfs_page *stream_tail;
+	uint64_t stream_count;
+
+	vfs_cache_counters stats;
+} __attribute__((aligned(64))) vfs_cache_shard;
+
+/**
+ * @brief Page cache, VFS_CACHE_SHARDS shards that each lock and evict on their own
+ * 
+ * A page lives in the shard picked by the top bits of its hash, so
+ * threads hitting different pages rarely touch the same lock. Only the
+ * settings here are shared, and they are read far more than written.
+ */
+typedef struct {
+	vfs_cache_shard shard[VFS_CACHE_SHARDS];
+	uint64_t max_pages;		// whole budget, split evenly between the shards
+	uint64_t epoch;			// flusher ticks so far
+	uint64_t flush_run_pages;	// most pages merged into one write
+	uint64_t readahead_max;		// largest readahead window in pages, 0 turns readahead off
+	vfs_cache_policy *policy;
+} vfs_page_cache;
 
 // Initalizations
 int vfs_initalize( void );
 
 // File system management
-int vfs_register_fs( vfs_filesystem **fs );
+int vfs_register_fs( uint8_t fs_type, vfs_filesystem **fs );
 vfs_filesystem *vfs_get_fs( uint8_t fs_type );
+vfs_filesystem *vfs_get_fs_by_id( uint8_t fs_id );
+void vfs_inode_set_fs( vfs_inode *node, uint8_t fs_type, uint8_t fs_id );
 
 // File system operations
-int vfs_close( inode_id id );
+int vfs_close( int handle );
 int vfs_create( uint8_t type, char *path, char *name );
+int vfs_create_at( inode_id parent, uint8_t type, char *name );
 vfs_directory_list *vfs_get_directory_list( inode_id id, vfs_directory_list *list );
+void vfs_free_directory_list( vfs_directory_list *list );
+int vfs_opendir( inode_id id, vfs_dir_iter *it );
+vfs_dirent *vfs_readdir( vfs_dir_iter *it );
+void vfs_closedir( vfs_dir_iter *it );
 int vfs_mkdir( inode_id parent, char *path, char *name );
-int vfs_mount( uint8_t fs_type, uint8_t *data, char *path );
+int vfs_mount( uint8_t fs_type, uint8_t *data, char *path, uint8_t write_policy );
+int vfs_set_write_policy( uint8_t fs_id, uint8_t write_policy );
+uint8_t vfs_get_write_policy( uint8_t fs_id );
+int vfs_fsync( inode_id id );
 int vfs_open( inode_id id );
 int vfs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset );
 int vfs_stat( inode_id id, vfs_stat_data *stat );
 int vfs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset );
+int vfs_readv( inode_id id, vfs_iovec *iov, uint32_t count );
+int vfs_read_ref( inode_id id, uint64_t offset, uint64_t size, vfs_page_ref *ref );
+void vfs_read_unref( vfs_page_ref *ref );
+int vfs_writev( inode_id id, vfs_iovec *iov, uint32_t count );
+
+// Handle operations
+vfs_handle *vfs_get_handle( int handle );
+int vfs_handle_read( int handle, uint8_t *data, uint64_t size );
+int vfs_handle_write( int handle, uint8_t *data, uint64_t size );
+int vfs_handle_seek( int handle, uint64_t offset );
 
 // Inode management
 inode_id vfs_lookup_inode( char *pathname );
+inode_id vfs_lookup_at( inode_id dir, char *path );
 vfs_inode *vfs_lookup_inode_ptr( char *pathname );
 vfs_inode *vfs_lookup_inode_ptr_by_id( inode_id id );
 vfs_inode *vfs_allocate_inode( void );
+vfs_inode *vfs_allocate_inode_with_id( inode_id id );
+vfs_inode *vfs_inode_get_by_id( inode_id id );
+int vfs_inode_table_insert( vfs_inode *node );
+int vfs_inode_table_remove( inode_id id );
+void vfs_inode_get( vfs_inode *node );
+void vfs_inode_put( vfs_inode *node );
+void vfs_inode_set_limits( uint64_t unused_inodes, uint64_t dentries );
 inode_id vfs_get_from_dir( inode_id id, char *name );
 void *vfs_get_device_struct_from_inode_id( inode_id id );
 
+// Dentry cache
+int vfs_dcache_initalize( void );
+uint32_t vfs_dcache_hash( inode_id parent, char *name );
+bool vfs_dcache_lookup( inode_id parent, char *name, uint32_t hash, inode_id *id );
+int vfs_dcache_add( inode_id parent, char *name, uint32_t hash, inode_id id );
+void vfs_dcache_invalidate( inode_id parent, char *name );
+void vfs_dcache_invalidate_dir( inode_id parent );
+
+// Slab allocator
+void vfs_slab_initalize( vfs_slab *slab, char *name, uint32_t object_size, uint32_t objects_per_slab );
+void *vfs_slab_alloc( vfs_slab *slab );
+void vfs_slab_free( vfs_slab *slab, void *obj );
+
+// Scratch arena
+int vfs_arena_initalize( vfs_arena *arena, uint64_t size );
+void *vfs_arena_alloc( vfs_arena *arena, uint64_t size );
+vfs_arena_mark vfs_arena_save( vfs_arena *arena );
+void vfs_arena_restore( vfs_arena *arena, vfs_arena_mark mark );
+vfs_arena *vfs_scratch( void );
+void vfs_thread_exit( void );
+void vfs_memory_diagnostic( void );
+
 // Cache management
 void vfs_cache_initalize( void );
-vfs_cache_item *vfs_cache_is_cached( uint64_t addr, uint32_t size );
-bool vfs_cache_read( uint64_t addr, uint32_t size, uint8_t *data );
-bool vfs_cache_write( uint64_t addr, uint32_t size, uint8_t *data, bool dirty );
-bool vfs_cache_flush( vfs_cache_item *ci );
-void vfs_cache_flush_all( void );
+bool vfs_cache_read( uint64_t drive, uint64_t addr, uint64_t size, uint8_t *data );
+bool vfs_cache_write( uint64_t drive, uint64_t addr, uint64_t size, uint8_t *data );
+vfs_page *vfs_cache_get_page( uint64_t drive, uint64_t index );
+void vfs_cache_put_page( vfs_page *page );
+bool vfs_cache_flush( vfs_page *page );
+int vfs_cache_flush_all( void );
+uint64_t vfs_cache_writeback( uint64_t min_age, uint64_t limit );
+void vfs_flush_tick( void );
+int vfs_sync( void );
+void vfs_cache_set_limit( uint64_t bytes );
+int vfs_cache_set_policy( uint8_t policy );
+vfs_page_cache *vfs_cache_get( void );
+void vfs_cache_sum( vfs_cache_counters *sum );
 void vfs_cache_diagnostic( void );
+uint64_t vfs_cache_readahead( uint64_t drive, uint64_t first, uint64_t count );
+uint64_t vfs_cache_prefetch( uint64_t drive, uint64_t *first, uint64_t *count, uint32_t windows );
+
+// Block devices
+int vfs_blockdev_register( char *name, void *data );
+int vfs_blockdev_find( char *name );
+vfs_blockdev *vfs_blockdev_get( uint64_t drive );
+
+// Disk requests
+int vfs_disk_submit( vfs_disk_request *request );
+int vfs_disk_wait( vfs_disk_request *request );
+int vfs_disk_io( vfs_disk_request *requests, uint64_t count );
+uint32_t vfs_disk_queue_depth( void );
+void vfs_disk_plug( void );
+int vfs_disk_unplug( void );
+
+// Metrics
+vfs_io_hint vfs_io_hint_set( uint8_t fs_id, uint8_t io_class, uint8_t cache_class, inode_id inode );
+vfs_io_hint vfs_io_hint_get( void );
+void vfs_io_hint_restore( vfs_io_hint hint );
+bool vfs_io_stream( bool streaming );
+bool vfs_io_streaming( void );
+uint64_t vfs_now_ns( void );
+uint64_t vfs_metrics_start( void );
+void vfs_metrics_record( uint8_t metric, uint64_t bytes, uint64_t start_ns );
+void vfs_metrics_sum( uint8_t fs_id, uint8_t io_class, uint8_t metric, vfs_metric *sum );
+void vfs_metrics_reset( void );
+uint64_t vfs_metrics_format( char *buffer, uint64_t size );
+uint64_t vfs_metrics_format_latency( char *buffer, uint64_t size );
 
 #ifdef VIFS_DEV
 	uint8_t *vfs_disk_read_test( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
 	bool vfs_disk_read_test_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
 	uint8_t *vfs_disk_write_test( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
 	bool vfs_disk_write_test_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
+	void vfs_disk_sync_test( uint64_t drive );
+	uint64_t vfs_disk_size_test( uint64_t drive );
+	int vfs_disk_attach_test( char *name, FILE *fp );
+	int vfs_disk_backend_test( uint64_t drive, uint8_t backend );
+	uint8_t vfs_disk_backend_get_test( uint64_t drive );
+	void vfs_disk_set_queue_depth_test( uint32_t depth );
+	uint32_t vfs_disk_queue_depth_test( void );
+	bool vfs_disk_submit_test( vfs_disk_request *request );
+	void vfs_disk_wait_test( vfs_disk_request *request );
+	void vfs_disk_drop_host_cache_test( uint64_t drive );
+
+	int vfs_flusher_start( void );
+	void vfs_flusher_stop( void );
+	int vfs_readahead_start( void );
+	void vfs_readahead_stop( void );
 #else
 	uint8_t *vfs_disk_read( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
 	uint8_t *vfs_disk_read_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
 	uint8_t *vfs_disk_write( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
 	uint8_t *vfs_disk_write_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data );
+	void vfs_disk_sync( uint64_t drive );
+	uint64_t vfs_disk_size( uint64_t drive );
 #endif
 
 #ifdef __cplusplus
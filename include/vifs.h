@@ -20,9 +20,29 @@ extern "C"
     #include <dirent.h>
     #include <unistd.h>
     #include <errno.h>
+    #include <time.h>
+    #include <fcntl.h>
+    #include <sys/wait.h>
 #endif
 
 #ifdef VIFS_DEV
+#define VIFS_THREADS_MAX 8
+#define VIFS_THREAD_FILES_MAX 32
+
+/**
+ * @brief One worker's share of a threaded test or benchmark
+ * 
+ */
+typedef struct {
+	int index;
+	uint64_t iterations;
+	uint64_t pages;			// pages to read from, for the cache hit bench
+	char dir[128];			// RFS directory to create files in, empty for read only
+	uint64_t ops;
+	uint64_t creates;
+	uint64_t errors;
+} vifs_thread_work;
+
 void vifs_show_help( void );
 int vifs_vfs_initalize( void );
 int vifs_afs_initalize( char *afs_img );
@@ -32,14 +52,51 @@ void vifs_ls( char *pathname );
 void vifs_cat( char *pathname );
 void vifs_cp( char *src, char *dest );
 void vifs_cpdir( char *src, char *dest );
+void vifs_cpdir_at( char *src, uint64_t dir, char *dest );
+void vifs_cp_at( char *real_file_pathname, uint64_t dir, char *vifs_name );
 void vifs_bootstrap( char *level, char *afs_image );
 void vifs_new_drive_img( char *size, char *afs_image );
 void vifs_pathname_to_path( char *pathname, char *path );
 void vifs_pathname_to_name( char *pathname, char *name );
 void vifs_parse_pathname( char *pathname, int path_or_name, char *data );
+void vifs_bench( char *name, char *afs_image );
+uint64_t vifs_bench_now_ns( void );
+void vfs_bench_inode_lookup( void );
+void vfs_bench_page_cache( void );
+void vfs_bench_cache_policy( void );
+void vfs_bench_flush( void );
+void vfs_bench_readahead( void );
+void vfs_bench_queue_depth( void );
+void vfs_bench_disk_plug( void );
+void vfs_bench_backends( void );
+void vfs_test_writeback( void );
+void vfs_test_write_error( void );
+void vfs_test_cache_ranges( void );
+void vfs_test_metrics( void );
+void vfs_test_cache_classes( void );
+void vfs_test_write_policy( void );
+void vifs_dirty_pages_shuffled( int drive, uint64_t first, uint64_t pages );
+void vifs_cache_drop( void );
+int vifs_scratch_drive( void );
+void vfs_test_cache_policy( uint8_t policy );
 void vfs_test_cp_real_file( char *real_file_pathname, char *vifs_path, char *vifs_name );
 void vfs_test_ramfs( void );
 void vfs_test_afs( void );
+void vfs_test_handle_throughput( void );
+void vfs_test_readv( void );
+void vfs_test_read_ref( void );
+void vfs_test_disk_queue( void );
+void vfs_test_blockdevs( void );
+void vfs_test_disk_plug( void );
+void vfs_test_inode_eviction( void );
+void vfs_test_lookup_at( void );
+void vfs_test_threads( void );
+void vfs_bench_threads( void );
+int vifs_thread_files_collect( void );
+uint64_t vifs_thread_checksum( uint64_t id );
+void *vifs_thread_worker( void *arg );
+void *vifs_cache_hit_worker( void *arg );
+uint64_t vifs_thread_run( vifs_thread_work *work, int count );
 void vfs_test_create_file( char *path, char *name, uint8_t *data, uint64_t size );
 void vfs_test_create_dir( char *path, char *name );
 void vfs_test_ls( char *path );
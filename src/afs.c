@@ -1,12 +1,8 @@
 #include "vfs.h"
 #include "afs.h"
 
-afs_drive *drive;
-afs_block_meta_data *block_meta_data;
-afs_block_directory *afs_root_dir;
-afs_inode afs_inodes;
-afs_inode *afs_inodes_tail;
-inode_id afs_id_top;
+afs_volume *afs_volumes[256];		// by fs id, NULL where no AFS is mounted
+vfs_slab afs_inode_slab;
 
 /**
  * @brief Initalize the AFS primatives
@@ -16,37 +12,99 @@ inode_id afs_id_top;
 int afs_initalize( void ) {
 	vfs_filesystem *afs;
 
-	int reg_err = vfs_register_fs( &afs );
+	int reg_err = vfs_register_fs( FS_TYPE_AFS, &afs );
 
 	if( reg_err != 0 ) {
 		vfs_debugf( "Register FS error: %d\n", reg_err );
 		return reg_err;
 	}
 
-	afs->type = FS_TYPE_AFS;
 	afs->op.mount = afs_mount;
-	afs->op.get_dir_list = afs_dir_list;
+	afs->op.opendir = afs_opendir;
+	afs->op.readdir = afs_readdir;
 	afs->op.read = afs_read;
 	afs->op.write = afs_write;
 	afs->op.create = afs_create;
 	afs->op.open = afs_open;
+	afs->op.close = afs_close;
+	afs->op.read_handle = afs_read_handle;
+	afs->op.read_ref = afs_read_ref;
+	afs->op.write_handle = afs_write_handle;
+	afs->op.readv = afs_readv;
+	afs->op.writev = afs_writev;
 	afs->op.stat = afs_stat;
+	afs->op.load_inode = afs_load_inode;
+	afs->op.evict_inode = afs_evict_inode;
 
-	afs_inodes_tail = &afs_inodes;
+	vfs_slab_initalize( &afs_inode_slab, "afs_inode", sizeof(afs_inode), AFS_INODE_SLAB_COUNT );
+	memset( afs_volumes, 0, sizeof(afs_volumes) );
 
 	return VFS_ERROR_NONE;
 }
 
+/**
+ * @brief Cache class for an I/O class, metadata and directories are pinned, file data streams during a bulk copy
+ * 
+ * @param io_class VFS_IO_CLASS_
+ * @return uint8_t VFS_CACHE_CLASS_
+ */
+static uint8_t afs_cache_class( uint8_t io_class ) {
+	switch( io_class ) {
+		case VFS_IO_CLASS_META:
+		case VFS_IO_CLASS_DIRECTORY:
+			return VFS_CACHE_CLASS_PINNED;
+		case VFS_IO_CLASS_FILE:
+			return vfs_io_streaming() ? VFS_CACHE_CLASS_STREAM : VFS_CACHE_CLASS_NORMAL;
+	}
+
+	return VFS_CACHE_CLASS_NORMAL;
+}
+
+/**
+ * @brief Tags the calling thread's disk I/O as this mount's
+ * 
+ * @param vol 
+ * @param io_class VFS_IO_CLASS_
+ * @param block_id first block of the file or directory it's for, 0 for the drive's own
+ * @return vfs_io_hint previous hint, to put back with vfs_io_hint_restore
+ */
+static inline vfs_io_hint afs_io_hint( afs_volume *vol, uint8_t io_class, uint32_t block_id ) {
+	return vfs_io_hint_set( vol->fs_id, io_class, afs_cache_class( io_class ), block_id != 0 ? VFS_INODE_ID( vol->fs_id, block_id ) : 0 );
+}
+
+/**
+ * @brief Metrics class for an AFS block type
+ * 
+ * @param block_type AFS_BLOCK_TYPE_
+ * @return uint8_t VFS_IO_CLASS_
+ */
+static uint8_t afs_io_class( uint32_t block_type ) {
+	switch( block_type ) {
+		case AFS_BLOCK_TYPE_FILE:
+			return VFS_IO_CLASS_FILE;
+		case AFS_BLOCK_TYPE_DIRECTORY:
+			return VFS_IO_CLASS_DIRECTORY;
+		case AFS_BLOCK_TYPE_META:
+		case AFS_BLOCK_TYPE_SYSTEM:
+			return VFS_IO_CLASS_META;
+	}
+
+	return VFS_IO_CLASS_OTHER;
+}
+
 /**
  * @brief Read a block into memory
  * 
+ * @param vol 
  * @param block_id 
  * @param size 
  * @param data 
  * @return uint8_t* 
  */
-uint8_t *afs_read_block( uint32_t block_id, uint64_t size, uint8_t *data ) {
-	data = vfs_disk_read( 0, (block_id * drive->block_size), size, data );
+uint8_t *afs_read_block( afs_volume *vol, uint32_t block_id, uint64_t size, uint8_t *data ) {
+	vfs_io_hint hint = afs_io_hint( vol, afs_io_class( vol->block_meta_data[block_id].block_type ), block_id );
+	data = vfs_disk_read( vol->blockdev, (block_id * vol->drive->block_size), size, data );
+	vfs_io_hint_restore( hint );
 
 	return data;
 }
@@ -54,27 +112,36 @@ uint8_t *afs_read_block( uint32_t block_id, uint64_t size, uint8_t *data ) {
 /**
  * @brief Write a block to disk
  * 
+ * @param vol 
  * @param block_id 
  * @param size 
  * @param data 
  * @return uint8_t* 
  */
-uint8_t *afs_write_block( uint32_t block_id, uint64_t size, uint8_t *data ) {
-	uint64_t offset = (block_id) * drive->block_size;
-	vfs_disk_write( 0, offset, size, data );
+uint8_t *afs_write_block( afs_volume *vol, uint32_t block_id, uint64_t size, uint8_t *data ) {
+	uint64_t offset = (block_id) * vol->drive->block_size;
+
+	vfs_io_hint hint = afs_io_hint( vol, afs_io_class( vol->block_meta_data[block_id].block_type ), block_id );
+	data = vfs_disk_write( vol->blockdev, offset, size, data );
+	vfs_io_hint_restore( hint );
+
+	return data;
 }
 
 /**
  * @brief Writes meta data for block_id to disk
  * 
+ * @param vol 
  * @param block_id 
  * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
  */
-int afs_write_meta( uint32_t block_id ) {
+int afs_write_meta( afs_volume *vol, uint32_t block_id ) {
 	uint64_t offset = sizeof(afs_drive);
 	offset = offset + (sizeof(afs_block_meta_data) * (block_id));
 
-	vfs_disk_write( 0, offset, sizeof(afs_block_meta_data), (uint8_t *)&block_meta_data[block_id] );
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_META, vol->block_meta_data[block_id].starting_block );
+	vfs_disk_write( vol->blockdev, offset, sizeof(afs_block_meta_data), (uint8_t *)&vol->block_meta_data[block_id] );
+	vfs_io_hint_restore( hint );
 
 	return VFS_ERROR_NONE;
 }
@@ -82,72 +149,150 @@ int afs_write_meta( uint32_t block_id ) {
 /**
  * @brief Writes directory block at block_id to disk
  * 
+ * @param vol 
  * @param block_id 
  * @param dir 
  * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
  */
-int afs_write_directory( uint32_t block_id, afs_block_directory *dir ) {
-	uint64_t offset = drive->block_size * (block_id);
-	vfs_disk_write( 0, offset, sizeof(afs_block_directory), (uint8_t *)dir );
+int afs_write_directory( afs_volume *vol, uint32_t block_id, afs_block_directory *dir ) {
+	uint64_t offset = vol->drive->block_size * (block_id);
+
+	// Entries are the mount's, so a new file's name goes out with its vfs_fsync
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_DIRECTORY, 0 );
+	vfs_disk_write( vol->blockdev, offset, sizeof(afs_block_directory), (uint8_t *)dir );
+	vfs_io_hint_restore( hint );
 
 	return VFS_ERROR_NONE;
 }
 
 /**
- * @brief Writes drive info block to disk
+ * @brief Writes the volume's drive info block to disk
  * 
- * @param block_id 
- * @param dir 
+ * @param vol 
  * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
  */
-int afs_write_drive_info( afs_drive *drive_info ) {
-	vfs_disk_write( 0, 0, sizeof(afs_drive), (uint8_t *)drive_info );
+int afs_write_drive_info( afs_volume *vol ) {
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_META, 0 );
+	vfs_disk_write( vol->blockdev, 0, sizeof(afs_drive), (uint8_t *)vol->drive );
+	vfs_io_hint_restore( hint );
 
 	return VFS_ERROR_NONE;
 }
 
+/**
+ * @brief Frees a volume a mount gave up on, and whatever of it was read in
+ * 
+ * @param vol 
+ */
+static void afs_volume_free( afs_volume *vol ) {
+	if( vol->root_dir != NULL ) {
+		vfs_free( vol->root_dir );
+	}
+
+	if( vol->block_meta_data != NULL ) {
+		vfs_free( vol->block_meta_data );
+	}
+
+	if( vol->drive != NULL ) {
+		vfs_free( vol->drive );
+	}
+
+	vfs_free( vol );
+}
 
 /**
  * @brief Mount the given AFS drive
  * 
+ * Each mount gets its own volume, so images on different block devices
+ * are served side by side with their own allocation lock.
+ * 
  * @param id 
  * @param path 
- * @param data_root 
+ * @param data_root name of the block device holding the image, NULL for drive 0
  * @return int VFS_ERROR_NONE if successful, otherwise VFS_ERROR_
  */
 int afs_mount( inode_id id, char *path, uint8_t *data_root ) {
-	drive = vfs_malloc( sizeof(afs_drive) );
+	vfs_inode *mount_inode = vfs_lookup_inode_ptr_by_id( id );
+	int blockdev = 0;
 
-	if( drive == NULL ) {
-		return VFS_ERROR_MEMORY;
+	if( data_root != NULL ) {
+		blockdev = vfs_blockdev_find( (char *)data_root );
+
+		if( blockdev < 0 ) {
+			vfs_debugf( "No block device \"%s\" for %s.\n", (char *)data_root, path );
+			return blockdev;
+		}
 	}
 
-	drive = (afs_drive *)vfs_disk_read( 0, 0, sizeof(afs_drive), (uint8_t *)drive );
+	afs_volume *vol = vfs_malloc( sizeof(afs_volume) );
 
-	afs_inodes_tail->block_id = drive->root_directory;
-	afs_inodes_tail->vfs_id = id;
-	afs_inodes_tail->next = NULL;
+	if( vol == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
 
-	afs_root_dir = vfs_malloc( sizeof(afs_block_directory) );
+	memset( vol, 0, sizeof(afs_volume) );
+	vol->fs_id = mount_inode->fs_id;
+	vol->blockdev = blockdev;
+	vfs_lock_initalize( &vol->alloc_lock );
 
-	if( afs_root_dir == NULL ) {
+	vol->drive = vfs_malloc( sizeof(afs_drive) );
+
+	if( vol->drive == NULL ) {
+		afs_volume_free( vol );
 		return VFS_ERROR_MEMORY;
 	}
 
-	afs_root_dir = (afs_block_directory *)afs_read_block(drive->root_directory, sizeof(afs_block_directory), (uint8_t *)afs_root_dir);
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_META, 0 );
+	vfs_disk_read( vol->blockdev, 0, sizeof(afs_drive), (uint8_t *)vol->drive );
+	vfs_io_hint_restore( hint );
 
-	uint32_t length_of_block_meta = drive->block_count * sizeof(afs_block_meta_data);
-	block_meta_data = vfs_malloc( length_of_block_meta );
+	afs_drive *d = vol->drive;
 
-	if( block_meta_data == NULL ) {
+	if( d->magic[0] != 'A' || d->magic[1] != 'F' || d->magic[2] != 'S' || d->magic[3] != ' ' ) {
+		vfs_debugf( "Drive %d is not AFS, mount failed.\n", blockdev );
+		afs_volume_free( vol );
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
+	uint32_t length_of_block_meta = vol->drive->block_count * sizeof(afs_block_meta_data);
+	vol->block_meta_data = vfs_malloc( length_of_block_meta );
+
+	if( vol->block_meta_data == NULL ) {
+		afs_volume_free( vol );
 		return VFS_ERROR_MEMORY;
 	}
 
 	vfs_debugf( "length_of_block_meta: %ld\n", length_of_block_meta );
 
-	vfs_disk_read( 1, sizeof(afs_drive), length_of_block_meta, (uint8_t *)block_meta_data );
+	hint = afs_io_hint( vol, VFS_IO_CLASS_META, 0 );
+	vfs_disk_read( vol->blockdev, sizeof(afs_drive), length_of_block_meta, (uint8_t *)vol->block_meta_data );
+	vfs_io_hint_restore( hint );
+
+	// Block types come from the meta data, so the root is read after it
+	vol->root_dir = vfs_malloc( sizeof(afs_block_directory) );
+
+	if( vol->root_dir == NULL ) {
+		afs_volume_free( vol );
+		return VFS_ERROR_MEMORY;
+	}
+
+	vol->root_dir = (afs_block_directory *)afs_read_block( vol, vol->drive->root_directory, sizeof(afs_block_directory), (uint8_t *)vol->root_dir );
+
+	// The mount point stands in for the root directory block
+	afs_inode *root = vfs_slab_alloc( &afs_inode_slab );
+
+	if( root == NULL ) {
+		afs_volume_free( vol );
+		return VFS_ERROR_MEMORY;
+	}
 
-	afs_load_directory_as_inodes( id, afs_root_dir );
+	root->block_id = vol->drive->root_directory;
+	root->vfs_id = id;
+	root->open = 0;
+	root->volume = vol;
+
+	afs_volumes[vol->fs_id] = vol;
+	mount_inode->fs_data = root;
 
 	return VFS_ERROR_NONE;
 }
@@ -169,10 +314,63 @@ int afs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	uint64_t final_offset = inode->block_id * drive->block_size;
+	afs_volume *vol = inode->volume;
+
+	uint64_t final_offset = inode->block_id * vol->drive->block_size;
 	final_offset = final_offset + offset;
 
-	vfs_disk_read( 0, final_offset, size, data );
+	vfs_io_hint hint = afs_io_hint( vol, afs_io_class( vol->block_meta_data[inode->block_id].block_type ), inode->block_id );
+	vfs_disk_read( vol->blockdev, final_offset, size, data );
+	vfs_io_hint_restore( hint );
+
+	return size;
+}
+
+/**
+ * @brief Lends the cached page holding offset of an AFS file
+ * 
+ * @param id 
+ * @param offset 
+ * @param size 
+ * @param ref 
+ * @return int bytes lent (clamped to the file and the page), 0 at the end of the file, otherwise VFS_ERROR_
+ */
+int afs_read_ref( inode_id id, uint64_t offset, uint64_t size, vfs_page_ref *ref ) {
+	afs_inode *inode = afs_lookup_by_inode_id( id );
+
+	if( inode == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	afs_volume *vol = inode->volume;
+	uint64_t file_size = vol->block_meta_data[ inode->block_id ].file_size;
+
+	if( offset >= file_size ) {
+		return 0;
+	}
+
+	uint64_t disk_offset = ((uint64_t)inode->block_id * vol->drive->block_size) + offset;
+	uint64_t in_page = disk_offset & (VFS_PAGE_SIZE - 1);
+
+	if( size > file_size - offset ) {
+		size = file_size - offset;
+	}
+
+	if( size > VFS_PAGE_SIZE - in_page ) {
+		size = VFS_PAGE_SIZE - in_page;
+	}
+
+	vfs_io_hint hint = afs_io_hint( vol, afs_io_class( vol->block_meta_data[inode->block_id].block_type ), inode->block_id );
+	vfs_page *page = vfs_cache_get_page( vol->blockdev, disk_offset >> VFS_PAGE_SHIFT );
+	vfs_io_hint_restore( hint );
+
+	if( page == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	ref->page = page;
+	ref->data = page->data + in_page;
+	ref->size = size;
 
 	return size;
 }
@@ -182,34 +380,28 @@ int afs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
  * 
  * @param parent 
  * @param type 
- * @param path 
  * @param name 
  * @return int inode id on success (greater than 0), otherwise VFS_ERROR_ on failure
  */
-int afs_create( inode_id parent, uint8_t type, char *path, char *name ) {
+int afs_create( inode_id parent, uint8_t type, char *name ) {
 	afs_inode *parent_inode = afs_lookup_by_inode_id( parent );
 
-	// Setup the inode
-	vfs_inode *vfs_inode_data = vfs_allocate_inode();
-	vfs_inode_data->fs_type = FS_TYPE_AFS;
-	vfs_inode_data->is_mount_point = false;
-	vfs_inode_data->type = type;
-	vfs_inode_data->next_inode = NULL;
+	if( parent_inode == NULL ) {
+		return VFS_ERROR_PATH_NOT_FOUND;
+	}
+
+	afs_volume *vol = parent_inode->volume;
 
-	//vfs_debugf( "inode id: %d\n", vfs_inode_data->id );
+	// The vfs inode is loaded from the new block the first time it's used
 
-	afs_inodes_tail->next = vfs_malloc( sizeof(afs_inode) );
-	afs_inode *file_inode = (afs_inode *)afs_inodes_tail->next;
-	file_inode->next = NULL;
-	file_inode->vfs_id = vfs_inode_data->id;
-	file_inode->block_id = drive->next_free;
-	afs_inodes_tail = file_inode;
+	// Block allocation and the drive info are shared by every file on the drive
+	vfs_lock_acquire( &vol->alloc_lock );
 
 	// Find an open block, fill in meta
-	uint32_t block_to_use = drive->next_free;
-	drive->next_free++;
-	block_meta_data[ block_to_use ].in_use = true;
-	strcpy( block_meta_data[ block_to_use ].name, name );
+	uint32_t block_to_use = vol->drive->next_free;
+	vol->drive->next_free++;
+	vol->block_meta_data[ block_to_use ].in_use = true;
+	strcpy( vol->block_meta_data[ block_to_use ].name, name );
 	uint32_t afs_type = AFS_BLOCK_TYPE_UNKNOWN;
 
 	// Format the block
@@ -234,27 +426,34 @@ int afs_create( inode_id parent, uint8_t type, char *path, char *name ) {
 		block_data = &file;
 		block_data_size = sizeof(afs_file);
 
-		block_meta_data[ block_to_use ].file_size = 0;
-		block_meta_data[ block_to_use ].starting_block = block_to_use;
-		block_meta_data[ block_to_use ].num_blocks = 1;
+		vol->block_meta_data[ block_to_use ].file_size = 0;
+		vol->block_meta_data[ block_to_use ].starting_block = block_to_use;
+		vol->block_meta_data[ block_to_use ].num_blocks = 1;
 	}
 
 	// Save the block type
-	block_meta_data[ block_to_use ].block_type = afs_type;
+	vol->block_meta_data[ block_to_use ].block_type = afs_type;
 
 	// Find directory, fill in index, increment next_index
-	afs_block_directory *parent_dir = vfs_malloc( sizeof(afs_block_directory) );
-	parent_dir = (afs_block_directory *)afs_read_block( parent_inode->block_id, sizeof(afs_block_directory), (uint8_t *)parent_dir );
+	vfs_arena_mark mark = vfs_arena_save( vfs_scratch() );
+	afs_block_directory *parent_dir = vfs_arena_alloc( vfs_scratch(), sizeof(afs_block_directory) );
+	parent_dir = (afs_block_directory *)afs_read_block( vol, parent_inode->block_id, sizeof(afs_block_directory), (uint8_t *)parent_dir );
 	parent_dir->index[parent_dir->next_index] = block_to_use;
 	parent_dir->next_index++;
 	
 	// Write everything to disk
-	afs_write_block( block_to_use, block_data_size, (uint8_t *)block_data );
-	afs_write_meta( block_to_use );
-	afs_write_directory( parent_inode->block_id, parent_dir );
-	afs_write_drive_info( drive );
+	afs_write_block( vol, block_to_use, block_data_size, (uint8_t *)block_data );
+	afs_write_meta( vol, block_to_use );
+	afs_write_directory( vol, parent_inode->block_id, parent_dir );
+	afs_write_drive_info( vol );
+
+	vfs_lock_release( &vol->alloc_lock );
+
+	vfs_arena_restore( vfs_scratch(), mark );
+
+	vfs_dcache_invalidate( parent, name );
 
-	return vfs_inode_data->id;
+	return VFS_INODE_ID( vol->fs_id, block_to_use );
 }
 
 /**
@@ -269,152 +468,551 @@ int afs_create( inode_id parent, uint8_t type, char *path, char *name ) {
 int afs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
 	afs_inode *node = afs_lookup_by_inode_id( id );
 
-	if( block_meta_data[node->block_id].block_type != AFS_BLOCK_TYPE_FILE ) {
+	if( node == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	afs_volume *vol = node->volume;
+
+	if( vol->block_meta_data[node->block_id].block_type != AFS_BLOCK_TYPE_FILE ) {
 		//vfs_debugf( "Block is not a file.\n" );
 		return VFS_ERROR_NOT_A_FILE;
 	}
 
+	vfs_lock_acquire( &vol->alloc_lock );
+
 	// TODO: Current assumes we're only writing full files starting at offset 0
-	block_meta_data[node->block_id].file_size = size;
-	block_meta_data[node->block_id].num_blocks = 1 + (size/drive->block_size);
+	vol->block_meta_data[node->block_id].file_size = size;
+	vol->block_meta_data[node->block_id].num_blocks = 1 + (size/vol->drive->block_size);
 
 	// TODO: Current assumes we're writing immediately at the blocks right after the first one
-	if( block_meta_data[node->block_id].num_blocks != 1 ) {
-		for( int i = 1; i < block_meta_data[node->block_id].num_blocks; i++ ) {
-			block_meta_data[drive->next_free].block_type = AFS_BLOCK_TYPE_FILE;
-			block_meta_data[drive->next_free].in_use = true;
-			afs_write_meta( drive->next_free );
-
-			drive->next_free++;
+	if( vol->block_meta_data[node->block_id].num_blocks != 1 ) {
+		for( int i = 1; i < vol->block_meta_data[node->block_id].num_blocks; i++ ) {
+			vol->block_meta_data[vol->drive->next_free].block_type = AFS_BLOCK_TYPE_FILE;
+			vol->block_meta_data[vol->drive->next_free].in_use = true;
+			vol->block_meta_data[vol->drive->next_free].starting_block = node->block_id;
+			afs_write_meta( vol, vol->drive->next_free );
+
+			vol->drive->next_free++;
 		}
 	}
 
-	afs_write_meta( node->block_id );
-	afs_write_drive_info( drive );
-	vfs_disk_write( 0, drive->block_size * node->block_id, size, data );
+	afs_write_meta( vol, node->block_id );
+	afs_write_drive_info( vol );
+	vfs_lock_release( &vol->alloc_lock );
+
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_FILE, node->block_id );
+	vfs_disk_write( vol->blockdev, vol->drive->block_size * node->block_id, size, data );
+	vfs_io_hint_restore( hint );
 
 	return size;
 }
 
 
 /**
- * @brief Load everything in a directory as a vfs_inode, if it hasn't been done already
+ * @brief Makes sure a file's blocks cover end bytes
  * 
- * @param parent_inode 
- * @param dir 
- * @return int VFS_ERROR_NONE on success, other error code
+ * A file can only grow past its blocks when it is the last thing allocated
+ * on the drive, since its blocks must stay contiguous.
+ * 
+ * @param inode 
+ * @param end 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
  */
-int afs_load_directory_as_inodes( inode_id parent_inode, afs_block_directory *dir ) {
-	for( int i = 0; i < dir->next_index; i++ ) {
-		//vfs_debugf( "load dir: index=%d\n", dir->index[i] );
-		afs_load_block_as_inode( &block_meta_data[dir->index[i]] );
+int afs_reserve( afs_inode *inode, uint64_t end ) {
+	afs_volume *vol = inode->volume;
+	afs_block_meta_data *meta = &vol->block_meta_data[ inode->block_id ];
+
+	vfs_lock_acquire( &vol->alloc_lock );
+
+	if( end <= (uint64_t)meta->num_blocks * vol->drive->block_size ) {
+		vfs_lock_release( &vol->alloc_lock );
+		return VFS_ERROR_NONE;
+	}
+
+	if( meta->starting_block + meta->num_blocks != vol->drive->next_free ) {
+		vfs_lock_release( &vol->alloc_lock );
+		return VFS_ERROR_NO_SPACE;
+	}
+
+	uint32_t blocks_needed = (end + vol->drive->block_size - 1) / vol->drive->block_size;
+
+	if( blocks_needed + meta->starting_block > vol->drive->block_count ) {
+		vfs_lock_release( &vol->alloc_lock );
+		return VFS_ERROR_NO_SPACE;
+	}
+
+	while( meta->num_blocks < blocks_needed ) {
+		vol->block_meta_data[vol->drive->next_free].block_type = AFS_BLOCK_TYPE_FILE;
+		vol->block_meta_data[vol->drive->next_free].in_use = true;
+		vol->block_meta_data[vol->drive->next_free].starting_block = inode->block_id;
+		afs_write_meta( vol, vol->drive->next_free );
+
+		vol->drive->next_free++;
+		meta->num_blocks++;
 	}
 
+	afs_write_drive_info( vol );
+
+	vfs_lock_release( &vol->alloc_lock );
+
 	return VFS_ERROR_NONE;
 }
 
 /**
- * @brief Load the given block as a vfs_inode, if it hasn't been done already
+ * @brief Sorts segment indexes by file offset (insertion sort, batches are small)
  * 
- * @param meta 
- * @return int vfs inode id on success, 0 on failure
+ * @param iov 
+ * @param order index array to sort
+ * @param count 
  */
-int afs_load_block_as_inode( afs_block_meta_data *meta ) {
-	inode_id ret_val = 0;
+static void afs_iov_sort( vfs_iovec *iov, uint32_t *order, uint32_t count ) {
+	for( uint32_t i = 0; i < count; i++ ) {
+		order[i] = i;
+	}
 
-	if( meta == NULL ) {
-		return 0;
+	for( uint32_t i = 1; i < count; i++ ) {
+		uint32_t cur = order[i];
+		uint32_t j = i;
+
+		while( j > 0 && iov[ order[j - 1] ].offset > iov[cur].offset ) {
+			order[j] = order[j - 1];
+			j--;
+		}
+
+		order[j] = cur;
 	}
+}
 
-	if( !afs_find_inode_from_block_id(meta->id) ) {
-		afs_inodes_tail->next = vfs_malloc( sizeof(afs_inode) );
-		afs_inodes_tail = afs_inodes_tail->next;
-		afs_inodes_tail->next = NULL;
-		
-		vfs_inode *inode = vfs_allocate_inode();
-		inode->fs_type = FS_TYPE_AFS;
+/**
+ * @brief Grows a run from sorted segment i while the next segment starts close enough to its end
+ * 
+ * @param iov 
+ * @param order segments sorted by offset
+ * @param count 
+ * @param i the run's first segment in order, not empty and inside the file
+ * @param file_size 
+ * @param run_start set to the run's first byte in the file
+ * @param run_end set to one past its last, no further than file_size
+ * @return uint32_t the run's last segment in order
+ */
+static uint32_t afs_readv_run( vfs_iovec *iov, uint32_t *order, uint32_t count, uint32_t i, uint64_t file_size, uint64_t *run_start, uint64_t *run_end ) {
+	vfs_iovec *first = &iov[ order[i] ];
+	uint32_t run_last = i;
 
-		switch( meta->block_type ) {
-			case AFS_BLOCK_TYPE_DIRECTORY:
-				inode->type = VFS_INODE_TYPE_DIR;
-				break;
-			case AFS_BLOCK_TYPE_FILE:
-				inode->type = VFS_INODE_TYPE_FILE;
-				break;
+	*run_start = first->offset;
+	*run_end = first->offset + first->size;
+
+	while( run_last + 1 < count ) {
+		vfs_iovec *next = &iov[ order[run_last + 1] ];
+
+		if( next->offset >= file_size || next->offset > *run_end + AFS_READV_MAX_GAP ) {
+			break;
 		}
 
-		afs_inodes_tail->vfs_id = inode->id;
-		afs_inodes_tail->block_id = meta->id;
+		if( next->offset + next->size > *run_end ) {
+			*run_end = next->offset + next->size;
+		}
+
+		run_last++;
+	}
 
-		ret_val = inode->id;
+	if( *run_end > file_size ) {
+		*run_end = file_size;
 	}
 
-	return ret_val;
+	return run_last;
 }
 
 /**
- * @brief Gets the vfs inode id of a block id, if it has been assigned
+ * @brief Reads a batch of segments from an AFS file
  * 
- * @param block_id 
- * @return inode_id inode id if it exists, otherwise 0
+ * Segments are sorted by offset and neighbours closer than AFS_READV_MAX_GAP
+ * are merged, so each run of nearby segments costs one disk read.
+ * 
+ * @param id 
+ * @param iov 
+ * @param count 
+ * @return int total bytes read (each segment clamped to the file size), otherwise VFS_ERROR_
  */
-inode_id afs_find_inode_from_block_id( uint32_t block_id ) {
-	afs_inode *head = &afs_inodes;
-	bool found = false;
-	inode_id ret_val = 0;
+int afs_readv( inode_id id, vfs_iovec *iov, uint32_t count ) {
+	afs_inode *inode = afs_lookup_by_inode_id( id );
+	uint32_t stack_order[VFS_IOV_STACK_COUNT];
+	uint32_t *order = stack_order;
+	int total = 0;
+
+	if( inode == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	afs_volume *vol = inode->volume;
+	uint64_t file_size = vol->block_meta_data[ inode->block_id ].file_size;
+	uint64_t base = (uint64_t)inode->block_id * vol->drive->block_size;
+
+	vfs_arena_mark mark = vfs_arena_save( vfs_scratch() );
+
+	if( count > VFS_IOV_STACK_COUNT ) {
+		order = vfs_arena_alloc( vfs_scratch(), sizeof(uint32_t) * count );
+
+		if( order == NULL ) {
+			vfs_arena_restore( vfs_scratch(), mark );
+			return VFS_ERROR_MEMORY;
+		}
+	}
+
+	afs_iov_sort( iov, order, count );
+
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_FILE, inode->block_id );
+
+	// Bring every run's missing pages in first, so their disk reads are in flight together
+	uint64_t *windows = vfs_arena_alloc( vfs_scratch(), sizeof(uint64_t) * 2 * count );
+	uint32_t runs = 0;
+
+	for( uint32_t i = 0; i < count && windows != NULL; ) {
+		vfs_iovec *first = &iov[ order[i] ];
+		uint64_t run_start = 0;
+		uint64_t run_end = 0;
 
-	do {
-		if( head->block_id == block_id ) {
-			found = true;
-			ret_val = head->vfs_id;
+		if( first->size == 0 || first->offset >= file_size ) {
+			i++;
+			continue;
+		}
+
+		i = afs_readv_run( iov, order, count, i, file_size, &run_start, &run_end ) + 1;
+
+		windows[runs] = (base + run_start) >> VFS_PAGE_SHIFT;
+		windows[count + runs] = ((base + run_end - 1) >> VFS_PAGE_SHIFT) - windows[runs] + 1;
+		runs++;
+	}
+
+	if( runs != 0 ) {
+		vfs_cache_prefetch( vol->blockdev, windows, windows + count, runs );
+	}
+
+	uint32_t i = 0;
+	while( i < count ) {
+		// Skip segments that are empty or entirely past the end of the file
+		vfs_iovec *first = &iov[ order[i] ];
+
+		if( first->size == 0 || first->offset >= file_size ) {
+			i++;
+			continue;
+		}
+
+		uint64_t run_start = 0;
+		uint64_t run_end = 0;
+		uint32_t run_last = afs_readv_run( iov, order, count, i, file_size, &run_start, &run_end );
+
+		if( run_last == i ) {
+			// Lone segment, read straight into the caller's buffer
+			vfs_disk_read( vol->blockdev, base + run_start, run_end - run_start, first->data );
+			total = total + (run_end - run_start);
 		} else {
-			head = head->next;
+			uint8_t *bounce = vfs_arena_alloc( vfs_scratch(), run_end - run_start );
+
+			if( bounce == NULL ) {
+				total = VFS_ERROR_MEMORY;
+				break;
+			}
+
+			vfs_disk_read( vol->blockdev, base + run_start, run_end - run_start, bounce );
+
+			for( uint32_t j = i; j <= run_last; j++ ) {
+				vfs_iovec *seg = &iov[ order[j] ];
+				uint64_t len = seg->size;
+
+				if( seg->size == 0 ) {
+					continue;
+				}
+
+				if( seg->offset + len > run_end ) {
+					len = run_end - seg->offset;
+				}
+
+				memcpy( seg->data, bounce + (seg->offset - run_start), len );
+				total = total + len;
+			}
+		}
+
+		i = run_last + 1;
+	}
+
+	vfs_io_hint_restore( hint );
+	vfs_arena_restore( vfs_scratch(), mark );
+
+	return total;
+}
+
+/**
+ * @brief Writes a batch of segments to an AFS file
+ * 
+ * Segments that exactly abut each other are gathered into one disk write.
+ * Overlapping segments are written one at a time in array order, so later
+ * segments win.
+ * 
+ * @param id 
+ * @param iov 
+ * @param count 
+ * @return int total bytes written, otherwise VFS_ERROR_
+ */
+int afs_writev( inode_id id, vfs_iovec *iov, uint32_t count ) {
+	afs_inode *inode = afs_lookup_by_inode_id( id );
+	uint32_t stack_order[VFS_IOV_STACK_COUNT];
+	uint32_t *order = stack_order;
+	uint64_t end = 0;
+	int total = 0;
+
+	if( inode == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	afs_volume *vol = inode->volume;
+	afs_block_meta_data *meta = &vol->block_meta_data[ inode->block_id ];
+
+	if( meta->block_type != AFS_BLOCK_TYPE_FILE ) {
+		return VFS_ERROR_NOT_A_FILE;
+	}
+
+	for( uint32_t i = 0; i < count; i++ ) {
+		if( iov[i].size != 0 && iov[i].offset + iov[i].size > end ) {
+			end = iov[i].offset + iov[i].size;
 		}
-	} while( head != NULL && !found );
+	}
 
-	//vfs_debugf( "Returning vfs_id: %d\n", ret_val );
+	int reserve_err = afs_reserve( inode, end );
+
+	if( reserve_err != VFS_ERROR_NONE ) {
+		return reserve_err;
+	}
+
+	uint64_t base = (uint64_t)inode->block_id * vol->drive->block_size;
+
+	vfs_arena_mark mark = vfs_arena_save( vfs_scratch() );
+
+	if( count > VFS_IOV_STACK_COUNT ) {
+		order = vfs_arena_alloc( vfs_scratch(), sizeof(uint32_t) * count );
+
+		if( order == NULL ) {
+			vfs_arena_restore( vfs_scratch(), mark );
+			return VFS_ERROR_MEMORY;
+		}
+	}
+
+	afs_iov_sort( iov, order, count );
+
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_FILE, inode->block_id );
+
+	bool overlap = false;
+	for( uint32_t i = 1; i < count; i++ ) {
+		if( iov[ order[i - 1] ].offset + iov[ order[i - 1] ].size > iov[ order[i] ].offset ) {
+			overlap = true;
+		}
+	}
+
+	if( overlap ) {
+		for( uint32_t i = 0; i < count; i++ ) {
+			vfs_disk_write( vol->blockdev, base + iov[i].offset, iov[i].size, iov[i].data );
+			total = total + iov[i].size;
+		}
+	} else {
+		uint32_t i = 0;
+		while( i < count ) {
+			uint64_t run_start = iov[ order[i] ].offset;
+			uint64_t run_end = run_start + iov[ order[i] ].size;
+			uint32_t run_last = i;
+
+			while( run_last + 1 < count && iov[ order[run_last + 1] ].offset == run_end ) {
+				run_end = run_end + iov[ order[run_last + 1] ].size;
+				run_last++;
+			}
+
+			if( run_last == i ) {
+				vfs_disk_write( vol->blockdev, base + run_start, run_end - run_start, iov[ order[i] ].data );
+			} else {
+				uint8_t *bounce = vfs_arena_alloc( vfs_scratch(), run_end - run_start );
+
+				if( bounce == NULL ) {
+					total = VFS_ERROR_MEMORY;
+					break;
+				}
+
+				for( uint32_t j = i; j <= run_last; j++ ) {
+					vfs_iovec *seg = &iov[ order[j] ];
+					memcpy( bounce + (seg->offset - run_start), seg->data, seg->size );
+				}
+
+				vfs_disk_write( vol->blockdev, base + run_start, run_end - run_start, bounce );
+			}
 
-	return ret_val;
+			total = total + (run_end - run_start);
+			i = run_last + 1;
+		}
+	}
+
+	vfs_io_hint_restore( hint );
+	vfs_arena_restore( vfs_scratch(), mark );
+
+	if( total >= 0 && end > meta->file_size ) {
+		meta->file_size = end;
+		afs_write_meta( vol, inode->block_id );
+	}
+
+	return total;
+}
+
+/**
+ * @brief Builds the vfs inode for an AFS block, called by the vfs when id isn't resident
+ * 
+ * AFS inode ids are VFS_INODE_ID( fs id, block id ), so the block is known
+ * from the id alone and an evicted inode comes back with the same id.
+ * 
+ * @param id 
+ * @return vfs_inode* new inode on success, NULL if the block isn't a file or directory
+ */
+vfs_inode *afs_load_inode( inode_id id ) {
+	afs_volume *vol = afs_volumes[ VFS_INODE_ID_FS( id ) ];
+	uint64_t block_id = VFS_INODE_ID_LOCAL( id );
+	uint8_t type = 0;
+
+	if( vol == NULL || block_id >= vol->drive->block_count ) {
+		return NULL;
+	}
+
+	afs_block_meta_data *meta = &vol->block_meta_data[block_id];
+
+	if( !meta->in_use ) {
+		return NULL;
+	}
+
+	switch( meta->block_type ) {
+		case AFS_BLOCK_TYPE_DIRECTORY:
+			type = VFS_INODE_TYPE_DIR;
+			break;
+		case AFS_BLOCK_TYPE_FILE:
+			type = VFS_INODE_TYPE_FILE;
+			break;
+		default:
+			return NULL;
+	}
+
+	afs_inode *afs_ino = vfs_slab_alloc( &afs_inode_slab );
+
+	if( afs_ino == NULL ) {
+		return NULL;
+	}
+
+	vfs_inode *node = vfs_allocate_inode_with_id( id );
+
+	if( node == NULL ) {
+		vfs_slab_free( &afs_inode_slab, afs_ino );
+		return NULL;
+	}
+
+	afs_ino->vfs_id = id;
+	afs_ino->block_id = block_id;
+	afs_ino->open = 0;
+	afs_ino->volume = vol;
+
+	vfs_inode_set_fs( node, FS_TYPE_AFS, vol->fs_id );
+	node->type = type;
+	node->fs_data = afs_ino;
+
+	return node;
+}
+
+/**
+ * @brief Releases the AFS state of an inode the vfs is evicting
+ * 
+ * @param node 
+ */
+void afs_evict_inode( vfs_inode *node ) {
+	if( node->fs_data != NULL ) {
+		vfs_slab_free( &afs_inode_slab, node->fs_data );
+		node->fs_data = NULL;
+	}
 }
 
 /**
- * @brief Returns a list of files in the given directory
+ * @brief Opens a cursor over an AFS directory
+ * 
+ * Only the entry count is read here, entries are read from the directory
+ * block one index at a time by afs_readdir.
  * 
  * @param id 
- * @param list 
- * @return vfs_directory_list* directory list on success, NULL on failure
+ * @param it 
+ * @return int VFS_ERROR_NONE on success, VFS_ERROR_ on failure
  */
-vfs_directory_list *afs_dir_list( inode_id id, vfs_directory_list *list ) {
+int afs_opendir( inode_id id, vfs_dir_iter *it ) {
 	afs_inode *afs_ino = afs_lookup_by_inode_id( id );
 
 	if( afs_ino == NULL ) {
 		//vfs_debugf( "afs inode not found.\n" );
-		return NULL;
+		return VFS_ERROR_PATH_NOT_FOUND;
 	}
 
-	if( block_meta_data[afs_ino->block_id].block_type != AFS_BLOCK_TYPE_DIRECTORY ) {
+	afs_volume *vol = afs_ino->volume;
+
+	if( vol->block_meta_data[afs_ino->block_id].block_type != AFS_BLOCK_TYPE_DIRECTORY ) {
 		//vfs_debugf( "afs inode is not a direcotry.\n" );
-		return NULL;
+		return VFS_ERROR_NOT_A_DIRECTORY;
 	}
 
-	afs_block_directory *dir_block = vfs_malloc( sizeof(afs_block_directory) );
-	dir_block = (afs_block_directory *)afs_read_block( afs_ino->block_id, sizeof(afs_block_directory), (uint8_t *)dir_block );
-	
-	afs_load_directory_as_inodes( id, dir_block );
+	uint32_t next_index = 0;
+
+	it->fs_data = vol;
+	it->fs_offset = (uint64_t)afs_ino->block_id * vol->drive->block_size;
 
-	list->count = dir_block->next_index;
-	list->entry = vfs_malloc( sizeof(vfs_directory_item) * list->count );
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_DIRECTORY, afs_ino->block_id );
+	vfs_disk_read( vol->blockdev, it->fs_offset + offsetof(afs_block_directory, next_index), sizeof(uint32_t), (uint8_t *)&next_index );
+	vfs_io_hint_restore( hint );
 
-	//vfs_debugf( "count: %d\n", list->count );
+	// The count comes off the disk, it can't be trusted past the index
+	it->count = next_index < AFS_DIRECTORY_ENTRIES ? next_index : AFS_DIRECTORY_ENTRIES;
 
-	for( int i = 0; i < list->count; i++ ) {
-		strcpy( list->entry[i].name, block_meta_data[dir_block->index[i]].name );
-		list->entry[i].id = afs_find_inode_from_block_id( block_meta_data[dir_block->index[i]].id );
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Reads the next entry of an AFS directory
+ * 
+ * @param it 
+ * @return int 1 if an entry was read, 0 at the end of the directory
+ */
+int afs_readdir( vfs_dir_iter *it ) {
+	afs_volume *vol = it->fs_data;
+	uint32_t block_id = 0;
 
-		//vfs_debugf( "i %d: name=\"%s\" id=%d\n", i, list->entry[i].name, list->entry[i].id );
+	if( it->position >= it->count ) {
+		return 0;
+	}
+
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_DIRECTORY, it->fs_offset / vol->drive->block_size );
+	vfs_disk_read( vol->blockdev, it->fs_offset + offsetof(afs_block_directory, index) + (it->position * sizeof(uint32_t)), sizeof(uint32_t), (uint8_t *)&block_id );
+	vfs_io_hint_restore( hint );
+
+	// So does the entry, one outside the drive ends the listing
+	if( block_id >= vol->drive->block_count ) {
+		return 0;
 	}
 
-	return list;
+	afs_block_meta_data *meta = &vol->block_meta_data[block_id];
+
+	strncpy( it->entry.name, meta->name, VFS_NAME_MAX - 1 );
+	it->entry.name[VFS_NAME_MAX - 1] = 0;
+	it->entry.id = VFS_INODE_ID( vol->fs_id, block_id );
+
+	switch( meta->block_type ) {
+		case AFS_BLOCK_TYPE_DIRECTORY:
+			it->entry.type = VFS_INODE_TYPE_DIR;
+			break;
+		case AFS_BLOCK_TYPE_FILE:
+			it->entry.type = VFS_INODE_TYPE_FILE;
+			break;
+		default:
+			it->entry.type = 0;
+	}
+
+	return 1;
 }
 
 /**
@@ -424,42 +1022,162 @@ vfs_directory_list *afs_dir_list( inode_id id, vfs_directory_list *list ) {
  * @return afs_file* Pointer to the AFS inode struct, NULL on failure
  */
 afs_inode *afs_lookup_by_inode_id( inode_id id ) {
-	afs_inode *inode = &afs_inodes;
-	bool found = false;
-
-	do {
-		if( inode->vfs_id == id ) {
-			found = true;
-		} else {
-			inode = inode->next;
-		}
-	} while( (inode != NULL) && !found );
+	vfs_inode *node = vfs_lookup_inode_ptr_by_id( id );
 
-	if( !found ) {
+	if( node == NULL ) {
 		return NULL;
 	}
 
-	return inode;
+	return node->fs_data;
 }
 
 /**
  * @brief Opens the inode id for use
  * 
  * @param id 
+ * @param h handle to fill in with the afs_inode and the file's extents
  * @return int 0 on success, VFS_ERROR_ on failure
  */
-int afs_open( inode_id id ) {
+int afs_open( inode_id id, vfs_handle *h ) {
 	afs_inode *inode = afs_lookup_by_inode_id( id );
 
 	if( inode == NULL ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	inode->open = true;
+	vfs_atomic_inc( &inode->open );
+
+	h->fs_data = inode;
+	afs_handle_load_extents( h );
 
 	return VFS_ERROR_NONE;
 }
 
+/**
+ * @brief Releases an open handle
+ * 
+ * @param h 
+ */
+void afs_close( vfs_handle *h ) {
+	afs_inode *inode = h->fs_data;
+
+	vfs_atomic_dec( &inode->open );
+}
+
+/**
+ * @brief Fills in the handle's size and extent list from the block meta data
+ * 
+ * AFS files occupy num_blocks contiguous blocks from starting_block, so a
+ * file is always a single extent.
+ * 
+ * @param h 
+ */
+void afs_handle_load_extents( vfs_handle *h ) {
+	afs_inode *inode = h->fs_data;
+	afs_volume *vol = inode->volume;
+	afs_block_meta_data *meta = &vol->block_meta_data[ inode->block_id ];
+
+	h->size = meta->file_size;
+	h->extent_count = 0;
+
+	if( meta->block_type != AFS_BLOCK_TYPE_FILE ) {
+		return;
+	}
+
+	h->extent[0].file_offset = 0;
+	h->extent[0].disk_offset = (uint64_t)inode->block_id * vol->drive->block_size;
+	h->extent[0].length = (uint64_t)meta->num_blocks * vol->drive->block_size;
+	h->extent_count = 1;
+}
+
+/**
+ * @brief Reads from an open file through its cached extents
+ * 
+ * @param h 
+ * @param data 
+ * @param size 
+ * @param offset 
+ * @return int number of bytes read (clamped to the file size), otherwise VFS_ERROR_
+ */
+int afs_read_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset ) {
+	if( offset >= h->size ) {
+		return 0;
+	}
+
+	if( offset + size > h->size ) {
+		size = h->size - offset;
+	}
+
+	afs_inode *inode = h->fs_data;
+	afs_volume *vol = inode->volume;
+	uint64_t done = 0;
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_FILE, inode->block_id );
+
+	for( uint32_t i = 0; i < h->extent_count && done < size; i++ ) {
+		vfs_extent *e = &h->extent[i];
+		uint64_t pos = offset + done;
+
+		if( pos < e->file_offset || pos >= e->file_offset + e->length ) {
+			continue;
+		}
+
+		uint64_t len = e->file_offset + e->length - pos;
+
+		if( len > size - done ) {
+			len = size - done;
+		}
+
+		vfs_disk_read( vol->blockdev, e->disk_offset + (pos - e->file_offset), len, data + done );
+		done = done + len;
+	}
+
+	vfs_io_hint_restore( hint );
+
+	return done;
+}
+
+/**
+ * @brief Writes to an open file through its cached extents
+ * 
+ * Writes inside the allocated blocks go straight to disk. A file can only
+ * grow past its blocks when it is the last thing allocated on the drive.
+ * 
+ * @param h 
+ * @param data 
+ * @param size 
+ * @param offset 
+ * @return int number of bytes written, otherwise VFS_ERROR_
+ */
+int afs_write_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset ) {
+	afs_inode *inode = h->fs_data;
+	afs_volume *vol = inode->volume;
+	afs_block_meta_data *meta = &vol->block_meta_data[ inode->block_id ];
+	uint64_t end = offset + size;
+
+	if( meta->block_type != AFS_BLOCK_TYPE_FILE ) {
+		return VFS_ERROR_NOT_A_FILE;
+	}
+
+	int reserve_err = afs_reserve( inode, end );
+
+	if( reserve_err != VFS_ERROR_NONE ) {
+		return reserve_err;
+	}
+
+	vfs_io_hint hint = afs_io_hint( vol, VFS_IO_CLASS_FILE, inode->block_id );
+	vfs_disk_write( vol->blockdev, ((uint64_t)inode->block_id * vol->drive->block_size) + offset, size, data );
+	vfs_io_hint_restore( hint );
+
+	if( end > meta->file_size ) {
+		meta->file_size = end;
+		afs_write_meta( vol, inode->block_id );
+	}
+
+	afs_handle_load_extents( h );
+
+	return size;
+}
+
 /**
  * @brief Returns stats on given inode
  * 
@@ -474,21 +1192,25 @@ int afs_stat( inode_id id, vfs_stat_data *stat ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	stat->size = block_meta_data[ inode->block_id ].file_size;
+	afs_volume *vol = inode->volume;
+	stat->size = vol->block_meta_data[ inode->block_id ].file_size;
 
 	return VFS_ERROR_NONE;
 }
 
 /**
- * @brief Displays diagnostic data about the drive
+ * @brief Displays diagnostic data about an AFS drive
  * 
+ * @param blockdev drive number of the image
  */
-void afs_dump_diagnostic_data( void ) {
+void afs_dump_diagnostic_data( uint64_t blockdev ) {
 	//vfs_debugf( "    \n", dd_drive-> );
 
+	vfs_arena_mark mark = vfs_arena_save( vfs_scratch() );
+
 	// Drive Info
-	afs_drive *dd_drive = vfs_malloc( sizeof(afs_drive) );
-	vfs_disk_read( 0, 0, sizeof(afs_drive), (uint8_t *)dd_drive );
+	afs_drive *dd_drive = vfs_arena_alloc( vfs_scratch(), sizeof(afs_drive) );
+	vfs_disk_read( blockdev, 0, sizeof(afs_drive), (uint8_t *)dd_drive );
 	vfs_debugf( "afs_drive:\n" );
 	vfs_debugf( "    magic: \"%c%c%c%c\"\n", dd_drive->magic[0], dd_drive->magic[1], dd_drive->magic[2], dd_drive->magic[3]);
 	vfs_debugf( "    version: %d\n", dd_drive->version );
@@ -500,10 +1222,10 @@ void afs_dump_diagnostic_data( void ) {
 	vfs_debugf( "\n" );
 
 	// Meta data 
-	afs_block_meta_data *dd_meta_data = vfs_malloc( sizeof(afs_block_meta_data) );
+	afs_block_meta_data *dd_meta_data = vfs_arena_alloc( vfs_scratch(), sizeof(afs_block_meta_data) );
 	for( int i = 0; i < dd_drive->block_count; i++ ) {
 		uint64_t offset = sizeof(afs_drive) + (sizeof(afs_block_meta_data) * i );
-		vfs_disk_read( 0, offset, sizeof(afs_block_meta_data), (uint8_t *)dd_meta_data );
+		vfs_disk_read( blockdev, offset, sizeof(afs_block_meta_data), (uint8_t *)dd_meta_data );
 
 		if( dd_meta_data->in_use == true && dd_meta_data->block_type != AFS_BLOCK_TYPE_META && dd_meta_data->file_size != 0 ) {
 			vfs_debugf( "afs_block_meta_data for block %d\n", dd_meta_data->id );
@@ -520,8 +1242,8 @@ void afs_dump_diagnostic_data( void ) {
 	vfs_debugf( "\n" );
 
 	// Root Directory
-	afs_block_directory *dd_root_dir = vfs_malloc( sizeof(afs_block_directory) );
-	vfs_disk_read( 0, dd_drive->block_size * dd_drive->root_directory, sizeof(afs_block_directory), (uint8_t *)dd_root_dir );
+	afs_block_directory *dd_root_dir = vfs_arena_alloc( vfs_scratch(), sizeof(afs_block_directory) );
+	vfs_disk_read( blockdev, dd_drive->block_size * dd_drive->root_directory, sizeof(afs_block_directory), (uint8_t *)dd_root_dir );
 	vfs_debugf( "Root Directory:\n" );
 	vfs_debugf( "    type: %d\n", dd_root_dir->type );
 	vfs_debugf( "    next_index: %d\n", dd_root_dir->next_index );
@@ -532,6 +1254,8 @@ void afs_dump_diagnostic_data( void ) {
 		}
 	}
 	vfs_debugf( "\n" );
+
+	vfs_arena_restore( vfs_scratch(), mark );
 }
 
 /**********************************************/
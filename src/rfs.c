@@ -3,6 +3,10 @@
 
 rfs_file_list rfs_files;
 rfs_mounted rfs_mounts;
+vfs_slab rfs_file_slab;
+vfs_slab rfs_file_list_slab;
+vfs_slab rfs_file_list_el_slab;
+vfs_lock rfs_lock;
 
 /**
  * @brief Initalizes the Ram File System
@@ -12,7 +16,7 @@ rfs_mounted rfs_mounts;
 int rfs_initalize( void ) {
 	vfs_filesystem *rfs;
 
-	int reg_err = vfs_register_fs( &rfs );
+	int reg_err = vfs_register_fs( FS_TYPE_RFS, &rfs );
 
 	if( reg_err != 0 ) {
 		vfs_debugf( "Register FS error: %d\n", reg_err );
@@ -24,27 +28,100 @@ int rfs_initalize( void ) {
 	rfs->op.create = rfs_create;
 	rfs->op.write = rfs_write;
 	rfs->op.read = rfs_read;
-	rfs->op.get_dir_list = rfs_dir_list;
+	rfs->op.read_handle = rfs_read_handle;
+	rfs->op.write_handle = rfs_write_handle;
+	rfs->op.readv = rfs_readv;
+	rfs->op.writev = rfs_writev;
+	rfs->op.opendir = rfs_opendir;
+	rfs->op.readdir = rfs_readdir;
 	rfs->op.stat = rfs_stat;
 
 	rfs_files.head = NULL;
 	rfs_files.tail = NULL;
 	rfs_files.count = 0;
 
+	vfs_lock_initalize( &rfs_lock );
+	vfs_slab_initalize( &rfs_file_slab, "rfs_file", sizeof(rfs_file), RFS_SLAB_COUNT );
+	vfs_slab_initalize( &rfs_file_list_slab, "rfs_file_list", sizeof(rfs_file_list), RFS_SLAB_COUNT );
+	vfs_slab_initalize( &rfs_file_list_el_slab, "rfs_file_list_el", sizeof(rfs_file_list_el), RFS_SLAB_COUNT );
+
 	return VFS_ERROR_NONE;
 }
 
+/**
+ * @brief Regenerates a generated file's contents, other files are left alone
+ * 
+ * The buffer is allocated once, so a reader racing the refresh may see a
+ * mix of old and new text but never freed memory.
+ * 
+ * @param f 
+ */
+static void rfs_refresh( rfs_file *f ) {
+	if( f->generate == NULL ) {
+		return;
+	}
+
+	vfs_lock_acquire( &rfs_lock );
+
+	uint64_t length = f->generate( (char *)f->data, RFS_GENERATED_MAX );
+
+	f->size = length < RFS_GENERATED_MAX ? length : RFS_GENERATED_MAX - 1;
+
+	vfs_lock_release( &rfs_lock );
+}
+
 /**
  * @brief Opens an RFS file for use
  * 
  * @param id 
+ * @param h handle to fill in with the rfs_file
  * @return int VFS_ERROR_NONE on success, VFS_ERROR_ on failure
  */
-int rfs_open( inode_id id ) {
+int rfs_open( inode_id id, vfs_handle *h ) {
+	rfs_file *f = rfs_lookup_by_inode_id( id );
+
+	if( f == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	rfs_refresh( f );
+
+	h->fs_data = f;
+	h->size = f->size;
 
 	return VFS_ERROR_NONE;
 }
 
+/**
+ * @brief Reads from an open RFS file
+ * 
+ * @param h 
+ * @param data 
+ * @param size 
+ * @param offset 
+ * @return int size of bytes read, otherwise VFS_ERROR_
+ */
+int rfs_read_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset ) {
+	return rfs_read_file( h->fs_data, data, size, offset );
+}
+
+/**
+ * @brief Writes to an open RFS file
+ * 
+ * @param h 
+ * @param data 
+ * @param size 
+ * @param offset 
+ * @return int Bytes written (greater than 0), otherwise VFS_ERROR_ on failure
+ */
+int rfs_write_handle( vfs_handle *h, uint8_t *data, uint64_t size, uint64_t offset ) {
+	int ret_val = rfs_write_file( h->fs_data, data, size, offset );
+
+	h->size = ((rfs_file *)h->fs_data)->size;
+
+	return ret_val;
+}
+
 /**
  * @brief Returns statistics for the given file
  * 
@@ -60,6 +137,8 @@ int rfs_stat( inode_id id, vfs_stat_data *stat ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
+	rfs_refresh( f );
+
 	stat->size = f->size;
 
 	return VFS_ERROR_NONE;
@@ -76,6 +155,8 @@ int rfs_mount( inode_id id, char *path, uint8_t *data_root ) {
 	// Register this mount point
 	rfs_mounted *mnt = NULL;
 
+	vfs_lock_acquire( &rfs_lock );
+
 	bool found = false;
 	if( rfs_mounts.id == 0 ) {
 		mnt = &rfs_mounts;
@@ -93,6 +174,7 @@ int rfs_mount( inode_id id, char *path, uint8_t *data_root ) {
 	}
 
 	if( mnt == NULL ) {
+		vfs_lock_release( &rfs_lock );
 		return VFS_ERROR_MEMORY;
 	}
 
@@ -105,17 +187,19 @@ int rfs_mount( inode_id id, char *path, uint8_t *data_root ) {
 	mnt->fs_id = ino->fs_id;
 
 	mnt->file_list.count = 1;
-	mnt->file_list.head = vfs_malloc( sizeof(rfs_file_list_el) );
+	mnt->file_list.head = vfs_slab_alloc( &rfs_file_list_el_slab );
 
 	if( mnt->file_list.head == NULL ) {
+		vfs_lock_release( &rfs_lock );
 		return VFS_ERROR_MEMORY;
 	}
 
 	mnt->file_list.tail = mnt->file_list.head;
 
-	mnt->file_list.head->file = vfs_malloc( sizeof(rfs_file) );
+	mnt->file_list.head->file = vfs_slab_alloc( &rfs_file_slab );
 
 	if( mnt->file_list.head->file == NULL ) {
+		vfs_lock_release( &rfs_lock );
 		return VFS_ERROR_MEMORY;
 	}
 
@@ -124,9 +208,10 @@ int rfs_mount( inode_id id, char *path, uint8_t *data_root ) {
 	mnt->file_list.head->file->vfs_parent_inode_id = 0;
 	strcpy( mnt->file_list.head->file->name, "/" );
 
-	rfs_file_list *root_dir_list = vfs_malloc( sizeof(rfs_file_list) );
+	rfs_file_list *root_dir_list = vfs_slab_alloc( &rfs_file_list_slab );
 
 	if( root_dir_list == NULL ) {
+		vfs_lock_release( &rfs_lock );
 		return VFS_ERROR_MEMORY;
 	}
 
@@ -134,6 +219,9 @@ int rfs_mount( inode_id id, char *path, uint8_t *data_root ) {
 	root_dir_list->tail = NULL;
 	root_dir_list->count = 0;
 	mnt->file_list.head->file->dir_list = (void *)root_dir_list;
+	ino->fs_data = mnt->file_list.head->file;
+
+	vfs_lock_release( &rfs_lock );
 
 	return VFS_ERROR_NONE;
 }
@@ -169,22 +257,24 @@ rfs_file_list *rfs_get_file_list_by_fs_id( uint8_t fs_id ) {
  * 
  * @param type 
  * @param parent 
- * @param path 
  * @param name 
  * @return int inode id on success, otherwise VFS_ERROR_ on failure
  */
-int rfs_create( inode_id parent, uint8_t type, char *path, char *name ) {
+int rfs_create( inode_id parent, uint8_t type, char *name ) {
 	// Allocate a VFS inode for this object, fill in details
 	vfs_inode *parent_node = vfs_lookup_inode_ptr_by_id(parent);
 	vfs_inode *node = vfs_allocate_inode();
-	node->fs_type = FS_TYPE_RFS;
+	vfs_inode_set_fs( node, FS_TYPE_RFS, parent_node->fs_id );
 	node->type = type;
-	node->fs_id = parent_node->fs_id;
 
 	// Allocate a RFS file, fill in details
-	rfs_file *f = vfs_malloc( sizeof(rfs_file) );
+	vfs_lock_acquire( &rfs_lock );
+	rfs_file *f = vfs_slab_alloc( &rfs_file_slab );
+	node->fs_data = f;
 	f->vfs_inode_id = node->id;
 	f->size = 0;
+	f->data = NULL;
+	f->generate = NULL;
 	f->vfs_parent_inode_id = parent;
 	strcpy( f->name, name );
 
@@ -202,7 +292,7 @@ int rfs_create( inode_id parent, uint8_t type, char *path, char *name ) {
 
 	// If dir, initalize the RFS dir_list
 	if( type == VFS_INODE_TYPE_DIR ) {
-		rfs_file_list *d_list = vfs_malloc( sizeof(rfs_file_list) );
+		rfs_file_list *d_list = vfs_slab_alloc( &rfs_file_list_slab );
 		f->dir_list = (void *)d_list;
 		d_list->count = 0;
 		d_list->head = NULL;
@@ -214,7 +304,7 @@ int rfs_create( inode_id parent, uint8_t type, char *path, char *name ) {
 	// Insert into parent directory
 	rfs_file *rfs_parent = rfs_lookup_by_inode_id( parent );
 	rfs_file_list *parent_dir = (rfs_file_list *)rfs_parent->dir_list;
-	rfs_file_list_el *list_el = vfs_malloc( sizeof(rfs_file_list_el) );
+	rfs_file_list_el *list_el = vfs_slab_alloc( &rfs_file_list_el_slab );
 	list_el->next = NULL;
 	list_el->file = f;
 
@@ -227,8 +317,10 @@ int rfs_create( inode_id parent, uint8_t type, char *path, char *name ) {
 	}
 	parent_dir->count++;
 
+	vfs_dcache_invalidate( parent, name );
+
 	// Attach completed file to the master list
-	rfs_file_list_el *main_file_list_el = vfs_malloc( sizeof(rfs_file_list_el) );
+	rfs_file_list_el *main_file_list_el = vfs_slab_alloc( &rfs_file_list_el_slab );
 	main_file_list_el->file = f;
 	main_file_list_el->next = NULL;
 
@@ -238,9 +330,47 @@ int rfs_create( inode_id parent, uint8_t type, char *path, char *name ) {
 	fl->tail->next = main_file_list_el;
 	fl->tail = main_file_list_el;
 
+	vfs_lock_release( &rfs_lock );
+
 	return node->id;
 }
 
+/**
+ * @brief Creates a read only file whose contents come from generate, remade on every open
+ * 
+ * @param parent directory to create it in
+ * @param name 
+ * @param generate 
+ * @return int inode id on success (greater than 0), otherwise VFS_ERROR_ on failure
+ */
+int rfs_create_generated( inode_id parent, char *name, rfs_generator generate ) {
+	int id = vfs_create_at( parent, VFS_INODE_TYPE_FILE, name );
+
+	if( id < 0 ) {
+		return id;
+	}
+
+	rfs_file *f = rfs_lookup_by_inode_id( id );
+
+	if( f == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	uint8_t *buffer = vfs_malloc( RFS_GENERATED_MAX );
+
+	if( buffer == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	vfs_lock_acquire( &rfs_lock );
+	f->data = buffer;
+	f->size = 0;
+	f->generate = generate;
+	vfs_lock_release( &rfs_lock );
+
+	return id;
+}
+
 /**
  * @brief Gets the rfs_file pointer for the given vfs inode id
  * 
@@ -249,6 +379,16 @@ int rfs_create( inode_id parent, uint8_t type, char *path, char *name ) {
  */
 rfs_file *rfs_lookup_by_inode_id( inode_id id ) {
 	vfs_inode *ino = vfs_lookup_inode_ptr_by_id( id );
+
+	if( ino == NULL ) {
+		return NULL;
+	}
+
+	// RFS inodes are never evicted, so the file set at create/mount stays put
+	if( ino->fs_data != NULL ) {
+		return (rfs_file *)ino->fs_data;
+	}
+
 	rfs_file_list *rfs_files = rfs_get_file_list_by_fs_id( ino->fs_id );
 
 	rfs_file *f = NULL;
@@ -292,31 +432,51 @@ int rfs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
+	return rfs_write_file( f, data, size, offset );
+}
+
+/**
+ * @brief Writes to the given rfs_file, growing it as needed
+ * 
+ * @param f 
+ * @param data 
+ * @param size 
+ * @param offset 
+ * @return int Bytes written (greater than 0), otherwise VFS_ERROR_ on failure
+ */
+int rfs_write_file( rfs_file *f, uint8_t *data, uint64_t size, uint64_t offset ) {
+	if( f->generate != NULL ) {
+		return VFS_ERROR_READ_ONLY;
+	}
+
 	// If no size, then it's the first write, so just create the mem and copy the data
 	if( f->size == 0 ) {
-		f->data = vfs_malloc( size );
+		f->data = vfs_malloc( size + offset );
 		
 		if( f->data == NULL ) {
 			//vfs_debugf( "Could not allocate space for file.\n" );
 			return VFS_ERROR_MEMORY;
 		}
 
-		f->size = size;
+		memset( f->data, 0, offset );
+		f->size = size + offset;
 	}
 
 	// Do a realloc if we don't have enough space
-	uint64_t space_to_realloc = 0;
-
 	if( f->size < offset + size ) {
-		space_to_realloc = size + offset;
-	}
+		uint8_t *new_data = vfs_realloc( f->data, size + offset );
 
-	if( space_to_realloc != 0 ) {
-		f->data = vfs_realloc( f->data, space_to_realloc );
+		if( new_data == NULL ) {
+			return VFS_ERROR_MEMORY;
+		}
+
+		memset( new_data + f->size, 0, (size + offset) - f->size );
+		f->data = new_data;
+		f->size = size + offset;
 	}
 
 	// Copy over the data
-	memcpy( (f->data + (uint8_t)offset), data, size );
+	memcpy( f->data + offset, data, size );
 
 	return size;
 }
@@ -338,47 +498,153 @@ int rfs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	memcpy( data + (uint8_t)offset, f->data, size );
+	// Reads by id have no open, a read from the start stands in for one
+	if( offset == 0 ) {
+		rfs_refresh( f );
+	}
+
+	return rfs_read_file( f, data, size, offset );
+}
+
+/**
+ * @brief Reads a batch of segments from an RFS file
+ * 
+ * @param id 
+ * @param iov 
+ * @param count 
+ * @return int total bytes read, otherwise VFS_ERROR_
+ */
+int rfs_readv( inode_id id, vfs_iovec *iov, uint32_t count ) {
+	rfs_file *f = rfs_lookup_by_inode_id( id );
+	int total = 0;
+
+	if( f == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	for( uint32_t i = 0; i < count; i++ ) {
+		total = total + rfs_read_file( f, iov[i].data, iov[i].size, iov[i].offset );
+	}
+
+	return total;
+}
+
+/**
+ * @brief Writes a batch of segments to an RFS file
+ * 
+ * @param id 
+ * @param iov 
+ * @param count 
+ * @return int total bytes written, otherwise VFS_ERROR_
+ */
+int rfs_writev( inode_id id, vfs_iovec *iov, uint32_t count ) {
+	rfs_file *f = rfs_lookup_by_inode_id( id );
+	int total = 0;
+
+	if( f == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	for( uint32_t i = 0; i < count; i++ ) {
+		int n = rfs_write_file( f, iov[i].data, iov[i].size, iov[i].offset );
+
+		if( n < 0 ) {
+			return n;
+		}
+
+		total = total + n;
+	}
+
+	return total;
+}
+
+/**
+ * @brief Reads from the given rfs_file
+ * 
+ * @param f 
+ * @param data 
+ * @param size 
+ * @param offset 
+ * @return int size of bytes read (clamped to the file size), otherwise VFS_ERROR_
+ */
+int rfs_read_file( rfs_file *f, uint8_t *data, uint64_t size, uint64_t offset ) {
+	if( offset >= f->size ) {
+		return 0;
+	}
+
+	if( offset + size > f->size ) {
+		size = f->size - offset;
+	}
+
+	memcpy( data, f->data + offset, size );
 
 	return size;
 }
 
 /**
- * @brief Returns a list of files in the given directory
+ * @brief Opens a cursor over an RFS directory
  * 
  * @param id 
- * @param list 
- * @return vfs_directory_list* Directory list on success, NULL on failure
+ * @param it 
+ * @return int VFS_ERROR_NONE on success, VFS_ERROR_ on failure
  */
-vfs_directory_list *rfs_dir_list( inode_id id, vfs_directory_list *list ) {
+int rfs_opendir( inode_id id, vfs_dir_iter *it ) {
 	rfs_file *dir = rfs_lookup_by_inode_id( id );
 
 	if( dir == NULL ) {
 		//vfs_debugf( "rfs_file not found.\n" );
-		return NULL;
+		return VFS_ERROR_PATH_NOT_FOUND;
 	}
 
 	if( dir->rfs_file_type != RFS_FILE_TYPE_DIR ) {
 		//vfs_debugf( "rfs_file is not a direcotry.\n" );
-		return NULL;
+		return VFS_ERROR_NOT_A_DIRECTORY;
 	}
 
 	if( dir->dir_list == NULL ) {
 		//vfs_debugf( "dir_list in rfs_file is NULL for id %ld.\n", id );
-		return NULL;
+		return VFS_ERROR_PATH_NOT_FOUND;
 	}
 
 	rfs_file_list *rfs_list = (rfs_file_list *)dir->dir_list;
 
-	list->count = rfs_list->count;
-	list->entry = vfs_malloc( sizeof(vfs_directory_item) * list->count );
+	it->count = rfs_list->count;
+	it->fs_data = rfs_list->head;
 
-	rfs_file_list_el *head = rfs_list->head;
+	return VFS_ERROR_NONE;
+}
 
-	for( int i = 0; i < list->count; i++ ) {
-		strcpy( list->entry[i].name, head->file->name );
-		list->entry[i].id = head->file->vfs_inode_id;
+/**
+ * @brief Reads the next entry of an RFS directory
+ * 
+ * @param it 
+ * @return int 1 if an entry was read, 0 at the end of the directory
+ */
+int rfs_readdir( vfs_dir_iter *it ) {
+	rfs_file_list_el *el = it->fs_data;
 
-		head = head->next;
+	if( el == NULL ) {
+		return 0;
 	}
-}
\ No newline at end of file
+
+	strcpy( it->entry.name, el->file->name );
+	it->entry.id = el->file->vfs_inode_id;
+
+	switch( el->file->rfs_file_type ) {
+		case RFS_FILE_TYPE_DIR:
+			it->entry.type = VFS_INODE_TYPE_DIR;
+			break;
+		case RFS_FILE_TYPE_FILE:
+			it->entry.type = VFS_INODE_TYPE_FILE;
+			break;
+		case RFS_FILE_TYPE_DEVICE:
+			it->entry.type = VFS_INODE_TYPE_DEVICE;
+			break;
+		default:
+			it->entry.type = 0;
+	}
+
+	it->fs_data = el->next;
+
+	return 1;
+}
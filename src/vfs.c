@@ -8,26 +8,67 @@
 
 #undef VFS_CACHE_DEBUG
 
-vfs_filesystem *file_systems;
+vfs_filesystem *fs_by_type[FS_TYPE_MAX];
+vfs_filesystem *fs_by_id[256];
+uint8_t write_policy_by_id[256];	// VFS_WRITE_ of each mount
 vfs_inode root_inode;
-vfs_inode *inode_index_tail;
+vfs_inode_table inode_table;
+vfs_slab inode_slab;
+vfs_dentry_cache dcache;
+vfs_slab dentry_slab;
+vfs_handle handles[VFS_MAX_HANDLES];
+vfs_slab *slab_list;
+VFS_THREAD_LOCAL vfs_arena scratch_arena;
+vfs_slab page_slab;
+vfs_slab page_data_slab;
+vfs_slab page_ghost_slab;
+int handle_free[VFS_MAX_HANDLES];
+int handle_free_count;
+vfs_lock handle_lock;
 inode_id vfs_inode_id_top;
 uint8_t fs_id_top;
 vfs_directory_list mount_points;
-
-vfs_cache_list cache;
-uint64_t cache_hits;
-uint64_t cache_misses;
-uint64_t cache_read_success;
-uint64_t cache_read_fail;
-uint64_t cache_write_success;
-uint64_t cache_write_fail;
-uint64_t cache_write_old;
-uint64_t cache_write_new;
-uint64_t cache_total_out;
-uint64_t cache_total_in;
-uint64_t cache_disk_read_calls;
-uint64_t cache_disk_write_calls;
+vfs_lock mount_lock;
+vfs_blockdev blockdevs[VFS_MAX_DRIVES];
+uint32_t blockdev_count;			// slots in use, registered devices are never taken out
+vfs_lock blockdev_lock;
+uint64_t disk_head[VFS_MAX_DRIVES];	// end of each drive's last submitted request, where C-LOOK carries on from
+VFS_THREAD_LOCAL vfs_disk_plug_state disk_plug;
+vfs_lock flush_lock;
+vfs_lock metrics_lock;
+vfs_page_cache cache;
+vfs_metrics metrics;				// counts of threads that have exited
+vfs_metrics *metrics_threads;		// blocks of live threads
+VFS_THREAD_LOCAL vfs_metrics *thread_metrics;
+VFS_THREAD_LOCAL vfs_io_hint io_hint;
+VFS_THREAD_LOCAL bool io_streaming;
+VFS_THREAD_LOCAL uint32_t metrics_sample;
+VFS_THREAD_LOCAL vfs_readahead_stream readahead_stream[VFS_READAHEAD_STREAMS];
+VFS_THREAD_LOCAL uint8_t readahead_stream_next;	// slot the next new stream replaces
+
+char *io_class_names[VFS_IO_CLASS_MAX] = { "other", "meta", "directory", "file" };
+char *metric_names[VFS_METRIC_MAX] = { "hit", "miss", "disk_read", "disk_write" };
+
+static void vfs_flusher_wake( void );
+static void vfs_readahead_queue( uint64_t drive, uint64_t first, uint64_t count );
+static void vfs_metrics_thread_exit( void );
+static bool vfs_disk_plug_hold( uint64_t drive, uint64_t addr, uint64_t size );
+static int vfs_disk_plug_flush( vfs_disk_plug_state *plug );
+static int vfs_metrics_publish( inode_id proc );
+
+static void vfs_clock_insert( vfs_cache_shard *shard, vfs_page *page );
+static void vfs_clock_remove( vfs_cache_shard *shard, vfs_page *page );
+static vfs_page *vfs_clock_victim( vfs_cache_shard *shard );
+static void vfs_2q_insert( vfs_cache_shard *shard, vfs_page *page );
+static void vfs_2q_remove( vfs_cache_shard *shard, vfs_page *page );
+static vfs_page *vfs_2q_victim( vfs_cache_shard *shard );
+static void vfs_2q_evict( vfs_cache_shard *shard, vfs_page *page );
+static void vfs_cache_policy_hit( vfs_page *page );
+
+vfs_cache_policy cache_policies[VFS_CACHE_POLICY_MAX] = {
+	{ .name = "clock", .insert = vfs_clock_insert, .hit = vfs_cache_policy_hit, .remove = vfs_clock_remove, .victim = vfs_clock_victim },
+	{ .name = "2q", .insert = vfs_2q_insert, .hit = vfs_cache_policy_hit, .remove = vfs_2q_remove, .victim = vfs_2q_victim, .evict = vfs_2q_evict }
+};
 
 /**
  * @brief Initalizes the VFS
@@ -35,8 +76,10 @@ uint64_t cache_disk_write_calls;
  * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
  */
 int vfs_initalize( void ) {
-	file_systems = NULL;
+	memset( fs_by_type, 0, sizeof(fs_by_type) );
+	memset( fs_by_id, 0, sizeof(fs_by_id) );
 
+	root_inode.op = NULL;
 	root_inode.fs_type = 0;
 	root_inode.type = VFS_INODE_TYPE_DIR;
 	root_inode.id = 1;
@@ -49,12 +92,51 @@ int vfs_initalize( void ) {
 
 	root_inode.dir_inodes->id = 0;
 	root_inode.dir_inodes->next_dir = NULL;
+	root_inode.next_inode = NULL;
+	root_inode.fs_data = NULL;
+	root_inode.on_lru = false;
+	root_inode.refcount = 1;	// never evicted
+	vfs_rwlock_initalize( &root_inode.lock );
+
+	slab_list = NULL;
+	vfs_slab_initalize( &inode_slab, "vfs_inode", sizeof(vfs_inode), VFS_INODE_SLAB_COUNT );
+
+	vfs_rwlock_initalize( &inode_table.lock );
+	vfs_lock_initalize( &inode_table.lru_lock );
+	vfs_lock_initalize( &inode_table.load_lock );
+	inode_table.bits = VFS_INODE_TABLE_INITIAL_BITS;
+	inode_table.count = 0;
+	inode_table.lru_head = NULL;
+	inode_table.lru_tail = NULL;
+	inode_table.unused = 0;
+	inode_table.unused_max = VFS_INODE_UNUSED_MAX;
+	inode_table.loads = 0;
+	inode_table.evictions = 0;
+	inode_table.slot = vfs_malloc( sizeof(vfs_inode *) << inode_table.bits );
+
+	if( inode_table.slot == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	memset( inode_table.slot, 0, sizeof(vfs_inode *) << inode_table.bits );
+	vfs_inode_table_insert( &root_inode );
 
-	inode_index_tail = &root_inode;
+	if( vfs_dcache_initalize() != VFS_ERROR_NONE ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	// Hand out low handle numbers first
+	memset( handles, 0, sizeof(handles) );
+	for( int i = 0; i < VFS_MAX_HANDLES; i++ ) {
+		handle_free[i] = VFS_MAX_HANDLES - 1 - i;
+	}
+	handle_free_count = VFS_MAX_HANDLES;
+	vfs_lock_initalize( &handle_lock );
 
 	vfs_inode_id_top = 2;
 
 	fs_id_top = 1;
+	vfs_lock_initalize( &mount_lock );
 
 	mount_points.count = 0;
 	mount_points.entry = NULL;
@@ -67,28 +149,25 @@ int vfs_initalize( void ) {
 /**
  * @brief Registers a file system for use
  * 
+ * @param fs_type FS_TYPE_ of the file system
  * @param fs 
  * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
  */
-int vfs_register_fs( vfs_filesystem **fs ) {
+int vfs_register_fs( uint8_t fs_type, vfs_filesystem **fs ) {
+	if( fs_type >= FS_TYPE_MAX ) {
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
 	*fs = vfs_malloc( sizeof(vfs_filesystem) );
 
 	if( *fs == NULL ) {
 		return VFS_ERROR_MEMORY;
 	}
 
-	(*fs)->next_fs = NULL;
-
-	vfs_filesystem *root = file_systems;
-	if( root == NULL ) {
-		file_systems = *fs;
-	} else {
-		while( root->next_fs != NULL ) {
-			root = root->next_fs;
-		}
+	memset( *fs, 0, sizeof(vfs_filesystem) );
+	(*fs)->type = fs_type;
 
-		root->next_fs = (void *)*fs;
-	}
+	fs_by_type[fs_type] = *fs;
 
 	return VFS_ERROR_NONE;
 }
@@ -100,34 +179,68 @@ int vfs_register_fs( vfs_filesystem **fs ) {
  * @return vfs_filesystem* Pointer to the file system, NULL on failure
  */
 vfs_filesystem *vfs_get_fs( uint8_t fs_type ) {
-	vfs_filesystem *fs = file_systems;
-
-	if( fs == NULL ) {
-		vfs_panic( "No file systems registered.\n" );
-
+	if( fs_type >= FS_TYPE_MAX ) {
 		return NULL;
 	}
 
-	while( fs != NULL ) {
-		if( fs->type == fs_type ) {
-			return fs;
-		}
+	return fs_by_type[fs_type];
+}
 
-		fs = (vfs_filesystem *)fs->next_fs;
-	}
+/**
+ * @brief Returns the file system mounted with the given fs id
+ * 
+ * @param fs_id 
+ * @return vfs_filesystem* Pointer to the file system, NULL if nothing is mounted with that id
+ */
+vfs_filesystem *vfs_get_fs_by_id( uint8_t fs_id ) {
+	return fs_by_id[fs_id];
+}
+
+/**
+ * @brief Binds an inode to the file system that controls it
+ * 
+ * @param node 
+ * @param fs_type 
+ * @param fs_id 
+ */
+void vfs_inode_set_fs( vfs_inode *node, uint8_t fs_type, uint8_t fs_id ) {
+	vfs_filesystem *fs = vfs_get_fs( fs_type );
 
-	vfs_panic( "Could not locate file system type: %d\n", fs_type );
+	node->fs_type = fs_type;
+	node->fs_id = fs_id;
+	node->op = NULL;
 
-	return NULL;
+	if( fs != NULL ) {
+		node->op = &fs->op;
+	}
 }
 
 /**
  * @brief Closes an open file
  * 
- * @param id id of inode to close
+ * @param handle handle returned by vfs_open
  * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
  */
-int vfs_close( inode_id id ) {
+int vfs_close( int handle ) {
+	vfs_handle *h = vfs_get_handle( handle );
+
+	if( h == NULL ) {
+		return VFS_ERROR_BAD_HANDLE;
+	}
+
+	if( h->op->close != NULL ) {
+		vfs_rwlock_write( &h->node->lock );
+		h->op->close( h );
+		vfs_rwlock_release( &h->node->lock );
+	}
+
+	vfs_inode_put( h->node );
+
+	vfs_lock_acquire( &handle_lock );
+	h->in_use = false;
+	handle_free[handle_free_count++] = handle;
+	vfs_lock_release( &handle_lock );
+
 	return VFS_ERROR_NONE;
 }
 
@@ -140,62 +253,239 @@ int vfs_close( inode_id id ) {
  * @return int inode di that was created (greater than 0), VFS_ERROR_ on failure
  */
 int vfs_create( uint8_t type, char *path, char *name ) {
-	vfs_inode *parent_node = vfs_lookup_inode_ptr( path );
+	return vfs_create_at( vfs_lookup_inode( path ), type, name );
+}
+
+/**
+ * @brief Creates an inode of type named name in the parent directory
+ * 
+ * Nothing is re-resolved, so callers holding a directory can create in it
+ * repeatedly without walking its path. A name already in the directory is
+ * refused, the file systems would store a second entry for it.
+ * 
+ * @param parent directory inode id
+ * @param type 
+ * @param name single path element, not "." or ".."
+ * @return int inode id that was created (greater than 0), VFS_ERROR_ on failure
+ */
+int vfs_create_at( inode_id parent, uint8_t type, char *name ) {
+	uint32_t name_length = vfs_strlen( name );
+
+	if( name_length == 0 || name_length >= VFS_NAME_MAX || strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) {
+		return VFS_ERROR_BAD_NAME;
+	}
+
+	for( uint32_t i = 0; i < name_length; i++ ) {
+		if( name[i] == '/' ) {
+			return VFS_ERROR_BAD_NAME;
+		}
+	}
+
+	vfs_inode *parent_node = parent != 0 ? vfs_inode_get_by_id( parent ) : NULL;
+	int ret_val = 0;
 
 	if( parent_node == NULL ) {
-		//vfs_debugf( "Cannot find path \"%s\"", path );
 		return VFS_ERROR_PATH_NOT_FOUND;
 	}
 
 	if( parent_node->type != VFS_INODE_TYPE_DIR ) {
-		vfs_debugf( "Cannot create at \"%s\", not a directory.\n", path );
+		vfs_debugf( "Cannot create in inode %ld, not a directory.\n", parent );
+		vfs_inode_put( parent_node );
 		return VFS_ERROR_NOT_A_DIRECTORY;
 	}
 
-	vfs_filesystem *fs = vfs_get_fs( parent_node->fs_type );
-
-	if( fs == NULL ) {
+	if( parent_node->op == NULL ) {
+		vfs_inode_put( parent_node );
 		return VFS_ERROR_UNKNOWN_FS;
 	}
 
-	return fs->op.create( parent_node->id, type, path, name );
+	if( vfs_lookup_at( parent, name ) != 0 ) {
+		vfs_inode_put( parent_node );
+		return VFS_ERROR_OBJECT_ALREADY_IN_USE;
+	}
+
+	// Creates in other directories go ahead in parallel
+	vfs_rwlock_write( &parent_node->lock );
+	vfs_disk_plug();
+	ret_val = parent_node->op->create( parent_node->id, type, name );
+
+	int unplugged = vfs_disk_unplug();
+
+	if( ret_val > 0 && unplugged != VFS_ERROR_NONE ) {
+		ret_val = unplugged;
+	}
+
+	vfs_rwlock_release( &parent_node->lock );
+
+	// The dentry records the parent for ".." and keeps the new inode resident
+	if( ret_val > 0 ) {
+		vfs_dcache_add( parent, name, vfs_dcache_hash( parent, name ), ret_val );
+	}
+
+	vfs_inode_put( parent_node );
+
+	return ret_val;
 }
 
 /**
  * @brief Returns each file in the provided directory
  * 
+ * Materializes the whole directory, prefer vfs_opendir/vfs_readdir. Free the
+ * result with vfs_free_directory_list.
+ * 
  * @param id 
  * @param list 
  * @return vfs_directory_list* Pointer to list, NULL on failure
  */
 vfs_directory_list *vfs_get_directory_list( inode_id id, vfs_directory_list *list ) {
-	vfs_inode *dir = vfs_lookup_inode_ptr_by_id( id );
+	vfs_dir_iter it;
+	vfs_dirent *d = NULL;
 
-	if( dir == NULL ) {
-		//vfs_debugf( "could not find inode %ld for directory listing.\n", id );
+	list->count = 0;
+	list->entry = NULL;
+
+	if( vfs_opendir( id, &it ) != VFS_ERROR_NONE ) {
 		return NULL;
 	}
 
+	if( it.count != 0 ) {
+		list->entry = vfs_malloc( sizeof(vfs_directory_item) * it.count );
+
+		if( list->entry == NULL ) {
+			vfs_closedir( &it );
+			return NULL;
+		}
+	}
+
+	while( list->count < it.count && (d = vfs_readdir( &it )) != NULL ) {
+		strcpy( list->entry[list->count].name, d->name );
+		list->entry[list->count].id = d->id;
+		list->entry[list->count].ptr = NULL;
+		list->entry[list->count].next = NULL;
+		list->count++;
+	}
+
+	vfs_closedir( &it );
+
+	return list;
+}
+
+/**
+ * @brief Frees the entries of a list returned by vfs_get_directory_list
+ * 
+ * @param list 
+ */
+void vfs_free_directory_list( vfs_directory_list *list ) {
+	if( list->entry != NULL ) {
+		vfs_free( list->entry );
+	}
+
+	list->entry = NULL;
+	list->count = 0;
+}
+
+/**
+ * @brief Opens a cursor over the entries of a directory
+ * 
+ * @param id inode id of the directory
+ * @param it caller owned cursor to initalize
+ * @return int VFS_ERROR_NONE on success, VFS_ERROR_ on failure
+ */
+int vfs_opendir( inode_id id, vfs_dir_iter *it ) {
+	vfs_inode *dir = vfs_inode_get_by_id( id );
+	int ret_val = 0;
+
+	memset( it, 0, sizeof(vfs_dir_iter) );
+
+	if( dir == NULL ) {
+		return VFS_ERROR_PATH_NOT_FOUND;
+	}
+
 	if( dir->type != VFS_INODE_TYPE_DIR ) {
-		//vfs_debugf( "indoe ID %ld is not a directory.\n", id );
+		vfs_inode_put( dir );
+		return VFS_ERROR_NOT_A_DIRECTORY;
+	}
+
+	if( dir->op == NULL || dir->op->opendir == NULL ) {
+		vfs_inode_put( dir );
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
+	it->dir = id;
+	it->node = dir;
+	it->op = dir->op;
+
+	vfs_rwlock_read( &dir->lock );
+	ret_val = it->op->opendir( id, it );
+	vfs_rwlock_release( &dir->lock );
+
+	if( ret_val != VFS_ERROR_NONE ) {
+		vfs_inode_put( dir );
+		it->node = NULL;
+		it->op = NULL;
+	}
+
+	return ret_val;
+}
+
+/**
+ * @brief Reads the next entry from a directory cursor
+ * 
+ * @param it 
+ * @return vfs_dirent* The entry, valid until the next call, NULL at the end or on failure
+ */
+vfs_dirent *vfs_readdir( vfs_dir_iter *it ) {
+	int ret_val = 0;
+
+	if( it->op == NULL ) {
 		return NULL;
 	}
 
-	vfs_filesystem *fs = vfs_get_fs( dir->fs_type );
+	vfs_rwlock_read( &it->node->lock );
+	ret_val = it->op->readdir( it );
+	vfs_rwlock_release( &it->node->lock );
 
-	return fs->op.get_dir_list( id, list );
+	if( ret_val != 1 ) {
+		return NULL;
+	}
+
+	it->position++;
+
+	return &it->entry;
+}
+
+/**
+ * @brief Closes a directory cursor
+ * 
+ * @param it 
+ */
+void vfs_closedir( vfs_dir_iter *it ) {
+	if( it->op != NULL && it->op->closedir != NULL ) {
+		it->op->closedir( it );
+	}
+
+	if( it->node != NULL ) {
+		vfs_inode_put( it->node );
+	}
+
+	it->node = NULL;
+	it->op = NULL;
 }
 
 /**
  * @brief Creates a diretory
  * 
- * @param parent 
- * @param path 
+ * @param parent directory to create in, 0 to resolve path instead
+ * @param path only used when parent is 0
  * @param name 
  * @return int inode id on success, VFS_ERROR_ on failure
  */
 int vfs_mkdir( inode_id parent, char *path, char *name ) {
-	return vfs_create( VFS_INODE_TYPE_DIR, path, name );
+	if( parent == 0 ) {
+		parent = vfs_lookup_inode( path );
+	}
+
+	return vfs_create_at( parent, VFS_INODE_TYPE_DIR, name );
 }
 
 /**
@@ -204,35 +494,100 @@ int vfs_mkdir( inode_id parent, char *path, char *name ) {
  * @param fs_type 
  * @param data 
  * @param path 
+ * @param write_policy VFS_WRITE_ for the disk writes of the mounted fs
  * @return int VFS_ERROR_NONE on success, otherwise error number
  */
-int vfs_mount( uint8_t fs_type, uint8_t *data, char *path ) {
+int vfs_mount( uint8_t fs_type, uint8_t *data, char *path, uint8_t write_policy ) {
 	vfs_filesystem *fs = vfs_get_fs( fs_type );
 	vfs_inode *mount_point = NULL;
 
-	mount_point = vfs_lookup_inode_ptr( path );
+	if( fs == NULL ) {
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
+	if( write_policy >= VFS_WRITE_POLICY_MAX ) {
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	// The mount holds its inode for good
+	inode_id mount_id = vfs_lookup_inode( path );
+	mount_point = mount_id != 0 ? vfs_inode_get_by_id( mount_id ) : NULL;
 	
 	if( mount_point == NULL ) {
 		vfs_debugf( "Path \"%s\" not found, mount failed.\n", path );
 		return VFS_ERROR_PATH_NOT_FOUND;
 	}
 
+	vfs_lock_acquire( &mount_lock );
+
 	if( mount_point->is_mount_point ) {
 		if( mount_point->fs_type != 0 ) {
 			vfs_debugf( "Mount point \"%s\" already claimed with fs_type %d\n", path, mount_point->type );
+			vfs_lock_release( &mount_lock );
+			vfs_inode_put( mount_point );
 			return VFS_ERROR_OBJECT_ALREADY_IN_USE;
 		}
 	}
 
 	if( mount_point->type != VFS_INODE_TYPE_DIR ) {
 		vfs_debugf( "Mount point \"%s\" is not a directory.\n", path );
+		vfs_lock_release( &mount_lock );
+		vfs_inode_put( mount_point );
 		return VFS_ERROR_NOT_A_DIRECTORY;
 	}
-	
-	mount_point->fs_type = fs_type;
-	mount_point->fs_id = fs_id_top++;
+
+	// Each mount takes the next fs id for good, fs_id_top wraps to 0 once all 255 are gone
+	if( fs_id_top == 0 ) {
+		vfs_debugf( "No fs id left to mount \"%s\".\n", path );
+		vfs_lock_release( &mount_lock );
+		vfs_inode_put( mount_point );
+		return VFS_ERROR_NO_SPACE;
+	}
+
+	vfs_rwlock_write( &mount_point->lock );
+
+	// The covered fs keeps its state for the inode until the new fs has mounted, a failed mount puts it back
+	uint8_t covered_type = mount_point->fs_type;
+	uint8_t covered_id = mount_point->fs_id;
+	void *covered_data = mount_point->fs_data;
+	vfs_operations *covered_op = mount_point->op;
+
+	vfs_inode_set_fs( mount_point, fs_type, fs_id_top );
+	mount_point->fs_data = NULL;
+
+	int ret_val = fs->op.mount( mount_point->id, path, data );
+
+	if( ret_val != VFS_ERROR_NONE ) {
+		vfs_inode_set_fs( mount_point, covered_type, covered_id );
+		mount_point->op = covered_op;
+		mount_point->fs_data = covered_data;
+
+		vfs_rwlock_release( &mount_point->lock );
+		vfs_lock_release( &mount_lock );
+		vfs_inode_put( mount_point );
+
+		return ret_val;
+	}
+
+	if( covered_op != NULL && covered_op->evict_inode != NULL ) {
+		void *mounted_data = mount_point->fs_data;
+
+		mount_point->fs_data = covered_data;
+		covered_op->evict_inode( mount_point );
+		mount_point->fs_data = mounted_data;
+	}
+
+	fs_id_top++;
 	mount_point->is_mount_point = true;
 
+	vfs_rwlock_release( &mount_point->lock );
+
+	fs_by_id[mount_point->fs_id] = fs;
+	vfs_set_write_policy( mount_point->fs_id, write_policy );
+
+	// Whatever was cached under the mount point is now hidden by the new fs
+	vfs_dcache_invalidate_dir( mount_point->id );
+
 	vfs_directory_item *mp_list_item = NULL;
 	bool found = false;
 	if( mount_points.count == 0 ) {
@@ -254,32 +609,106 @@ int vfs_mount( uint8_t fs_type, uint8_t *data, char *path ) {
 
 	mp_list_item->id = mount_point->id;
 	mp_list_item->ptr = mount_point;
+	mp_list_item->next = NULL;
 	strcpy(mp_list_item->name, path);
 	mount_points.count++;
+
+	vfs_lock_release( &mount_lock );
+
+	// The metrics files appear wherever an RFS is mounted on /proc
+	if( fs_type == FS_TYPE_RFS && strcmp( path, VFS_PROC_PATH ) == 0 && vfs_metrics_publish( mount_point->id ) != VFS_ERROR_NONE ) {
+		vfs_debugf( "Could not publish the metrics files in %s.\n", path );
+	}
 		
-	return fs->op.mount( mount_point->id, path, data );
+	return ret_val;
+}
+
+/**
+ * @brief Changes how a mount's disk writes reach the disk
+ * 
+ * Switching away from write back leaves pages already dirty for the
+ * flusher or vfs_fsync.
+ * 
+ * @param fs_id 
+ * @param write_policy VFS_WRITE_
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
+ */
+int vfs_set_write_policy( uint8_t fs_id, uint8_t write_policy ) {
+	if( write_policy >= VFS_WRITE_POLICY_MAX ) {
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	vfs_atomic_store( &write_policy_by_id[fs_id], write_policy );
+
+	return VFS_ERROR_NONE;
 }
 
-/*
+/**
+ * @brief How a mount's disk writes reach the disk
+ * 
+ * @param fs_id 
+ * @return uint8_t VFS_WRITE_
+ */
+uint8_t vfs_get_write_policy( uint8_t fs_id ) {
+	return vfs_atomic_load( &write_policy_by_id[fs_id] );
+}
+
+/**
  * @brief Opens a file
  * 
+ * The inode, its fs operations and the fs's own state for the file are
+ * resolved once here and kept in the handle for vfs_handle_read/write.
+ * 
  * @param id 
- * @return 0 on success, VFS_ERROR_ on failure
+ * @return int handle (0 or greater) on success, VFS_ERROR_ on failure
  */
 int vfs_open( inode_id id ) {
-	vfs_inode *node = vfs_lookup_inode_ptr_by_id( id );
+	vfs_inode *node = vfs_inode_get_by_id( id );
 
 	if( node == NULL ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	vfs_filesystem *fs = vfs_get_fs( node->fs_type );
-
-	if( fs == NULL ) {
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
 		return VFS_ERROR_UNKNOWN_FS;
 	}
 
-	return fs->op.open( id );
+	vfs_lock_acquire( &handle_lock );
+
+	if( handle_free_count == 0 ) {
+		vfs_lock_release( &handle_lock );
+		vfs_inode_put( node );
+		return VFS_ERROR_MEMORY;
+	}
+
+	int handle = handle_free[--handle_free_count];
+	vfs_lock_release( &handle_lock );
+
+	vfs_handle *h = &handles[handle];
+
+	memset( h, 0, sizeof(vfs_handle) );
+	h->id = id;
+	h->node = node;
+	h->op = node->op;
+
+	if( h->op->open != NULL ) {
+		vfs_rwlock_write( &node->lock );
+		int open_err = h->op->open( id, h );
+		vfs_rwlock_release( &node->lock );
+
+		if( open_err < 0 ) {
+			vfs_lock_acquire( &handle_lock );
+			handle_free[handle_free_count++] = handle;
+			vfs_lock_release( &handle_lock );
+			vfs_inode_put( node );
+			return open_err;
+		}
+	}
+
+	h->in_use = true;
+
+	return handle;
 }
 
 /**
@@ -292,16 +721,26 @@ int vfs_open( inode_id id ) {
  * @return int 
  */
 int vfs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
-	vfs_inode *node = vfs_lookup_inode_ptr_by_id( id );
+	vfs_inode *node = vfs_inode_get_by_id( id );
+	int ret_val = 0;
 
 	if( node == NULL ) {
 		//vfs_debugf( "inode ID %ld not found, aborting read.\n", id );
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	vfs_filesystem *fs = vfs_get_fs( node->fs_type );
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
+	vfs_rwlock_read( &node->lock );
+	ret_val = node->op->read( id, data, size, offset );
+	vfs_rwlock_release( &node->lock );
 
-	return fs->op.read( id, data, size, offset );
+	vfs_inode_put( node );
+
+	return ret_val;
 }
 
 /**
@@ -312,19 +751,25 @@ int vfs_read( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
  * @return int VFS_ERROR_NONE on succcess, VFS_ERROR_ on failure
  */
 int vfs_stat( inode_id id, vfs_stat_data *stat_data ) {
-	vfs_inode *node = vfs_lookup_inode_ptr_by_id( id );
+	vfs_inode *node = vfs_inode_get_by_id( id );
+	int ret_val = 0;
 
 	if( node == NULL ) {
 		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	vfs_filesystem *fs = vfs_get_fs( node->fs_type );
-
-	if( fs == NULL ) {
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
 		return VFS_ERROR_UNKNOWN_FS;
 	}
 
-	return fs->op.stat( id, stat_data );
+	vfs_rwlock_read( &node->lock );
+	ret_val = node->op->stat( id, stat_data );
+	vfs_rwlock_release( &node->lock );
+
+	vfs_inode_put( node );
+
+	return ret_val;
 }
 
 /**
@@ -337,7 +782,8 @@ int vfs_stat( inode_id id, vfs_stat_data *stat_data ) {
  * @return int number of bytes written, -1 if error
  */
 int vfs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
-	vfs_inode *node = vfs_lookup_inode_ptr_by_id( id );
+	vfs_inode *node = vfs_inode_get_by_id( id );
+	int ret_val = 0;
 
 	if( node == NULL ) {
 		//vfs_debugf( "inode ID %ld not found, aborting write.\n", id );
@@ -348,554 +794,5931 @@ int vfs_write( inode_id id, uint8_t *data, uint64_t size, uint64_t offset ) {
 	if( node->type == VFS_INODE_TYPE_DEVICE ) {
 		device *dev = node->dev->data;
 
-		return dev->write( id, data, size, offset );
+		ret_val = dev->write( id, data, size, offset );
+		vfs_inode_put( node );
+
+		return ret_val;
 	}
 	#endif
 
-	vfs_filesystem *fs = vfs_get_fs( node->fs_type );
-
-	if( fs == NULL ) {
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
 		return VFS_ERROR_UNKNOWN_FS;
 	}
 
-	return fs->op.write( id, data, size, offset );
-}
+	vfs_rwlock_write( &node->lock );
+	vfs_disk_plug();
+	ret_val = node->op->write( id, data, size, offset );
 
-/**
- * @brief Gets the inode id of path
- * 
- * @param path 
- * @return inode_id ID of inode if successful, otherwise 0
- */
-inode_id vfs_lookup_inode( char *pathname ) {
-	vfs_inode *node = vfs_lookup_inode_ptr( pathname );
+	int unplugged = vfs_disk_unplug();
 
-	if( node != NULL ) {
-		return node->id;
+	if( ret_val >= 0 && unplugged != VFS_ERROR_NONE ) {
+		ret_val = unplugged;
 	}
-	
-	return 0;
+
+	vfs_rwlock_release( &node->lock );
+
+	vfs_inode_put( node );
+
+	return ret_val;
 }
 
 /**
- * @brief Returns a vfs_inode object represented by path
+ * @brief Reads a batch of segments from inode id
  * 
- * @param pathname ABSOLUTE path to look up
- * @return vfs_inode* Pointer to inode if found, NULL on failure
+ * The inode and fs are resolved once for the whole batch. File systems
+ * without a readv operation get one read per segment.
+ * 
+ * @param id 
+ * @param iov segments to fill
+ * @param count number of segments
+ * @return int total bytes read, VFS_ERROR_ on failure
  */
-vfs_inode *vfs_lookup_inode_ptr( char *pathname ) {
-	vfs_inode *ret_val = NULL;
-	uint32_t path_length = vfs_strlen( pathname );
+int vfs_readv( inode_id id, vfs_iovec *iov, uint32_t count ) {
+	vfs_inode *node = vfs_inode_get_by_id( id );
+	int total = 0;
 
-	if( strcmp( pathname, "/" ) == 0 ) {
-		return &root_inode;
+	if( node == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
 	}
 
-	// Break up path by seperator
-	// Test each element in turn
-	// Return last element
-	
-	bool keep_going = true;
-	inode_id parent_inode_id = 0;
-	char *c = pathname;
-	int element_index = 0;
-	int path_index = 0;
-	char name[VFS_NAME_MAX];
-	memset( name, 0, VFS_NAME_MAX );
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
+		return VFS_ERROR_UNKNOWN_FS;
+	}
 
-	do {	
-		if( *c != '/' && *c != 0 ) {
-			// build the element
+	vfs_rwlock_read( &node->lock );
 
-			name[element_index] = *c;
-			element_index++;
-		} else {
-			// done building the element, check for it
-			//vfs_debugf( "Element: \"%s\"\n", name );
+	if( node->op->readv != NULL ) {
+		total = node->op->readv( id, iov, count );
+	} else {
+		for( uint32_t i = 0; i < count; i++ ) {
+			int n = node->op->read( id, iov[i].data, iov[i].size, iov[i].offset );
 
-			if( element_index == 0 ) {
-				parent_inode_id = 1;
-				// ignore root dir
-			} else {
-				parent_inode_id = vfs_get_from_dir( parent_inode_id, name );
-				if( parent_inode_id != 0 ) {
-					// do it again
-					memset( name, 0, VFS_NAME_MAX );
-					element_index = 0;
-				} else {
-					// coudln't find it, fail overall
-					return NULL;
-				}
+			if( n < 0 ) {
+				total = n;
+				break;
 			}
-		}
-
-		c++;
-		path_index++;
 
-		if( path_index > path_length ) {
-			keep_going = false;
+			total = total + n;
 		}
-	} while( keep_going );
-	
-	ret_val = vfs_lookup_inode_ptr_by_id( parent_inode_id );
+	}
 
-	return ret_val;
+	vfs_rwlock_release( &node->lock );
+	vfs_inode_put( node );
+
+	return total;
 }
 
 /**
- * @brief Gets inode structure from inode id
+ * @brief Lends file data straight out of the page cache, for read-only parsers
+ * 
+ * Gives at most size bytes from offset and never crosses a page, so a
+ * parser walks the file a page at a time. File systems that can't lend
+ * pages hand out a private copy instead. Each call that returns more than
+ * 0 must be paired with vfs_read_unref.
  * 
  * @param id 
- * @return vfs_inode* Pointer to inode structure on success, NULL on failure
+ * @param offset 
+ * @param size 
+ * @param ref filled in with the data
+ * @return int bytes at ref->data, 0 at the end of the file, otherwise VFS_ERROR_
  */
-vfs_inode *vfs_lookup_inode_ptr_by_id( inode_id id ) {
-	vfs_inode *ret_val = NULL;
-	bool found = false;
-	vfs_inode *head = &root_inode;
+int vfs_read_ref( inode_id id, uint64_t offset, uint64_t size, vfs_page_ref *ref ) {
+	vfs_inode *node = vfs_inode_get_by_id( id );
+	int ret = 0;
 
-	do {
-		if( head->id == id ) {
-			ret_val = head;
-			found = true;
-		}
+	ref->data = NULL;
+	ref->size = 0;
+	ref->page = NULL;
 
-		head = head->next_inode;
-	} while( head != NULL && !found );
+	if( node == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
 
-	return ret_val;
-}
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
+	vfs_rwlock_read( &node->lock );
+
+	if( node->op->read_ref != NULL ) {
+		ret = node->op->read_ref( id, offset, size, ref );
+	} else {
+		if( size > VFS_PAGE_SIZE - (offset & (VFS_PAGE_SIZE - 1)) ) {
+			size = VFS_PAGE_SIZE - (offset & (VFS_PAGE_SIZE - 1));
+		}
+
+		ref->data = vfs_malloc( size );
+		ret = ref->data != NULL ? node->op->read( id, ref->data, size, offset ) : VFS_ERROR_MEMORY;
+
+		if( ret > 0 ) {
+			ref->size = ret;
+		} else if( ref->data != NULL ) {
+			vfs_free( ref->data );
+			ref->data = NULL;
+		}
+	}
+
+	vfs_rwlock_release( &node->lock );
+	vfs_inode_put( node );
+
+	return ret;
+}
+
+/**
+ * @brief Gives back what vfs_read_ref lent out
+ * 
+ * @param ref 
+ */
+void vfs_read_unref( vfs_page_ref *ref ) {
+	if( ref->page != NULL ) {
+		vfs_cache_put_page( ref->page );
+	} else if( ref->data != NULL ) {
+		vfs_free( ref->data );
+	}
+
+	ref->data = NULL;
+	ref->size = 0;
+	ref->page = NULL;
+}
+
+/**
+ * @brief Writes a batch of segments to inode id
+ * 
+ * Segments are written as if in array order. File systems without a writev
+ * operation get one write per segment.
+ * 
+ * @param id 
+ * @param iov segments to write
+ * @param count number of segments
+ * @return int total bytes written, VFS_ERROR_ on failure
+ */
+int vfs_writev( inode_id id, vfs_iovec *iov, uint32_t count ) {
+	vfs_inode *node = vfs_inode_get_by_id( id );
+	int total = 0;
+
+	if( node == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	if( node->op == NULL ) {
+		vfs_inode_put( node );
+		return VFS_ERROR_UNKNOWN_FS;
+	}
+
+	vfs_rwlock_write( &node->lock );
+	vfs_disk_plug();
+
+	if( node->op->writev != NULL ) {
+		total = node->op->writev( id, iov, count );
+	} else {
+		for( uint32_t i = 0; i < count; i++ ) {
+			int n = node->op->write( id, iov[i].data, iov[i].size, iov[i].offset );
+
+			if( n < 0 ) {
+				total = n;
+				break;
+			}
+
+			total = total + n;
+		}
+	}
+
+	int unplugged = vfs_disk_unplug();
+
+	if( total >= 0 && unplugged != VFS_ERROR_NONE ) {
+		total = unplugged;
+	}
+
+	vfs_rwlock_release( &node->lock );
+	vfs_inode_put( node );
+
+	return total;
+}
+
+/**
+ * @brief Returns the handle structure for an open handle
+ * 
+ * @param handle 
+ * @return vfs_handle* Pointer to the handle, NULL if handle is not open
+ */
+vfs_handle *vfs_get_handle( int handle ) {
+	if( handle < 0 || handle >= VFS_MAX_HANDLES ) {
+		return NULL;
+	}
+
+	if( !handles[handle].in_use ) {
+		return NULL;
+	}
+
+	return &handles[handle];
+}
+
+/**
+ * @brief Reads size bytes at the handle's cursor into data, advancing the cursor
+ * 
+ * @param handle 
+ * @param data 
+ * @param size 
+ * @return int number of bytes read (0 at end of file), VFS_ERROR_ on failure
+ */
+int vfs_handle_read( int handle, uint8_t *data, uint64_t size ) {
+	vfs_handle *h = vfs_get_handle( handle );
+	int ret_val = 0;
+
+	if( h == NULL ) {
+		return VFS_ERROR_BAD_HANDLE;
+	}
+
+	vfs_rwlock_read( &h->node->lock );
+
+	if( h->op->read_handle != NULL ) {
+		ret_val = h->op->read_handle( h, data, size, h->cursor );
+	} else {
+		ret_val = h->op->read( h->id, data, size, h->cursor );
+	}
+
+	vfs_rwlock_release( &h->node->lock );
+
+	if( ret_val > 0 ) {
+		h->cursor = h->cursor + ret_val;
+	}
+
+	return ret_val;
+}
+
+/**
+ * @brief Writes size bytes from data at the handle's cursor, advancing the cursor
+ * 
+ * @param handle 
+ * @param data 
+ * @param size 
+ * @return int number of bytes written, VFS_ERROR_ on failure
+ */
+int vfs_handle_write( int handle, uint8_t *data, uint64_t size ) {
+	vfs_handle *h = vfs_get_handle( handle );
+	int ret_val = 0;
+
+	if( h == NULL ) {
+		return VFS_ERROR_BAD_HANDLE;
+	}
+
+	vfs_rwlock_write( &h->node->lock );
+	vfs_disk_plug();
+
+	if( h->op->write_handle != NULL ) {
+		ret_val = h->op->write_handle( h, data, size, h->cursor );
+	} else {
+		ret_val = h->op->write( h->id, data, size, h->cursor );
+	}
+
+	int unplugged = vfs_disk_unplug();
+
+	if( ret_val >= 0 && unplugged != VFS_ERROR_NONE ) {
+		ret_val = unplugged;
+	}
+
+	vfs_rwlock_release( &h->node->lock );
+
+	if( ret_val > 0 ) {
+		h->cursor = h->cursor + ret_val;
+	}
+
+	return ret_val;
+}
+
+/**
+ * @brief Moves the handle's cursor to offset
+ * 
+ * @param handle 
+ * @param offset 
+ * @return int VFS_ERROR_NONE on success, VFS_ERROR_ on failure
+ */
+int vfs_handle_seek( int handle, uint64_t offset ) {
+	vfs_handle *h = vfs_get_handle( handle );
+
+	if( h == NULL ) {
+		return VFS_ERROR_BAD_HANDLE;
+	}
+
+	h->cursor = offset;
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Gets the inode id of path
+ * 
+ * @param path 
+ * @return inode_id ID of inode if successful, otherwise 0
+ */
+inode_id vfs_lookup_inode( char *pathname ) {
+	return vfs_lookup_at( root_inode.id, pathname );
+}
+
+/**
+ * @brief Resolves a single path element inside dir
+ * 
+ * ".." follows the parent recorded when dir was walked to, and stops at the
+ * root. Like any other name, "." and ".." only resolve inside a directory.
+ * 
+ * @param dir 
+ * @param name 
+ * @return inode_id ID of the element if found, otherwise 0
+ */
+static inode_id vfs_lookup_element( inode_id dir, char *name ) {
+	if( strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) {
+		vfs_inode *node = dir == root_inode.id ? &root_inode : vfs_lookup_inode_ptr_by_id( dir );
+
+		if( node == NULL || node->type != VFS_INODE_TYPE_DIR ) {
+			return 0;
+		}
+
+		if( name[1] == 0 || node == &root_inode ) {
+			return dir;
+		}
+
+		return vfs_atomic_load( &node->parent );
+	}
+
+	uint32_t hash = vfs_dcache_hash( dir, name );
+	inode_id found_id = 0;
+
+	if( !vfs_dcache_lookup( dir, name, hash, &found_id ) ) {
+		found_id = vfs_get_from_dir( dir, name );
+		vfs_dcache_add( dir, name, hash, found_id );
+	}
+
+	return found_id;
+}
+
+/**
+ * @brief Gets the inode id of path, relative to dir
+ * 
+ * Paths starting with '/' resolve from the root instead. Empty elements are
+ * skipped, "." and ".." are understood.
+ * 
+ * @param dir directory to start from
+ * @param path 
+ * @return inode_id ID of inode if successful, otherwise 0
+ */
+inode_id vfs_lookup_at( inode_id dir, char *path ) {
+	inode_id id = dir;
+	char name[VFS_NAME_MAX];
+	char *c = path;
+
+	if( *c == '/' ) {
+		id = root_inode.id;
+	}
+
+	while( id != 0 && *c != 0 ) {
+		uint32_t element_index = 0;
+
+		while( *c == '/' ) {
+			c++;
+		}
+
+		if( *c == 0 ) {
+			break;
+		}
+
+		while( *c != '/' && *c != 0 ) {
+			if( element_index == VFS_NAME_MAX - 1 ) {
+				// name too long, can't exist
+				return 0;
+			}
+
+			name[element_index] = *c;
+			element_index++;
+			c++;
+		}
+
+		name[element_index] = 0;
+		id = vfs_lookup_element( id, name );
+	}
+
+	return id;
+}
+
+/**
+ * @brief Returns a vfs_inode object represented by path
+ * 
+ * The inode is only sure to stay resident while something holds a
+ * reference to it, use vfs_inode_get_by_id to take one.
+ * 
+ * @param pathname ABSOLUTE path to look up
+ * @return vfs_inode* Pointer to inode if found, NULL on failure
+ */
+vfs_inode *vfs_lookup_inode_ptr( char *pathname ) {
+	inode_id id = vfs_lookup_inode( pathname );
+
+	if( id == 0 ) {
+		return NULL;
+	}
+
+	return vfs_lookup_inode_ptr_by_id( id );
+}
+
+/**
+ * @brief Hashes an inode id into a slot index for a table of 1 << bits slots
+ * 
+ * @param id 
+ * @param bits 
+ * @return uint64_t slot index
+ */
+static inline uint64_t vfs_inode_hash( inode_id id, uint8_t bits ) {
+	// Fibonacci hashing, sequential ids spread evenly across the table
+	return (id * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+/**
+ * @brief Unlinks an inode from the unused LRU, caller holds inode_table.lru_lock
+ * 
+ * @param node 
+ */
+static void vfs_inode_lru_remove( vfs_inode *node ) {
+	vfs_inode *prev = node->lru_prev;
+	vfs_inode *next = node->lru_next;
+
+	if( prev != NULL ) {
+		prev->lru_next = next;
+	} else {
+		inode_table.lru_head = next;
+	}
+
+	if( next != NULL ) {
+		next->lru_prev = prev;
+	} else {
+		inode_table.lru_tail = prev;
+	}
+
+	node->on_lru = false;
+	inode_table.unused--;
+}
+
+/**
+ * @brief Puts an inode at the most recently used end of the unused LRU, caller holds inode_table.lru_lock
+ * 
+ * @param node 
+ */
+static void vfs_inode_lru_push( vfs_inode *node ) {
+	node->lru_prev = NULL;
+	node->lru_next = inode_table.lru_head;
+
+	if( inode_table.lru_head != NULL ) {
+		inode_table.lru_head->lru_prev = node;
+	} else {
+		inode_table.lru_tail = node;
+	}
+
+	inode_table.lru_head = node;
+	node->on_lru = true;
+	inode_table.unused++;
+}
+
+/**
+ * @brief Finds id in the table, caller holds inode_table.lock
+ * 
+ * @param id 
+ * @return vfs_inode* 
+ */
+static vfs_inode *vfs_inode_table_probe( inode_id id ) {
+	uint64_t mask = (1ULL << inode_table.bits) - 1;
+	uint64_t i = vfs_inode_hash( id, inode_table.bits );
+	vfs_inode *node = inode_table.slot[i];
+
+	while( node != NULL ) {
+		if( node->id == id ) {
+			return node;
+		}
+
+		i = (i + 1) & mask;
+		node = inode_table.slot[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Removes id from the table, caller holds inode_table.lock for writing
+ * 
+ * @param id 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+static int vfs_inode_table_remove_locked( inode_id id ) {
+	uint64_t mask = (1ULL << inode_table.bits) - 1;
+	uint64_t i = vfs_inode_hash( id, inode_table.bits );
+
+	while( inode_table.slot[i] != NULL && inode_table.slot[i]->id != id ) {
+		i = (i + 1) & mask;
+	}
+
+	if( inode_table.slot[i] == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	inode_table.slot[i] = NULL;
+	inode_table.count--;
+
+	// Pull later entries of the probe run back over the hole, so lookups don't stop early
+	uint64_t j = i;
+
+	while( true ) {
+		j = (j + 1) & mask;
+
+		if( inode_table.slot[j] == NULL ) {
+			break;
+		}
+
+		uint64_t home = vfs_inode_hash( inode_table.slot[j]->id, inode_table.bits );
+
+		// Entry can move to i only if its home slot isn't cyclically in (i, j]
+		bool stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+
+		if( !stays ) {
+			inode_table.slot[i] = inode_table.slot[j];
+			inode_table.slot[j] = NULL;
+			i = j;
+		}
+	}
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Evicts unreferenced inodes, oldest first, until the unused LRU is within its limit
+ * 
+ * Caller holds inode_table.lru_lock. An inode looked up since it joined
+ * the LRU goes back to the front once instead of being evicted.
+ */
+static void vfs_inode_trim( void ) {
+	uint64_t chances = inode_table.unused;
+
+	while( inode_table.unused > inode_table.unused_max ) {
+		vfs_inode *node = inode_table.lru_tail;
+
+		if( vfs_atomic_load( &node->referenced ) && chances > 0 ) {
+			vfs_atomic_store( &node->referenced, false );
+			vfs_inode_lru_remove( node );
+			vfs_inode_lru_push( node );
+			chances--;
+			continue;
+		}
+
+		vfs_inode_lru_remove( node );
+
+		// A lookup may have taken a reference since the inode joined the LRU,
+		// with the table locked nobody else can find it
+		vfs_rwlock_write( &inode_table.lock );
+
+		if( vfs_atomic_load( &node->refcount ) != 0 ) {
+			vfs_rwlock_release( &inode_table.lock );
+			continue;
+		}
+
+		vfs_inode_table_remove_locked( node->id );
+		vfs_rwlock_release( &inode_table.lock );
+
+		if( node->op->evict_inode != NULL ) {
+			node->op->evict_inode( node );
+		}
+
+		vfs_slab_free( &inode_slab, node );
+		inode_table.evictions++;
+	}
+}
+
+/**
+ * @brief Whether an unreferenced inode can be dropped and loaded again later
+ * 
+ * @param node 
+ * @return true 
+ * @return false 
+ */
+static inline bool vfs_inode_evictable( vfs_inode *node ) {
+	return node->op != NULL && node->op->load_inode != NULL;
+}
+
+/**
+ * @brief Takes another reference on an inode
+ * 
+ * The caller must already hold a reference, otherwise use vfs_inode_get_by_id.
+ * 
+ * @param node 
+ */
+void vfs_inode_get( vfs_inode *node ) {
+	if( vfs_atomic_inc( &node->refcount ) == 1 && vfs_inode_evictable( node ) ) {
+		vfs_lock_acquire( &inode_table.lru_lock );
+
+		if( node->on_lru ) {
+			vfs_inode_lru_remove( node );
+		}
+
+		vfs_lock_release( &inode_table.lru_lock );
+	}
+}
+
+/**
+ * @brief Drops a reference on an inode
+ * 
+ * When the last reference goes, an inode its fs can load again joins the
+ * unused LRU. Any other inode stays resident since it can't be rebuilt.
+ * 
+ * @param node 
+ */
+void vfs_inode_put( vfs_inode *node ) {
+	if( !vfs_inode_evictable( node ) ) {
+		vfs_atomic_dec( &node->refcount );
+		return;
+	}
+
+	// Only the last reference needs the LRU, drop the others without locking
+	uint32_t refs = vfs_atomic_load( &node->refcount );
+
+	while( refs > 1 ) {
+		if( __atomic_compare_exchange_n( &node->refcount, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+			return;
+		}
+	}
+
+	// Going to zero under lru_lock means trim can't free the inode out from under us
+	vfs_lock_acquire( &inode_table.lru_lock );
+
+	if( vfs_atomic_dec( &node->refcount ) == 0 && !node->on_lru ) {
+		vfs_inode_lru_push( node );
+		vfs_inode_trim();
+	}
+
+	vfs_lock_release( &inode_table.lru_lock );
+}
+
+/**
+ * @brief Finds a resident inode, optionally taking a reference on it
+ * 
+ * @param id 
+ * @param take_ref 
+ * @return vfs_inode* 
+ */
+static vfs_inode *vfs_inode_find_resident( inode_id id, bool take_ref ) {
+	uint32_t refs = 0;
+
+	vfs_rwlock_read( &inode_table.lock );
+
+	vfs_inode *node = vfs_inode_table_probe( id );
+
+	if( node != NULL ) {
+		if( take_ref ) {
+			refs = vfs_atomic_inc( &node->refcount );
+		}
+
+		// Second chance instead of moving it up the LRU, lookups stay read only
+		if( !vfs_atomic_load( &node->referenced ) ) {
+			vfs_atomic_store( &node->referenced, true );
+		}
+	}
+
+	vfs_rwlock_release( &inode_table.lock );
+
+	if( refs == 1 && vfs_inode_evictable( node ) ) {
+		vfs_lock_acquire( &inode_table.lru_lock );
+
+		if( node->on_lru ) {
+			vfs_inode_lru_remove( node );
+		}
+
+		vfs_lock_release( &inode_table.lru_lock );
+	}
+
+	return node;
+}
+
+/**
+ * @brief Finds an inode, loading it through its fs if it isn't resident
+ * 
+ * @param id 
+ * @param take_ref 
+ * @return vfs_inode* 
+ */
+static vfs_inode *vfs_inode_find( inode_id id, bool take_ref ) {
+	vfs_inode *node = vfs_inode_find_resident( id, take_ref );
+
+	if( node != NULL ) {
+		return node;
+	}
+
+	vfs_filesystem *fs = fs_by_id[ VFS_INODE_ID_FS( id ) ];
+
+	if( VFS_INODE_ID_FS( id ) == 0 || fs == NULL || fs->op.load_inode == NULL ) {
+		return NULL;
+	}
+
+	vfs_lock_acquire( &inode_table.load_lock );
+
+	// Another thread may have loaded it while this one waited
+	node = vfs_inode_find_resident( id, take_ref );
+
+	if( node == NULL ) {
+		node = fs->op.load_inode( id );
+
+		if( node != NULL && vfs_inode_table_insert( node ) != VFS_ERROR_NONE ) {
+			if( node->op->evict_inode != NULL ) {
+				node->op->evict_inode( node );
+			}
+
+			vfs_slab_free( &inode_slab, node );
+			node = NULL;
+		}
+
+		if( node != NULL ) {
+			vfs_atomic_add( &inode_table.loads, 1 );
+
+			if( take_ref ) {
+				vfs_atomic_inc( &node->refcount );
+			} else {
+				vfs_lock_acquire( &inode_table.lru_lock );
+
+				if( vfs_atomic_load( &node->refcount ) == 0 && !node->on_lru ) {
+					node->referenced = true;
+					vfs_inode_lru_push( node );
+					vfs_inode_trim();
+				}
+
+				vfs_lock_release( &inode_table.lru_lock );
+			}
+		}
+	}
+
+	vfs_lock_release( &inode_table.load_lock );
+
+	return node;
+}
+
+/**
+ * @brief Gets inode structure from inode id
+ * 
+ * Inodes that were never loaded or have been evicted are rebuilt by their
+ * fs's load_inode operation, when the id carries a fs id. No reference is
+ * taken, the result is only sure to stay resident while the caller holds
+ * one through some other path (an open handle, a dentry, the vfs call it's
+ * running under).
+ * 
+ * @param id 
+ * @return vfs_inode* Pointer to inode structure on success, NULL on failure
+ */
+vfs_inode *vfs_lookup_inode_ptr_by_id( inode_id id ) {
+	return vfs_inode_find( id, false );
+}
+
+/**
+ * @brief Gets inode structure from inode id and takes a reference on it
+ * 
+ * Release it with vfs_inode_put.
+ * 
+ * @param id 
+ * @return vfs_inode* Pointer to inode structure on success, NULL on failure
+ */
+vfs_inode *vfs_inode_get_by_id( inode_id id ) {
+	return vfs_inode_find( id, true );
+}
+
+/**
+ * @brief Doubles the size of the inode table and rehashes every inode, caller holds inode_table.lock for writing
+ * 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+static int vfs_inode_table_grow( void ) {
+	uint8_t new_bits = inode_table.bits + 1;
+	uint64_t new_mask = (1ULL << new_bits) - 1;
+	vfs_inode **new_slot = vfs_malloc( sizeof(vfs_inode *) << new_bits );
+
+	if( new_slot == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	memset( new_slot, 0, sizeof(vfs_inode *) << new_bits );
+
+	for( uint64_t i = 0; i < (1ULL << inode_table.bits); i++ ) {
+		vfs_inode *node = inode_table.slot[i];
+
+		if( node != NULL ) {
+			uint64_t n = vfs_inode_hash( node->id, new_bits );
+
+			while( new_slot[n] != NULL ) {
+				n = (n + 1) & new_mask;
+			}
+
+			new_slot[n] = node;
+		}
+	}
+
+	vfs_free( inode_table.slot );
+	inode_table.slot = new_slot;
+	inode_table.bits = new_bits;
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Adds an inode to the id index
+ * 
+ * @param node 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+int vfs_inode_table_insert( vfs_inode *node ) {
+	vfs_rwlock_write( &inode_table.lock );
+
+	// Keep the load factor under 3/4 so probe chains stay short
+	if( (inode_table.count + 1) * 4 > (3ULL << inode_table.bits) ) {
+		int grow_err = vfs_inode_table_grow();
+
+		if( grow_err != VFS_ERROR_NONE ) {
+			vfs_rwlock_release( &inode_table.lock );
+			return grow_err;
+		}
+	}
+
+	uint64_t mask = (1ULL << inode_table.bits) - 1;
+	uint64_t i = vfs_inode_hash( node->id, inode_table.bits );
+
+	while( inode_table.slot[i] != NULL ) {
+		i = (i + 1) & mask;
+	}
+
+	inode_table.slot[i] = node;
+	inode_table.count++;
+
+	vfs_rwlock_release( &inode_table.lock );
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Removes an inode from the id index
+ * 
+ * @param id 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+int vfs_inode_table_remove( inode_id id ) {
+	vfs_rwlock_write( &inode_table.lock );
+	int ret_val = vfs_inode_table_remove_locked( id );
+	vfs_rwlock_release( &inode_table.lock );
+
+	return ret_val;
+}
+
+/**
+ * @brief Create a new inode for use
+ * 
+ * @return vfs_inode* Pointer to inode structure on success, NULL on failure or once the ids below 1 << VFS_INODE_ID_FS_SHIFT are used up
+ */
+vfs_inode *vfs_allocate_inode( void ) {
+	inode_id id = vfs_atomic_add( &vfs_inode_id_top, 1 ) - 1;
+
+	// Past the local bits an id would collide with a mounted fs's
+	if( id >= (1ULL << VFS_INODE_ID_FS_SHIFT) ) {
+		return NULL;
+	}
+
+	vfs_inode *node = vfs_allocate_inode_with_id( id );
+
+	if( node == NULL ) {
+		return NULL;
+	}
+
+	if( vfs_inode_table_insert( node ) != VFS_ERROR_NONE ) {
+		vfs_slab_free( &inode_slab, node );
+		return NULL;
+	}
+
+	return node;
+}
+
+/**
+ * @brief Create a new inode with a given id, without adding it to the id index
+ * 
+ * For fs load_inode operations, the vfs adds the inode to the index once
+ * the fs has filled it in, so no other thread sees it half built.
+ * 
+ * @param id 
+ * @return vfs_inode* Pointer to inode structure on success, NULL on failure
+ */
+vfs_inode *vfs_allocate_inode_with_id( inode_id id ) {
+	vfs_inode *node = vfs_slab_alloc( &inode_slab );
+
+	if( node == NULL ) {
+		return NULL;
+	}
+
+	memset( node, 0, sizeof(vfs_inode) );
+	node->id = id;
+	vfs_rwlock_initalize( &node->lock );
+
+	return node;
+}
+
+/**
+ * @brief Gets the inode id of file name from the parent dir
+ * 
+ * @param parent_id parent inode id
+ * @param name name of the file 
+ * @return inode_id id of the found file, or 0 if not found
+ */
+inode_id vfs_get_from_dir( inode_id parent_id, char *name ) {
+	vfs_dir_iter it;
+	vfs_dirent *d = NULL;
+	inode_id ret_val = 0;
+
+	if( vfs_opendir( parent_id, &it ) != VFS_ERROR_NONE ) {
+		return 0;
+	}
+
+	while( (d = vfs_readdir( &it )) != NULL ) {
+		if( strcmp( d->name, name ) == 0 ) {
+			ret_val = d->id;
+			break;
+		}
+	}
+
+	vfs_closedir( &it );
+
+	return ret_val;
+}
+
+/**
+ * @brief Unlinks a dentry from the dentry LRU, caller holds dcache.lock for writing
+ * 
+ * @param d 
+ */
+static void vfs_dcache_lru_remove( vfs_dentry *d ) {
+	vfs_dentry *prev = d->lru_prev;
+	vfs_dentry *next = d->lru_next;
+
+	if( prev != NULL ) {
+		prev->lru_next = next;
+	} else {
+		dcache.lru_head = next;
+	}
+
+	if( next != NULL ) {
+		next->lru_prev = prev;
+	} else {
+		dcache.lru_tail = prev;
+	}
+}
+
+/**
+ * @brief Puts a dentry at the most recently used end of the dentry LRU, caller holds dcache.lock for writing
+ * 
+ * @param d 
+ */
+static void vfs_dcache_lru_push( vfs_dentry *d ) {
+	d->lru_prev = NULL;
+	d->lru_next = dcache.lru_head;
+
+	if( dcache.lru_head != NULL ) {
+		dcache.lru_head->lru_prev = d;
+	} else {
+		dcache.lru_tail = d;
+	}
+
+	dcache.lru_head = d;
+}
+
+/**
+ * @brief Frees a dentry already unlinked from its hash chain, dropping its inode reference, caller holds dcache.lock for writing
+ * 
+ * @param d 
+ */
+static void vfs_dcache_release( vfs_dentry *d ) {
+	vfs_dcache_lru_remove( d );
+
+	if( d->node != NULL ) {
+		vfs_inode_put( d->node );
+	}
+
+	vfs_slab_free( &dentry_slab, d );
+	dcache.count--;
+}
+
+/**
+ * @brief Drops the least recently used dentry, caller holds dcache.lock for writing
+ * 
+ * Dentries hit since they were last considered go back to the front once.
+ */
+static void vfs_dcache_evict( void ) {
+	uint64_t chances = dcache.count;
+	vfs_dentry *victim = dcache.lru_tail;
+
+	while( victim != NULL && victim->referenced && chances > 0 ) {
+		victim->referenced = false;
+		vfs_dcache_lru_remove( victim );
+		vfs_dcache_lru_push( victim );
+
+		victim = dcache.lru_tail;
+		chances--;
+	}
+
+	if( victim == NULL ) {
+		return;
+	}
+
+	vfs_dentry **link = &dcache.bucket[ victim->hash & ((1U << dcache.bits) - 1) ];
+
+	while( *link != victim ) {
+		link = (vfs_dentry **)&(*link)->next;
+	}
+
+	*link = victim->next;
+	vfs_dcache_release( victim );
+	dcache.evictions++;
+}
+
+/**
+ * @brief Initalizes the dentry cache
+ * 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+int vfs_dcache_initalize( void ) {
+	vfs_slab_initalize( &dentry_slab, "vfs_dentry", sizeof(vfs_dentry), VFS_DCACHE_SLAB_COUNT );
+
+	dcache.bits = VFS_DCACHE_INITIAL_BITS;
+	dcache.count = 0;
+	dcache.hits = 0;
+	dcache.negative_hits = 0;
+	dcache.misses = 0;
+	dcache.evictions = 0;
+	dcache.max = VFS_DCACHE_MAX;
+	dcache.lru_head = NULL;
+	dcache.lru_tail = NULL;
+	vfs_rwlock_initalize( &dcache.lock );
+	dcache.bucket = vfs_malloc( sizeof(vfs_dentry *) << dcache.bits );
+
+	if( dcache.bucket == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	memset( dcache.bucket, 0, sizeof(vfs_dentry *) << dcache.bits );
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Hashes a (parent, name) pair for the dentry cache
+ * 
+ * @param parent parent inode id
+ * @param name 
+ * @return uint32_t 
+ */
+uint32_t vfs_dcache_hash( inode_id parent, char *name ) {
+	// FNV-1a over the name, seeded with the parent id
+	uint32_t hash = 2166136261U ^ (uint32_t)(parent * 0x9E3779B9U);
+
+	while( *name != 0 ) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619U;
+		name++;
+	}
+
+	return hash;
+}
+
+/**
+ * @brief Finds the dentry for name in parent, caller holds dcache.lock
+ * 
+ * @param parent 
+ * @param name 
+ * @param hash 
+ * @return vfs_dentry* 
+ */
+static vfs_dentry *vfs_dcache_find( inode_id parent, char *name, uint32_t hash ) {
+	vfs_dentry *d = dcache.bucket[ hash & ((1U << dcache.bits) - 1) ];
+
+	while( d != NULL ) {
+		if( d->hash == hash && d->parent == parent && strcmp( d->name, name ) == 0 ) {
+			return d;
+		}
+
+		d = d->next;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Finds the cached dentry for name in parent
+ * 
+ * @param parent parent inode id
+ * @param name 
+ * @param hash result of vfs_dcache_hash( parent, name )
+ * @param id set to the cached inode id on a hit, 0 for a negative entry
+ * @return true on a hit
+ * @return false on a miss
+ */
+bool vfs_dcache_lookup( inode_id parent, char *name, uint32_t hash, inode_id *id ) {
+	vfs_rwlock_read( &dcache.lock );
+
+	vfs_dentry *d = vfs_dcache_find( parent, name, hash );
+
+	if( d != NULL ) {
+		*id = d->id;
+
+		if( d->id == 0 ) {
+			vfs_atomic_add( &dcache.negative_hits, 1 );
+		} else {
+			vfs_atomic_add( &dcache.hits, 1 );
+		}
+
+		if( !vfs_atomic_load( &d->referenced ) ) {
+			vfs_atomic_store( &d->referenced, true );
+		}
+	} else {
+		vfs_atomic_add( &dcache.misses, 1 );
+	}
+
+	vfs_rwlock_release( &dcache.lock );
+
+	return d != NULL;
+}
+
+/**
+ * @brief Doubles the dentry cache bucket count, caller holds dcache.lock for writing
+ * 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+static int vfs_dcache_grow( void ) {
+	uint8_t new_bits = dcache.bits + 1;
+	uint32_t new_mask = (1U << new_bits) - 1;
+	vfs_dentry **new_bucket = vfs_malloc( sizeof(vfs_dentry *) << new_bits );
+
+	if( new_bucket == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	memset( new_bucket, 0, sizeof(vfs_dentry *) << new_bits );
+
+	for( uint32_t i = 0; i < (1U << dcache.bits); i++ ) {
+		vfs_dentry *d = dcache.bucket[i];
+
+		while( d != NULL ) {
+			vfs_dentry *next = d->next;
+
+			d->next = new_bucket[ d->hash & new_mask ];
+			new_bucket[ d->hash & new_mask ] = d;
+
+			d = next;
+		}
+	}
+
+	vfs_free( dcache.bucket );
+	dcache.bucket = new_bucket;
+	dcache.bits = new_bits;
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Caches the result of looking up name in parent
+ * 
+ * @param parent parent inode id
+ * @param name 
+ * @param hash result of vfs_dcache_hash( parent, name )
+ * @param id inode id found, 0 to record that name does not exist
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+int vfs_dcache_add( inode_id parent, char *name, uint32_t hash, inode_id id ) {
+	vfs_inode *node = NULL;
+
+	if( vfs_strlen( name ) >= VFS_NAME_MAX ) {
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	// Positive entries keep their inode resident, take the reference before locking
+	if( id != 0 ) {
+		node = vfs_inode_get_by_id( id );
+	}
+
+	// The dentry pins the inode, so its parent stays known for ".."
+	if( node != NULL ) {
+		vfs_atomic_store( &node->parent, parent );
+	}
+
+	vfs_rwlock_write( &dcache.lock );
+
+	// Another thread may have added it while this one searched the directory
+	if( vfs_dcache_find( parent, name, hash ) != NULL ) {
+		vfs_rwlock_release( &dcache.lock );
+
+		if( node != NULL ) {
+			vfs_inode_put( node );
+		}
+
+		return VFS_ERROR_NONE;
+	}
+
+	while( dcache.count >= dcache.max ) {
+		vfs_dcache_evict();
+	}
+
+	if( dcache.count + 1 > (1U << dcache.bits) ) {
+		vfs_dcache_grow();
+	}
+
+	vfs_dentry *d = vfs_slab_alloc( &dentry_slab );
+
+	if( d == NULL ) {
+		vfs_rwlock_release( &dcache.lock );
+
+		if( node != NULL ) {
+			vfs_inode_put( node );
+		}
+
+		return VFS_ERROR_MEMORY;
+	}
+
+	uint32_t b = hash & ((1U << dcache.bits) - 1);
+
+	d->parent = parent;
+	d->id = id;
+	d->node = node;
+	d->hash = hash;
+	d->referenced = false;
+	strcpy( d->name, name );
+	d->next = dcache.bucket[b];
+	dcache.bucket[b] = d;
+	dcache.count++;
+	vfs_dcache_lru_push( d );
+
+	vfs_rwlock_release( &dcache.lock );
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Drops the cached entry for name in parent, called when a directory changes
+ * 
+ * @param parent parent inode id
+ * @param name 
+ */
+void vfs_dcache_invalidate( inode_id parent, char *name ) {
+	uint32_t hash = vfs_dcache_hash( parent, name );
+
+	vfs_rwlock_write( &dcache.lock );
+
+	vfs_dentry **link = &dcache.bucket[ hash & ((1U << dcache.bits) - 1) ];
+
+	while( *link != NULL ) {
+		vfs_dentry *d = *link;
+
+		if( d->hash == hash && d->parent == parent && strcmp( d->name, name ) == 0 ) {
+			*link = d->next;
+			vfs_dcache_release( d );
+		} else {
+			link = (vfs_dentry **)&d->next;
+		}
+	}
+
+	vfs_rwlock_release( &dcache.lock );
+}
+
+/**
+ * @brief Drops every cached entry under parent
+ * 
+ * @param parent parent inode id
+ */
+void vfs_dcache_invalidate_dir( inode_id parent ) {
+	vfs_rwlock_write( &dcache.lock );
+
+	for( uint32_t i = 0; i < (1U << dcache.bits); i++ ) {
+		vfs_dentry **link = &dcache.bucket[i];
+
+		while( *link != NULL ) {
+			vfs_dentry *d = *link;
+
+			if( d->parent == parent ) {
+				*link = d->next;
+				vfs_dcache_release( d );
+			} else {
+				link = (vfs_dentry **)&d->next;
+			}
+		}
+	}
+
+	vfs_rwlock_release( &dcache.lock );
+}
+
+/**
+ * @brief Sets how many unreferenced inodes and dentries are kept, evicting down to the new limits
+ * 
+ * @param unused_inodes at least 1
+ * @param dentries at least 1
+ */
+void vfs_inode_set_limits( uint64_t unused_inodes, uint64_t dentries ) {
+	// Dentries first, dropping them releases inodes
+	vfs_rwlock_write( &dcache.lock );
+	dcache.max = dentries > 0 ? dentries : 1;
+
+	while( dcache.count > dcache.max ) {
+		vfs_dcache_evict();
+	}
+
+	vfs_rwlock_release( &dcache.lock );
+
+	vfs_lock_acquire( &inode_table.lru_lock );
+	inode_table.unused_max = unused_inodes > 0 ? unused_inodes : 1;
+	vfs_inode_trim();
+	vfs_lock_release( &inode_table.lru_lock );
+}
+
+/**
+ * @brief Initalizes a slab allocator for objects of object_size
+ * 
+ * @param slab 
+ * @param name shown by vfs_memory_diagnostic
+ * @param object_size 
+ * @param objects_per_slab 
+ */
+void vfs_slab_initalize( vfs_slab *slab, char *name, uint32_t object_size, uint32_t objects_per_slab ) {
+	// Free objects hold the free list link, round up to pointer alignment
+	if( object_size < sizeof(void *) ) {
+		object_size = sizeof(void *);
+	}
+
+	slab->name = name;
+	slab->object_size = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	slab->objects_per_slab = objects_per_slab;
+	slab->free_list = NULL;
+	slab->slabs = NULL;
+	slab->slab_count = 0;
+	slab->in_use = 0;
+	slab->allocs = 0;
+	vfs_lock_initalize( &slab->lock );
+
+	slab->next = slab_list;
+	slab_list = slab;
+}
+
+/**
+ * @brief Allocates one object from the slab, growing it by a chunk if needed
+ * 
+ * @param slab 
+ * @return void* Pointer to the object, NULL on failure
+ */
+void *vfs_slab_alloc( vfs_slab *slab ) {
+	vfs_lock_acquire( &slab->lock );
+
+	if( slab->free_list == NULL ) {
+		// Chunk layout: [next chunk ptr][object 0][object 1]...
+		uint8_t *chunk = vfs_malloc( sizeof(void *) + ((uint64_t)slab->object_size * slab->objects_per_slab) );
+
+		if( chunk == NULL ) {
+			vfs_lock_release( &slab->lock );
+			return NULL;
+		}
+
+		*(void **)chunk = slab->slabs;
+		slab->slabs = chunk;
+		slab->slab_count++;
+
+		// Thread the free list in address order so allocations walk forward
+		uint8_t *obj = chunk + sizeof(void *);
+		for( uint32_t i = 0; i < slab->objects_per_slab; i++ ) {
+			void *next = NULL;
+
+			if( i + 1 < slab->objects_per_slab ) {
+				next = obj + slab->object_size;
+			}
+
+			*(void **)obj = next;
+			obj = obj + slab->object_size;
+		}
+
+		slab->free_list = chunk + sizeof(void *);
+	}
+
+	void *obj = slab->free_list;
+	slab->free_list = *(void **)obj;
+	slab->in_use++;
+	slab->allocs++;
+
+	vfs_lock_release( &slab->lock );
+
+	return obj;
+}
+
+/**
+ * @brief Returns an object to the slab
+ * 
+ * @param slab 
+ * @param obj 
+ */
+void vfs_slab_free( vfs_slab *slab, void *obj ) {
+	if( obj == NULL ) {
+		return;
+	}
+
+	vfs_lock_acquire( &slab->lock );
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+	slab->in_use--;
+	vfs_lock_release( &slab->lock );
+}
+
+/**
+ * @brief Initalizes an arena with a size byte backing buffer
+ * 
+ * @param arena 
+ * @param size 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+int vfs_arena_initalize( vfs_arena *arena, uint64_t size ) {
+	arena->base = vfs_malloc( size );
+
+	if( arena->base == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	arena->size = size;
+	arena->used = 0;
+	arena->high_water = 0;
+	arena->overflow = NULL;
+	arena->overflow_count = 0;
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Allocates size bytes from the arena, 16 byte aligned
+ * 
+ * @param arena 
+ * @param size 
+ * @return void* Pointer to memory valid until the arena is restored past it, NULL on failure
+ */
+void *vfs_arena_alloc( vfs_arena *arena, uint64_t size ) {
+	uint64_t aligned = (size + 15) & ~15ULL;
+
+	if( arena->used + aligned <= arena->size ) {
+		void *ret_val = arena->base + arena->used;
+
+		arena->used = arena->used + aligned;
+
+		if( arena->used > arena->high_water ) {
+			arena->high_water = arena->used;
+		}
+
+		return ret_val;
+	}
+
+	// Too big for what's left, chain a one off allocation with a 16 byte header
+	uint8_t *block = vfs_malloc( size + 16 );
+
+	if( block == NULL ) {
+		return NULL;
+	}
+
+	*(void **)block = arena->overflow;
+	arena->overflow = block;
+	arena->overflow_count++;
+
+	return block + 16;
+}
+
+/**
+ * @brief Returns the arena's current position
+ * 
+ * @param arena 
+ * @return vfs_arena_mark 
+ */
+vfs_arena_mark vfs_arena_save( vfs_arena *arena ) {
+	vfs_arena_mark mark;
+
+	mark.used = arena->used;
+	mark.overflow = arena->overflow;
+
+	return mark;
+}
+
+/**
+ * @brief Releases everything allocated from the arena since mark was saved
+ * 
+ * @param arena 
+ * @param mark 
+ */
+void vfs_arena_restore( vfs_arena *arena, vfs_arena_mark mark ) {
+	while( arena->overflow != mark.overflow && arena->overflow != NULL ) {
+		void *next = *(void **)arena->overflow;
+
+		vfs_free( arena->overflow );
+		arena->overflow = next;
+	}
+
+	arena->used = mark.used;
+}
+
+/**
+ * @brief Returns the calling thread's scratch arena for per-operation temporary buffers
+ * 
+ * The arena is set up on first use. If that fails every allocation falls
+ * through to the overflow chain, which still works.
+ * 
+ * @return vfs_arena* 
+ */
+vfs_arena *vfs_scratch( void ) {
+	if( scratch_arena.base == NULL && scratch_arena.size == 0 ) {
+		vfs_arena_initalize( &scratch_arena, VFS_SCRATCH_SIZE );
+	}
+
+	return &scratch_arena;
+}
+
+/**
+ * @brief Releases the calling thread's vfs state, call before a thread that used the vfs exits
+ * 
+ */
+void vfs_thread_exit( void ) {
+	vfs_arena_mark empty = { 0, NULL };
+
+	vfs_arena_restore( &scratch_arena, empty );
+
+	if( scratch_arena.base != NULL ) {
+		vfs_free( scratch_arena.base );
+	}
+
+	memset( &scratch_arena, 0, sizeof(vfs_arena) );
+
+	vfs_metrics_thread_exit();
+}
+
+/**
+ * @brief Display slab and scratch arena usage
+ * 
+ */
+void vfs_memory_diagnostic( void ) {
+	vfs_slab *slab = slab_list;
+
+	vfs_debugf( "%-20s %8s %8s %10s %8s\n", "Slab", "size", "in use", "allocs", "chunks" );
+
+	while( slab != NULL ) {
+		vfs_debugf( "%-20s %8d %8ld %10ld %8ld\n", slab->name, slab->object_size, slab->in_use, slab->allocs, slab->slab_count );
+
+		slab = slab->next;
+	}
+
+	vfs_debugf( "Scratch high water:  %ld of %ld\n", scratch_arena.high_water, scratch_arena.size );
+	vfs_debugf( "Scratch overflows:   %ld\n", scratch_arena.overflow_count );
+}
+
+/**
+ * @brief Shard i's part of a budget, the remainder goes to the first shards
+ * 
+ * @param pages whole budget, at least VFS_CACHE_SHARDS
+ * @param i shard
+ * @return uint64_t 
+ */
+static inline uint64_t vfs_cache_shard_budget( uint64_t pages, int i ) {
+	return pages / VFS_CACHE_SHARDS + ((uint64_t)i < pages % VFS_CACHE_SHARDS ? 1 : 0);
+}
+
+/**
+ * @brief Initalizes the vfs page cache
+ * 
+ */
+void vfs_cache_initalize( void ) {
+	vfs_slab_initalize( &page_slab, "vfs_page", sizeof(vfs_page), VFS_PAGE_SLAB_COUNT );
+	vfs_slab_initalize( &page_data_slab, "vfs_page_data", VFS_PAGE_SIZE, VFS_PAGE_SLAB_COUNT );
+	vfs_slab_initalize( &page_ghost_slab, "vfs_page_ghost", sizeof(vfs_page_ghost), VFS_PAGE_SLAB_COUNT );
+
+	vfs_lock_initalize( &blockdev_lock );
+	vfs_lock_initalize( &flush_lock );
+	vfs_lock_initalize( &metrics_lock );
+
+	memset( &cache, 0, sizeof(vfs_page_cache) );
+
+	cache.max_pages = VFS_PAGE_CACHE_MAX_PAGES;
+	cache.flush_run_pages = VFS_FLUSH_RUN_PAGES;
+	cache.readahead_max = VFS_READAHEAD_MAX_PAGES;
+	cache.policy = &cache_policies[VFS_CACHE_POLICY_CLOCK];
+
+	for( int i = 0; i < VFS_CACHE_SHARDS; i++ ) {
+		vfs_cache_shard *shard = &cache.shard[i];
+
+		vfs_rwlock_initalize( &shard->lock );
+
+		shard->bits = VFS_PAGE_CACHE_INITIAL_BITS;
+		shard->max_pages = vfs_cache_shard_budget( cache.max_pages, i );
+		shard->bucket = vfs_malloc( sizeof(vfs_page *) << shard->bits );
+
+		if( shard->bucket == NULL ) {
+			vfs_panic( "Could not allocate page cache.\n" );
+			return;
+		}
+
+		memset( shard->bucket, 0, sizeof(vfs_page *) << shard->bits );
+	}
+}
+
+/**
+ * @brief Hashes a (drive, page number) pair for the page cache
+ * 
+ * @param drive 
+ * @param index 
+ * @return uint32_t 
+ */
+static inline uint32_t vfs_cache_hash( uint64_t drive, uint64_t index ) {
+	uint64_t key = (drive << 48) ^ index;
+
+	return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/**
+ * @brief Shard a page hash belongs to, picked by the top bits so buckets use the low ones
+ * 
+ * @param hash 
+ * @return vfs_cache_shard* 
+ */
+static inline vfs_cache_shard *vfs_cache_shard_of( uint32_t hash ) {
+	return &cache.shard[ hash >> (32 - VFS_CACHE_SHARD_BITS) ];
+}
+
+/**
+ * @brief Shard of the page holding byte addr of drive
+ * 
+ * @param drive 
+ * @param addr 
+ * @return vfs_cache_shard* 
+ */
+static inline vfs_cache_shard *vfs_cache_shard_at( uint64_t drive, uint64_t addr ) {
+	return vfs_cache_shard_of( vfs_cache_hash( drive, addr >> VFS_PAGE_SHIFT ) );
+}
+
+/**
+ * @brief Shard a cached page lives in
+ * 
+ * @param page 
+ * @return vfs_cache_shard* 
+ */
+static inline vfs_cache_shard *vfs_page_shard( vfs_page *page ) {
+	return vfs_cache_shard_of( vfs_cache_hash( page->drive, page->index ) );
+}
+
+/**
+ * @brief Finds a cached page, caller holds shard->lock
+ * 
+ * @param shard 
+ * @param drive 
+ * @param index 
+ * @param hash 
+ * @return vfs_page* NULL if the page isn't cached
+ */
+static vfs_page *vfs_cache_find( vfs_cache_shard *shard, uint64_t drive, uint64_t index, uint32_t hash ) {
+	vfs_page *page = shard->bucket[ hash & ((1U << shard->bits) - 1) ];
+
+	while( page != NULL ) {
+		if( page->index == index && page->drive == drive ) {
+			return page;
+		}
+
+		page = page->hash_next;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief True if a page is cached, takes its shard's lock for reading
+ * 
+ * @param drive 
+ * @param index 
+ * @return bool 
+ */
+static bool vfs_cache_contains( uint64_t drive, uint64_t index ) {
+	uint32_t hash = vfs_cache_hash( drive, index );
+	vfs_cache_shard *shard = vfs_cache_shard_of( hash );
+
+	vfs_rwlock_read( &shard->lock );
+
+	bool found = vfs_cache_find( shard, drive, index, hash ) != NULL;
+
+	vfs_rwlock_release( &shard->lock );
+
+	return found;
+}
+
+/**
+ * @brief Doubles a shard's bucket count, caller holds shard->lock for writing
+ * 
+ * @param shard 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ on failure
+ */
+static int vfs_cache_grow( vfs_cache_shard *shard ) {
+	uint8_t new_bits = shard->bits + 1;
+	uint32_t new_mask = (1U << new_bits) - 1;
+	vfs_page **new_bucket = vfs_malloc( sizeof(vfs_page *) << new_bits );
+
+	if( new_bucket == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	memset( new_bucket, 0, sizeof(vfs_page *) << new_bits );
+
+	for( uint32_t i = 0; i < (1U << shard->bits); i++ ) {
+		vfs_page *page = shard->bucket[i];
+
+		while( page != NULL ) {
+			vfs_page *next = page->hash_next;
+			uint32_t b = vfs_cache_hash( page->drive, page->index ) & new_mask;
+
+			page->hash_next = new_bucket[b];
+			new_bucket[b] = page;
+
+			page = next;
+		}
+	}
+
+	vfs_free( shard->bucket );
+	shard->bucket = new_bucket;
+	shard->bits = new_bits;
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Shared policy hit, only marks the page referenced
+ * 
+ * @param page 
+ */
+static void vfs_cache_policy_hit( vfs_page *page ) {
+	if( !vfs_atomic_load( &page->referenced ) ) {
+		vfs_atomic_store( &page->referenced, true );
+	}
+}
+
+/**
+ * @brief Adds a page behind the shard's clock hand, so it is looked at last
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_clock_insert( vfs_cache_shard *shard, vfs_page *page ) {
+	if( shard->clock_hand == NULL ) {
+		page->lru_prev = page;
+		page->lru_next = page;
+		shard->clock_hand = page;
+		return;
+	}
+
+	vfs_page *prev = shard->clock_hand->lru_prev;
+
+	page->lru_prev = prev;
+	page->lru_next = shard->clock_hand;
+	prev->lru_next = page;
+	shard->clock_hand->lru_prev = page;
+}
+
+/**
+ * @brief Takes a page out of the shard's clock ring
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_clock_remove( vfs_cache_shard *shard, vfs_page *page ) {
+	if( page->lru_next == page ) {
+		shard->clock_hand = NULL;
+	} else {
+		vfs_page *prev = page->lru_prev;
+		vfs_page *next = page->lru_next;
+
+		prev->lru_next = next;
+		next->lru_prev = prev;
+
+		if( shard->clock_hand == page ) {
+			shard->clock_hand = next;
+		}
+	}
+
+	page->lru_prev = NULL;
+	page->lru_next = NULL;
+}
+
+/**
+ * @brief Sweeps the hand, clearing referenced pages, until an unreferenced one turns up
+ * 
+ * @param shard 
+ * @return vfs_page* 
+ */
+static vfs_page *vfs_clock_victim( vfs_cache_shard *shard ) {
+	while( shard->clock_hand != NULL && shard->clock_hand->referenced ) {
+		shard->clock_hand->referenced = false;
+		shard->clock_hand = shard->clock_hand->lru_next;
+	}
+
+	return shard->clock_hand;
+}
+
+/**
+ * @brief Pushes a page on the head of a 2Q queue
+ * 
+ * @param head 
+ * @param tail 
+ * @param page 
+ */
+static void vfs_2q_push( vfs_page **head, vfs_page **tail, vfs_page *page ) {
+	page->lru_prev = NULL;
+	page->lru_next = *head;
+
+	if( *head != NULL ) {
+		(*head)->lru_prev = page;
+	} else {
+		*tail = page;
+	}
+
+	*head = page;
+}
+
+/**
+ * @brief Unlinks a page from a 2Q queue
+ * 
+ * @param head 
+ * @param tail 
+ * @param page 
+ */
+static void vfs_2q_unlink( vfs_page **head, vfs_page **tail, vfs_page *page ) {
+	vfs_page *prev = page->lru_prev;
+	vfs_page *next = page->lru_next;
+
+	if( prev != NULL ) {
+		prev->lru_next = next;
+	} else {
+		*head = next;
+	}
+
+	if( next != NULL ) {
+		next->lru_prev = prev;
+	} else {
+		*tail = prev;
+	}
+
+	page->lru_prev = NULL;
+	page->lru_next = NULL;
+}
+
+/**
+ * @brief Removes the ghost for a page if the shard has one
+ * 
+ * @param shard 
+ * @param drive 
+ * @param index 
+ * @return true if the page was evicted from A1in recently
+ */
+static bool vfs_2q_ghost_take( vfs_cache_shard *shard, uint64_t drive, uint64_t index ) {
+	vfs_page_ghost **link = &shard->ghost_bucket[ vfs_cache_hash( drive, index ) & ((1U << VFS_PAGE_GHOST_BITS) - 1) ];
+
+	while( *link != NULL ) {
+		vfs_page_ghost *g = *link;
+
+		if( g->index == index && g->drive == drive ) {
+			*link = g->hash_next;
+			g->live = false;
+			return true;
+		}
+
+		link = (vfs_page_ghost **)&g->hash_next;
+	}
+
+	return false;
+}
+
+/**
+ * @brief Remembers a page leaving A1in, dropping the oldest ghosts past the shard's max_pages / 2
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_2q_ghost_add( vfs_cache_shard *shard, vfs_page *page ) {
+	vfs_page_ghost *g = vfs_slab_alloc( &page_ghost_slab );
+
+	if( g != NULL ) {
+		uint32_t b = vfs_cache_hash( page->drive, page->index ) & ((1U << VFS_PAGE_GHOST_BITS) - 1);
+
+		g->drive = page->drive;
+		g->index = page->index;
+		g->live = true;
+		g->hash_next = shard->ghost_bucket[b];
+		g->fifo_next = NULL;
+		shard->ghost_bucket[b] = g;
+
+		if( shard->ghost_fifo_tail != NULL ) {
+			shard->ghost_fifo_tail->fifo_next = g;
+		} else {
+			shard->ghost_fifo_head = g;
+		}
+
+		shard->ghost_fifo_tail = g;
+		shard->ghost_count++;
+	}
+
+	while( shard->ghost_count > shard->max_pages / 2 && shard->ghost_fifo_head != NULL ) {
+		vfs_page_ghost *old = shard->ghost_fifo_head;
+
+		shard->ghost_fifo_head = old->fifo_next;
+
+		if( shard->ghost_fifo_head == NULL ) {
+			shard->ghost_fifo_tail = NULL;
+		}
+
+		if( old->live ) {
+			vfs_2q_ghost_take( shard, old->drive, old->index );
+		}
+
+		vfs_slab_free( &page_ghost_slab, old );
+		shard->ghost_count--;
+	}
+}
+
+/**
+ * @brief New pages go on A1in, pages whose ghost is still around go straight to Am
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_2q_insert( vfs_cache_shard *shard, vfs_page *page ) {
+	if( vfs_2q_ghost_take( shard, page->drive, page->index ) ) {
+		page->queue = VFS_PAGE_QUEUE_AM;
+		vfs_2q_push( &shard->am_head, &shard->am_tail, page );
+		shard->am_count++;
+	} else {
+		page->queue = VFS_PAGE_QUEUE_A1IN;
+		vfs_2q_push( &shard->a1in_head, &shard->a1in_tail, page );
+		shard->a1in_count++;
+	}
+}
+
+/**
+ * @brief Takes a page off whichever 2Q queue it is on
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_2q_remove( vfs_cache_shard *shard, vfs_page *page ) {
+	if( page->queue == VFS_PAGE_QUEUE_A1IN ) {
+		vfs_2q_unlink( &shard->a1in_head, &shard->a1in_tail, page );
+		shard->a1in_count--;
+	} else if( page->queue == VFS_PAGE_QUEUE_AM ) {
+		vfs_2q_unlink( &shard->am_head, &shard->am_tail, page );
+		shard->am_count--;
+	}
+
+	page->queue = VFS_PAGE_QUEUE_NONE;
+}
+
+/**
+ * @brief Evicts from A1in while it holds more than a quarter of the shard, otherwise from Am
+ * 
+ * Am gives referenced pages a second chance instead of reordering on every
+ * hit, hits only run under the read lock.
+ * 
+ * @param shard 
+ * @return vfs_page* 
+ */
+static vfs_page *vfs_2q_victim( vfs_cache_shard *shard ) {
+	uint64_t a1in_max = shard->max_pages / 4;
+
+	if( shard->a1in_tail != NULL && (shard->a1in_count > a1in_max || shard->am_tail == NULL) ) {
+		return shard->a1in_tail;
+	}
+
+	while( shard->am_tail != NULL && shard->am_tail->referenced ) {
+		vfs_page *page = shard->am_tail;
+
+		page->referenced = false;
+		vfs_2q_unlink( &shard->am_head, &shard->am_tail, page );
+		vfs_2q_push( &shard->am_head, &shard->am_tail, page );
+	}
+
+	return shard->am_tail;
+}
+
+/**
+ * @brief Remembers a page evicted from A1in, so it goes to Am if it's read again soon
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_2q_evict( vfs_cache_shard *shard, vfs_page *page ) {
+	if( page->queue == VFS_PAGE_QUEUE_A1IN ) {
+		vfs_2q_ghost_add( shard, page );
+	}
+}
+
+/**
+ * @brief Puts a page on its class's list, a normal page goes to the policy, caller holds shard->lock for writing
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_cache_class_insert( vfs_cache_shard *shard, vfs_page *page ) {
+	if( page->cache_class == VFS_CACHE_CLASS_PINNED ) {
+		vfs_2q_push( &shard->pinned_head, &shard->pinned_tail, page );
+		shard->pinned_count++;
+	} else if( page->cache_class == VFS_CACHE_CLASS_STREAM ) {
+		vfs_2q_push( &shard->stream_head, &shard->stream_tail, page );
+		shard->stream_count++;
+	} else {
+		cache.policy->insert( shard, page );
+	}
+}
+
+/**
+ * @brief Takes a page off its class's list, caller holds shard->lock for writing
+ * 
+ * @param shard 
+ * @param page 
+ */
+static void vfs_cache_class_remove( vfs_cache_shard *shard, vfs_page *page ) {
+	if( page->cache_class == VFS_CACHE_CLASS_PINNED ) {
+		vfs_2q_unlink( &shard->pinned_head, &shard->pinned_tail, page );
+		shard->pinned_count--;
+	} else if( page->cache_class == VFS_CACHE_CLASS_STREAM ) {
+		vfs_2q_unlink( &shard->stream_head, &shard->stream_tail, page );
+		shard->stream_count--;
+	} else {
+		cache.policy->remove( shard, page );
+	}
+}
+
+/**
+ * @brief Moves a page to a longer lived class, caller holds shard->lock for writing
+ * 
+ * @param shard 
+ * @param page 
+ * @param cache_class VFS_CACHE_CLASS_
+ */
+static void vfs_cache_class_promote( vfs_cache_shard *shard, vfs_page *page, uint8_t cache_class ) {
+	vfs_cache_class_remove( shard, page );
+
+	page->cache_class = cache_class;
+	page->referenced = false;
+	page->promote = false;
+
+	vfs_cache_class_insert( shard, page );
+	shard->stats.promotions++;
+}
+
+/**
+ * @brief Oldest pinned page not hit since it was last looked at, caller holds shard->lock for writing
+ * 
+ * @param shard 
+ * @return vfs_page* NULL if nothing is pinned
+ */
+static vfs_page *vfs_cache_pinned_victim( vfs_cache_shard *shard ) {
+	uint64_t chances = shard->pinned_count;
+
+	while( shard->pinned_tail != NULL && shard->pinned_tail->referenced && chances > 0 ) {
+		vfs_page *page = shard->pinned_tail;
+
+		page->referenced = false;
+		vfs_2q_unlink( &shard->pinned_head, &shard->pinned_tail, page );
+		vfs_2q_push( &shard->pinned_head, &shard->pinned_tail, page );
+
+		chances--;
+	}
+
+	return shard->pinned_tail;
+}
+
+/**
+ * @brief Picks the page to evict from shard by class, caller holds shard->lock for writing
+ * 
+ * Stream pages go first, oldest first, then the policy's choice. Pinned
+ * pages go only past VFS_CACHE_PINNED_PERCENT of the shard or once nothing
+ * else is left. A stream page someone else hit since, or a normal page a
+ * pinned reader hit, is promoted instead of evicted.
+ * 
+ * @param shard 
+ * @return vfs_page* NULL if the shard is empty
+ */
+static vfs_page *vfs_cache_victim( vfs_cache_shard *shard ) {
+	while( shard->stream_tail != NULL ) {
+		vfs_page *page = shard->stream_tail;
+
+		if( !page->referenced && !page->promote ) {
+			return page;
+		}
+
+		vfs_cache_class_promote( shard, page, page->promote ? VFS_CACHE_CLASS_PINNED : VFS_CACHE_CLASS_NORMAL );
+	}
+
+	if( shard->pinned_count * 100 > shard->max_pages * VFS_CACHE_PINNED_PERCENT ) {
+		return vfs_cache_pinned_victim( shard );
+	}
+
+	vfs_page *page = cache.policy->victim( shard );
+
+	while( page != NULL && page->promote ) {
+		vfs_cache_class_promote( shard, page, VFS_CACHE_CLASS_PINNED );
+		page = cache.policy->victim( shard );
+	}
+
+	return page != NULL ? page : vfs_cache_pinned_victim( shard );
+}
+
+/**
+ * @brief Evicts the victim in shard, writing it back first if dirty, caller holds shard->lock for writing
+ * 
+ * A dirty victim that can't be written stays, it holds the only copy of
+ * its data. It goes back on its list as if just inserted and the next
+ * victim is tried.
+ * 
+ * @param shard 
+ * @return true if a page was evicted
+ */
+static bool vfs_cache_evict( vfs_cache_shard *shard ) {
+	vfs_page *page = NULL;
+
+	for( uint64_t tries = shard->count; tries > 0; tries-- ) {
+		page = vfs_cache_victim( shard );
+
+		// A page being written back or completed stays until that's done, the
+		// cache goes over budget for a moment instead
+		if( page == NULL || page->writeback || page->pins != 0 ) {
+			return false;
+		}
+
+		if( !page->dirty ) {
+			break;
+		}
+
+		if( vfs_cache_flush( page ) ) {
+			shard->stats.dirty_evictions++;
+			break;
+		}
+
+		vfs_cache_class_remove( shard, page );
+		vfs_cache_class_insert( shard, page );
+		page = NULL;
+	}
+
+	if( page == NULL ) {
+		return false;
+	}
+
+	vfs_page **link = &shard->bucket[ vfs_cache_hash( page->drive, page->index ) & ((1U << shard->bits) - 1) ];
+
+	while( *link != page ) {
+		link = (vfs_page **)&(*link)->hash_next;
+	}
+
+	*link = page->hash_next;
+
+	// Only now is the page certain to go, a policy's memory of it starts here
+	if( cache.policy->evict != NULL ) {
+		cache.policy->evict( shard, page );
+	}
+
+	vfs_cache_class_remove( shard, page );
+
+	vfs_slab_free( &page_data_slab, page->data );
+	vfs_slab_free( &page_slab, page );
+
+	shard->count--;
+	shard->stats.evictions++;
+
+	return true;
+}
+
+/**
+ * @brief Allocates an uncached page
+ * 
+ * @param drive 
+ * @param index 
+ * @param valid true if the caller fills all of its data, false if nothing in it is valid yet
+ * @return vfs_page* NULL on failure
+ */
+static vfs_page *vfs_cache_page_new( uint64_t drive, uint64_t index, bool valid ) {
+	vfs_page *page = vfs_slab_alloc( &page_slab );
+
+	if( page == NULL ) {
+		return NULL;
+	}
+
+	page->data = vfs_slab_alloc( &page_data_slab );
+
+	if( page->data == NULL ) {
+		vfs_slab_free( &page_slab, page );
+		return NULL;
+	}
+
+	page->drive = drive;
+	page->index = index;
+	page->dirty = false;
+	page->valid_start = 0;
+	page->valid_end = valid ? VFS_PAGE_SIZE : 0;
+	page->pins = 0;
+	page->refs = 0;
+	page->read_count = 0;
+	page->write_count = 0;
+	page->referenced = false;
+	page->promote = false;
+	page->writeback = false;
+	page->cache_class = io_hint.cache_class < VFS_CACHE_CLASS_MAX ? io_hint.cache_class : VFS_CACHE_CLASS_NORMAL;
+	page->dirty_epoch = 0;
+	page->queue = VFS_PAGE_QUEUE_NONE;
+	page->owner = io_hint;
+
+	return page;
+}
+
+/**
+ * @brief Frees a page that never made it into the cache
+ * 
+ * @param page 
+ */
+static inline void vfs_cache_page_free( vfs_page *page ) {
+	vfs_slab_free( &page_data_slab, page->data );
+	vfs_slab_free( &page_slab, page );
+}
+
+/**
+ * @brief Inserts a new page into its shard, evicting to stay in budget, caller holds shard->lock for writing
+ * 
+ * If the page is already cached that one wins and the new one is freed.
+ * 
+ * @param shard 
+ * @param page 
+ * @param hash 
+ * @return vfs_page* the cached page
+ */
+static vfs_page *vfs_cache_insert( vfs_cache_shard *shard, vfs_page *page, uint32_t hash ) {
+	vfs_page *existing = vfs_cache_find( shard, page->drive, page->index, hash );
+
+	if( existing != NULL ) {
+		vfs_cache_page_free( page );
+		return existing;
+	}
+
+	while( shard->count >= shard->max_pages && vfs_cache_evict( shard ) );
+
+	if( shard->count + 1 > (1U << shard->bits) ) {
+		vfs_cache_grow( shard );
+	}
+
+	uint32_t b = hash & ((1U << shard->bits) - 1);
+
+	page->hash_next = shard->bucket[b];
+	shard->bucket[b] = page;
+	shard->count++;
+	vfs_cache_class_insert( shard, page );
+
+	return page;
+}
+
+/**
+ * @brief Records a hit on page, caller holds its shard lock
+ * 
+ * Stream readers leave no mark, so pages only they touch stay first to
+ * go. A pinned reader flags the page to be pinned when it next comes up
+ * for eviction, the lists can't change under the read lock.
+ * 
+ * @param page 
+ */
+static inline void vfs_cache_touch( vfs_page *page ) {
+	if( io_hint.cache_class == VFS_CACHE_CLASS_STREAM ) {
+		return;
+	}
+
+	if( io_hint.cache_class == VFS_CACHE_CLASS_PINNED && page->cache_class != VFS_CACHE_CLASS_PINNED && !vfs_atomic_load( &page->promote ) ) {
+		vfs_atomic_store( &page->promote, true );
+	}
+
+	cache.policy->hit( page );
+}
+
+/**
+ * @brief Marks the shards over a range of a drive as changed on disk
+ * 
+ * Fills whose disk read started before this may hold the old data and are
+ * not inserted. Call it after the write reached the disk.
+ * 
+ * @param drive 
+ * @param addr 
+ * @param size 
+ */
+static void vfs_cache_changed( uint64_t drive, uint64_t addr, uint64_t size ) {
+	if( size == 0 ) {
+		return;
+	}
+
+	uint64_t first = addr >> VFS_PAGE_SHIFT;
+	uint64_t last = (addr + size - 1) >> VFS_PAGE_SHIFT;
+
+	if( last - first >= VFS_CACHE_SHARDS ) {
+		for( uint32_t s = 0; s < VFS_CACHE_SHARDS; s++ ) {
+			vfs_atomic_inc( &cache.shard[s].generation );
+		}
+
+		return;
+	}
+
+	for( uint64_t index = first; index <= last; index++ ) {
+		vfs_atomic_inc( &vfs_cache_shard_of( vfs_cache_hash( drive, index ) )->generation );
+	}
+}
+
+/**
+ * @brief Reads a page in from disk and inserts it
+ * 
+ * The disk read happens before the shard lock is taken. If another thread
+ * inserted the same page meanwhile, that page wins and this one is dropped,
+ * so the page returned may be only partly valid. If instead a write reached
+ * the disk under the shard while the read was in flight, the page may
+ * already have been written, flushed and evicted, so it is read again
+ * rather than inserted with the old data.
+ * 
+ * @param shard shard of hash
+ * @param drive 
+ * @param index 
+ * @param hash 
+ * @param read false to insert the page with nothing valid, for a caller about to write into it
+ * @return vfs_page* cached page with shard->lock held for writing, NULL on failure (lock not held)
+ */
+static vfs_page *vfs_cache_fill( vfs_cache_shard *shard, uint64_t drive, uint64_t index, uint32_t hash, bool read ) {
+	vfs_page *page = vfs_cache_page_new( drive, index, read );
+
+	if( page == NULL ) {
+		return NULL;
+	}
+
+	if( !read ) {
+		vfs_atomic_add( &shard->stats.write_allocs, 1 );
+		vfs_rwlock_write( &shard->lock );
+
+		return vfs_cache_insert( shard, page, hash );
+	}
+
+	while( true ) {
+		uint64_t generation = vfs_atomic_load( &shard->generation );
+
+		if( !vfs_disk_read_no_cache( drive, index << VFS_PAGE_SHIFT, VFS_PAGE_SIZE, page->data ) ) {
+			vfs_cache_page_free( page );
+			return NULL;
+		}
+
+		vfs_rwlock_write( &shard->lock );
+
+		if( vfs_atomic_load( &shard->generation ) == generation || vfs_cache_find( shard, drive, index, hash ) != NULL ) {
+			break;
+		}
+
+		vfs_rwlock_release( &shard->lock );
+	}
+
+	vfs_atomic_add( &shard->stats.fills, 1 );
+
+	return vfs_cache_insert( shard, page, hash );
+}
+
+/**
+ * @brief Adds a block device to the registry
+ * 
+ * @param name what file systems' mount data names it by
+ * @param data the driver's state for it
+ * @return int its drive number, otherwise VFS_ERROR_
+ */
+int vfs_blockdev_register( char *name, void *data ) {
+	if( name == NULL || name[0] == 0 || vfs_strlen( name ) >= VFS_NAME_MAX ) {
+		return VFS_ERROR_BAD_NAME;
+	}
+
+	vfs_lock_acquire( &blockdev_lock );
+
+	for( uint32_t i = 0; i < blockdev_count; i++ ) {
+		if( strcmp( blockdevs[i].name, name ) == 0 ) {
+			vfs_lock_release( &blockdev_lock );
+			return VFS_ERROR_OBJECT_ALREADY_IN_USE;
+		}
+	}
+
+	if( blockdev_count == VFS_MAX_DRIVES ) {
+		vfs_lock_release( &blockdev_lock );
+		return VFS_ERROR_NO_SPACE;
+	}
+
+	int drive = blockdev_count;
+
+	strcpy( blockdevs[drive].name, name );
+	blockdevs[drive].data = data;
+
+	// Published last, so vfs_blockdev_get never sees a half filled slot
+	vfs_atomic_store( &blockdev_count, drive + 1 );
+
+	vfs_lock_release( &blockdev_lock );
+
+	return drive;
+}
+
+/**
+ * @brief Looks up a block device's drive number by name
+ * 
+ * @param name 
+ * @return int drive number, VFS_ERROR_NOT_A_DEVICE if there's no such device
+ */
+int vfs_blockdev_find( char *name ) {
+	uint32_t count = vfs_atomic_load( &blockdev_count );
+
+	for( uint32_t i = 0; i < count; i++ ) {
+		if( strcmp( blockdevs[i].name, name ) == 0 ) {
+			return i;
+		}
+	}
+
+	return VFS_ERROR_NOT_A_DEVICE;
+}
+
+/**
+ * @brief The registered block device for a drive number
+ * 
+ * @param drive 
+ * @return vfs_blockdev* NULL if nothing is registered there
+ */
+vfs_blockdev *vfs_blockdev_get( uint64_t drive ) {
+	if( drive >= vfs_atomic_load( &blockdev_count ) ) {
+		return NULL;
+	}
+
+	return &blockdevs[drive];
+}
+
+/**
+ * @brief Starts a disk request, on the drive's queue if it has one, otherwise done before this returns
+ * 
+ * @param request filled in with drive, offset, length, data and write
+ * @return int VFS_ERROR_NONE, the outcome is vfs_disk_wait's
+ */
+int vfs_disk_submit( vfs_disk_request *request ) {
+	request->queued = false;
+	request->done = false;
+	request->result = VFS_ERROR_NONE;
+	request->start = vfs_now_ns();
+	request->hint = io_hint;
+
+	if( request->drive < VFS_MAX_DRIVES ) {
+		vfs_atomic_store( &disk_head[request->drive], request->offset + request->length );
+	}
+
+#ifdef VIFS_DEV
+	if( vfs_disk_submit_test( request ) ) {
+		return VFS_ERROR_NONE;
+	}
+#endif
+
+	// No queue, the no_cache calls record their own metrics
+	if( request->write ) {
+		if( !vfs_disk_write_no_cache( request->drive, request->offset, request->length, request->data ) ) {
+			request->result = VFS_ERROR_UNKNOWN;
+		}
+	} else if( !vfs_disk_read_no_cache( request->drive, request->offset, request->length, request->data ) ) {
+		request->result = VFS_ERROR_UNKNOWN;
+	}
+
+	request->done = true;
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Waits for a submitted request to complete
+ * 
+ * @param request 
+ * @return int VFS_ERROR_NONE if all of it was read or written, otherwise VFS_ERROR_
+ */
+int vfs_disk_wait( vfs_disk_request *request ) {
+#ifdef VIFS_DEV
+	if( request->queued ) {
+		vfs_disk_wait_test( request );
+
+		vfs_io_hint hint = vfs_io_hint_set( request->hint.fs_id, request->hint.io_class, request->hint.cache_class, request->hint.inode );
+		vfs_metrics_record( request->write ? VFS_METRIC_DISK_WRITE : VFS_METRIC_DISK_READ, request->length, request->start );
+		vfs_io_hint_restore( hint );
+	}
+#endif
+
+	return request->result;
+}
+
+/**
+ * @brief Where C-LOOK carries on from on a drive
+ * 
+ * @param drive 
+ * @return uint64_t byte offset just past the drive's last submitted request
+ */
+static inline uint64_t vfs_disk_head( uint64_t drive ) {
+	return drive < VFS_MAX_DRIVES ? vfs_atomic_load( &disk_head[drive] ) : 0;
+}
+
+/**
+ * @brief True if request a comes before request b in C-LOOK order
+ * 
+ * Per drive, requests at or past the head go first in ascending offset,
+ * then the sweep wraps to the lowest offset.
+ * 
+ * @param a 
+ * @param a_behind a is before its drive's head
+ * @param b 
+ * @param b_behind 
+ * @return bool 
+ */
+static inline bool vfs_disk_request_before( vfs_disk_request *a, bool a_behind, vfs_disk_request *b, bool b_behind ) {
+	if( a->drive != b->drive ) {
+		return a->drive < b->drive;
+	}
+
+	if( a_behind != b_behind ) {
+		return b_behind;
+	}
+
+	return a->offset < b->offset;
+}
+
+/**
+ * @brief Submits count requests and waits for all of them, as many in flight at once as the queue takes
+ * 
+ * Requests are put in C-LOOK order and neighbours that are adjacent both on
+ * disk and in memory, with the same direction, are merged into one. Without
+ * a queue merges go up to VFS_DISK_MERGE_MAX_PAGES, with one only requests
+ * smaller than VFS_DISK_SPLIT_PAGES are merged, so reads split to fill the
+ * queue stay split. Requests in one batch must not overlap, the queue may
+ * run them in any order.
+ * 
+ * @param requests 
+ * @param count 
+ * @return int VFS_ERROR_NONE, otherwise the first request's VFS_ERROR_ that failed
+ */
+int vfs_disk_io( vfs_disk_request *requests, uint64_t count ) {
+	int err = VFS_ERROR_NONE;
+	uint64_t max = vfs_disk_queue_depth() == 1 ? VFS_DISK_MERGE_MAX_PAGES * VFS_PAGE_SIZE : VFS_DISK_SPLIT_PAGES * VFS_PAGE_SIZE;
+	vfs_disk_request *merged = count > 1 ? vfs_malloc( (sizeof(vfs_disk_request) + sizeof(uint64_t) * 2 + sizeof(bool)) * count ) : NULL;
+
+	// One request, or no memory to reorder in, goes out as it is
+	if( merged == NULL ) {
+		for( uint64_t i = 0; i < count; i++ ) {
+			vfs_disk_submit( &requests[i] );
+		}
+
+		for( uint64_t i = 0; i < count; i++ ) {
+			int request_err = vfs_disk_wait( &requests[i] );
+
+			if( err == VFS_ERROR_NONE ) {
+				err = request_err;
+			}
+		}
+
+		return err;
+	}
+
+	uint64_t *order = (uint64_t *)(merged + count);
+	uint64_t *first = order + count;	// each merged request's first place in order
+	bool *behind = (bool *)(first + count);
+	uint64_t merges = 0;
+
+	// Heads move as other threads submit, each request is placed against one look at its drive's
+	for( uint64_t i = 0; i < count; i++ ) {
+		behind[i] = requests[i].offset < vfs_disk_head( requests[i].drive );
+	}
+
+	// Insertion sort, batches are a queue's worth
+	for( uint64_t i = 0; i < count; i++ ) {
+		uint64_t j = i;
+
+		while( j > 0 && vfs_disk_request_before( &requests[i], behind[i], &requests[ order[j - 1] ], behind[ order[j - 1] ] ) ) {
+			order[j] = order[j - 1];
+			j--;
+		}
+
+		order[j] = i;
+	}
+
+	for( uint64_t i = 0; i < count; i++ ) {
+		vfs_disk_request *r = &requests[ order[i] ];
+		vfs_disk_request *m = merges != 0 ? &merged[merges - 1] : NULL;
+
+		if( m != NULL && m->drive == r->drive && m->write == r->write && m->offset + m->length == r->offset && m->data + m->length == r->data && m->length + r->length <= max ) {
+			m->length = m->length + r->length;
+			continue;
+		}
+
+		merged[merges] = *r;
+		first[merges] = i;
+		merges++;
+	}
+
+	for( uint64_t i = 0; i < merges; i++ ) {
+		vfs_disk_submit( &merged[i] );
+	}
+
+	for( uint64_t i = 0; i < merges; i++ ) {
+		int request_err = vfs_disk_wait( &merged[i] );
+		uint64_t end = i + 1 < merges ? first[i + 1] : count;
+
+		// Every request merged into it shares its outcome
+		for( uint64_t j = first[i]; j < end; j++ ) {
+			requests[ order[j] ].done = true;
+			requests[ order[j] ].result = request_err;
+		}
+
+		if( err == VFS_ERROR_NONE ) {
+			err = request_err;
+		}
+	}
+
+	vfs_free( merged );
+
+	return err;
+}
+
+/**
+ * @brief How many requests the disk keeps in flight, 1 when it does them one at a time
+ * 
+ * @return uint32_t 
+ */
+uint32_t vfs_disk_queue_depth( void ) {
+#ifdef VIFS_DEV
+	return vfs_disk_queue_depth_test();
+#else
+	return 1;
+#endif
+}
+
+/**
+ * @brief Reads page windows into the cache, their disk reads in flight together up to the queue depth
+ * 
+ * Each window skips the cached pages at its front and stops at the next
+ * cached page, so nothing already cached is read again or replaced. A
+ * window is split into up to vfs_disk_queue_depth requests of at least
+ * VFS_DISK_SPLIT_PAGES pages, so it's one read when there is no queue.
+ * The windows together ask for at most a quarter of the cache and never
+ * read past the end of the drive.
+ * 
+ * @param drive 
+ * @param first first page of each window
+ * @param count pages in each window
+ * @param windows 
+ * @param readahead count the pages as readahead, otherwise as fills
+ * @return uint64_t pages inserted
+ */
+static uint64_t vfs_cache_read_windows( uint64_t drive, uint64_t *first, uint64_t *count, uint32_t windows, bool readahead ) {
+	uint64_t end = vfs_disk_size( drive ) >> VFS_PAGE_SHIFT;
+	uint32_t depth = vfs_disk_queue_depth();
+	uint64_t total = 0;
+	uint64_t requests = 0;
+	uint64_t inserted = 0;
+
+	// max_pages may be changing under set_limit, one read of it is enough
+	uint64_t budget = vfs_atomic_load( &cache.max_pages ) / 4;
+	uint64_t *start = vfs_malloc( sizeof(uint64_t) * windows * 2 );
+
+	if( start == NULL ) {
+		return 0;
+	}
+
+	uint64_t *pages = start + windows;
+
+	for( uint32_t w = 0; w < windows; w++ ) {
+		uint64_t at = first[w];
+		uint64_t want = count[w];
+
+		pages[w] = 0;
+
+		if( at >= end ) {
+			continue;
+		}
+
+		if( want > end - at ) {
+			want = end - at;
+		}
+
+		if( want > budget - total ) {
+			want = budget - total;
+		}
+
+		while( want > 0 && vfs_cache_contains( drive, at ) ) {
+			at++;
+			want--;
+		}
+
+		while( pages[w] < want && !vfs_cache_contains( drive, at + pages[w] ) ) {
+			pages[w]++;
+		}
+
+		uint64_t pieces = (pages[w] + VFS_DISK_SPLIT_PAGES - 1) / VFS_DISK_SPLIT_PAGES;
+
+		start[w] = at;
+		total = total + pages[w];
+		requests = requests + (pieces > depth ? depth : pieces);
+	}
+
+	uint8_t *buffer = total != 0 ? vfs_malloc( total * VFS_PAGE_SIZE ) : NULL;
+	vfs_disk_request *request = buffer != NULL ? vfs_malloc( sizeof(vfs_disk_request) * requests ) : NULL;
+
+	if( request == NULL ) {
+		if( buffer != NULL ) {
+			vfs_free( buffer );
+		}
+
+		vfs_free( start );
+		return 0;
+	}
+
+	// Pages of a shard written to disk during the reads are left out, the reads may predate the writes
+	uint64_t generation[VFS_CACHE_SHARDS];
+
+	for( uint32_t s = 0; s < VFS_CACHE_SHARDS; s++ ) {
+		generation[s] = vfs_atomic_load( &cache.shard[s].generation );
+	}
+
+	uint64_t r = 0;
+	uint8_t *at_buffer = buffer;
+
+	for( uint32_t w = 0; w < windows; w++ ) {
+		uint64_t pieces = (pages[w] + VFS_DISK_SPLIT_PAGES - 1) / VFS_DISK_SPLIT_PAGES;
+
+		if( pieces > depth ) {
+			pieces = depth;
+		}
+
+		uint64_t per = pieces == 0 ? 0 : (pages[w] + pieces - 1) / pieces;
+
+		for( uint64_t done = 0; done < pages[w]; done = done + per ) {
+			uint64_t n = pages[w] - done < per ? pages[w] - done : per;
+
+			request[r].drive = drive;
+			request[r].offset = (start[w] + done) << VFS_PAGE_SHIFT;
+			request[r].length = n * VFS_PAGE_SIZE;
+			request[r].data = at_buffer + done * VFS_PAGE_SIZE;
+			request[r].write = false;
+			r++;
+		}
+
+		at_buffer = at_buffer + pages[w] * VFS_PAGE_SIZE;
+	}
+
+	vfs_disk_io( request, r );
+
+	uint32_t w = 0;
+	bool full = false;
+
+	for( uint64_t i = 0; i < r && !full; i++ ) {
+		uint64_t index = request[i].offset >> VFS_PAGE_SHIFT;
+		bool window_start = false;
+
+		// Requests are in window order, a window's first one starts where the window does
+		while( w < windows && pages[w] == 0 ) {
+			w++;
+		}
+
+		if( w < windows && index == start[w] ) {
+			window_start = true;
+			w++;
+		}
+
+		if( request[i].result != VFS_ERROR_NONE ) {
+			continue;
+		}
+
+		for( uint64_t j = 0; j < request[i].length >> VFS_PAGE_SHIFT; j++ ) {
+			uint32_t hash = vfs_cache_hash( drive, index + j );
+			vfs_cache_shard *shard = vfs_cache_shard_of( hash );
+			vfs_page *page = vfs_cache_page_new( drive, index + j, true );
+
+			if( page == NULL ) {
+				full = true;
+				break;
+			}
+
+			memcpy( page->data, request[i].data + j * VFS_PAGE_SIZE, VFS_PAGE_SIZE );
+
+			vfs_rwlock_write( &shard->lock );
+
+			if( vfs_atomic_load( &shard->generation ) != generation[shard - cache.shard] ) {
+				vfs_cache_page_free( page );
+			} else if( vfs_cache_insert( shard, page, hash ) == page ) {
+				if( readahead ) {
+					shard->stats.readahead_pages++;
+				} else {
+					vfs_atomic_add( &shard->stats.fills, 1 );
+				}
+
+				inserted++;
+			}
+
+			if( readahead && window_start && j == 0 ) {
+				shard->stats.readahead_windows++;
+			}
+
+			vfs_rwlock_release( &shard->lock );
+		}
+	}
+
+	vfs_free( request );
+	vfs_free( buffer );
+	vfs_free( start );
+
+	return inserted;
+}
+
+/**
+ * @brief Reads count pages from first on drive into the cache, see vfs_cache_read_windows
+ * 
+ * Called by the readahead thread, or straight from the read path when
+ * there is none.
+ * 
+ * @param drive 
+ * @param first 
+ * @param count 
+ * @return uint64_t pages inserted
+ */
+uint64_t vfs_cache_readahead( uint64_t drive, uint64_t first, uint64_t count ) {
+	return vfs_cache_read_windows( drive, &first, &count, 1, true );
+}
+
+/**
+ * @brief Reads several page windows into the cache with their disk reads overlapped, for vectored reads
+ * 
+ * @param drive 
+ * @param first first page of each window
+ * @param count pages in each window
+ * @param windows 
+ * @return uint64_t pages inserted
+ */
+uint64_t vfs_cache_prefetch( uint64_t drive, uint64_t *first, uint64_t *count, uint32_t windows ) {
+	return vfs_cache_read_windows( drive, first, count, windows, false );
+}
+
+/**
+ * @brief Feeds a read of pages first to last to the calling thread's stream table, starting readahead if it's sequential
+ * 
+ * The first sequential read opens a VFS_READAHEAD_MIN_PAGES window past
+ * the read. Once the reader is past the middle of the last window, the next
+ * one goes out, twice as large up to readahead_max.
+ * 
+ * @param drive 
+ * @param first 
+ * @param last 
+ * @return uint64_t window to read in place of a missing page, 0 if the read isn't sequential
+ */
+static uint64_t vfs_readahead_note( uint64_t drive, uint64_t first, uint64_t last ) {
+	vfs_readahead_stream *s = NULL;
+	uint64_t start = 0;
+	uint64_t count = 0;
+
+	for( int i = 0; i < VFS_READAHEAD_STREAMS; i++ ) {
+		vfs_readahead_stream *t = &readahead_stream[i];
+
+		if( t->live && t->drive == drive && first >= t->last && first <= t->last + 1 ) {
+			s = t;
+			break;
+		}
+	}
+
+	if( s == NULL ) {
+		s = &readahead_stream[readahead_stream_next];
+		readahead_stream_next = (readahead_stream_next + 1) % VFS_READAHEAD_STREAMS;
+
+		s->drive = drive;
+		s->last = last;
+		s->ahead = last + 1;
+		s->window = 0;
+		s->live = true;
+
+		return 0;
+	}
+
+	s->last = last;
+
+	if( s->ahead <= last ) {
+		s->ahead = last + 1;
+	}
+
+	if( s->window == 0 || s->ahead - last <= s->window / 2 ) {
+		count = s->window == 0 ? VFS_READAHEAD_MIN_PAGES : s->window * 2;
+
+		if( count > cache.readahead_max ) {
+			count = cache.readahead_max;
+		}
+
+		start = s->ahead;
+		s->ahead = s->ahead + count;
+		s->window = count;
+	}
+
+	if( count != 0 ) {
+		vfs_readahead_queue( drive, start, count );
+	}
+
+	return s->window;
+}
+
+/**
+ * @brief True if the page can take a copy of [start, end) without reading anything in, caller holds its shard lock
+ * 
+ * A read needs the whole range valid. A write only needs its range to touch
+ * or overlap the valid one, so the valid range stays contiguous afterwards.
+ * 
+ * @param page 
+ * @param start 
+ * @param end 
+ * @param write 
+ * @return bool 
+ */
+static inline bool vfs_page_covers( vfs_page *page, uint32_t start, uint32_t end, bool write ) {
+	if( write ) {
+		return page->valid_start == page->valid_end || (start <= page->valid_end && end >= page->valid_start);
+	}
+
+	return start >= page->valid_start && end <= page->valid_end;
+}
+
+/**
+ * @brief Grows the page's valid range to cover [start, end), caller holds its shard lock for writing
+ * 
+ * @param page 
+ * @param start 
+ * @param end 
+ */
+static inline void vfs_page_validate( vfs_page *page, uint32_t start, uint32_t end ) {
+	if( page->valid_start == page->valid_end ) {
+		page->valid_start = start;
+		page->valid_end = end;
+		return;
+	}
+
+	if( start < page->valid_start ) {
+		page->valid_start = start;
+	}
+
+	if( end > page->valid_end ) {
+		page->valid_end = end;
+	}
+}
+
+/**
+ * @brief Finds or inserts a page that can serve [start, end) without further disk reads
+ * 
+ * A missing page is read in whole for a read and allocated empty for a
+ * write. A page that is only partly valid gets just its missing bytes read,
+ * with the shard lock dropped and the page pinned meanwhile. Bytes that became
+ * valid during the read are newer than the drive and are kept.
+ * 
+ * @param drive 
+ * @param index 
+ * @param hash 
+ * @param start 
+ * @param end 
+ * @param write 
+ * @return vfs_page* page with its shard lock held for writing, NULL on failure (lock not held)
+ */
+static vfs_page *vfs_cache_prepare( uint64_t drive, uint64_t index, uint32_t hash, uint32_t start, uint32_t end, bool write ) {
+	vfs_cache_shard *shard = vfs_cache_shard_of( hash );
+
+	vfs_rwlock_write( &shard->lock );
+
+	vfs_page *page = vfs_cache_find( shard, drive, index, hash );
+
+	if( page == NULL ) {
+		vfs_rwlock_release( &shard->lock );
+
+		page = vfs_cache_fill( shard, drive, index, hash, !write );
+
+		if( page == NULL ) {
+			return NULL;
+		}
+	}
+
+	if( vfs_page_covers( page, start, end, write ) ) {
+		return page;
+	}
+
+	uint32_t valid_start = page->valid_start;
+	uint32_t valid_end = page->valid_end;
+	uint64_t base = index << VFS_PAGE_SHIFT;
+
+	page->pins++;
+
+	vfs_rwlock_release( &shard->lock );
+
+	uint8_t *missing = vfs_slab_alloc( &page_data_slab );
+	bool ok = missing != NULL;
+
+	if( ok && valid_start > 0 && !vfs_disk_read_no_cache( drive, base, valid_start, missing ) ) {
+		ok = false;
+	}
+
+	if( ok && valid_end < VFS_PAGE_SIZE && !vfs_disk_read_no_cache( drive, base + valid_end, VFS_PAGE_SIZE - valid_end, missing + valid_end ) ) {
+		ok = false;
+	}
+
+	vfs_rwlock_write( &shard->lock );
+
+	page->pins--;
+
+	// The valid range only grew while the page was pinned, so everything
+	// still outside it was read above
+	if( ok ) {
+		memcpy( page->data, missing, page->valid_start );
+		memcpy( page->data + page->valid_end, missing + page->valid_end, VFS_PAGE_SIZE - page->valid_end );
+
+		page->valid_start = 0;
+		page->valid_end = VFS_PAGE_SIZE;
+		shard->stats.partial_fills++;
+	} else {
+		vfs_rwlock_release( &shard->lock );
+		page = NULL;
+	}
+
+	if( missing != NULL ) {
+		vfs_slab_free( &page_data_slab, missing );
+	}
+
+	return page;
+}
+
+/**
+ * @brief Lends out a whole cached page, reading it in first if needed
+ * 
+ * The page leaves the replacement lists until the last vfs_cache_put_page,
+ * so it can't be evicted and doesn't hold up eviction of the rest of its
+ * shard. Writers still update it in place.
+ * 
+ * @param drive 
+ * @param index page number
+ * @return vfs_page* NULL if the page can't be cached
+ */
+vfs_page *vfs_cache_get_page( uint64_t drive, uint64_t index ) {
+	vfs_page *page = vfs_cache_prepare( drive, index, vfs_cache_hash( drive, index ), 0, VFS_PAGE_SIZE, false );
+
+	if( page == NULL ) {
+		return NULL;
+	}
+
+	vfs_cache_shard *shard = vfs_page_shard( page );
+
+	if( page->refs == 0 ) {
+		vfs_cache_class_remove( shard, page );
+	}
+
+	page->refs++;
+	shard->stats.lends++;
+
+	vfs_rwlock_release( &shard->lock );
+
+	return page;
+}
+
+/**
+ * @brief Gives back a page from vfs_cache_get_page
+ * 
+ * @param page 
+ */
+void vfs_cache_put_page( vfs_page *page ) {
+	vfs_cache_shard *shard = vfs_page_shard( page );
+
+	vfs_rwlock_write( &shard->lock );
+
+	page->refs--;
+
+	if( page->refs == 0 ) {
+		vfs_cache_class_insert( shard, page );
+	}
+
+	vfs_rwlock_release( &shard->lock );
+}
+
+/**
+ * @brief Copies size bytes at addr on drive into data, reading in missing pages
+ * 
+ * @param drive 
+ * @param addr 
+ * @param size 
+ * @param data 
+ * 
+ * @return true if every byte came through the cache
+ */
+bool vfs_cache_read( uint64_t drive, uint64_t addr, uint64_t size, uint8_t *data ) {
+	uint64_t start = vfs_metrics_start();
+	uint64_t done = 0;
+	uint64_t window = 0;
+	bool missed = false;
+	bool counted = false;		// this page's miss was counted before its readahead
+
+	if( size != 0 && cache.readahead_max != 0 ) {
+		window = vfs_readahead_note( drive, addr >> VFS_PAGE_SHIFT, (addr + size - 1) >> VFS_PAGE_SHIFT );
+	}
+
+	while( done < size ) {
+		uint64_t index = (addr + done) >> VFS_PAGE_SHIFT;
+		uint32_t offset = (addr + done) & (VFS_PAGE_SIZE - 1);
+		uint64_t len = VFS_PAGE_SIZE - offset;
+		uint32_t hash = vfs_cache_hash( drive, index );
+		vfs_cache_shard *shard = vfs_cache_shard_of( hash );
+
+		if( len > size - done ) {
+			len = size - done;
+		}
+
+		vfs_rwlock_read( &shard->lock );
+
+		vfs_page *page = vfs_cache_find( shard, drive, index, hash );
+
+		if( page != NULL && vfs_page_covers( page, offset, offset + len, false ) ) {
+			if( !counted ) {
+				vfs_atomic_add( &shard->stats.hits, 1 );
+			}
+
+			vfs_cache_touch( page );
+		} else if( page == NULL && window != 0 ) {
+			// A sequential reader got ahead of readahead, it waits for the
+			// whole window instead of one page
+			vfs_atomic_add( &shard->stats.misses, 1 );
+			vfs_rwlock_release( &shard->lock );
+
+			if( !missed && start == 0 ) {
+				start = vfs_now_ns();
+			}
+
+			vfs_cache_readahead( drive, index, window );
+			window = 0;
+			missed = true;
+			counted = true;
+			continue;
+		} else {
+			if( !counted ) {
+				vfs_atomic_add( &shard->stats.misses, 1 );
+			}
+
+			vfs_rwlock_release( &shard->lock );
+
+			if( !missed && start == 0 ) {
+				start = vfs_now_ns();
+			}
+
+			page = vfs_cache_prepare( drive, index, hash, offset, offset + len, false );
+			missed = true;
+
+			if( page == NULL ) {
+				return false;
+			}
+		}
+
+		memcpy( data + done, page->data + offset, len );
+		vfs_atomic_add( &page->read_count, 1 );
+
+		vfs_rwlock_release( &shard->lock );
+
+		done = done + len;
+		counted = false;
+	}
+
+	vfs_atomic_add( &vfs_cache_shard_at( drive, addr )->stats.bytes_out, size );
+	vfs_metrics_record( missed ? VFS_METRIC_MISS : VFS_METRIC_HIT, size, start );
+
+	return true;
+}
+
+/**
+ * @brief Dirty pages in all shards, read without taking their locks
+ * 
+ * @return uint64_t 
+ */
+static uint64_t vfs_cache_dirty_pages( void ) {
+	uint64_t dirty = 0;
+
+	for( int i = 0; i < VFS_CACHE_SHARDS; i++ ) {
+		dirty = dirty + vfs_atomic_load( &cache.shard[i].dirty );
+	}
+
+	return dirty;
+}
+
+/**
+ * @brief Writes size bytes from data into the cached pages at addr on drive
+ * 
+ * Follows the write policy of the mount in the caller's hint. Under write
+ * back pages are marked dirty and reach the disk when flushed. A write to an
+ * uncached page doesn't read it in, only the written bytes become valid.
+ * 
+ * Write through and write around put the data on the disk first and leave
+ * the pages clean, so a page filled meanwhile is corrected after. Write
+ * around only updates pages that are already cached. Under a vfs_disk_plug
+ * write through is held as dirty pages until the unplug instead.
+ * 
+ * @param drive 
+ * @param addr 
+ * @param size 
+ * @param data 
+ * 
+ * @return true if every byte was written to the cache or past it to the disk, false otherwise
+ */
+bool vfs_cache_write( uint64_t drive, uint64_t addr, uint64_t size, uint8_t *data ) {
+	uint8_t policy = vfs_get_write_policy( io_hint.fs_id );
+	uint64_t start = vfs_metrics_start();
+	uint64_t done = 0;
+	bool missed = false;
+	bool held = policy == VFS_WRITE_THROUGH && vfs_disk_plug_hold( drive, addr, size );
+
+	if( policy != VFS_WRITE_BACK && !held ) {
+		if( !vfs_disk_write_no_cache( drive, addr, size, data ) ) {
+			return false;
+		}
+
+		vfs_cache_changed( drive, addr, size );
+	}
+
+	while( done < size ) {
+		uint64_t index = (addr + done) >> VFS_PAGE_SHIFT;
+		uint32_t offset = (addr + done) & (VFS_PAGE_SIZE - 1);
+		uint64_t len = VFS_PAGE_SIZE - offset;
+		uint32_t hash = vfs_cache_hash( drive, index );
+		vfs_cache_shard *shard = vfs_cache_shard_of( hash );
+
+		if( len > size - done ) {
+			len = size - done;
+		}
+
+		vfs_rwlock_write( &shard->lock );
+
+		vfs_page *page = vfs_cache_find( shard, drive, index, hash );
+
+		if( page != NULL && vfs_page_covers( page, offset, offset + len, true ) ) {
+			vfs_atomic_add( &shard->stats.hits, 1 );
+			vfs_cache_touch( page );
+		} else if( page == NULL && policy == VFS_WRITE_AROUND ) {
+			vfs_atomic_add( &shard->stats.misses, 1 );
+			vfs_rwlock_release( &shard->lock );
+
+			missed = true;
+			done = done + len;
+			continue;
+		} else {
+			vfs_atomic_add( &shard->stats.misses, 1 );
+			vfs_rwlock_release( &shard->lock );
+
+			if( !missed && start == 0 ) {
+				start = vfs_now_ns();
+			}
+
+			page = vfs_cache_prepare( drive, index, hash, offset, offset + len, true );
+			missed = true;
+
+			if( page == NULL ) {
+				return false;
+			}
+		}
+
+		memcpy( page->data + offset, data + done, len );
+		vfs_page_validate( page, offset, offset + len );
+		page->write_count++;
+
+		// A page dirtied for two inodes is no longer any one file's
+		inode_id inode = page->dirty && page->owner.inode != io_hint.inode ? 0 : io_hint.inode;
+
+		page->owner = io_hint;
+		page->owner.inode = inode;
+
+		if( !page->dirty && (policy == VFS_WRITE_BACK || held) ) {
+			page->dirty = true;
+			page->dirty_epoch = vfs_atomic_load( &cache.epoch );
+			vfs_atomic_inc( &shard->dirty );
+		}
+
+		vfs_rwlock_release( &shard->lock );
+
+		done = done + len;
+	}
+
+	vfs_atomic_add( &vfs_cache_shard_at( drive, addr )->stats.bytes_in, size );
+	vfs_metrics_record( missed ? VFS_METRIC_MISS : VFS_METRIC_HIT, size, start );
+
+	if( policy == VFS_WRITE_THROUGH && !held ) {
+		vfs_disk_sync( drive );
+	}
+
+	// Held pages go out at the unplug, the plug bounds how many there are
+	if( policy != VFS_WRITE_BACK ) {
+		return true;
+	}
+
+	// Past the hard limit the writer pays for write back itself, past the
+	// background limit the flusher is told to start early
+	uint64_t dirty_percent = vfs_cache_dirty_pages() * 100 / vfs_atomic_load( &cache.max_pages );
+
+	if( dirty_percent >= VFS_DIRTY_RATIO ) {
+		vfs_cache_writeback( 0, VFS_FLUSH_BATCH_PAGES );
+	} else if( dirty_percent >= VFS_DIRTY_BACKGROUND_RATIO ) {
+		vfs_flusher_wake();
+	}
+
+	return true;
+}
+
+/**
+ * @brief Writes a dirty page out to disk, caller holds its shard lock for writing
+ * 
+ * @param page 
+ * @return true Successful flush
+ * @return false Flush failure, the page is left dirty
+ */
+bool vfs_cache_flush( vfs_page *page ) {
+	if( page->dirty == true ) {
+		vfs_io_hint hint = vfs_io_hint_set( page->owner.fs_id, page->owner.io_class, page->owner.cache_class, page->owner.inode );
+
+		bool ok = vfs_disk_write_no_cache( page->drive, (page->index << VFS_PAGE_SHIFT) + page->valid_start, page->valid_end - page->valid_start, page->data + page->valid_start );
+
+		vfs_io_hint_restore( hint );
+
+		if( !ok ) {
+			return false;
+		}
+
+		vfs_cache_shard *shard = vfs_page_shard( page );
+
+		page->dirty = false;
+		vfs_atomic_dec( &shard->dirty );
+		vfs_atomic_inc( &shard->generation );
+		shard->stats.writebacks++;
+	}
+
+	return true;
+}
+
+/**
+ * @brief True if page a comes before page b on disk
+ * 
+ * @param a 
+ * @param b 
+ * @return bool 
+ */
+static inline bool vfs_page_before( vfs_page *a, vfs_page *b ) {
+	return a->drive < b->drive || (a->drive == b->drive && a->index < b->index);
+}
+
+/**
+ * @brief Sifts pages[root] down a max heap of end pages
+ * 
+ * @param pages 
+ * @param root 
+ * @param end 
+ */
+static void vfs_page_sift( vfs_page **pages, uint64_t root, uint64_t end ) {
+	while( root * 2 + 1 < end ) {
+		uint64_t child = root * 2 + 1;
+
+		if( child + 1 < end && vfs_page_before( pages[child], pages[child + 1] ) ) {
+			child++;
+		}
+
+		if( !vfs_page_before( pages[root], pages[child] ) ) {
+			return;
+		}
+
+		vfs_page *swap = pages[root];
+		pages[root] = pages[child];
+		pages[child] = swap;
+		root = child;
+	}
+}
+
+/**
+ * @brief Sorts pages by (drive, page number), heapsort since there's no qsort in the kernel
+ * 
+ * @param pages 
+ * @param count 
+ */
+static void vfs_page_sort( vfs_page **pages, uint64_t count ) {
+	for( uint64_t start = count / 2; start > 0; start-- ) {
+		vfs_page_sift( pages, start - 1, count );
+	}
+
+	for( uint64_t end = count; end > 1; end-- ) {
+		vfs_page *swap = pages[0];
+		pages[0] = pages[end - 1];
+		pages[end - 1] = swap;
+
+		vfs_page_sift( pages, 0, end - 1 );
+	}
+}
+
+/**
+ * @brief Reverses pages[first] to pages[end - 1]
+ * 
+ * @param pages 
+ * @param first 
+ * @param end 
+ */
+static void vfs_page_reverse( vfs_page **pages, uint64_t first, uint64_t end ) {
+	while( first + 1 < end ) {
+		vfs_page *swap = pages[first];
+		pages[first] = pages[end - 1];
+		pages[end - 1] = swap;
+
+		first++;
+		end--;
+	}
+}
+
+/**
+ * @brief Sorts pages into C-LOOK order, each drive's sweep starting at the first gap at or past its head
+ * 
+ * Rotating only at a gap between pages keeps every run of neighbours whole,
+ * so it still goes out as one write.
+ * 
+ * @param pages 
+ * @param count 
+ */
+static void vfs_page_sort_clook( vfs_page **pages, uint64_t count ) {
+	vfs_page_sort( pages, count );
+
+	for( uint64_t first = 0; first < count; ) {
+		uint64_t drive = pages[first]->drive;
+		uint64_t head = vfs_disk_head( drive ) >> VFS_PAGE_SHIFT;
+		uint64_t end = first;
+		uint64_t turn = 0;
+
+		while( end < count && pages[end]->drive == drive ) {
+			if( turn == 0 && end > first && pages[end]->index >= head && pages[end]->index != pages[end - 1]->index + 1 ) {
+				turn = end;
+			}
+
+			end++;
+		}
+
+		// Rotate left so turn comes first
+		if( turn != 0 ) {
+			vfs_page_reverse( pages, first, turn );
+			vfs_page_reverse( pages, turn, end );
+			vfs_page_reverse( pages, first, end );
+		}
+
+		first = end;
+	}
+}
+
+/**
+ * @brief True if page has to go out with a write back for only's inode
+ * 
+ * Pages owned by no one inode on only's mount go too, see vfs_fsync.
+ * 
+ * @param page 
+ * @param only NULL for every page
+ * @return bool 
+ */
+static inline bool vfs_page_written_for( vfs_page *page, vfs_io_hint *only ) {
+	return only == NULL || (page->owner.fs_id == only->fs_id && (page->owner.inode == only->inode || page->owner.inode == 0));
+}
+
+/**
+ * @brief Waits for a run's write and takes its pages out of writeback
+ * 
+ * The pages of a run whose write failed are dirtied again, the cache still
+ * holds the only copy of their data.
+ * 
+ * @param pages 
+ * @param first first page of the run in pages
+ * @param end one past its last
+ * @param request the run's write
+ * @param written add the run's pages to if it was written
+ * @return int VFS_ERROR_NONE if the run was written, otherwise VFS_ERROR_
+ */
+static int vfs_cache_writeback_done( vfs_page **pages, uint64_t first, uint64_t end, vfs_disk_request *request, uint64_t *written ) {
+	int result = vfs_disk_wait( request );
+
+	if( result == VFS_ERROR_NONE ) {
+		*written = *written + (end - first);
+	}
+
+	for( uint64_t k = first; k < end; k++ ) {
+		vfs_cache_shard *shard = vfs_page_shard( pages[k] );
+
+		vfs_rwlock_write( &shard->lock );
+
+		pages[k]->writeback = false;
+
+		if( result != VFS_ERROR_NONE ) {
+			if( !pages[k]->dirty ) {
+				pages[k]->dirty = true;
+				vfs_atomic_inc( &shard->dirty );
+			}
+		} else {
+			vfs_atomic_inc( &shard->generation );
+			shard->stats.writebacks++;
+
+			if( k == first ) {
+				shard->stats.flush_writes++;
+			}
+		}
+
+		vfs_rwlock_release( &shard->lock );
+	}
+
+	return result;
+}
+
+/**
+ * @brief Writes pages marked writeback out in the order given, merging neighbours into single large writes
+ * 
+ * A run of adjacent pages, whose valid bytes join up, is copied out page by
+ * page under each page's shard lock and written with one disk write after,
+ * so readers and writers carry on during the I/O. Up to
+ * vfs_disk_queue_depth runs are in flight at once, each with its own
+ * buffer. A page dirtied again during its write is left dirty for the next
+ * pass, so is every page of a run that failed. Caller holds flush_lock so
+ * an older copy of a page never lands after a newer one.
+ * 
+ * @param pages 
+ * @param count 
+ * @param written set to the pages written, failed runs aren't counted
+ * @return int VFS_ERROR_NONE, otherwise the first failed run's VFS_ERROR_, VFS_ERROR_MEMORY with every page taken back out of writeback if there's no memory for the runs
+ */
+static int vfs_cache_write_pages( vfs_page **pages, uint64_t count, uint64_t *written ) {
+	int result = VFS_ERROR_NONE;
+	uint32_t depth = vfs_disk_queue_depth();
+	uint8_t *run = count != 0 ? vfs_malloc( depth * cache.flush_run_pages * VFS_PAGE_SIZE ) : NULL;
+	vfs_disk_request *requests = run != NULL ? vfs_malloc( (sizeof(vfs_disk_request) + sizeof(uint64_t) * 2) * depth ) : NULL;
+
+	*written = 0;
+
+	if( count == 0 ) {
+		return VFS_ERROR_NONE;
+	}
+
+	if( requests == NULL ) {
+		for( uint64_t i = 0; i < count; i++ ) {
+			vfs_cache_shard *shard = vfs_page_shard( pages[i] );
+
+			vfs_rwlock_write( &shard->lock );
+			pages[i]->writeback = false;
+			vfs_rwlock_release( &shard->lock );
+		}
+
+		if( run != NULL ) {
+			vfs_free( run );
+		}
+
+		return VFS_ERROR_MEMORY;
+	}
+
+	// First and one past the last page in pages of the run each request writes
+	uint64_t *spans = (uint64_t *)(requests + depth);
+	uint64_t issued = 0;
+	uint64_t finished = 0;
+
+	for( uint64_t i = 0; i < count; ) {
+		uint64_t j = i;
+		uint32_t head = 0;
+		uint32_t tail = 0;
+		vfs_io_hint owner = { 0, VFS_IO_CLASS_OTHER, VFS_CACHE_CLASS_NORMAL, 0 };
+		uint32_t slot = issued % depth;
+
+		// The oldest run in flight is in this slot, its buffer is free once it's done
+		if( issued - finished == depth ) {
+			int done = vfs_cache_writeback_done( pages, spans[slot * 2], spans[slot * 2 + 1], &requests[slot], written );
+
+			result = result != VFS_ERROR_NONE ? result : done;
+			finished++;
+		}
+
+		uint8_t *buffer = run + (uint64_t)slot * cache.flush_run_pages * VFS_PAGE_SIZE;
+
+		// Only valid bytes go out, the rest of a page may not mirror the drive
+		while( j < count && j - i < cache.flush_run_pages ) {
+			vfs_page *page = pages[j];
+
+			if( j > i && (page->drive != pages[i]->drive || page->index != pages[j - 1]->index + 1 || tail != VFS_PAGE_SIZE) ) {
+				break;
+			}
+
+			vfs_cache_shard *shard = vfs_page_shard( page );
+
+			vfs_rwlock_write( &shard->lock );
+
+			if( j > i && page->valid_start != 0 ) {
+				vfs_rwlock_release( &shard->lock );
+				break;
+			}
+
+			if( j == i ) {
+				head = page->valid_start;
+				owner = page->owner;
+			}
+
+			tail = page->valid_end;
+			memcpy( buffer + (j - i) * VFS_PAGE_SIZE + page->valid_start, page->data + page->valid_start, page->valid_end - page->valid_start );
+
+			if( page->dirty ) {
+				page->dirty = false;
+				vfs_atomic_dec( &shard->dirty );
+			}
+
+			vfs_rwlock_release( &shard->lock );
+
+			j++;
+		}
+
+		uint64_t length = (j - i - 1) * VFS_PAGE_SIZE + tail - head;
+
+		// A run is counted for its first page's owner
+		vfs_io_hint hint = vfs_io_hint_set( owner.fs_id, owner.io_class, owner.cache_class, owner.inode );
+
+		requests[slot].drive = pages[i]->drive;
+		requests[slot].offset = (pages[i]->index << VFS_PAGE_SHIFT) + head;
+		requests[slot].length = length;
+		requests[slot].data = buffer + head;
+		requests[slot].write = true;
+		spans[slot * 2] = i;
+		spans[slot * 2 + 1] = j;
+
+		vfs_disk_submit( &requests[slot] );
+
+		vfs_io_hint_restore( hint );
+
+		issued++;
+		i = j;
+	}
+
+	for( ; finished < issued; finished++ ) {
+		uint32_t slot = finished % depth;
+
+		int done = vfs_cache_writeback_done( pages, spans[slot * 2], spans[slot * 2 + 1], &requests[slot], written );
+
+		result = result != VFS_ERROR_NONE ? result : done;
+	}
+
+	vfs_free( requests );
+	vfs_free( run );
+
+	return result;
+}
+
+/**
+ * @brief Writes back dirty pages, merging neighbours into single large writes
+ * 
+ * Eligible pages are marked writeback shard by shard and put in C-LOOK
+ * order, the first limit of them are written by vfs_cache_write_pages.
+ * Passes are serialized by flush_lock.
+ * 
+ * @param min_age only pages dirty for at least this many flusher ticks
+ * @param limit most pages to write back
+ * @param only fs id and inode to write back for, NULL for every page
+ * @param written set to the pages written
+ * @return int VFS_ERROR_NONE, otherwise VFS_ERROR_ with the pages that couldn't be written left dirty
+ */
+static int vfs_cache_writeback_for( uint64_t min_age, uint64_t limit, vfs_io_hint *only, uint64_t *written ) {
+	uint64_t count = 0;
+
+	*written = 0;
+
+	vfs_lock_acquire( &flush_lock );
+
+	// Pages dirtied after this are left for the next pass
+	uint64_t dirty = vfs_cache_dirty_pages();
+	uint64_t epoch = vfs_atomic_load( &cache.epoch );
+
+	if( dirty == 0 || limit == 0 ) {
+		vfs_lock_release( &flush_lock );
+		return VFS_ERROR_NONE;
+	}
+
+	vfs_page **pages = vfs_malloc( sizeof(vfs_page *) * dirty );
+
+	if( pages == NULL ) {
+		vfs_lock_release( &flush_lock );
+		return VFS_ERROR_MEMORY;
+	}
+
+	for( int s = 0; s < VFS_CACHE_SHARDS && count < dirty; s++ ) {
+		vfs_cache_shard *shard = &cache.shard[s];
+
+		vfs_rwlock_write( &shard->lock );
+
+		for( uint32_t i = 0; i < (1U << shard->bits) && count < dirty; i++ ) {
+			for( vfs_page *page = shard->bucket[i]; page != NULL && count < dirty; page = page->hash_next ) {
+				if( page->dirty && !page->writeback && epoch - page->dirty_epoch >= min_age && vfs_page_written_for( page, only ) ) {
+					page->writeback = true;
+					pages[count++] = page;
+				}
+			}
+		}
+
+		vfs_rwlock_release( &shard->lock );
+	}
+
+	// Sorting everything before cutting at limit keeps each pass's runs whole
+	vfs_page_sort_clook( pages, count );
+
+	for( uint64_t i = limit; i < count; i++ ) {
+		vfs_cache_shard *shard = vfs_page_shard( pages[i] );
+
+		vfs_rwlock_write( &shard->lock );
+		pages[i]->writeback = false;
+		vfs_rwlock_release( &shard->lock );
+	}
+
+	if( count > limit ) {
+		count = limit;
+	}
+
+	int result = vfs_cache_write_pages( pages, count, written );
+
+	vfs_lock_release( &flush_lock );
+
+	vfs_free( pages );
+
+	return result;
+}
+
+/**
+ * @brief Holds a write through write in the calling thread's plug
+ * 
+ * The range is merged into one the plug already holds when they overlap or
+ * touch. A full plug is written out first, so a plug never holds more than
+ * VFS_DISK_PLUG_RANGES ranges.
+ * 
+ * @param drive 
+ * @param addr 
+ * @param size 
+ * @return bool true if the plug took it, the caller marks its pages dirty, false if the thread isn't plugged
+ */
+static bool vfs_disk_plug_hold( uint64_t drive, uint64_t addr, uint64_t size ) {
+	vfs_disk_plug_state *plug = &disk_plug;
+
+	if( plug->depth == 0 || size == 0 || drive >= VFS_MAX_DRIVES ) {
+		return false;
+	}
+
+	uint64_t first = addr >> VFS_PAGE_SHIFT;
+	uint64_t last = (addr + size - 1) >> VFS_PAGE_SHIFT;
+
+	plug->sync[drive] = true;
+
+	for( uint32_t i = 0; i < plug->count; i++ ) {
+		vfs_disk_plug_range *r = &plug->range[i];
+
+		if( r->drive == drive && first <= r->last + 1 && last + 1 >= r->first ) {
+			r->first = first < r->first ? first : r->first;
+			r->last = last > r->last ? last : r->last;
+
+			return true;
+		}
+	}
+
+	if( plug->count == VFS_DISK_PLUG_RANGES ) {
+		int flushed = vfs_disk_plug_flush( plug );
+
+		if( plug->error == VFS_ERROR_NONE ) {
+			plug->error = flushed;
+		}
+
+		plug->sync[drive] = true;
+	}
+
+	plug->range[plug->count].drive = drive;
+	plug->range[plug->count].first = first;
+	plug->range[plug->count].last = last;
+	plug->count++;
+
+	return true;
+}
+
+/**
+ * @brief Writes out the pages a plug holds in C-LOOK order and syncs the drives that need it
+ * 
+ * Without memory to sort them in, each page goes out on its own in the
+ * order the plug holds them. Pages that fail to write stay dirty.
+ * 
+ * @param plug 
+ * @return int VFS_ERROR_NONE, otherwise the first VFS_ERROR_ a write returned
+ */
+static int vfs_disk_plug_flush( vfs_disk_plug_state *plug ) {
+	uint64_t total = 0;
+
+	for( uint32_t i = 0; i < plug->count; i++ ) {
+		total = total + plug->range[i].last - plug->range[i].first + 1;
+	}
+
+	vfs_page **pages = total != 0 ? vfs_malloc( sizeof(vfs_page *) * total ) : NULL;
+	uint64_t count = 0;
+	uint64_t written = 0;
+	int result = VFS_ERROR_NONE;
+
+	vfs_lock_acquire( &flush_lock );
+
+	// A page cleaned or evicted since went out already, the flusher or eviction wrote it
+	for( uint32_t i = 0; i < plug->count; i++ ) {
+		for( uint64_t index = plug->range[i].first; index <= plug->range[i].last; index++ ) {
+			uint32_t hash = vfs_cache_hash( plug->range[i].drive, index );
+			vfs_cache_shard *shard = vfs_cache_shard_of( hash );
+
+			vfs_rwlock_write( &shard->lock );
+
+			vfs_page *page = vfs_cache_find( shard, plug->range[i].drive, index, hash );
+
+			bool held = page != NULL && page->dirty && !page->writeback;
+
+			if( held ) {
+				page->writeback = true;
+			}
+
+			if( held && pages != NULL ) {
+				pages[count++] = page;
+			}
+
+			vfs_rwlock_release( &shard->lock );
+
+			if( held && pages == NULL ) {
+				int one = vfs_cache_write_pages( &page, 1, &written );
+
+				if( result == VFS_ERROR_NONE ) {
+					result = one;
+				}
+			}
+		}
+	}
+
+	vfs_page_sort_clook( pages, count );
+
+	int sorted = vfs_cache_write_pages( pages, count, &written );
+
+	if( result == VFS_ERROR_NONE ) {
+		result = sorted;
+	}
+
+	vfs_lock_release( &flush_lock );
+
+	if( pages != NULL ) {
+		vfs_free( pages );
+	}
+
+	for( uint64_t drive = 0; drive < VFS_MAX_DRIVES; drive++ ) {
+		if( plug->sync[drive] ) {
+			vfs_disk_sync( drive );
+			plug->sync[drive] = false;
+		}
+	}
+
+	plug->count = 0;
+
+	return result;
+}
+
+/**
+ * @brief Starts holding the calling thread's write through writes, plugs nest
+ * 
+ * Until the outermost vfs_disk_unplug those writes go into the cache as
+ * dirty pages instead of to the disk, so other readers see them and a
+ * page evicted meanwhile is written first. The unplug writes them out
+ * sorted, merged and in C-LOOK order, with one sync per drive. A file
+ * system operation's scattered small writes, like a create's block, meta
+ * data, directory and drive header, go out as a few large ones. Write back
+ * isn't affected, the flusher already merges its pages, and neither is
+ * write around, holding it would bring its pages into the cache.
+ */
+void vfs_disk_plug( void ) {
+	disk_plug.depth++;
+}
+
+/**
+ * @brief Ends a vfs_disk_plug, the outermost one writes out what it held
+ * 
+ * The write through writes it held only reach the disk here, so callers
+ * report a failure in place of what they wrote.
+ * 
+ * @return int VFS_ERROR_NONE, otherwise the first VFS_ERROR_ writing out the plug returned
+ */
+int vfs_disk_unplug( void ) {
+	if( disk_plug.depth == 0 ) {
+		return VFS_ERROR_NONE;
+	}
+
+	disk_plug.depth--;
+
+	if( disk_plug.depth != 0 ) {
+		return VFS_ERROR_NONE;
+	}
+
+	int result = disk_plug.error;
+
+	disk_plug.error = VFS_ERROR_NONE;
+
+	if( disk_plug.count != 0 ) {
+		int flushed = vfs_disk_plug_flush( &disk_plug );
+
+		if( result == VFS_ERROR_NONE ) {
+			result = flushed;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Writes back dirty pages, see vfs_cache_writeback_for
+ * 
+ * Pages that fail to write stay dirty for a later pass, vfs_cache_flush_all
+ * and vfs_fsync report the error.
+ * 
+ * @param min_age only pages dirty for at least this many flusher ticks
+ * @param limit most pages to write back
+ * @return uint64_t pages written
+ */
+uint64_t vfs_cache_writeback( uint64_t min_age, uint64_t limit ) {
+	uint64_t written = 0;
+
+	vfs_cache_writeback_for( min_age, limit, NULL, &written );
+
+	return written;
+}
+
+/**
+ * @brief Writes back dirty pages in batches until a pass writes nothing
+ * 
+ * A failed write doesn't stop it, the rest still go out.
+ * 
+ * @param only fs id and inode to write back for, NULL for every page
+ * @return int VFS_ERROR_NONE, otherwise the first failed pass's VFS_ERROR_
+ */
+static int vfs_cache_writeback_all( vfs_io_hint *only ) {
+	int result = VFS_ERROR_NONE;
+	uint64_t written = 0;
+
+	do {
+		int pass = vfs_cache_writeback_for( 0, VFS_FLUSH_BATCH_PAGES, only, &written );
+
+		result = result != VFS_ERROR_NONE ? result : pass;
+	} while( written != 0 && vfs_cache_dirty_pages() != 0 );
+
+	return result;
+}
+
+/**
+ * @brief Flush all dirty pages to disk
+ * 
+ * @return int VFS_ERROR_NONE, otherwise VFS_ERROR_ with the pages that couldn't be written left dirty
+ */
+int vfs_cache_flush_all( void ) {
+	return vfs_cache_writeback_all( NULL );
+}
+
+/**
+ * @brief One flusher pass, called every VFS_FLUSH_INTERVAL_MS
+ * 
+ * Writes back pages that have been dirty for VFS_DIRTY_EXPIRE_TICKS, or
+ * everything while more than VFS_DIRTY_BACKGROUND_RATIO percent of the cache
+ * is dirty. The host build runs it from the flusher thread, the kernel from
+ * its timer.
+ */
+void vfs_flush_tick( void ) {
+	vfs_atomic_add( &cache.epoch, 1 );
+
+	while( vfs_cache_dirty_pages() * 100 / vfs_atomic_load( &cache.max_pages ) >= VFS_DIRTY_BACKGROUND_RATIO ) {
+		if( vfs_cache_writeback( 0, VFS_FLUSH_BATCH_PAGES ) == 0 ) {
+			return;
+		}
+	}
+
+	while( vfs_cache_writeback( VFS_DIRTY_EXPIRE_TICKS, VFS_FLUSH_BATCH_PAGES ) == VFS_FLUSH_BATCH_PAGES );
+}
+
+/**
+ * @brief Flushes every registered drive, drive 0 even when nothing registered it
+ * 
+ */
+static void vfs_disk_sync_all( void ) {
+	uint32_t count = vfs_atomic_load( &blockdev_count );
+
+	for( uint32_t drive = 0; drive == 0 || drive < count; drive++ ) {
+		vfs_disk_sync( drive );
+	}
+}
+
+/**
+ * @brief Writes every dirty page back and flushes the drives, a barrier for callers
+ * 
+ * @return int VFS_ERROR_NONE on success, otherwise the write back's VFS_ERROR_
+ */
+int vfs_sync( void ) {
+	int result = vfs_cache_flush_all();
+
+	vfs_disk_sync_all();
+
+	return result;
+}
+
+/**
+ * @brief Writes a file's dirty data and metadata to the disk and syncs the drive
+ * 
+ * Pages are found by the inode their writer's hint named. A page written
+ * for more than one inode since it was last clean, like a block of
+ * shared metadata, goes out with any of them, so does one written for the
+ * mount itself. That's intended, the file's metadata may be on those pages
+ * and fsync has to make it durable too, at the cost of writing some that
+ * belong to other files on the same mount.
+ * 
+ * @param id 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_, the pages that couldn't be written are left dirty
+ */
+int vfs_fsync( inode_id id ) {
+	vfs_inode *node = vfs_inode_get_by_id( id );
+
+	if( node == NULL ) {
+		return VFS_ERROR_FILE_NOT_FOUND;
+	}
+
+	// Ids the vfs hands out, like RFS files' and mount points', don't carry the fs id
+	vfs_io_hint only = { node->fs_id, VFS_IO_CLASS_OTHER, VFS_CACHE_CLASS_NORMAL, id };
+
+	vfs_inode_put( node );
+
+	int result = vfs_cache_writeback_all( &only );
+
+	// The mount's drive isn't known here, its pages may have gone to any of them
+	vfs_disk_sync_all();
+
+	return result;
+}
+
+/**
+ * @brief Sets the page cache memory budget, evicting right away if it's now over
+ * 
+ * Each shard gets an even part of it and evicts on its own, so one shard
+ * can be full while others have room.
+ * 
+ * @param bytes page data to keep at most, rounded down to whole pages
+ */
+void vfs_cache_set_limit( uint64_t bytes ) {
+	uint64_t pages = bytes / VFS_PAGE_SIZE;
+
+	if( pages < VFS_PAGE_CACHE_MIN_PAGES ) {
+		pages = VFS_PAGE_CACHE_MIN_PAGES;
+	}
+
+	vfs_atomic_store( &cache.max_pages, pages );
+
+	for( int i = 0; i < VFS_CACHE_SHARDS; i++ ) {
+		vfs_cache_shard *shard = &cache.shard[i];
+
+		vfs_rwlock_write( &shard->lock );
+
+		shard->max_pages = vfs_cache_shard_budget( pages, i );
+
+		while( shard->count > shard->max_pages && vfs_cache_evict( shard ) );
+
+		vfs_rwlock_release( &shard->lock );
+	}
+}
+
+/**
+ * @brief Switches the replacement policy, cached pages are handed over to the new one
+ * 
+ * Every shard is locked, in order, for the switch, hits read the policy
+ * under their shard's lock.
+ * 
+ * @param policy VFS_CACHE_POLICY_
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
+ */
+int vfs_cache_set_policy( uint8_t policy ) {
+	if( policy >= VFS_CACHE_POLICY_MAX ) {
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	for( int i = 0; i < VFS_CACHE_SHARDS; i++ ) {
+		vfs_rwlock_write( &cache.shard[i].lock );
+	}
+
+	vfs_cache_policy *old = cache.policy;
+
+	if( old != &cache_policies[policy] ) {
+		cache.policy = &cache_policies[policy];
+
+		for( int s = 0; s < VFS_CACHE_SHARDS; s++ ) {
+			vfs_cache_shard *shard = &cache.shard[s];
+
+			for( uint32_t i = 0; i < (1U << shard->bits); i++ ) {
+				for( vfs_page *page = shard->bucket[i]; page != NULL; page = page->hash_next ) {
+					if( page->cache_class == VFS_CACHE_CLASS_NORMAL && page->refs == 0 ) {
+						old->remove( shard, page );
+						cache.policy->insert( shard, page );
+					}
+				}
+			}
+		}
+	}
+
+	for( int i = VFS_CACHE_SHARDS - 1; i >= 0; i-- ) {
+		vfs_rwlock_release( &cache.shard[i].lock );
+	}
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Gets the page cache, for its settings
+ * 
+ * @return vfs_page_cache* 
+ */
+vfs_page_cache *vfs_cache_get( void ) {
+	return &cache;
+}
+
+/**
+ * @brief Adds up the counters of every shard
+ * 
+ * @param sum filled in with the totals and the page and dirty page gauges
+ */
+void vfs_cache_sum( vfs_cache_counters *sum ) {
+	memset( sum, 0, sizeof(vfs_cache_counters) );
+
+	for( int i = 0; i < VFS_CACHE_SHARDS; i++ ) {
+		vfs_cache_shard *shard = &cache.shard[i];
+		vfs_cache_counters *from = &shard->stats;
+
+		vfs_rwlock_read( &shard->lock );
+
+		sum->pages = sum->pages + shard->count;
+		sum->dirty = sum->dirty + vfs_atomic_load( &shard->dirty );
+		sum->pinned = sum->pinned + shard->pinned_count;
+		sum->streaming = sum->streaming + shard->stream_count;
+		sum->hits = sum->hits + vfs_atomic_load( &from->hits );
+		sum->misses = sum->misses + vfs_atomic_load( &from->misses );
+		sum->evictions = sum->evictions + from->evictions;
+		sum->dirty_evictions = sum->dirty_evictions + from->dirty_evictions;
+		sum->promotions = sum->promotions + from->promotions;
+		sum->lends = sum->lends + from->lends;
+		sum->fills = sum->fills + vfs_atomic_load( &from->fills );
+		sum->partial_fills = sum->partial_fills + from->partial_fills;
+		sum->write_allocs = sum->write_allocs + vfs_atomic_load( &from->write_allocs );
+		sum->writebacks = sum->writebacks + from->writebacks;
+		sum->flush_writes = sum->flush_writes + from->flush_writes;
+		sum->readahead_windows = sum->readahead_windows + from->readahead_windows;
+		sum->readahead_pages = sum->readahead_pages + from->readahead_pages;
+		sum->bytes_out = sum->bytes_out + vfs_atomic_load( &from->bytes_out );
+		sum->bytes_in = sum->bytes_in + vfs_atomic_load( &from->bytes_in );
+		sum->disk_read_calls = sum->disk_read_calls + vfs_atomic_load( &from->disk_read_calls );
+		sum->disk_write_calls = sum->disk_write_calls + vfs_atomic_load( &from->disk_write_calls );
+
+		vfs_rwlock_release( &shard->lock );
+	}
+}
+
+/**
+ * @brief Sets who the calling thread's disk I/O is for
+ * 
+ * @param fs_id mount doing the I/O
+ * @param io_class VFS_IO_CLASS_
+ * @param cache_class VFS_CACHE_CLASS_ for pages it brings into the cache
+ * @param inode file it's for, 0 for the mount's own I/O
+ * @return vfs_io_hint the previous hint, for vfs_io_hint_restore
+ */
+vfs_io_hint vfs_io_hint_set( uint8_t fs_id, uint8_t io_class, uint8_t cache_class, inode_id inode ) {
+	vfs_io_hint previous = io_hint;
+
+	io_hint.fs_id = fs_id;
+	io_hint.io_class = io_class;
+	io_hint.cache_class = cache_class;
+	io_hint.inode = inode;
+
+	return previous;
+}
+
+/**
+ * @brief Gets the calling thread's I/O hint
+ * 
+ * @return vfs_io_hint 
+ */
+vfs_io_hint vfs_io_hint_get( void ) {
+	return io_hint;
+}
+
+/**
+ * @brief Puts back a hint returned by vfs_io_hint_set
+ * 
+ * @param hint 
+ */
+void vfs_io_hint_restore( vfs_io_hint hint ) {
+	io_hint = hint;
+}
+
+/**
+ * @brief Marks the calling thread as copying in bulk, file systems then tag its file data VFS_CACHE_CLASS_STREAM
+ * 
+ * @param streaming 
+ * @return bool the previous setting, to put back when the copy is done
+ */
+bool vfs_io_stream( bool streaming ) {
+	bool previous = io_streaming;
+
+	io_streaming = streaming;
+
+	return previous;
+}
+
+/**
+ * @brief True if the calling thread is in a bulk copy
+ * 
+ * @return bool 
+ */
+bool vfs_io_streaming( void ) {
+	return io_streaming;
+}
+
+/**
+ * @brief Start time for a cache call, taken for one call in VFS_METRICS_HIT_SAMPLE
+ * 
+ * Reading the clock costs more than a hit, so hits are sampled. A call
+ * that misses takes its start when it goes to the disk instead.
+ * 
+ * @return uint64_t vfs_now_ns(), or 0 if this call isn't timed
+ */
+uint64_t vfs_metrics_start( void ) {
+	metrics_sample++;
+
+	if( metrics_sample < VFS_METRICS_HIT_SAMPLE ) {
+		return 0;
+	}
+
+	metrics_sample = 0;
+
+	return vfs_now_ns();
+}
+
+/**
+ * @brief Gives the calling thread its own metrics block
+ * 
+ * @return vfs_metrics* NULL if there is no memory for one
+ */
+static vfs_metrics *vfs_metrics_thread( void ) {
+	vfs_metrics *block = vfs_malloc( sizeof(vfs_metrics) );
+
+	if( block == NULL ) {
+		return NULL;
+	}
+
+	memset( block, 0, sizeof(vfs_metrics) );
+
+	vfs_lock_acquire( &metrics_lock );
+	block->next = metrics_threads;
+	metrics_threads = block;
+	vfs_lock_release( &metrics_lock );
+
+	thread_metrics = block;
+
+	return block;
+}
+
+/**
+ * @brief Adds from to sum
+ * 
+ * @param sum 
+ * @param from 
+ */
+static void vfs_metric_add( vfs_metric *sum, vfs_metric *from ) {
+	sum->count = sum->count + vfs_atomic_load( &from->count );
+	sum->bytes = sum->bytes + vfs_atomic_load( &from->bytes );
+	sum->ns = sum->ns + vfs_atomic_load( &from->ns );
+
+	for( int b = 0; b < VFS_LATENCY_BUCKETS; b++ ) {
+		sum->bucket[b] = sum->bucket[b] + vfs_atomic_load( &from->bucket[b] );
+	}
+}
+
+/**
+ * @brief Folds the calling thread's metrics into the exited threads' block and frees its own
+ * 
+ */
+static void vfs_metrics_thread_exit( void ) {
+	vfs_metrics *block = thread_metrics;
+
+	if( block == NULL ) {
+		return;
+	}
+
+	vfs_lock_acquire( &metrics_lock );
+
+	vfs_metrics **link = &metrics_threads;
+
+	while( *link != block ) {
+		link = &(*link)->next;
+	}
+
+	*link = block->next;
+
+	for( int f = 0; f < VFS_METRICS_MOUNTS; f++ ) {
+		for( int c = 0; c < VFS_IO_CLASS_MAX; c++ ) {
+			for( int m = 0; m < VFS_METRIC_MAX; m++ ) {
+				vfs_metric_add( &metrics.metric[f][c][m], &block->metric[f][c][m] );
+			}
+		}
+	}
+
+	vfs_lock_release( &metrics_lock );
+
+	vfs_free( block );
+	thread_metrics = NULL;
+}
+
+/**
+ * @brief Counts one I/O of the calling thread's hint
+ * 
+ * @param metric VFS_METRIC_
+ * @param bytes 
+ * @param start_ns vfs_now_ns() when the I/O began, 0 if it wasn't timed
+ */
+void vfs_metrics_record( uint8_t metric, uint64_t bytes, uint64_t start_ns ) {
+	uint8_t mount = io_hint.fs_id < VFS_METRICS_MOUNTS ? io_hint.fs_id : 0;
+	uint8_t io_class = io_hint.io_class < VFS_IO_CLASS_MAX ? io_hint.io_class : VFS_IO_CLASS_OTHER;
+	vfs_metrics *block = thread_metrics != NULL ? thread_metrics : vfs_metrics_thread();
+
+	if( block == NULL ) {
+		return;
+	}
+
+	// Only this thread writes its block, a store is enough for readers to see whole values
+	vfs_metric *m = &block->metric[mount][io_class][metric];
+
+	vfs_atomic_store( &m->count, m->count + 1 );
+	vfs_atomic_store( &m->bytes, m->bytes + bytes );
+
+	if( start_ns != 0 ) {
+		uint64_t ns = vfs_now_ns() - start_ns;
+		uint32_t b = 0;
+
+		while( b < VFS_LATENCY_BUCKETS - 1 && (ns >> b) != 0 ) {
+			b++;
+		}
+
+		vfs_atomic_store( &m->ns, m->ns + ns );
+		vfs_atomic_store( &m->bucket[b], m->bucket[b] + 1 );
+	}
+}
+
+/**
+ * @brief Adds up one metric over every thread, caller holds metrics_lock
+ * 
+ * @param fs_id 
+ * @param io_class 
+ * @param metric 
+ * @param sum filled in with the totals
+ */
+static void vfs_metrics_cell( int fs_id, int io_class, int metric, vfs_metric *sum ) {
+	memset( sum, 0, sizeof(vfs_metric) );
+
+	vfs_metric_add( sum, &metrics.metric[fs_id][io_class][metric] );
+
+	for( vfs_metrics *block = metrics_threads; block != NULL; block = block->next ) {
+		vfs_metric_add( sum, &block->metric[fs_id][io_class][metric] );
+	}
+}
+
+/**
+ * @brief Adds up the metrics matching fs_id, io_class and metric, any of which may be VFS_METRICS_ALL
+ * 
+ * @param fs_id 
+ * @param io_class 
+ * @param metric 
+ * @param sum filled in with the totals
+ */
+void vfs_metrics_sum( uint8_t fs_id, uint8_t io_class, uint8_t metric, vfs_metric *sum ) {
+	vfs_metric cell;
+
+	memset( sum, 0, sizeof(vfs_metric) );
+
+	vfs_lock_acquire( &metrics_lock );
+
+	for( int f = 0; f < VFS_METRICS_MOUNTS; f++ ) {
+		for( int c = 0; c < VFS_IO_CLASS_MAX; c++ ) {
+			for( int m = 0; m < VFS_METRIC_MAX; m++ ) {
+				if( (fs_id != VFS_METRICS_ALL && fs_id != f) || (io_class != VFS_METRICS_ALL && io_class != c) || (metric != VFS_METRICS_ALL && metric != m) ) {
+					continue;
+				}
+
+				vfs_metrics_cell( f, c, m, &cell );
+				vfs_metric_add( sum, &cell );
+			}
+		}
+	}
+
+	vfs_lock_release( &metrics_lock );
+}
+
+/**
+ * @brief Zeroes every metric
+ * 
+ */
+void vfs_metrics_reset( void ) {
+	vfs_lock_acquire( &metrics_lock );
+
+	memset( metrics.metric, 0, sizeof(metrics.metric) );
+
+	for( vfs_metrics *block = metrics_threads; block != NULL; block = block->next ) {
+		memset( block->metric, 0, sizeof(block->metric) );
+	}
+
+	vfs_lock_release( &metrics_lock );
+}
+
+/**
+ * @brief Appends str to buffer, as much of it as fits
+ * 
+ * @param buffer 
+ * @param size 
+ * @param length bytes already in buffer
+ * @return uint64_t length with all of str added, may be past size like snprintf
+ */
+static uint64_t vfs_text_str( char *buffer, uint64_t size, uint64_t length, char *str ) {
+	while( *str != '\0' ) {
+		if( length + 1 < size ) {
+			buffer[length] = *str;
+		}
+
+		length++;
+		str++;
+	}
+
+	if( size != 0 ) {
+		buffer[length < size ? length : size - 1] = '\0';
+	}
+
+	return length;
+}
+
+/**
+ * @brief Appends value in decimal and then sep to buffer
+ * 
+ * @param buffer 
+ * @param size 
+ * @param length 
+ * @param value 
+ * @param sep 
+ * @return uint64_t 
+ */
+static uint64_t vfs_text_u64( char *buffer, uint64_t size, uint64_t length, uint64_t value, char *sep ) {
+	char digits[24];
+	int i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+
+	do {
+		digits[--i] = '0' + (value % 10);
+		value = value / 10;
+	} while( value != 0 );
+
+	length = vfs_text_str( buffer, size, length, digits + i );
+
+	return vfs_text_str( buffer, size, length, sep );
+}
+
+/**
+ * @brief Writes the cache gauges and every non zero metric as text, the contents of /proc/metrics
+ * 
+ * One "name value" line per gauge, a blank line, then a table of
+ * mount, class, metric, count, bytes and average ns.
+ * 
+ * @param buffer 
+ * @param size 
+ * @return uint64_t length of the text, may be past size like snprintf
+ */
+uint64_t vfs_metrics_format( char *buffer, uint64_t size ) {
+	uint64_t length = 0;
+	vfs_cache_counters stats;
+	vfs_metric cell;
+
+	vfs_cache_sum( &stats );
+
+	length = vfs_text_str( buffer, size, length, "cache_pages " );
+	length = vfs_text_u64( buffer, size, length, stats.pages, "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_max_pages " );
+	length = vfs_text_u64( buffer, size, length, vfs_atomic_load( &cache.max_pages ), "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_dirty_pages " );
+	length = vfs_text_u64( buffer, size, length, stats.dirty, "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_pinned_pages " );
+	length = vfs_text_u64( buffer, size, length, stats.pinned, "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_stream_pages " );
+	length = vfs_text_u64( buffer, size, length, stats.streaming, "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_fills " );
+	length = vfs_text_u64( buffer, size, length, stats.fills, "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_readahead_pages " );
+	length = vfs_text_u64( buffer, size, length, stats.readahead_pages, "\n" );
+	length = vfs_text_str( buffer, size, length, "cache_writebacks " );
+	length = vfs_text_u64( buffer, size, length, stats.writebacks, "\n" );
+
+	length = vfs_text_str( buffer, size, length, "\nmount class metric count bytes avg_ns\n" );
+
+	vfs_lock_acquire( &metrics_lock );
+
+	for( int f = 0; f < VFS_METRICS_MOUNTS; f++ ) {
+		for( int c = 0; c < VFS_IO_CLASS_MAX; c++ ) {
+			for( int m = 0; m < VFS_METRIC_MAX; m++ ) {
+				vfs_metrics_cell( f, c, m, &cell );
+
+				uint64_t count = cell.count;
+				uint64_t timed = 0;
+
+				if( count == 0 ) {
+					continue;
+				}
+
+				for( int b = 0; b < VFS_LATENCY_BUCKETS; b++ ) {
+					timed = timed + cell.bucket[b];
+				}
+
+				length = vfs_text_u64( buffer, size, length, f, " " );
+				length = vfs_text_str( buffer, size, length, io_class_names[c] );
+				length = vfs_text_str( buffer, size, length, " " );
+				length = vfs_text_str( buffer, size, length, metric_names[m] );
+				length = vfs_text_str( buffer, size, length, " " );
+				length = vfs_text_u64( buffer, size, length, count, " " );
+				length = vfs_text_u64( buffer, size, length, cell.bytes, " " );
+				length = vfs_text_u64( buffer, size, length, timed != 0 ? cell.ns / timed : 0, "\n" );
+			}
+		}
+	}
+
+	vfs_lock_release( &metrics_lock );
+
+	return length;
+}
+
+/**
+ * @brief Creates /proc/metrics and /proc/latency, called by vfs_mount when an RFS is mounted on /proc
+ * 
+ * @param proc the mount point
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
+ */
+static int vfs_metrics_publish( inode_id proc ) {
+	int metrics = rfs_create_generated( proc, "metrics", vfs_metrics_format );
+	int latency = rfs_create_generated( proc, "latency", vfs_metrics_format_latency );
+
+	if( metrics < 0 ) {
+		return metrics;
+	}
+
+	return latency < 0 ? latency : VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Writes the latency histogram of every non zero metric as text, the contents of /proc/latency
+ * 
+ * A header of bucket upper bounds in ns, then one line per metric of
+ * mount, class, metric and the count in each bucket.
+ * 
+ * @param buffer 
+ * @param size 
+ * @return uint64_t length of the text, may be past size like snprintf
+ */
+uint64_t vfs_metrics_format_latency( char *buffer, uint64_t size ) {
+	uint64_t length = vfs_text_str( buffer, size, 0, "mount class metric" );
+	vfs_metric cell;
+
+	for( int b = 0; b < VFS_LATENCY_BUCKETS - 1; b++ ) {
+		length = vfs_text_str( buffer, size, length, " " );
+		length = vfs_text_u64( buffer, size, length, 1ULL << b, "" );
+	}
+
+	length = vfs_text_str( buffer, size, length, " inf\n" );
+
+	vfs_lock_acquire( &metrics_lock );
+
+	for( int f = 0; f < VFS_METRICS_MOUNTS; f++ ) {
+		for( int c = 0; c < VFS_IO_CLASS_MAX; c++ ) {
+			for( int m = 0; m < VFS_METRIC_MAX; m++ ) {
+				vfs_metrics_cell( f, c, m, &cell );
+
+				if( cell.count == 0 ) {
+					continue;
+				}
+
+				length = vfs_text_u64( buffer, size, length, f, " " );
+				length = vfs_text_str( buffer, size, length, io_class_names[c] );
+				length = vfs_text_str( buffer, size, length, " " );
+				length = vfs_text_str( buffer, size, length, metric_names[m] );
+
+				for( int b = 0; b < VFS_LATENCY_BUCKETS; b++ ) {
+					length = vfs_text_str( buffer, size, length, " " );
+					length = vfs_text_u64( buffer, size, length, cell.bucket[b], "" );
+				}
+
+				length = vfs_text_str( buffer, size, length, "\n" );
+			}
+		}
+	}
+
+	vfs_lock_release( &metrics_lock );
+
+	return length;
+}
+
+void *vfs_get_device_struct_from_inode_id( inode_id id ) {
+	vfs_inode *ino = vfs_lookup_inode_ptr_by_id( id );
+
+	if( ino == NULL ) {
+		//return VFS_ERROR_FILE_NOT_FOUND;
+		return NULL;
+	}
+
+	if( ino->type != VFS_INODE_TYPE_DEVICE ) {
+		//return VFS_ERROR_NOT_A_DEVICE;
+		return NULL;
+	}
+
+	return ino->dev->data;	
+}
+
+/**
+ * @brief Display cache diagnostic data
+ * 
+ */
+void vfs_cache_diagnostic( void ) {
+	vfs_cache_counters stats;
+	uint64_t buckets = 0;
+
+	vfs_cache_sum( &stats );
+
+	for( int i = 0; i < VFS_CACHE_SHARDS; i++ ) {
+		buckets = buckets + (1U << cache.shard[i].bits);
+	}
+
+	vfs_debugf( "Cache pages:         %ld of %ld (%ld bytes)\n", stats.pages, cache.max_pages, stats.pages * VFS_PAGE_SIZE );
+	vfs_debugf( "Cache dirty pages:   %ld\n", stats.dirty );
+	vfs_debugf( "Cache buckets:       %ld in %d shards\n", buckets, VFS_CACHE_SHARDS );
+	vfs_debugf( "Cache policy:        %s\n", cache.policy->name );
+	vfs_debugf( "Cache total out:     %ld\n", stats.bytes_out );
+	vfs_debugf( "Cache total in:      %ld\n", stats.bytes_in );
+	vfs_debugf( "Cache hits:          %ld, misses %ld\n", stats.hits, stats.misses );
+	vfs_debugf( "Cache evictions:     %ld (%ld dirty)\n", stats.evictions, stats.dirty_evictions );
+	vfs_debugf( "Cache classes:       %ld pinned, %ld normal, %ld stream, %ld promoted\n", stats.pinned, stats.pages - stats.pinned - stats.streaming, stats.streaming, stats.promotions );
+	vfs_debugf( "Cache page lends:    %ld\n", stats.lends );
+	vfs_debugf( "Cache page fills:    %ld\n", stats.fills );
+	vfs_debugf( "Cache partial fills: %ld\n", stats.partial_fills );
+	vfs_debugf( "Cache write allocs:  %ld\n", stats.write_allocs );
+	vfs_debugf( "Cache readahead:     %ld pages in %ld reads\n", stats.readahead_pages, stats.readahead_windows );
+	vfs_debugf( "Cache writebacks:    %ld pages in %ld writes\n", stats.writebacks, stats.flush_writes );
+	vfs_debugf( "Cache disk r calls:  %ld\n", stats.disk_read_calls );
+	vfs_debugf( "Cache disk w calls:  %ld\n", stats.disk_write_calls );
+
+	#ifdef VFS_CACHE_DEBUG
+	for( int s = 0; s < VFS_CACHE_SHARDS; s++ ) {
+		vfs_cache_shard *shard = &cache.shard[s];
+
+		vfs_rwlock_read( &shard->lock );
+
+		for( uint32_t i = 0; i < (1U << shard->bits); i++ ) {
+			for( vfs_page *page = shard->bucket[i]; page != NULL; page = page->hash_next ) {
+				vfs_debugf( "Cache Page %ld:%ld\n", page->drive, page->index );
+				vfs_debugf( "    Dirty:   %X    --    Reads:   %ld    --    Writes:  %ld\n", page->dirty, page->read_count, page->write_count );
+			}
+		}
+
+		vfs_rwlock_release( &shard->lock );
+	}
+	#endif
+
+	vfs_debugf( "Dentries:            %ld\n", dcache.count );
+	vfs_debugf( "Dentry hits:         %ld\n", dcache.hits );
+	vfs_debugf( "Dentry neg hits:     %ld\n", dcache.negative_hits );
+	vfs_debugf( "Dentry misses:       %ld\n", dcache.misses );
+	vfs_debugf( "Dentry evictions:    %ld\n", dcache.evictions );
+	vfs_debugf( "Inodes resident:     %ld\n", inode_table.count );
+	vfs_debugf( "Inodes unused:       %ld\n", inode_table.unused );
+	vfs_debugf( "Inode loads:         %ld\n", inode_table.loads );
+	vfs_debugf( "Inode evictions:     %ld\n", inode_table.evictions );
+}
+
+#ifdef VIFS_DEV
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// One io_uring for every VFS_DISK_BACKEND_URING image, entries carry the image's fd. Set up, torn down and used under ring_mutex
+uint32_t disk_queue_depth = VFS_DISK_QUEUE_DEPTH;	// size the next ring is set up with
+uint32_t ring_depth;			// 0 with no ring
+uint32_t ring_inflight;
+uint32_t ring_users;			// images on VFS_DISK_BACKEND_URING, the ring goes when the last one leaves
+bool ring_reaping;				// a thread is in io_uring_enter waiting for completions
+int ring_fd = -1;
+pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+uint8_t *ring_sq;
+uint8_t *ring_cq;
+uint64_t ring_sq_size;
+uint64_t ring_cq_size;
+struct io_uring_sqe *ring_sqes;
+uint64_t ring_sqes_size;
+uint32_t *ring_sq_tail;
+uint32_t *ring_sq_mask;
+uint32_t *ring_sq_array;
+uint32_t *ring_cq_head;
+uint32_t *ring_cq_tail;
+uint32_t *ring_cq_mask;
+struct io_uring_cqe *ring_cqes;
+
+/**
+ * @brief The host image behind a drive number
+ * 
+ * @param drive 
+ * @return vfs_disk_image* NULL if no image is attached there
+ */
+static vfs_disk_image *vfs_disk_image_of( uint64_t drive ) {
+	vfs_blockdev *dev = vfs_blockdev_get( drive );
+
+	return dev != NULL ? dev->data : NULL;
+}
+
+/**
+ * @brief Reads from the image through stdio, one request at a time
+ * 
+ * @param image 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool 
+ */
+static bool vfs_disk_stdio_read( vfs_disk_image *image, uint64_t offset, uint64_t length, uint8_t *data ) {
+	vfs_lock_acquire( &image->lock );
+	fseek( image->fp, offset, SEEK_SET );
+
+	int read_err = fread( data, length, 1, image->fp );
+	vfs_lock_release( &image->lock );
+
+	return read_err == 1;
+}
+
+/**
+ * @brief Writes to the image through stdio, one request at a time
+ * 
+ * @param image 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool 
+ */
+static bool vfs_disk_stdio_write( vfs_disk_image *image, uint64_t offset, uint64_t length, uint8_t *data ) {
+	vfs_lock_acquire( &image->lock );
+	fseek( image->fp, offset, SEEK_SET );
+
+	int write_err = fwrite( data, length, 1, image->fp );
+	vfs_lock_release( &image->lock );
+
+	return write_err == 1;
+}
+
+/**
+ * @brief Copies out of the mapped image, requests run side by side
+ * 
+ * @param image 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool false past the end of the image
+ */
+static bool vfs_disk_mmap_read( vfs_disk_image *image, uint64_t offset, uint64_t length, uint8_t *data ) {
+	if( offset + length > image->map_size ) {
+		return false;
+	}
+
+	memcpy( data, image->map + offset, length );
+
+	return true;
+}
+
+/**
+ * @brief Copies into the mapped image, the kernel writes it back until msync makes it durable
+ * 
+ * @param image 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool false past the end of the image, a mapping can't grow it
+ */
+static bool vfs_disk_mmap_write( vfs_disk_image *image, uint64_t offset, uint64_t length, uint8_t *data ) {
+	if( offset + length > image->map_size ) {
+		return false;
+	}
+
+	memcpy( image->map + offset, data, length );
+
+	return true;
+}
+
+/**
+ * @brief pread or pwrite all of length, carrying on after short transfers
+ * 
+ * @param fd 
+ * @param write 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return uint64_t bytes moved, short only at the end of the image or on error
+ */
+static uint64_t vfs_disk_fd_io( int fd, bool write, uint64_t offset, uint64_t length, uint8_t *data ) {
+	uint64_t done = 0;
+
+	while( done < length ) {
+		ssize_t moved;
+
+		if( write ) {
+			moved = pwrite( fd, data + done, length - done, offset + done );
+		} else {
+			moved = pread( fd, data + done, length - done, offset + done );
+		}
+
+		if( moved < 0 && errno == EINTR ) {
+			continue;
+		}
+
+		if( moved <= 0 ) {
+			break;
+		}
+
+		done += moved;
+	}
+
+	return done;
+}
+
+/**
+ * @brief Whether a request can go to an O_DIRECT fd as is
+ * 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool 
+ */
+static bool vfs_disk_direct_aligned( uint64_t offset, uint64_t length, uint8_t *data ) {
+	uint64_t mask = VFS_DISK_DIRECT_ALIGN - 1;
+
+	return (offset & mask) == 0 && (length & mask) == 0 && ((uintptr_t)data & mask) == 0;
+}
+
+/**
+ * @brief Reads at offset on the image's fd, through an aligned bounce buffer when O_DIRECT needs one
+ * 
+ * @param image 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool 
+ */
+static bool vfs_disk_pread_read( vfs_disk_image *image, uint64_t offset, uint64_t length, uint8_t *data ) {
+	if( image->backend != VFS_DISK_BACKEND_DIRECT || vfs_disk_direct_aligned( offset, length, data ) ) {
+		return vfs_disk_fd_io( image->fd, false, offset, length, data ) == length;
+	}
+
+	uint64_t start = offset & ~(uint64_t)(VFS_DISK_DIRECT_ALIGN - 1);
+	uint64_t span = ((offset + length - start) + VFS_DISK_DIRECT_ALIGN - 1) & ~(uint64_t)(VFS_DISK_DIRECT_ALIGN - 1);
+	uint8_t *bounce = NULL;
+
+	if( posix_memalign( (void **)&bounce, VFS_DISK_DIRECT_ALIGN, span ) != 0 ) {
+		return false;
+	}
+
+	bool ok = vfs_disk_fd_io( image->fd, false, start, span, bounce ) >= offset + length - start;
+
+	if( ok ) {
+		memcpy( data, bounce + (offset - start), length );
+	}
+
+	free( bounce );
+
+	return ok;
+}
+
+/**
+ * @brief Writes at offset on the image's fd, unaligned O_DIRECT writes read, patch and write back whole aligned blocks
+ * 
+ * Every O_DIRECT write holds the image lock, so an aligned write can't land
+ * between a bounced write's read and write back and be undone by it. The
+ * other backends run without it.
+ * 
+ * @param image 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return bool 
+ */
+static bool vfs_disk_pread_write( vfs_disk_image *image, uint64_t offset, uint64_t length, uint8_t *data ) {
+	if( image->backend != VFS_DISK_BACKEND_DIRECT ) {
+		return vfs_disk_fd_io( image->fd, true, offset, length, data ) == length;
+	}
+
+	if( vfs_disk_direct_aligned( offset, length, data ) ) {
+		vfs_lock_acquire( &image->lock );
+		bool ok = vfs_disk_fd_io( image->fd, true, offset, length, data ) == length;
+		vfs_lock_release( &image->lock );
+
+		return ok;
+	}
+
+	uint64_t start = offset & ~(uint64_t)(VFS_DISK_DIRECT_ALIGN - 1);
+	uint64_t span = ((offset + length - start) + VFS_DISK_DIRECT_ALIGN - 1) & ~(uint64_t)(VFS_DISK_DIRECT_ALIGN - 1);
+	uint8_t *bounce = NULL;
+
+	if( posix_memalign( (void **)&bounce, VFS_DISK_DIRECT_ALIGN, span ) != 0 ) {
+		return false;
+	}
+
+	vfs_lock_acquire( &image->lock );
+
+	// Past the end of the image reads short, that part starts out zeroed
+	uint64_t got = vfs_disk_fd_io( image->fd, false, start, span, bounce );
+	memset( bounce + got, 0, span - got );
+	memcpy( bounce + (offset - start), data, length );
+
+	bool ok = vfs_disk_fd_io( image->fd, true, start, span, bounce ) == span;
+
+	vfs_lock_release( &image->lock );
+	free( bounce );
+
+	return ok;
+}
+
+/**
+ * @brief Unmaps and closes the io_uring, caller holds ring_mutex and nothing is in flight
+ */
+static void vfs_disk_ring_teardown( void ) {
+	if( ring_fd < 0 ) {
+		return;
+	}
+
+	munmap( ring_sqes, ring_sqes_size );
+
+	if( ring_cq != ring_sq ) {
+		munmap( ring_cq, ring_cq_size );
+	}
+
+	munmap( ring_sq, ring_sq_size );
+	close( ring_fd );
+
+	ring_fd = -1;
+	vfs_atomic_store( &ring_depth, 0 );
+}
+
+/**
+ * @brief Sets up an io_uring of depth entries, caller holds ring_mutex
+ * 
+ * @param depth 
+ * @return int VFS_ERROR_NONE, otherwise VFS_ERROR_ and there is no ring
+ */
+static int vfs_disk_ring_setup( uint32_t depth ) {
+	struct io_uring_params params;
+
+	memset( &params, 0, sizeof(params) );
+
+	ring_fd = syscall( __NR_io_uring_setup, depth, &params );
+
+	if( ring_fd < 0 ) {
+		ring_fd = -1;
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	ring_sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	// Newer kernels put both rings in one mapping
+	if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		if( ring_cq_size > ring_sq_size ) {
+			ring_sq_size = ring_cq_size;
+		}
+
+		ring_cq_size = ring_sq_size;
+	}
+
+	ring_sq = mmap( NULL, ring_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING );
+	ring_cq = ring_sq;
+
+	if( ring_sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP) ) {
+		ring_cq = mmap( NULL, ring_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING );
+	}
+
+	ring_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring_sqes = ring_cq == MAP_FAILED ? MAP_FAILED : mmap( NULL, ring_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES );
+
+	if( ring_sq == MAP_FAILED || ring_cq == MAP_FAILED || ring_sqes == MAP_FAILED ) {
+		if( ring_cq != MAP_FAILED && ring_cq != ring_sq ) {
+			munmap( ring_cq, ring_cq_size );
+		}
+
+		if( ring_sq != MAP_FAILED ) {
+			munmap( ring_sq, ring_sq_size );
+		}
+
+		close( ring_fd );
+		ring_fd = -1;
+
+		return VFS_ERROR_MEMORY;
+	}
+
+	ring_sq_tail = (uint32_t *)(ring_sq + params.sq_off.tail);
+	ring_sq_mask = (uint32_t *)(ring_sq + params.sq_off.ring_mask);
+	ring_sq_array = (uint32_t *)(ring_sq + params.sq_off.array);
+	ring_cq_head = (uint32_t *)(ring_cq + params.cq_off.head);
+	ring_cq_tail = (uint32_t *)(ring_cq + params.cq_off.tail);
+	ring_cq_mask = (uint32_t *)(ring_cq + params.cq_off.ring_mask);
+	ring_cqes = (struct io_uring_cqe *)(ring_cq + params.cq_off.cqes);
+
+	// The kernel may round depth up, in flight is held to what was asked for
+	ring_inflight = 0;
+	vfs_atomic_store( &ring_depth, depth );
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Takes every completion off the ring and marks its request done, caller holds ring_mutex
+ */
+static void vfs_disk_ring_reap( void ) {
+	uint32_t head = *ring_cq_head;
+
+	while( head != vfs_atomic_load( ring_cq_tail ) ) {
+		struct io_uring_cqe *cqe = &ring_cqes[ head & *ring_cq_mask ];
+		vfs_disk_request *request = (vfs_disk_request *)(uintptr_t)cqe->user_data;
+
+		request->transferred = cqe->res;
+		request->done = true;
+		ring_inflight--;
+		head++;
+	}
+
+	vfs_atomic_store( ring_cq_head, head );
+}
+
+/**
+ * @brief Waits until at least one more request completes, caller holds ring_mutex and something is in flight
+ * 
+ * One thread at a time sleeps in the kernel and reaps for everyone, the
+ * rest wait on ring_cond for it.
+ */
+static void vfs_disk_ring_wait_any( void ) {
+	if( ring_reaping ) {
+		pthread_cond_wait( &ring_cond, &ring_mutex );
+		return;
+	}
+
+	ring_reaping = true;
+	pthread_mutex_unlock( &ring_mutex );
+
+	syscall( __NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+
+	pthread_mutex_lock( &ring_mutex );
+	vfs_disk_ring_reap();
+	ring_reaping = false;
+	pthread_cond_broadcast( &ring_cond );
+}
+
+/**
+ * @brief Queues a request on the io_uring, waiting for a free slot when queue depth are in flight
+ * 
+ * @param request 
+ * @return bool false if there is no ring or it wouldn't take the request, the caller does it itself
+ */
+bool vfs_disk_submit_test( vfs_disk_request *request ) {
+	vfs_disk_image *image = vfs_disk_image_of( request->drive );
+
+	if( image == NULL || image->backend != VFS_DISK_BACKEND_URING || vfs_atomic_load( &ring_depth ) == 0 || request->length > UINT32_MAX ) {
+		return false;
+	}
+
+	pthread_mutex_lock( &ring_mutex );
+
+	while( ring_inflight >= ring_depth ) {
+		vfs_disk_ring_wait_any();
+	}
+
+	uint32_t tail = *ring_sq_tail;
+	uint32_t index = tail & *ring_sq_mask;
+	struct io_uring_sqe *sqe = &ring_sqes[index];
+
+	memset( sqe, 0, sizeof(struct io_uring_sqe) );
+	sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = image->fd;
+	sqe->addr = (uintptr_t)request->data;
+	sqe->len = request->length;
+	sqe->off = request->offset;
+	sqe->user_data = (uintptr_t)request;
+	ring_sq_array[index] = index;
+
+	request->queued = true;
+	request->transferred = 0;
+	ring_inflight++;
+
+	vfs_atomic_store( ring_sq_tail, tail + 1 );
+
+	// Only io_uring_enter hands entries to the kernel, so one it refused can be taken back
+	if( syscall( __NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0 ) != 1 ) {
+		vfs_atomic_store( ring_sq_tail, tail );
+
+		request->queued = false;
+		ring_inflight--;
+
+		pthread_mutex_unlock( &ring_mutex );
+		return false;
+	}
+
+	pthread_mutex_unlock( &ring_mutex );
+
+	return true;
+}
+
+/**
+ * @brief Waits for a queued request, finishing a short transfer with pread or pwrite
+ * 
+ * A completion with an error, or one still short after that, sets the
+ * request's result, write back dirties the run again on it.
+ * 
+ * @param request 
+ */
+void vfs_disk_wait_test( vfs_disk_request *request ) {
+	pthread_mutex_lock( &ring_mutex );
+
+	while( !request->done ) {
+		vfs_disk_ring_wait_any();
+	}
+
+	pthread_mutex_unlock( &ring_mutex );
+
+	int64_t moved = request->transferred;
+
+	if( moved >= 0 && (uint64_t)moved < request->length ) {
+		moved = moved + vfs_disk_fd_io( vfs_disk_image_of( request->drive )->fd, request->write, request->offset + moved, request->length - moved, request->data + moved );
+	}
+
+	request->result = moved >= 0 && (uint64_t)moved == request->length ? VFS_ERROR_NONE : VFS_ERROR_UNKNOWN;
+
+	if( request->result != VFS_ERROR_NONE ) {
+		vfs_debugf( "vfs_disk_wait_test: %s failed.\n", request->write ? "write" : "read" );
+	}
+}
+
+/**
+ * @brief Sets the io_uring size used the next time the uring backend is picked
+ * 
+ * @param depth clamped to 1 to VFS_DISK_QUEUE_DEPTH_MAX
+ */
+void vfs_disk_set_queue_depth_test( uint32_t depth ) {
+	if( depth < 1 ) {
+		depth = 1;
+	}
+
+	if( depth > VFS_DISK_QUEUE_DEPTH_MAX ) {
+		depth = VFS_DISK_QUEUE_DEPTH_MAX;
+	}
+
+	disk_queue_depth = depth;
+}
+
+/**
+ * @brief Requests in flight at once on the image, 1 without an io_uring
+ * 
+ * @return uint32_t 
+ */
+uint32_t vfs_disk_queue_depth_test( void ) {
+	uint32_t depth = vfs_atomic_load( &ring_depth );
+
+	return depth == 0 ? 1 : depth;
+}
+
+/**
+ * @brief Writes out and drops a drive's image pages from the host page cache, so the next reads go to the disk
+ * 
+ * @param drive 
+ */
+void vfs_disk_drop_host_cache_test( uint64_t drive ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
+
+	if( image == NULL ) {
+		return;
+	}
+
+	vfs_disk_sync_test( drive );
+
+	vfs_lock_acquire( &image->lock );
+	fflush( image->fp );
+	fdatasync( fileno( image->fp ) );
+	posix_fadvise( fileno( image->fp ), 0, 0, POSIX_FADV_DONTNEED );
+	vfs_lock_release( &image->lock );
+}
+
+/**
+ * @brief Registers an open image file as a block device, read and written through stdio until a backend is picked
+ * 
+ * @param name block device name mounts refer to it by
+ * @param fp image file, opened for reading and writing, owned by the caller
+ * @return int drive number, otherwise VFS_ERROR_
+ */
+int vfs_disk_attach_test( char *name, FILE *fp ) {
+	if( fp == NULL ) {
+		return VFS_ERROR_NOT_A_DEVICE;
+	}
+
+	vfs_disk_image *image = vfs_malloc( sizeof(vfs_disk_image) );
+
+	if( image == NULL ) {
+		return VFS_ERROR_MEMORY;
+	}
+
+	memset( image, 0, sizeof(vfs_disk_image) );
+	image->fp = fp;
+	image->backend = VFS_DISK_BACKEND_STDIO;
+	image->fd = -1;
+	vfs_lock_initalize( &image->lock );
+
+	int drive = vfs_blockdev_register( name, image );
+
+	if( drive < 0 ) {
+		vfs_free( image );
+	}
+
+	return drive;
+}
+
+/**
+ * @brief The backend a drive's image is read and written through
+ * 
+ * @param drive 
+ * @return uint8_t VFS_DISK_BACKEND_, STDIO if no image is attached there
+ */
+uint8_t vfs_disk_backend_get_test( uint64_t drive ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
+
+	return image != NULL ? image->backend : VFS_DISK_BACKEND_STDIO;
+}
+
+/**
+ * @brief Moves a drive on to or off the shared io_uring
+ * 
+ * The ring is set up for the first uring image, rebuilt if the queue depth
+ * was changed since, and torn down when the last one leaves.
+ * 
+ * @param join 
+ * @return int VFS_ERROR_NONE, otherwise VFS_ERROR_ and the drive isn't on the ring
+ */
+static int vfs_disk_ring_use( bool join ) {
+	int err = VFS_ERROR_NONE;
+
+	pthread_mutex_lock( &ring_mutex );
+
+	if( !join ) {
+		if( --ring_users == 0 ) {
+			vfs_disk_ring_teardown();
+		}
+
+		pthread_mutex_unlock( &ring_mutex );
+		return VFS_ERROR_NONE;
+	}
+
+	if( ring_fd >= 0 && ring_depth != disk_queue_depth ) {
+		vfs_disk_ring_teardown();
+	}
+
+	if( ring_fd < 0 ) {
+		err = vfs_disk_ring_setup( disk_queue_depth );
+	}
+
+	if( err == VFS_ERROR_NONE ) {
+		ring_users++;
+	}
+
+	pthread_mutex_unlock( &ring_mutex );
+
+	return err;
+}
+
+/**
+ * @brief Picks how a drive's image file is read and written, call before any I/O
+ * 
+ * stdio's buffer is flushed before the image is mapped or reopened, and
+ * the old backend is synced before it's dropped, so nothing is lost across
+ * a switch. PREAD, DIRECT and URING reopen the image through /proc/self/fd
+ * so they get their own file description and flags. URING falls back to
+ * PREAD when the kernel has no io_uring. Nothing may be in flight on any
+ * drive, the ring is shared.
+ * 
+ * @param drive 
+ * @param backend VFS_DISK_BACKEND_
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_ and the stdio backend is kept
+ */
+int vfs_disk_backend_test( uint64_t drive, uint8_t backend ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
+
+	if( image == NULL ) {
+		return VFS_ERROR_NOT_A_DEVICE;
+	}
+
+	if( backend >= VFS_DISK_BACKEND_MAX ) {
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	vfs_lock_acquire( &image->lock );
+
+	if( image->map != NULL ) {
+		msync( image->map, image->map_size, MS_SYNC );
+		munmap( image->map, image->map_size );
+
+		image->map = NULL;
+		image->map_size = 0;
+	}
+
+	if( image->backend == VFS_DISK_BACKEND_URING ) {
+		vfs_disk_ring_use( false );
+	}
+
+	if( image->fd >= 0 ) {
+		fdatasync( image->fd );
+		close( image->fd );
+
+		image->fd = -1;
+	}
+
+	image->backend = VFS_DISK_BACKEND_STDIO;
+
+	if( backend == VFS_DISK_BACKEND_PREAD || backend == VFS_DISK_BACKEND_DIRECT || backend == VFS_DISK_BACKEND_URING ) {
+		char path[32];
+
+		fflush( image->fp );
+		sprintf( path, "/proc/self/fd/%d", fileno( image->fp ) );
+
+		image->fd = open( path, O_RDWR | (backend == VFS_DISK_BACKEND_DIRECT ? O_DIRECT : 0) );
+
+		if( image->fd < 0 ) {
+			vfs_lock_release( &image->lock );
+			return VFS_ERROR_UNKNOWN;
+		}
+	}
+
+	if( backend == VFS_DISK_BACKEND_URING && vfs_disk_ring_use( true ) != VFS_ERROR_NONE ) {
+		// The fd is good, requests just go one at a time
+		image->backend = VFS_DISK_BACKEND_PREAD;
+
+		vfs_lock_release( &image->lock );
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	if( backend == VFS_DISK_BACKEND_MMAP ) {
+		fflush( image->fp );
+		fseek( image->fp, 0, SEEK_END );
+
+		long size = ftell( image->fp );
+		void *map = size > 0 ? mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno( image->fp ), 0 ) : MAP_FAILED;
+
+		if( map == MAP_FAILED ) {
+			vfs_lock_release( &image->lock );
+			return VFS_ERROR_MEMORY;
+		}
+
+		image->map = map;
+		image->map_size = size;
+	}
+
+	image->backend = backend;
+
+	vfs_lock_release( &image->lock );
+
+	return VFS_ERROR_NONE;
+}
+
+/**
+ * @brief Simulate a disk read
+ * 
+ * @param drive
+ * @param data 
+ * @param offset 
+ * @param length 
+ */
+uint8_t *vfs_disk_read_test( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
+	vfs_atomic_add( &vfs_cache_shard_at( drive, offset )->stats.disk_read_calls, 1 );
+
+	if( vfs_cache_read( drive, offset, length, data ) == true ) {
+		return data;
+	}
 
+	// Pages that can't be read whole (past the end of the image) aren't cached
+	vfs_disk_read_no_cache( drive, offset, length, data );
+
+	return data;
+}
 
 /**
- * @brief Create a new inode for use
+ * @brief Read directly from the disk, bypassing cache
  * 
- * @return vfs_inode* Pointer to inode structure on success, NULL on failure
+ * @param drive 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return true 
+ * @return false 
  */
-vfs_inode *vfs_allocate_inode( void ) {
-	vfs_inode *node = vfs_malloc( sizeof(vfs_inode) );
+bool vfs_disk_read_test_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
+	uint64_t start = vfs_now_ns();
+	bool ok = false;
+
+	if( image == NULL ) {
+		ok = false;
+	} else if( image->backend == VFS_DISK_BACKEND_MMAP ) {
+		ok = vfs_disk_mmap_read( image, offset, length, data );
+	} else if( image->fd >= 0 ) {
+		ok = vfs_disk_pread_read( image, offset, length, data );
+	} else {
+		ok = vfs_disk_stdio_read( image, offset, length, data );
+	}
 
-	node->fs_type = 0;
-	node->fs_id = 0;
-	node->id = vfs_inode_id_top++;
-	node->type = 0;
-	node->is_mount_point = false;
+	if( !ok ) {
+		vfs_debugf( "vfs_disk_read_test: read failed.\n" );
+		return false;
+	}
 
-	inode_index_tail->next_inode = node;
-	inode_index_tail = node;
+	vfs_metrics_record( VFS_METRIC_DISK_READ, length, start );
 
-	return node;
+	return true;
 }
 
 /**
- * @brief Gets the inode id of file name from the parent dir
+ * @brief Simulate a disk write
  * 
- * @param parent_id parent inode id
- * @param name name of the file 
- * @return inode_id id of the found file, or VFS_ERROR_ if failed
+ * @param drive 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return uint8_t* 
  */
-inode_id vfs_get_from_dir( inode_id parent_id, char *name ) {
-	vfs_directory_list list;
-	vfs_get_directory_list( parent_id, &list );
+uint8_t *vfs_disk_write_test( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
+	vfs_atomic_add( &vfs_cache_shard_at( drive, offset )->stats.disk_write_calls, 1 );
 
-	for( int i = 0; i < list.count; i++ ) {
-		if( strcmp(list.entry[i].name, name ) == 0 ) {
-			return list.entry[i].id;
-		}
+	if( vfs_cache_write( drive, offset, length, data ) == true ) {
+		return data;
 	}
 
-	return VFS_ERROR_FILE_NOT_FOUND;
+	vfs_disk_write_test_no_cache( drive, offset, length, data );
+
+	return data;
 }
 
 /**
- * @brief Initalizes the vfs cache
+ * @brief Write directly to the disk, bypassing cache
  * 
+ * @param drive 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return true 
+ * @return false 
  */
-void vfs_cache_initalize( void ) {
-	cache.head = NULL;
-	cache.tail = NULL;
-	cache_hits = 0;
-	cache_misses = 0;
-	cache_read_success = 0;
-	cache_read_fail = 0;
-	cache_write_success = 0;
-	cache_write_fail = 0;
-	cache_write_old = 0;
-	cache_write_new = 0;
-	cache_total_in = 0;
-	cache_total_out = 0;
-	cache_disk_read_calls = 0;
-	cache_disk_write_calls = 0;
-}
-
-/**
- * @brief Returns true if the memory at addr and size is cached
- * 
- * @param addr Address to test if it's cached
- * @param size Size of data we want to access in cache
- * @return pointer Cache item
- * @return NULL Cache miss
- */
-vfs_cache_item *vfs_cache_is_cached( uint64_t addr, uint32_t size ) {
-	if( cache.head == NULL ) {
+bool vfs_disk_write_test_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
+	uint64_t start = vfs_now_ns();
+	bool ok = false;
+
+	if( image == NULL ) {
+		ok = false;
+	} else if( image->backend == VFS_DISK_BACKEND_MMAP ) {
+		ok = vfs_disk_mmap_write( image, offset, length, data );
+	} else if( image->fd >= 0 ) {
+		ok = vfs_disk_pread_write( image, offset, length, data );
+	} else {
+		ok = vfs_disk_stdio_write( image, offset, length, data );
+	}
+
+	if( !ok ) {
+		vfs_debugf( "vfs_disk_write_test: write failed.\n" );
 		return false;
 	}
 
-	vfs_cache_item *ci = cache.head;
+	vfs_metrics_record( VFS_METRIC_DISK_WRITE, length, start );
 
-	do {
-		// If the address is greater than or equal to the cached addr, look more
-		// otherwise go to the next item
-		if( addr >= ci->address ) {
-			// If the searched for size is less than or equal to the cached size,
-			// then look more. Otherwise go to the next item.
-			if( size <= ci->size ) {
-				// It's possible from above that the we get addr = 10, size = 3
-				// and ci.addr = 0, ci.size = 10. This would cause a buffer overflow.
-				// If addr + size are within ci.addr + ci.size, we have a hit for
-				// sure, otherwise fail for now (but TODO: expand the cache area).
-				// This expansion will prevent overlapping addresses in MOST situations
-				if( addr + size <= ci->address + ci->size ) {
-					#ifdef VFS_CACHE_DEBUG
-					vfs_debugf( "Cache hit @ %ld\n", addr );
-					#endif
-
-					cache_hits++;
-					return ci;
-				} else {
-					// Expand the cached area
-				}
-			}
-		}
+	return true;
+}
 
-		ci = ci->next;
-	} while( ci != NULL );
+/**
+ * @brief Pushes buffered writes out to the image file, a mapped or fd backed image is synced to the disk under it
+ * 
+ * @param drive 
+ */
+void vfs_disk_sync_test( uint64_t drive ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
 
-	#ifdef VFS_CACHE_DEBUG
-	vfs_debugf( "Cache miss @ %ld\n", addr );
-	#endif 
+	if( image == NULL ) {
+		return;
+	}
 
-	cache_misses++;
-	return NULL;
+	if( image->backend == VFS_DISK_BACKEND_MMAP ) {
+		msync( image->map, image->map_size, MS_SYNC );
+		return;
+	}
+
+	if( image->fd >= 0 ) {
+		fdatasync( image->fd );
+		return;
+	}
+
+	vfs_lock_acquire( &image->lock );
+	fflush( image->fp );
+	vfs_lock_release( &image->lock );
 }
 
 /**
- * @brief Gets the cache at addr, copies it into data, for size length
- * 
- * @param addr 
- * @param size 
- * @param data 
+ * @brief Monotonic time in ns, for latency metrics
  * 
- * @return true if we read from the cache
+ * @return uint64_t 
  */
-bool vfs_cache_read( uint64_t addr, uint32_t size, uint8_t *data ) {
-	vfs_cache_item *ci = vfs_cache_is_cached( addr, size );
+uint64_t vfs_now_ns( void ) {
+	struct timespec ts;
 
-	if( ci != NULL ) {
-		uint32_t offset = addr - ci->address;
-		memcpy( data, ci->data + offset, size );
-		ci->read_count++;
-		cache_read_success++;
-		cache_total_out =+ size;
-		return true;
-	}
+	clock_gettime( CLOCK_MONOTONIC, &ts );
 
-	cache_read_fail++;
-	return false;
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
 }
 
 /**
- * @brief Writes data to the cache at addr for size
+ * @brief Size of the image file in bytes
  * 
- * @param addr 
- * @param size 
- * @param data 
- * 
- * @return true if we wrote to the cache, false otherwise
+ * @param drive 
+ * @return uint64_t 
  */
-bool vfs_cache_write( uint64_t addr, uint32_t size, uint8_t *data, bool dirty ) {
-	vfs_cache_item *ci = vfs_cache_is_cached( addr, size );
+uint64_t vfs_disk_size_test( uint64_t drive ) {
+	vfs_disk_image *image = vfs_disk_image_of( drive );
 
-	if( ci != NULL ) {
-		uint32_t offset = addr - ci->address;
-		memcpy( ci->data + offset, data, size );
-		ci->dirty = dirty;
-		ci->write_count++;
-		cache_write_old++;
-		cache_write_success++;
-		cache_total_in = cache_total_in + size;
-		return true;
-	} else {
-		ci = vfs_malloc( sizeof(vfs_cache_item) );
+	if( image == NULL ) {
+		return 0;
+	}
 
-		if( ci == NULL ) {
-			cache_write_fail++;
-			return false;
-		}
+	if( image->backend == VFS_DISK_BACKEND_MMAP ) {
+		return image->map_size;
+	}
 
-		if( cache.head == NULL ) {
-			cache.head = ci;
-			cache.tail = ci;
-		} else {
-			cache.tail->next = ci;
-			cache.tail = ci;
-		}
+	if( image->fd >= 0 ) {
+		struct stat st;
 
-		ci->address = addr;
-		ci->size = size;
-		ci->next = NULL;
-		ci->data = vfs_malloc( size );
-		ci->dirty = dirty;
-		if( dirty ) {
-			ci->write_count = 1;
-		} else {
-			ci->write_count = 0;
-		}
-		ci->read_count = 0;
-		memcpy( ci->data, data, size );
-		
-		cache_write_success++;
-		cache_write_new++;
-		cache_total_in = cache_total_in + size;
-		return true;
+		return fstat( image->fd, &st ) == 0 ? st.st_size : 0;
 	}
 
-	cache_write_fail++;
-	return false;
+	vfs_lock_acquire( &image->lock );
+	fseek( image->fp, 0, SEEK_END );
+
+	long size = ftell( image->fp );
+	vfs_lock_release( &image->lock );
+
+	return size < 0 ? 0 : size;
 }
 
+pthread_t flusher_thread;
+pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+bool flusher_running = false;
+bool flusher_kicked = false;
+
 /**
- * @brief Flushes the given cache block to disk
+ * @brief Flusher thread body, ticks every VFS_FLUSH_INTERVAL_MS or when kicked
  * 
- * @param ci 
- * @return true Successful flush
- * @return false Flush failure
+ * @param arg unused
+ * @return void* 
  */
-bool vfs_cache_flush( vfs_cache_item *ci ) {
-	if( ci->dirty == true ) {
-		vfs_disk_write_no_cache( 0, ci->address, ci->size, ci->data );
+static void *vfs_flusher( void *arg ) {
+	(void)arg;
+
+	pthread_mutex_lock( &flusher_mutex );
+
+	while( flusher_running ) {
+		struct timespec until;
 
-		ci->dirty = false;
+		clock_gettime( CLOCK_REALTIME, &until );
+		until.tv_nsec = until.tv_nsec + (VFS_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+		until.tv_sec = until.tv_sec + (VFS_FLUSH_INTERVAL_MS / 1000) + until.tv_nsec / 1000000000L;
+		until.tv_nsec = until.tv_nsec % 1000000000L;
+
+		while( flusher_running && !flusher_kicked ) {
+			if( pthread_cond_timedwait( &flusher_cond, &flusher_mutex, &until ) != 0 ) {
+				break;
+			}
+		}
+
+		flusher_kicked = false;
+		pthread_mutex_unlock( &flusher_mutex );
+
+		vfs_flush_tick();
+
+		pthread_mutex_lock( &flusher_mutex );
 	}
 
-	return true;
+	pthread_mutex_unlock( &flusher_mutex );
+	vfs_thread_exit();
+
+	return NULL;
 }
 
 /**
- * @brief Flush all cache items to disk
+ * @brief Starts the background flusher thread
  * 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
  */
-void vfs_cache_flush_all( void ) {
-	vfs_cache_item *ci = cache.head;
+int vfs_flusher_start( void ) {
+	pthread_mutex_lock( &flusher_mutex );
 
-	if( ci == NULL ) {
-		return;
+	if( flusher_running ) {
+		pthread_mutex_unlock( &flusher_mutex );
+		return VFS_ERROR_NONE;
 	}
 
-	do {
-		vfs_cache_flush( ci );
-
-		ci = ci->next;
-	} while( ci != NULL );
-}
-
-void *vfs_get_device_struct_from_inode_id( inode_id id ) {
-	vfs_inode *ino = vfs_lookup_inode_ptr_by_id( id );
+	flusher_running = true;
+	flusher_kicked = false;
 
-	if( ino == NULL ) {
-		//return VFS_ERROR_FILE_NOT_FOUND;
-		return NULL;
+	if( pthread_create( &flusher_thread, NULL, vfs_flusher, NULL ) != 0 ) {
+		flusher_running = false;
+		pthread_mutex_unlock( &flusher_mutex );
+		return VFS_ERROR_UNKNOWN;
 	}
 
-	if( ino->type != VFS_INODE_TYPE_DEVICE ) {
-		//return VFS_ERROR_NOT_A_DEVICE;
-		return NULL;
-	}
+	pthread_mutex_unlock( &flusher_mutex );
 
-	return ino->dev->data;	
+	return VFS_ERROR_NONE;
 }
 
 /**
- * @brief Display cache diagnostic data
+ * @brief Stops the flusher thread and waits for its last pass, call vfs_sync after for a clean cache
  * 
  */
-void vfs_cache_diagnostic( void ) {
-	uint64_t total_size = 0;
-	uint64_t total_objects = 0;
-
-	vfs_cache_item *ci = cache.head;
+void vfs_flusher_stop( void ) {
+	pthread_mutex_lock( &flusher_mutex );
 
-	if( ci == NULL ) {
-		vfs_debugf( "No cache.\n" );
+	if( !flusher_running ) {
+		pthread_mutex_unlock( &flusher_mutex );
 		return;
 	}
 
-	do {
-		total_size = total_size + ci->size;
-		total_objects++;
-
-		ci = ci->next;
-	} while( ci != NULL );
-
-	vfs_debugf( "Cache objects:       %ld\n", total_objects );
-	vfs_debugf( "Cache total size:    %ld\n", total_size );
-	vfs_debugf( "Cache total out:     %ld\n", cache_total_out );
-	vfs_debugf( "Cache total in:      %ld\n", cache_total_in );
-	vfs_debugf( "Cache hits:          %ld\n", cache_hits );
-	vfs_debugf( "Cache misses:        %ld\n", cache_misses );
-	vfs_debugf( "Cache read success:  %ld\n", cache_read_success );
-	vfs_debugf( "Cache read fail:     %ld\n", cache_read_fail );
-	vfs_debugf( "Cache write success: %ld\n", cache_write_success );
-	vfs_debugf( "Cache write fail:    %ld\n", cache_write_fail );
-	vfs_debugf( "Cache write new:     %ld\n", cache_write_new );
-	vfs_debugf( "Cache write old:     %ld\n", cache_write_old );
-	vfs_debugf( "Cache disk r calls:  %ld\n", cache_disk_read_calls );
-	vfs_debugf( "Cache disk w calls:  %ld\n", cache_disk_write_calls );
-
-	ci = cache.head;
-
-	do {
-		vfs_debugf( "Cache Object 0x%X:\n", ci->address );
-		vfs_debugf( "    Dirty:   %X    --    Size:    0x%X\n", ci->dirty, ci->size );
-		vfs_debugf( "    Reads:   %ld    --    Writes:  %ld\n", ci->read_count, ci->write_count );
+	flusher_running = false;
+	pthread_cond_signal( &flusher_cond );
+	pthread_mutex_unlock( &flusher_mutex );
 
-		ci = ci->next;
-	} while( ci != NULL );
+	pthread_join( flusher_thread, NULL );
 }
 
-#ifdef VIFS_DEV
+/**
+ * @brief Asks the flusher for a pass now, if it's running
+ * 
+ */
+static void vfs_flusher_wake( void ) {
+	pthread_mutex_lock( &flusher_mutex );
+
+	if( flusher_running && !flusher_kicked ) {
+		flusher_kicked = true;
+		pthread_cond_signal( &flusher_cond );
+	}
+
+	pthread_mutex_unlock( &flusher_mutex );
+}
 
-extern FILE *fp;
+pthread_t readahead_thread;
+pthread_mutex_t readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+bool readahead_running = false;
+vfs_readahead_request readahead_ring[VFS_READAHEAD_QUEUE];
+uint32_t readahead_head;
+uint32_t readahead_count;
 
 /**
- * @brief Simulate a disk read
+ * @brief Readahead thread, reads queued windows into the cache until stopped
  * 
- * @param drive
- * @param data 
- * @param offset 
- * @param length 
+ * @param arg unused
+ * @return void* 
  */
-uint8_t *vfs_disk_read_test( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	cache_disk_read_calls++;
+static void *vfs_readahead_worker( void *arg ) {
+	(void)arg;
 
-	if( vfs_cache_read( offset, length, data ) == true ) {
-		return data;
-	}
+	pthread_mutex_lock( &readahead_mutex );
+
+	while( readahead_running ) {
+		if( readahead_count == 0 ) {
+			pthread_cond_wait( &readahead_cond, &readahead_mutex );
+			continue;
+		}
+
+		vfs_readahead_request request = readahead_ring[readahead_head];
+
+		readahead_head = (readahead_head + 1) % VFS_READAHEAD_QUEUE;
+		readahead_count--;
+
+		pthread_mutex_unlock( &readahead_mutex );
 
-	if( vfs_disk_read_no_cache( drive, offset, length, data ) == true ) {
-		vfs_cache_write( offset, length, data, false );
+		vfs_io_hint_set( request.hint.fs_id, request.hint.io_class, request.hint.cache_class, request.hint.inode );
+		vfs_cache_readahead( request.drive, request.first, request.count );
+
+		pthread_mutex_lock( &readahead_mutex );
 	}
 
-	return data;
+	pthread_mutex_unlock( &readahead_mutex );
+	vfs_thread_exit();
+
+	return NULL;
 }
 
 /**
- * @brief Read directly from the disk, bypassing cache
+ * @brief Starts the readahead thread, until then readahead runs in the reader
  * 
- * @param drive 
- * @param offset 
- * @param length 
- * @param data 
- * @return true 
- * @return false 
+ * @return int VFS_ERROR_NONE on success, otherwise VFS_ERROR_
  */
-bool vfs_disk_read_test_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	fseek( fp, offset, SEEK_SET );
-	
-	int read_err = fread( data, length, 1, fp );
+int vfs_readahead_start( void ) {
+	pthread_mutex_lock( &readahead_mutex );
 
-	if( read_err != 1 ) {
-		vfs_debugf( "vfs_disk_read_test: fread failed.\n" );
-		return false;
+	if( readahead_running ) {
+		pthread_mutex_unlock( &readahead_mutex );
+		return VFS_ERROR_NONE;
 	}
 
-	return true;
+	readahead_running = true;
+	readahead_head = 0;
+	readahead_count = 0;
+
+	if( pthread_create( &readahead_thread, NULL, vfs_readahead_worker, NULL ) != 0 ) {
+		readahead_running = false;
+		pthread_mutex_unlock( &readahead_mutex );
+		return VFS_ERROR_UNKNOWN;
+	}
+
+	pthread_mutex_unlock( &readahead_mutex );
+
+	return VFS_ERROR_NONE;
 }
 
 /**
- * @brief Simulate a disk write
+ * @brief Stops the readahead thread, windows still queued are dropped
  * 
- * @param drive 
- * @param offset 
- * @param length 
- * @param data 
- * @return uint8_t* 
  */
-uint8_t *vfs_disk_write_test( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	cache_disk_write_calls++;
+void vfs_readahead_stop( void ) {
+	pthread_mutex_lock( &readahead_mutex );
 
-	if( vfs_cache_write(offset, length, data, true ) == true ) {
-		return data;
+	if( !readahead_running ) {
+		pthread_mutex_unlock( &readahead_mutex );
+		return;
 	}
 
-	vfs_disk_write_test_no_cache( drive, offset, length, data );
+	readahead_running = false;
+	pthread_cond_signal( &readahead_cond );
+	pthread_mutex_unlock( &readahead_mutex );
 
-	return data;
+	pthread_join( readahead_thread, NULL );
 }
 
 /**
- * @brief Write directly to the disk, bypassing cache
+ * @brief Hands a window to the readahead thread, or reads it now if the thread isn't running
+ * 
+ * A window that doesn't fit in the queue is dropped, the reader falls
+ * back to demand reads for it.
  * 
  * @param drive 
- * @param offset 
- * @param length 
- * @param data 
- * @return true 
- * @return false 
+ * @param first 
+ * @param count 
  */
-bool vfs_disk_write_test_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	fseek( fp, offset, SEEK_SET );
-
-	int write_err = fwrite( data, length, 1, fp );
+static void vfs_readahead_queue( uint64_t drive, uint64_t first, uint64_t count ) {
+	pthread_mutex_lock( &readahead_mutex );
 
-	if( write_err != 1 ) {
-		vfs_debugf( "vfs_disk_write_test: fwrite failed.\n" );
-		return false;
+	if( !readahead_running ) {
+		pthread_mutex_unlock( &readahead_mutex );
+		vfs_cache_readahead( drive, first, count );
+		return;
 	}
 
-	fflush(fp);
+	if( readahead_count < VFS_READAHEAD_QUEUE ) {
+		vfs_readahead_request *request = &readahead_ring[ (readahead_head + readahead_count) % VFS_READAHEAD_QUEUE ];
 
-	return true;
+		request->drive = drive;
+		request->first = first;
+		request->count = count;
+		request->hint = io_hint;
+		readahead_count++;
+
+		pthread_cond_signal( &readahead_cond );
+	}
+
+	pthread_mutex_unlock( &readahead_mutex );
 }
 
 #else
 
 uint8_t *vfs_disk_read( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	cache_disk_read_calls++;
+	vfs_atomic_add( &vfs_cache_shard_at( drive, offset )->stats.disk_read_calls, 1 );
 
-	if( vfs_cache_read( offset, length, data ) == true ) {
+	if( vfs_cache_read( drive, offset, length, data ) == true ) {
 		return data;
 	}
 
-	if( vfs_disk_read_no_cache( drive, offset, length, data ) != NULL ) {
-		vfs_cache_write( offset, length, data, false );
-	}
-
-	return data;
+	// Pages that can't be read whole (past the end of the drive) aren't cached
+	return vfs_disk_read_no_cache( drive, offset, length, data );
 }
 
+/**
+ * @brief Reads from the AHCI disk, bypassing cache
+ * 
+ * The AHCI driver only reaches its one disk, registered as drive 0, so
+ * every other drive fails instead of reading that disk.
+ * 
+ * @param drive 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return uint8_t* data, NULL on failure
+ */
 uint8_t *vfs_disk_read_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
+	uint64_t start = vfs_now_ns();
+
+	if( drive != 0 ) {
+		vfs_debugf( "No ahci drive %ld.\n", drive );
+		return NULL;
+	}
+
 	if( !ahci_read_at_byte_offset_512_chunks( offset, length, data ) ) {
 		vfs_debugf( "Could not read from ahci drive.\n" );
 		return NULL;
 	}
 
+	vfs_metrics_record( VFS_METRIC_DISK_READ, length, start );
+
 	return data;
 }
 
 uint8_t *vfs_disk_write( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	cache_disk_write_calls++;
+	vfs_atomic_add( &vfs_cache_shard_at( drive, offset )->stats.disk_write_calls, 1 );
 
-	if( vfs_cache_write(offset, length, data, true ) == true ) {
+	if( vfs_cache_write( drive, offset, length, data ) == true ) {
 		return data;
 	}
 
-	vfs_disk_write_no_cache( drive, offset, length, data );
+	uint8_t *written = vfs_disk_write_no_cache( drive, offset, length, data );
 
-	return data;
+	if( written != NULL ) {
+		vfs_cache_changed( drive, offset, length );
+	}
+
+	return written;
 }
 
+/**
+ * @brief Writes to the AHCI disk, bypassing cache
+ * 
+ * The AHCI driver has no write yet, so this always fails. Write back keeps
+ * the pages dirty and write through reports the error.
+ * 
+ * @param drive 
+ * @param offset 
+ * @param length 
+ * @param data 
+ * @return uint8_t* data, NULL on failure
+ */
 uint8_t *vfs_disk_write_no_cache( uint64_t drive, uint64_t offset, uint64_t length, uint8_t *data ) {
-	// TODO
+	vfs_debugf( "Could not write to ahci drive %ld, not supported yet.\n", drive );
+
+	return NULL;
+}
+
+void vfs_disk_sync( uint64_t drive ) {
+	// AHCI writes complete before returning, nothing is buffered
+}
+
+/**
+ * @brief There is no flusher thread in the kernel, its timer calls vfs_flush_tick
+ * 
+ */
+static void vfs_flusher_wake( void ) {
+}
+
+/**
+ * @brief No clock source is hooked up in the kernel yet, metrics count but don't time
+ * 
+ * @return uint64_t 0, which vfs_metrics_record takes as untimed
+ */
+uint64_t vfs_now_ns( void ) {
+	return 0;
+}
+
+/**
+ * @brief No size query in the AHCI driver yet, readahead isn't clamped
+ * 
+ * @param drive 
+ * @return uint64_t 
+ */
+uint64_t vfs_disk_size( uint64_t drive ) {
+	return UINT64_MAX;
+}
+
+/**
+ * @brief No readahead thread in the kernel, the window is read in by the reader with one large read
+ * 
+ * @param drive 
+ * @param first 
+ * @param count 
+ */
+static void vfs_readahead_queue( uint64_t drive, uint64_t first, uint64_t count ) {
+	vfs_cache_readahead( drive, first, count );
 }
 
 #endif
\ No newline at end of file
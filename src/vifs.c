@@ -17,7 +17,7 @@ vfs_filesystem -- fs data, inode counter, links to elsewhere
 
 vfs_register_fs() -- puts the fs into the kernel for use
 vfs_lookup( path ) -- returns inode associated with path
-vfs_mount( fs type, fs data root, fs path )
+vfs_mount( fs type, fs data root, fs path, write policy )
 
 
 --------------------FS Layer--------------------
@@ -44,14 +44,26 @@ FILE *fp;
 #define COMMAND_MKDIR 8
 #define COMMAND_CAT 9
 #define COMMAND_NEW 10
+#define COMMAND_BENCH 11
 
 #define WANT_PATH 0
 #define WANT_NAME 1
 
+#define VIFS_AFS_BLOCKDEV "afs0"		// block device the -afs-img image is attached as, drive 0
+#define VIFS_SCRATCH_BLOCKDEV "scratch"	// temp image the cache tests read and write raw pages on
+#define VIFS_SCRATCH_PAGES 5000
+
 #define INPUT_IS(x) strcmp( argv[i], x ) == 0
 #define verbosef( ... ) if( verbose == true ) printf( __VA_ARGS__ )
 
 bool verbose = false;
+uint8_t vifs_disk_backend = VFS_DISK_BACKEND_STDIO;
+char *vifs_disk_backend_names[VFS_DISK_BACKEND_MAX] = { "stdio", "mmap", "pread", "direct", "uring" };
+
+char vifs_thread_files[VIFS_THREAD_FILES_MAX][VFS_NAME_MAX * 2];
+uint64_t vifs_thread_sums[VIFS_THREAD_FILES_MAX];
+int vifs_thread_file_count = 0;
+int vifs_scratch = VFS_ERROR_NOT_A_DEVICE;
 
 int main( int argc, char *argv[] ) {
 	bool opt_afs_img = false;
@@ -98,9 +110,29 @@ int main( int argc, char *argv[] ) {
 			} else if( INPUT_IS( "-v" ) ) {
 				verbose = true;
 				expect_params = 0;
+			} else if( INPUT_IS( "-backend" ) && i + 1 < argc ) {
+				i++;
+				vifs_disk_backend = VFS_DISK_BACKEND_MAX;
+
+				for( int b = 0; b < VFS_DISK_BACKEND_MAX; b++ ) {
+					if( INPUT_IS( vifs_disk_backend_names[b] ) ) {
+						vifs_disk_backend = b;
+					}
+				}
+
+				if( vifs_disk_backend == VFS_DISK_BACKEND_MAX ) {
+					printf( "Unknown backend: %s.\n", argv[i] );
+					return 0;
+				}
+			} else if( INPUT_IS( "-qd" ) && i + 1 < argc ) {
+				i++;
+				vfs_disk_set_queue_depth_test( atoi( argv[i] ) );
 			} else if( INPUT_IS( "new" ) ) {
 				command = COMMAND_NEW;
 				expect_params = 1;
+			} else if( INPUT_IS( "bench" ) ) {
+				command = COMMAND_BENCH;
+				expect_params = 1;
 			} else {
 				printf( "Unexpected command.\n" );
 				return 0;
@@ -125,7 +157,7 @@ int main( int argc, char *argv[] ) {
 
 	vifs_vfs_initalize();
 
-	if( command == COMMAND_NEW || command == COMMAND_RUN_OS_TESTS || command == COMMAND_HELP || command == COMMAND_BOOTSTRAP ) {
+	if( command == COMMAND_NEW || command == COMMAND_RUN_OS_TESTS || command == COMMAND_HELP || command == COMMAND_BOOTSTRAP || command == COMMAND_BENCH ) {
 		// do nothing
 	} else {
 		if( afs_img != NULL ) {
@@ -135,14 +167,23 @@ int main( int argc, char *argv[] ) {
 		}
 	}
 
+	// Commands that write let dirty pages go out in the background as they run
+	if( command == COMMAND_CP || command == COMMAND_CPDIR || command == COMMAND_BOOTSTRAP || command == COMMAND_MKDIR ) {
+		vfs_flusher_start();
+	}
+
+	if( command == COMMAND_CAT ) {
+		vfs_readahead_start();
+	}
+
 	switch( command ) {
 		case COMMAND_CP:
 			vifs_cp( param_1, param_2 );
-			vfs_cache_flush_all();
+			vfs_sync();
 			break;
 		case COMMAND_CPDIR:
 			vifs_cpdir( param_1, param_2 );
-			vfs_cache_flush_all();
+			vfs_sync();
 			break;
 		case COMMAND_BOOTSTRAP:
 			if( afs_img == NULL ) {
@@ -151,7 +192,7 @@ int main( int argc, char *argv[] ) {
 				vifs_bootstrap( param_1, afs_img );
 			}
 
-			vfs_cache_flush_all();
+			vfs_sync();
 			break;
 		case COMMAND_RUN_OS_TESTS:
 			vifs_run_os_tests();
@@ -164,7 +205,7 @@ int main( int argc, char *argv[] ) {
 			break;
 		case COMMAND_MKDIR:
 			vifs_mkdir( param_1 );
-			vfs_cache_flush_all();
+			vfs_sync();
 			break;
 		case COMMAND_CAT:
 			vifs_cat( param_1 );
@@ -176,17 +217,30 @@ int main( int argc, char *argv[] ) {
 				vifs_new_drive_img( param_1, afs_img );
 			}
 			
+			break;
+		case COMMAND_BENCH:
+			if( afs_img == NULL ) {
+				vifs_bench( param_1, "afs.img" );
+			} else {
+				vifs_bench( param_1, afs_img );
+			}
+
 			break;
 		default:
 			printf( "Unknown command.\n" );
 	}
 
+	vfs_flusher_stop();
+	vfs_readahead_stop();
+
 	return 0;
 }
 
 void vifs_show_help( void ) {
 	printf( "vifs [command] [parameters] [options]\n" );
 	printf( "     Commands and Parameters:\n");
+	printf( "         bench <name>\n" );
+	printf( "              Runs a benchmark: inodes, handles, threads, cache, policy, flush, readahead, queue, plug, backends, all\n" );
 	printf( "         bootstrap <level>\n" );
 	printf( "              Formats a drive to a default state\n" );
 	printf( "              Level 0 = empty drive\n" );
@@ -209,6 +263,10 @@ void vifs_show_help( void ) {
 	printf( "     Options:\n" );
 	printf( "         -afs <afs_image_file>\n" );
 	printf( "              Specify afs file, otherwise use afs.img\n" );
+	printf( "         -backend <stdio|mmap|pread|direct|uring>\n" );
+	printf( "              How the image file is accessed, stdio by default\n" );
+	printf( "         -qd <depth>\n" );
+	printf( "              Requests in flight at once on the uring backend, 32 by default\n" );
 	printf( "         -v   Turns on verbose mode\n" );
 }
 
@@ -272,47 +330,74 @@ void vifs_cp( char *src, char *dest ) {
  * @param dest 
  */
 void vifs_cpdir( char *src, char *dest ) {
+	inode_id dir = vfs_lookup_inode( dest );
+
+	if( dir == 0 ) {
+		printf( "%s not found.\n", dest );
+		return;
+	}
+
+	vifs_cpdir_at( src, dir, dest );
+}
+
+/**
+ * @brief Copies a host directory into an already resolved vifs directory
+ * 
+ * Each level is created relative to its parent, so no destination path is
+ * walked from the root again.
+ * 
+ * @param src host directory
+ * @param dir vifs directory inode id
+ * @param dest vifs path of dir, only used for output
+ */
+void vifs_cpdir_at( char *src, uint64_t dir, char *dest ) {
 	verbosef( "cpdir from %s to %s\n", src, dest );
 
 	DIR *d;
-	struct dirent *dir;
+	struct dirent *dir_ent;
 	char src_loc_full[256];
 	char dest_loc_full[256];
 
 	d = opendir( src );
 
 	if(d) {
-		while( (dir = readdir(d)) != NULL ) {
+		while( (dir_ent = readdir(d)) != NULL ) {
 			memset( src_loc_full, 0, 256 );
 			memset( dest_loc_full, 0, 256 );
 
-			if( strcmp( dir->d_name, "." ) == 0 ) {
+			if( strcmp( dir_ent->d_name, "." ) == 0 ) {
 				// Skip and continue
 				continue;
 			}
 
-			if( strcmp( dir->d_name, ".." ) == 0 ) {
+			if( strcmp( dir_ent->d_name, ".." ) == 0 ) {
 				// Skip and continue
 				continue;
 			}
 
 			strcpy( src_loc_full, src );
 			strcat( src_loc_full, "/" );
-			strcat( src_loc_full, dir->d_name );
+			strcat( src_loc_full, dir_ent->d_name );
 
 			strcpy( dest_loc_full, dest );
 			if( strcmp( dest, "/" ) != 0 ) {
 				strcat( dest_loc_full, "/" );
 			}
-			strcat( dest_loc_full, dir->d_name );
+			strcat( dest_loc_full, dir_ent->d_name );
 
 			printf( "%s -> %s\n", src_loc_full, dest_loc_full );
 
-			if( dir->d_type == DT_REG ) {
-				vifs_cp( src_loc_full, dest_loc_full );
-			} else if( dir->d_type == DT_DIR ) {
-				vifs_mkdir( dest_loc_full );
-				vifs_cpdir( src_loc_full, dest_loc_full );
+			if( dir_ent->d_type == DT_REG ) {
+				vifs_cp_at( src_loc_full, dir, dir_ent->d_name );
+			} else if( dir_ent->d_type == DT_DIR ) {
+				int sub_dir = vfs_create_at( dir, VFS_INODE_TYPE_DIR, dir_ent->d_name );
+
+				if( sub_dir < 0 ) {
+					vfs_panic( "Could not create %s\n", dir_ent->d_name );
+					continue;
+				}
+
+				vifs_cpdir_at( src_loc_full, sub_dir, dest_loc_full );
 			}
 		}
 
@@ -417,6 +502,26 @@ void vifs_parse_pathname( char *pathname, int path_or_name, char *data ) {
 	}
 }
 
+/**
+ * @brief Attaches the just opened image as VIFS_AFS_BLOCKDEV and switches it to the -backend one, staying on stdio if it can't be used
+ * 
+ * @param image 
+ * @return bool false if it couldn't be attached
+ */
+static bool vifs_disk_attach( FILE *image ) {
+	int drive = vfs_disk_attach_test( VIFS_AFS_BLOCKDEV, image );
+
+	if( drive < 0 ) {
+		return false;
+	}
+
+	if( vfs_disk_backend_test( drive, vifs_disk_backend ) != VFS_ERROR_NONE ) {
+		printf( "Could not use the %s backend, using %s.\n", vifs_disk_backend_names[vifs_disk_backend], vifs_disk_backend_names[vfs_disk_backend_get_test( drive )] );
+	}
+
+	return true;
+}
+
 /**
  * @brief 
  * 
@@ -440,6 +545,7 @@ void vifs_bootstrap( char *level, char *afs_image ) {
 	
 	// Boostrap afs.img
 	afs_bootstrap( fp, size );
+	vifs_disk_attach( fp );
 
 	if( atoi(level) == 1 ) {
 		char hello_data[] = "World of AFS!";
@@ -495,7 +601,13 @@ int vifs_vfs_initalize( void ) {
  * @return int 
  */
 int vifs_afs_initalize( char *afs_img ) {
-	fp = fopen( "afs.img", "r+" );
+	fp = fopen( afs_img, "r+" );
+
+	if( fp == NULL || !vifs_disk_attach( fp ) ) {
+		printf( "Could not open %s.\n", afs_img );
+
+		return 1;
+	}
 
 	// Initalize AFS
 	int afs_init_err = afs_initalize();
@@ -507,13 +619,15 @@ int vifs_afs_initalize( char *afs_img ) {
 	verbosef( "AFS initalizing done.\n" );
 	
 	// Mount AFS
-	int afs_mount_err = vfs_mount( FS_TYPE_AFS, NULL, "/" );
+	int afs_mount_err = vfs_mount( FS_TYPE_AFS, (uint8_t *)VIFS_AFS_BLOCKDEV, "/", VFS_WRITE_BACK );
 	if( afs_mount_err != 0 ) {
 		printf( "Could not mount afs drive.\n" );
 
 		return 1;
 	}
 	verbosef( "Mounted afs to /.\n" );
+
+	return 0;
 }
 
 /**
@@ -525,6 +639,12 @@ int vifs_run_os_tests( void ) {
 	// Open and size afs.img
 	fp = fopen( "afs.img", "r+" );
 
+	if( fp == NULL || !vifs_disk_attach( fp ) ) {
+		vfs_panic( "Could not open afs.img.\n" );
+
+		return 1;
+	}
+
 	// Initalize AFS
 	int afs_init_err = afs_initalize();
 	if( afs_init_err != 0 ) {
@@ -535,7 +655,7 @@ int vifs_run_os_tests( void ) {
 	vfs_debugf( "AFS initalizing done.\n" );
 	
 	// Mount AFS
-	int afs_mount_err = vfs_mount( FS_TYPE_AFS, NULL, "/" );
+	int afs_mount_err = vfs_mount( FS_TYPE_AFS, (uint8_t *)VIFS_AFS_BLOCKDEV, "/", VFS_WRITE_BACK );
 	if( afs_mount_err != 0 ) {
 		vfs_panic( "Could not mount afs drive.\n" );
 
@@ -557,7 +677,7 @@ int vifs_run_os_tests( void ) {
 	vfs_debugf( "RFS initalizing done.\n" );
 
 	// Mount RFS
-	int mount_err = vfs_mount( FS_TYPE_RFS, NULL, "/proc" );
+	int mount_err = vfs_mount( FS_TYPE_RFS, NULL, "/proc", VFS_WRITE_BACK );
 	if( mount_err != 0 ) {
 		vfs_panic( "Could not mount root fs.\n" );
 
@@ -565,7 +685,7 @@ int vifs_run_os_tests( void ) {
 	}
 	vfs_debugf( "Mounted RFS /proc.\n" );
 
-	int mount_err2 = vfs_mount( FS_TYPE_RFS, NULL, "/dev" );
+	int mount_err2 = vfs_mount( FS_TYPE_RFS, NULL, "/dev", VFS_WRITE_BACK );
 	if( mount_err != 0 ) {
 		vfs_panic( "Could not mount /dev fs.\n" );
 
@@ -577,159 +697,2261 @@ int vifs_run_os_tests( void ) {
 
 	vfs_test_ramfs();
 	vfs_test_afs();
+	vfs_test_handle_throughput();
+	vfs_test_readv();
+	vfs_test_read_ref();
+	vfs_test_inode_eviction();
+	vfs_test_lookup_at();
+	vfs_test_cache_policy( VFS_CACHE_POLICY_CLOCK );
+	vfs_test_cache_policy( VFS_CACHE_POLICY_2Q );
+	vfs_test_writeback();
+	vfs_test_write_error();
+	vfs_test_cache_ranges();
+	vfs_test_metrics();
+	vfs_test_cache_classes();
+	vfs_test_write_policy();
+	vfs_test_disk_queue();
+	vfs_test_blockdevs();
+	vfs_test_disk_plug();
+	vfs_test_threads();
 
 	vfs_cache_diagnostic();
+	vfs_memory_diagnostic();
 }
 
 /**
- * @brief 
+ * @brief Runs the named benchmark
  * 
+ * @param name 
+ * @param afs_image image to mount for benchmarks that need a drive
  */
-void vfs_test_afs( void ) {
-	vfs_test_ls( "/" );
-	vfs_test_ls( "/share" );
-	vfs_test_ls( "/share/test_data" );
-	vfs_test_ls( "/home/adam" );
-	
-	vfs_test_cat( "/home/adam/magic" );
-	
-	//vfs_test_cat( "/share/test_data/picard_history.txt" );
+void vifs_bench( char *name, char *afs_image ) {
+	bool all = strcmp( name, "all" ) == 0;
+	bool ran = false;
 
-	vifs_mkdir( "/usr" );
-	vifs_mkdir( "/usr/bin" );
-	//vfs_test_cat( "/share/test_data/picard_history.txt" );
+	if( all || strcmp( name, "handles" ) == 0 ) {
+		if( vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_test_handle_throughput();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "threads" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_threads();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "inodes" ) == 0 ) {
+		vfs_bench_inode_lookup();
+		ran = true;
+	}
+
+	if( all || strcmp( name, "cache" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_page_cache();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "flush" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_flush();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "readahead" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_readahead();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "policy" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_cache_policy();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "queue" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_queue_depth();
+		}
+
+		ran = true;
+	}
+
+	if( all || strcmp( name, "plug" ) == 0 ) {
+		if( all || vifs_afs_initalize( afs_image ) == 0 ) {
+			vfs_bench_disk_plug();
+		}
 
-	afs_dump_diagnostic_data();
+		ran = true;
+	}
+
+	if( all || strcmp( name, "backends" ) == 0 ) {
+		vfs_bench_backends();
+		ran = true;
+	}
+
+	if( !ran ) {
+		printf( "Unknown benchmark: %s\n", name );
+	}
 }
 
 /**
- * @brief 
+ * @brief Returns a monotonic timestamp in nanoseconds
  * 
+ * @return uint64_t 
  */
-void vfs_test_ramfs( void ) {
-	char hello_data[] = "Hello, world!";
-	char hello_data_b[] = "Another testing file.\nMulti-line?\nWooho!\n";
-	char proc_build_num[] = "1984";
-	char proc_magic[] = "NCC-1701-D";
-	char ram0[] = "RAM file 0";
-	char ram1[] = "RAMM file 1";
+uint64_t vifs_bench_now_ns( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
 
-	vfs_test_create_file( "/dev", "ram0", ram0, sizeof(ram0) );
-	vfs_test_create_file( "/dev", "ram1", ram1, sizeof(ram1) );
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
 
-	vfs_test_create_file( "/proc", "test.txt", hello_data, sizeof(hello_data) );
-	vfs_test_create_file( "/proc", "test_2.txt", hello_data_b, sizeof(hello_data_b) );
-	vfs_test_create_dir( "/proc", "build" );
-	vfs_test_create_file( "/proc", "magic", proc_magic, sizeof(proc_magic) );
-	vfs_test_create_file( "/proc/build", "number", proc_build_num, sizeof(proc_build_num) );
+/**
+ * @brief Times random vfs_lookup_inode_ptr_by_id calls as the inode count grows
+ * 
+ * Lookup cost should stay flat regardless of how many inodes are loaded.
+ */
+void vfs_bench_inode_lookup( void ) {
+	uint64_t sizes[] = { 1000, 10000, 100000, 1000000 };
+	uint64_t lookups = 2000000;
+	uint64_t inodes = 1;
+	uint64_t seed = 88172645463325252ULL;
+
+	printf( "Inode lookup by id\n" );
+	printf( "    %10s %14s %10s\n", "inodes", "lookups", "ns/lookup" );
+
+	for( uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ ) {
+		while( inodes < sizes[s] ) {
+			vfs_inode *node = vfs_allocate_inode();
+
+			if( node == NULL ) {
+				printf( "Inode allocation failed at %ld.\n", inodes );
+				return;
+			}
 
-	vfs_test_ls( "/" );
-	vfs_test_ls( "/proc" );
-	vfs_test_ls( "/proc/build" );
-	vfs_test_ls( "/dev" );
-	
-	vfs_test_cat( "/proc/magic" );
-	vfs_test_cat( "/proc/build/number" );
-	vfs_test_cat( "/dev/ram0" );
-	vfs_test_cat( "/dev/ram1" );
+			node->type = VFS_INODE_TYPE_FILE;
+			inodes++;
+		}
+
+		uint64_t found = 0;
+		uint64_t start = vifs_bench_now_ns();
+
+		for( uint64_t i = 0; i < lookups; i++ ) {
+			// xorshift, so lookups don't walk the table in order
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+
+			if( vfs_lookup_inode_ptr_by_id( 1 + (seed % inodes) ) != NULL ) {
+				found++;
+			}
+		}
+
+		uint64_t elapsed = vifs_bench_now_ns() - start;
+
+		if( found != lookups ) {
+			printf( "    lookup failed: found %ld of %ld\n", found, lookups );
+		}
+
+		printf( "    %10ld %14ld %10.1f\n", inodes, lookups, (double)elapsed / lookups );
+	}
+
+	printf( "\n" );
 }
 
 /**
- * @brief Copies a file from the host drive into the vifs drive (and writes to disk as apporpriate)
+ * @brief Collects up to VIFS_THREAD_FILES_MAX files from the test image and checksums them
  * 
- * @param real_file_pathname 
- * @param vifs_name 
- * @param data 
- * @param size 
+ * @return int number of files found
  */
-void vfs_test_cp_real_file( char *real_file_pathname, char *vifs_path, char *vifs_name ) {
-	FILE *f = fopen( real_file_pathname, "r" );
+int vifs_thread_files_collect( void ) {
+	char *dirs[] = { "/", "/share", "/share/fonts", "/share/test_data", "/home/adam" };
 
-	if( f == NULL ) {
-		vfs_debugf( "Cannot copy %s, f returned NULL.\n", real_file_pathname );
-		return;
+	vifs_thread_file_count = 0;
+
+	for( uint32_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++ ) {
+		vfs_dir_iter it;
+		vfs_dirent *d = NULL;
+
+		if( vfs_opendir( vfs_lookup_inode( dirs[i] ), &it ) != VFS_ERROR_NONE ) {
+			continue;
+		}
+
+		while( (d = vfs_readdir( &it )) != NULL && vifs_thread_file_count < VIFS_THREAD_FILES_MAX ) {
+			if( d->type != VFS_INODE_TYPE_FILE ) {
+				continue;
+			}
+
+			char *path = vifs_thread_files[vifs_thread_file_count];
+			snprintf( path, VFS_NAME_MAX * 2, "%s%s%s", dirs[i], strcmp( dirs[i], "/" ) == 0 ? "" : "/", d->name );
+			vifs_thread_sums[vifs_thread_file_count] = vifs_thread_checksum( vfs_lookup_inode( path ) );
+			vifs_thread_file_count++;
+		}
+
+		vfs_closedir( &it );
 	}
 
-	struct stat file_meta;
-	stat( real_file_pathname, &file_meta );
+	return vifs_thread_file_count;
+}
 
-	uint8_t *buff = vfs_malloc( file_meta.st_size );
+/**
+ * @brief FNV-1a over a file's contents, read through vfs_read
+ * 
+ * @param id 
+ * @return uint64_t checksum, 0 if the file can't be read
+ */
+uint64_t vifs_thread_checksum( uint64_t id ) {
+	uint8_t buff[4096];
+	uint64_t hash = 14695981039346656037ULL;
+	vfs_stat_data stats;
 
-	if( fread( buff, file_meta.st_size, 1, f ) != 1 ) {
-		vfs_debugf( "Read failed on %s, fread returned not 1.\n", real_file_pathname );
-		return;
+	if( id == 0 || vfs_stat( id, &stats ) != VFS_ERROR_NONE ) {
+		return 0;
 	}
 
-	vfs_test_create_file( vifs_path, vifs_name, buff, file_meta.st_size );
+	for( uint64_t offset = 0; offset < stats.size; offset = offset + sizeof(buff) ) {
+		uint64_t len = sizeof(buff);
 
-	vfs_free( buff );
+		if( offset + len > stats.size ) {
+			len = stats.size - offset;
+		}
+
+		if( vfs_read( id, buff, len, offset ) < 0 ) {
+			return 0;
+		}
+
+		for( uint64_t i = 0; i < len; i++ ) {
+			hash = (hash ^ buff[i]) * 1099511628211ULL;
+		}
+	}
+
+	return hash;
 }
 
 /**
- * @brief Test creating a file
+ * @brief Thread body: looks up and reads the collected files, optionally creating RFS files
  * 
- * @param path 
- * @param name 
- * @param data 
- * @param size 
+ * Every read is checked against the single threaded checksum.
+ * 
+ * @param arg vifs_thread_work
+ * @return void* 
  */
-void vfs_test_create_file( char *path, char *name, uint8_t *data, uint64_t size ) {
-	int file_inode = vfs_create( VFS_INODE_TYPE_FILE, path, name );
-	if( file_inode < 0 ) {
-		vfs_panic( "Could not create %s\n", name );
-	}
+void *vifs_thread_worker( void *arg ) {
+	vifs_thread_work *work = (vifs_thread_work *)arg;
+	uint64_t seed = 88172645463325252ULL + work->index;
 
-	int write_err = vfs_write( file_inode, data, size, 0 );
-	if( write_err < 0 ) {
-		vfs_panic( "Error when writing.\n" );
+	for( uint64_t i = 0; i < work->iterations; i++ ) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		int f = seed % vifs_thread_file_count;
+
+		if( vifs_thread_checksum( vfs_lookup_inode( vifs_thread_files[f] ) ) != vifs_thread_sums[f] ) {
+			work->errors++;
+		}
+
+		work->ops++;
+
+		if( work->dir[0] == 0 || i % 25 != 0 ) {
+			continue;
+		}
+
+		// Create a file in this thread's own RFS directory, then read it back by path
+		char name[VFS_NAME_MAX];
+		char path[sizeof(work->dir) + VFS_NAME_MAX + 1];
+		uint8_t data[64];
+		uint8_t got[64];
+
+		snprintf( name, VFS_NAME_MAX, "f%ld", i );
+		snprintf( path, sizeof(path), "%s/%s", work->dir, name );
+		memset( data, 'a' + work->index, sizeof(data) );
+
+		int id = vfs_create( VFS_INODE_TYPE_FILE, work->dir, name );
+
+		if( id < 0 || vfs_write( id, data, sizeof(data), 0 ) < 0 ) {
+			work->errors++;
+			continue;
+		}
+
+		if( vfs_read( vfs_lookup_inode( path ), got, sizeof(got), 0 ) < 0 || memcmp( data, got, sizeof(got) ) != 0 ) {
+			work->errors++;
+		}
+
+		work->creates++;
 	}
+
+	vfs_thread_exit();
+
+	return NULL;
 }
 
 /**
- * @brief Test creating a directory
+ * @brief Runs count worker threads to completion
  * 
- * @param path 
- * @param name 
+ * @param work one vifs_thread_work per thread, filled in by the caller
+ * @param count 
+ * @return uint64_t elapsed nanoseconds
  */
-void vfs_test_create_dir( char *path, char *name ) {
-	int file_inode = vfs_mkdir( vfs_lookup_inode(path), path, name );
-	if( file_inode < 0 ) {
-		vfs_panic( "Could not create %s\n", name );
+uint64_t vifs_thread_run( vifs_thread_work *work, int count ) {
+	pthread_t threads[VIFS_THREADS_MAX];
+	uint64_t start = vifs_bench_now_ns();
+
+	for( int t = 0; t < count; t++ ) {
+		pthread_create( &threads[t], NULL, vifs_thread_worker, &work[t] );
 	}
+
+	for( int t = 0; t < count; t++ ) {
+		pthread_join( threads[t], NULL );
+	}
+
+	return vifs_bench_now_ns() - start;
 }
 
 /**
- * @brief Test listing a file
+ * @brief Aggregate lookup + read throughput as reader threads are added
  * 
- * @param path 
  */
-void vfs_test_ls( char *path ) {
-	char type_dir[] = "DIR ";
-	char type_file[] = "FILE";
-	char type_unknown[] = "????";
+void vfs_bench_threads( void ) {
+	int counts[] = { 1, 2, 4, 8 };
+	uint64_t iterations = 400;
+	vifs_thread_work work[VIFS_THREADS_MAX];
 
-	vfs_debugf( "Listing: %s\n", path );
-	vfs_directory_list *dir_list = vfs_malloc( sizeof(vfs_directory_list) );
-	vfs_get_directory_list( vfs_lookup_inode(path), dir_list );
+	if( vifs_thread_files_collect() == 0 ) {
+		printf( "Thread scaling: no test files found, skipping.\n\n" );
+		return;
+	}
 
-	for( int i = 0; i < dir_list->count; i++ ) {
-		char *type = NULL;
+	printf( "Thread scaling: lookup + full read of %d files\n", vifs_thread_file_count );
+	printf( "    %8s %10s %12s %8s\n", "threads", "ops", "ops/sec", "errors" );
 
-		vfs_inode *n = vfs_lookup_inode_ptr_by_id( dir_list->entry[i].id );
-		switch( n->type ) {
-			case VFS_INODE_TYPE_DIR:
-				type = type_dir;
-				break;
-			case VFS_INODE_TYPE_FILE:
-				type = type_file;
-				break;
-			default:
-				type = type_unknown;
+	for( uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++ ) {
+		uint64_t ops = 0;
+		uint64_t errors = 0;
+
+		memset( work, 0, sizeof(work) );
+
+		for( int t = 0; t < counts[c]; t++ ) {
+			work[t].index = t;
+			work[t].iterations = iterations;
+		}
+
+		uint64_t elapsed = vifs_thread_run( work, counts[c] );
+
+		for( int t = 0; t < counts[c]; t++ ) {
+			ops = ops + work[t].ops;
+			errors = errors + work[t].errors;
 		}
 
-		vfs_debugf( "    %03ld %s %s\n", dir_list->entry[i].id, type, dir_list->entry[i].name );
+		printf( "    %8d %10ld %12.0f %8ld\n", counts[c], ops, ops / (elapsed / 1e9), errors );
+	}
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Readers and RFS creators running at once, every result checked
+ * 
+ */
+void vfs_test_threads( void ) {
+	int count = 4;
+	uint64_t ops = 0;
+	uint64_t creates = 0;
+	uint64_t errors = 0;
+	vifs_thread_work work[VIFS_THREADS_MAX];
+
+	if( vifs_thread_files_collect() == 0 ) {
+		vfs_debugf( "Threads: no test files found, skipping.\n\n" );
+		return;
 	}
 
+	memset( work, 0, sizeof(work) );
+
+	for( int t = 0; t < count; t++ ) {
+		char name[VFS_NAME_MAX];
+
+		snprintf( name, VFS_NAME_MAX, "t%d", t );
+		snprintf( work[t].dir, sizeof(work[t].dir), "/proc/%s", name );
+		vfs_test_create_dir( "/proc", name );
+
+		work[t].index = t;
+		work[t].iterations = 100;
+	}
+
+	vifs_thread_run( work, count );
+
+	for( int t = 0; t < count; t++ ) {
+		ops = ops + work[t].ops;
+		creates = creates + work[t].creates;
+		errors = errors + work[t].errors;
+	}
+
+	vfs_debugf( "Threads: %d threads, %ld reads, %ld creates: %s\n\n", count, ops, creates, errors == 0 ? "ok" : "ERRORS" );
+}
+
+/**
+ * @brief Times small random cached disk reads as the number of cached pages grows
+ * 
+ * Every read is a page cache hit, so the cost should stay flat.
+ */
+void vfs_bench_page_cache( void ) {
+	uint64_t sizes[] = { 64, 512, 4096 };
+	uint64_t reads = 1000000;
+	uint64_t seed = 88172645463325252ULL;
+	uint8_t buff[64];
+
+	printf( "Page cache hits\n" );
+	printf( "    %10s %14s %10s\n", "pages", "reads", "ns/read" );
+
+	for( uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ ) {
+		// Warm every page first so the timed loop only sees hits
+		for( uint64_t p = 0; p < sizes[s]; p++ ) {
+			vfs_disk_read( 0, p * VFS_PAGE_SIZE, sizeof(buff), buff );
+		}
+
+		uint64_t start = vifs_bench_now_ns();
+
+		for( uint64_t i = 0; i < reads; i++ ) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+
+			uint64_t offset = (seed % sizes[s]) * VFS_PAGE_SIZE + (seed >> 52) % (VFS_PAGE_SIZE - sizeof(buff));
+
+			vfs_disk_read( 0, offset, sizeof(buff), buff );
+		}
+
+		uint64_t elapsed = vifs_bench_now_ns() - start;
+
+		printf( "    %10ld %14ld %10.1f\n", sizes[s], reads, (double)elapsed / reads );
+	}
+
+	// The same hits from more threads, shards keep them off each other's locks
+	int counts[] = { 1, 2, 4, 8 };
+	uint64_t hot_pages = 512;
+	vifs_thread_work work[VIFS_THREADS_MAX];
+	pthread_t threads[VIFS_THREADS_MAX];
+
+	for( uint64_t p = 0; p < hot_pages; p++ ) {
+		vfs_disk_read( 0, p * VFS_PAGE_SIZE, sizeof(buff), buff );
+	}
+
+	printf( "\nPage cache hits by thread, %ld pages\n", hot_pages );
+	printf( "    %10s %14s %14s\n", "threads", "reads", "reads/sec" );
+
+	for( uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++ ) {
+		uint64_t total = 0;
+
+		memset( work, 0, sizeof(work) );
+
+		uint64_t start = vifs_bench_now_ns();
+
+		for( int t = 0; t < counts[c]; t++ ) {
+			work[t].index = t;
+			work[t].iterations = reads / 4;
+			work[t].pages = hot_pages;
+			pthread_create( &threads[t], NULL, vifs_cache_hit_worker, &work[t] );
+		}
+
+		for( int t = 0; t < counts[c]; t++ ) {
+			pthread_join( threads[t], NULL );
+			total = total + work[t].ops;
+		}
+
+		uint64_t elapsed = vifs_bench_now_ns() - start;
+
+		printf( "    %10d %14ld %14.0f\n", counts[c], total, total / (elapsed / 1e9) );
+	}
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Page cache bench worker, iterations random 64 byte reads over the first pages pages
+ * 
+ * @param arg vifs_thread_work
+ * @return void* 
+ */
+void *vifs_cache_hit_worker( void *arg ) {
+	vifs_thread_work *work = arg;
+	uint64_t seed = 88172645463325252ULL ^ ((uint64_t)(work->index + 1) << 32);
+	uint8_t buff[64];
+
+	for( uint64_t i = 0; i < work->iterations; i++ ) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		uint64_t offset = (seed % work->pages) * VFS_PAGE_SIZE + (seed >> 52) % (VFS_PAGE_SIZE - sizeof(buff));
+
+		vfs_disk_read( 0, offset, sizeof(buff), buff );
+		work->ops++;
+	}
+
+	vfs_thread_exit();
+
+	return NULL;
+}
+
+/**
+ * @brief Empties the page cache of everything it can drop and puts the default budget back
+ * 
+ */
+void vifs_cache_drop( void ) {
+	vfs_cache_set_limit( 0 );
+	vfs_cache_set_limit( VFS_PAGE_CACHE_MAX_PAGES * VFS_PAGE_SIZE );
+}
+
+/**
+ * @brief Drive of a scratch image for tests that read and write raw pages, attached on first use
+ * 
+ * A temp file of VIFS_SCRATCH_PAGES pages, each filled with its own
+ * pattern, on the same backend as the AFS image. No file system owns any
+ * of it, so the tests can't damage the image they run on.
+ * 
+ * @return int drive, VFS_ERROR_ if it couldn't be made
+ */
+int vifs_scratch_drive( void ) {
+	if( vifs_scratch >= 0 ) {
+		return vifs_scratch;
+	}
+
+	FILE *image = tmpfile();
+	uint8_t *page = vfs_malloc( VFS_PAGE_SIZE );
+	bool ok = image != NULL && page != NULL;
+
+	for( uint64_t p = 0; p < VIFS_SCRATCH_PAGES && ok; p++ ) {
+		for( uint64_t i = 0; i < VFS_PAGE_SIZE; i++ ) {
+			page[i] = (uint8_t)(p * 31 + i * 7);
+		}
+
+		ok = fwrite( page, VFS_PAGE_SIZE, 1, image ) == 1;
+	}
+
+	if( page != NULL ) {
+		vfs_free( page );
+	}
+
+	if( !ok ) {
+		if( image != NULL ) {
+			fclose( image );
+		}
+
+		return VFS_ERROR_NOT_A_DEVICE;
+	}
+
+	fflush( image );
+	vifs_scratch = vfs_disk_attach_test( VIFS_SCRATCH_BLOCKDEV, image );
+
+	if( vifs_scratch >= 0 ) {
+		vfs_disk_backend_test( vifs_scratch, vifs_disk_backend );
+	}
+
+	return vifs_scratch;
+}
+
+/**
+ * @brief Rewrites a run of pages in shuffled order, leaving them dirty for the caller to write back
+ * 
+ * @param drive 
+ * @param first first page to dirty
+ * @param pages 
+ */
+void vifs_dirty_pages_shuffled( int drive, uint64_t first, uint64_t pages ) {
+	uint64_t seed = 88172645463325252ULL;
+	uint64_t *order = vfs_malloc( sizeof(uint64_t) * pages );
+	uint8_t *buff = vfs_malloc( VFS_PAGE_SIZE );
+
+	for( uint64_t i = 0; i < pages; i++ ) {
+		order[i] = first + i;
+	}
+
+	for( uint64_t i = pages - 1; i > 0; i-- ) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		uint64_t j = seed % (i + 1);
+		uint64_t swap = order[i];
+		order[i] = order[j];
+		order[j] = swap;
+	}
+
+	// Same bytes back, so the image doesn't change
+	for( uint64_t i = 0; i < pages; i++ ) {
+		vfs_disk_read( drive, order[i] * VFS_PAGE_SIZE, VFS_PAGE_SIZE, buff );
+		vfs_disk_write( drive, order[i] * VFS_PAGE_SIZE, VFS_PAGE_SIZE, buff );
+	}
+
+	vfs_free( buff );
+	vfs_free( order );
+}
+
+/**
+ * @brief Flush throughput of scattered dirty pages, one write per page against coalesced runs
+ * 
+ */
+void vfs_bench_flush( void ) {
+	uint64_t runs[] = { 1, VFS_FLUSH_RUN_PAGES };
+	uint64_t pages = 2048;
+	vfs_page_cache *cache = vfs_cache_get();
+	vfs_cache_counters before;
+	vfs_cache_counters after;
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		printf( "Flush: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	// Big enough that nothing gets written back before the timed flush
+	vfs_cache_set_limit( pages * 4 * VFS_PAGE_SIZE );
+
+	printf( "Flush: %ld dirty pages, dirtied in shuffled order\n", pages );
+	printf( "    %10s %10s %10s %10s\n", "max run", "writes", "ms", "MiB/s" );
+
+	for( uint32_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++ ) {
+		vifs_dirty_pages_shuffled( drive, 1000, pages );
+
+		cache->flush_run_pages = runs[r];
+
+		vfs_cache_sum( &before );
+
+		uint64_t start = vifs_bench_now_ns();
+
+		vfs_sync();
+
+		uint64_t elapsed = vifs_bench_now_ns() - start;
+
+		vfs_cache_sum( &after );
+
+		printf( "    %10ld %10ld %10.2f %10.1f\n", runs[r], after.flush_writes - before.flush_writes, elapsed / 1e6, (pages * VFS_PAGE_SIZE / 1048576.0) / (elapsed / 1e9) );
+	}
+
+	cache->flush_run_pages = VFS_FLUSH_RUN_PAGES;
+	vfs_cache_set_limit( VFS_PAGE_CACHE_MAX_PAGES * VFS_PAGE_SIZE );
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Runs this vifs binary in dir with its output dropped
+ * 
+ * @param dir 
+ * @param args argv for it, NULL terminated
+ * @return int its exit status, -1 if it couldn't be run
+ */
+static int vifs_run_self( char *dir, char **args ) {
+	pid_t pid = fork();
+
+	if( pid == 0 ) {
+		int null_fd = open( "/dev/null", O_WRONLY );
+
+		dup2( null_fd, STDOUT_FILENO );
+		dup2( null_fd, STDERR_FILENO );
+
+		if( chdir( dir ) == 0 ) {
+			execv( "/proc/self/exe", args );
+		}
+
+		_exit( 127 );
+	}
+
+	int status = 0;
+
+	if( pid < 0 || waitpid( pid, &status, 0 ) < 0 ) {
+		return -1;
+	}
+
+	return WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+}
+
+/**
+ * @brief Times a large cpdir and ostests on a fresh image with each disk backend
+ * 
+ * Every step runs as its own vifs process in a scratch directory, so each
+ * backend starts cold and the caller's afs.img is left alone.
+ */
+void vfs_bench_backends( void ) {
+	uint64_t files = 128;
+	uint64_t file_size = 64 * 1024;
+	uint64_t image_size = 32 * 1024 * 1024;
+	char dir[] = "/tmp/vifs_backends_XXXXXX";
+	char src[64];
+	char path[128];
+
+	if( mkdtemp( dir ) == NULL ) {
+		printf( "Disk backends: no scratch directory, skipping.\n\n" );
+		return;
+	}
+
+	sprintf( src, "%s/src", dir );
+	mkdir( src, 0755 );
+
+	uint8_t *data = vfs_malloc( file_size );
+
+	for( uint64_t f = 0; f < files; f++ ) {
+		for( uint64_t i = 0; i < file_size; i++ ) {
+			data[i] = (uint8_t)(i * 31 + f);
+		}
+
+		sprintf( path, "%s/file_%03ld", src, f );
+
+		FILE *out = fopen( path, "w" );
+
+		if( out != NULL ) {
+			fwrite( data, file_size, 1, out );
+			fclose( out );
+		}
+	}
+
+	vfs_free( data );
+
+	printf( "Disk backends: cpdir of %ld x %ld KiB files, then ostests, on a fresh %ld MiB image\n", files, file_size / 1024, image_size / (1024 * 1024) );
+	printf( "    %-8s %12s %12s\n", "backend", "cpdir ms", "ostests ms" );
+
+	sprintf( path, "%s/afs.img", dir );
+
+	for( int b = 0; b < VFS_DISK_BACKEND_MAX; b++ ) {
+		char *name = vifs_disk_backend_names[b];
+		char *bootstrap[] = { "vifs", "-backend", name, "bootstrap", "0", NULL };
+		char *cpdir[] = { "vifs", "-backend", name, "cpdir", src, "/", NULL };
+		char *ostests[] = { "vifs", "-backend", name, "ostests", NULL };
+		FILE *image = fopen( path, "w" );
+
+		if( image == NULL || ftruncate( fileno( image ), image_size ) != 0 ) {
+			printf( "    %-8s could not create the image\n", name );
+
+			if( image != NULL ) {
+				fclose( image );
+			}
+
+			continue;
+		}
+
+		fclose( image );
+
+		int err = vifs_run_self( dir, bootstrap );
+		uint64_t start = vifs_bench_now_ns();
+
+		err = err != 0 ? err : vifs_run_self( dir, cpdir );
+
+		uint64_t cpdir_ns = vifs_bench_now_ns() - start;
+
+		start = vifs_bench_now_ns();
+		err = err != 0 ? err : vifs_run_self( dir, ostests );
+
+		uint64_t ostests_ns = vifs_bench_now_ns() - start;
+
+		if( err != 0 ) {
+			printf( "    %-8s failed (%d)\n", name, err );
+			continue;
+		}
+
+		printf( "    %-8s %12.3f %12.3f\n", name, cpdir_ns / 1e6, ostests_ns / 1e6 );
+	}
+
+	for( uint64_t f = 0; f < files; f++ ) {
+		sprintf( path, "%s/file_%03ld", src, f );
+		unlink( path );
+	}
+
+	sprintf( path, "%s/afs.img", dir );
+	unlink( path );
+	rmdir( src );
+	rmdir( dir );
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Empties the page cache and drops the image from the host's, so the next reads go to the disk
+ */
+static void vifs_bench_cold( void ) {
+	vifs_cache_drop();
+	vfs_disk_drop_host_cache_test( 0 );
+}
+
+/**
+ * @brief Cold scattered and sequential reads on the pread backend and on io_uring at growing queue depths
+ * 
+ * Scattered reads are prefetches of VFS_DISK_SPLIT_PAGES page windows
+ * spread over the image, sequential ones readahead windows across it.
+ */
+void vfs_bench_queue_depth( void ) {
+	uint32_t depths[] = { 0, 1, 4, 16, 64 };	// 0 is the pread backend
+	uint64_t image_pages = vfs_disk_size( 0 ) >> VFS_PAGE_SHIFT;
+	uint64_t stride = 4 * VFS_DISK_SPLIT_PAGES;
+	uint32_t saved_depth = vfs_disk_queue_depth_test();
+	uint64_t first[64];
+	uint64_t count[64];
+
+	vfs_sync();
+
+	printf( "Disk queue: cold reads, %ld image pages\n", image_pages );
+	printf( "    %8s %6s %12s %10s %12s %10s\n", "backend", "depth", "scatter ms", "MiB/s", "seq ms", "MiB/s" );
+
+	for( uint32_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++ ) {
+		uint8_t backend = depths[d] == 0 ? VFS_DISK_BACKEND_PREAD : VFS_DISK_BACKEND_URING;
+
+		vfs_disk_set_queue_depth_test( depths[d] );
+
+		if( vfs_disk_backend_test( 0, backend ) != VFS_ERROR_NONE ) {
+			printf( "    %8s %6d could not be set up\n", vifs_disk_backend_names[backend], depths[d] );
+			continue;
+		}
+
+		// A prefetch asks for at most a quarter of the cache, 64 windows of 4 pages
+		uint64_t scatter = 0;
+
+		vifs_bench_cold();
+
+		uint64_t start = vifs_bench_now_ns();
+
+		for( uint64_t p = 0; p + VFS_DISK_SPLIT_PAGES <= image_pages; ) {
+			uint32_t n = 0;
+
+			while( n < sizeof(first) / sizeof(first[0]) && p + VFS_DISK_SPLIT_PAGES <= image_pages ) {
+				first[n] = p;
+				count[n] = VFS_DISK_SPLIT_PAGES;
+				n++;
+				p = p + stride;
+			}
+
+			scatter = scatter + vfs_cache_prefetch( 0, first, count, n );
+		}
+
+		uint64_t scatter_ns = vifs_bench_now_ns() - start;
+		uint64_t seq = 0;
+
+		vifs_bench_cold();
+
+		start = vifs_bench_now_ns();
+
+		for( uint64_t p = 0; p < image_pages; p = p + VFS_READAHEAD_MAX_PAGES ) {
+			seq = seq + vfs_cache_readahead( 0, p, VFS_READAHEAD_MAX_PAGES );
+		}
+
+		uint64_t seq_ns = vifs_bench_now_ns() - start;
+
+		printf( "    %8s %6d %12.2f %10.1f %12.2f %10.1f\n", vifs_disk_backend_names[backend], vfs_disk_queue_depth(), scatter_ns / 1e6, (scatter * VFS_PAGE_SIZE / 1048576.0) / (scatter_ns / 1e9), seq_ns / 1e6, (seq * VFS_PAGE_SIZE / 1048576.0) / (seq_ns / 1e9) );
+	}
+
+	vfs_disk_set_queue_depth_test( saved_depth );
+	vfs_disk_backend_test( 0, vifs_disk_backend );
+	vfs_cache_set_limit( VFS_PAGE_CACHE_MAX_PAGES * VFS_PAGE_SIZE );
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Cold sequential reads with readahead off, run by the reader and run by the readahead thread
+ * 
+ * Streams the whole image in page sized reads, then reads the test files
+ * through handles in 512 byte chunks, dropping the cache before each pass.
+ */
+void vfs_bench_readahead( void ) {
+	char *files[] = { "/share/fonts/gomme10x20n.bdf", "/share/test_data/picard_history.txt" };
+	char *modes[] = { "off", "inline", "thread" };
+	vfs_page_cache *cache = vfs_cache_get();
+	vfs_cache_counters stats;
+	uint64_t image_pages = vfs_disk_size( 0 ) >> VFS_PAGE_SHIFT;
+	uint64_t file_passes = 50;
+	uint8_t *buff = vfs_malloc( VFS_PAGE_SIZE );
+
+	printf( "Readahead: cold sequential reads, %ld image pages, %ld passes over the test files\n", image_pages, file_passes );
+	printf( "    %8s %8s %12s %10s %10s\n", "mode", "stream", "disk reads", "ms", "MiB/s" );
+
+	for( uint32_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++ ) {
+		cache->readahead_max = m == 0 ? 0 : VFS_READAHEAD_MAX_PAGES;
+
+		if( m == 2 ) {
+			vfs_readahead_start();
+		}
+
+		// Whole image, one page per read
+		vifs_cache_drop();
+
+		vfs_cache_sum( &stats );
+
+		uint64_t disk_reads = stats.fills + stats.readahead_windows;
+		uint64_t start = vifs_bench_now_ns();
+
+		for( uint64_t p = 0; p < image_pages; p++ ) {
+			vfs_disk_read( 0, p * VFS_PAGE_SIZE, VFS_PAGE_SIZE, buff );
+		}
+
+		uint64_t elapsed = vifs_bench_now_ns() - start;
+
+		vfs_cache_sum( &stats );
+
+		printf( "    %8s %8s %12ld %10.2f %10.1f\n", modes[m], "image", stats.fills + stats.readahead_windows - disk_reads, elapsed / 1e6, (image_pages * VFS_PAGE_SIZE / 1048576.0) / (elapsed / 1e9) );
+
+		// Files through handles, small reads
+		uint64_t bytes = 0;
+
+		disk_reads = stats.fills + stats.readahead_windows;
+		elapsed = 0;
+
+		for( uint64_t pass = 0; pass < file_passes; pass++ ) {
+			vifs_cache_drop();
+
+			start = vifs_bench_now_ns();
+
+			for( uint32_t f = 0; f < sizeof(files) / sizeof(files[0]); f++ ) {
+				inode_id id = vfs_lookup_inode( files[f] );
+				int handle = id != 0 ? vfs_open( id ) : -1;
+				int n = 0;
+
+				if( handle < 0 ) {
+					continue;
+				}
+
+				while( (n = vfs_handle_read( handle, buff, 512 )) > 0 ) {
+					bytes = bytes + n;
+				}
+
+				vfs_close( handle );
+			}
+
+			elapsed = elapsed + (vifs_bench_now_ns() - start);
+		}
+
+		vfs_cache_sum( &stats );
+
+		printf( "    %8s %8s %12ld %10.2f %10.1f\n", modes[m], "files", stats.fills + stats.readahead_windows - disk_reads, elapsed / 1e6, (bytes / 1048576.0) / (elapsed / 1e9) );
+
+		if( m == 2 ) {
+			vfs_readahead_stop();
+		}
+	}
+
+	cache->readahead_max = VFS_READAHEAD_MAX_PAGES;
+	vfs_free( buff );
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Checks that scattered dirty pages are sorted and merged into full runs
+ * 
+ */
+void vfs_test_writeback( void ) {
+	uint64_t pages = VFS_FLUSH_RUN_PAGES * 2;
+	vfs_cache_counters stats;
+	uint8_t before[64];
+	uint8_t after[64];
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		vfs_debugf( "Write back: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	vfs_cache_flush_all();
+	vfs_disk_read_no_cache( drive, 1000 * VFS_PAGE_SIZE + 10, sizeof(before), before );
+
+	vifs_dirty_pages_shuffled( drive, 1000, pages );
+
+	vfs_cache_sum( &stats );
+
+	uint64_t writes = stats.flush_writes;
+	uint64_t written = vfs_cache_writeback( 0, pages );
+
+	vfs_disk_read_no_cache( drive, 1000 * VFS_PAGE_SIZE + 10, sizeof(after), after );
+	vfs_cache_sum( &stats );
+
+	bool ok = written == pages && stats.flush_writes - writes == 2 && stats.dirty == 0 && memcmp( before, after, sizeof(before) ) == 0;
+
+	vfs_debugf( "Write back: %ld pages in %ld writes: %s\n\n", written, stats.flush_writes - writes, ok ? "ok" : "FAILED" );
+}
+
+/**
+ * @brief Checks that a page whose write back fails stays dirty and goes out once the drive takes it
+ * 
+ * The image is mapped on the mmap backend, which can't write past its end,
+ * then moved to pread, which grows the file. Neither write back nor
+ * eviction may drop the page meanwhile.
+ */
+void vfs_test_write_error( void ) {
+	uint64_t image_pages = 4;
+	uint64_t page = image_pages + 4;
+	uint8_t data[100];
+	uint8_t got[100];
+	vfs_cache_counters stats;
+	bool ok = true;
+	FILE *image = tmpfile();
+
+	if( image == NULL || ftruncate( fileno( image ), image_pages * VFS_PAGE_SIZE ) != 0 ) {
+		vfs_debugf( "Write errors: no temp file, skipping.\n\n" );
+		return;
+	}
+
+	int drive = vfs_disk_attach_test( "err0", image );
+
+	if( drive < 0 || vfs_disk_backend_test( drive, VFS_DISK_BACKEND_MMAP ) != VFS_ERROR_NONE ) {
+		vfs_debugf( "Write errors: no mmap backend, skipping.\n\n" );
+		return;
+	}
+
+	vfs_cache_flush_all();
+
+	memset( data, 'e', sizeof(data) );
+	vfs_disk_write( drive, page * VFS_PAGE_SIZE, sizeof(data), data );
+
+	uint64_t written = vfs_cache_writeback( 0, VFS_FLUSH_BATCH_PAGES );
+
+	vfs_cache_sum( &stats );
+	ok = written == 0 && stats.dirty == 1 && vfs_cache_flush_all() != VFS_ERROR_NONE && vfs_sync() != VFS_ERROR_NONE;
+
+	// Eviction can't drop it either
+	vifs_cache_drop();
+	vfs_cache_sum( &stats );
+	ok = ok && stats.dirty == 1;
+
+	// Write through held by a plug only reaches the disk at the unplug, which has to report it
+	uint8_t mount = VFS_METRICS_MOUNTS - 1;
+
+	vfs_set_write_policy( mount, VFS_WRITE_THROUGH );
+	vfs_io_hint hint = vfs_io_hint_set( mount, VFS_IO_CLASS_FILE, VFS_CACHE_CLASS_NORMAL, 0 );
+
+	vfs_disk_plug();
+	vfs_disk_write( drive, (page + 1) * VFS_PAGE_SIZE, sizeof(data), data );
+	int unplugged = vfs_disk_unplug();
+
+	vfs_io_hint_restore( hint );
+	vfs_set_write_policy( mount, VFS_WRITE_BACK );
+	vfs_cache_sum( &stats );
+
+	ok = ok && unplugged != VFS_ERROR_NONE && stats.dirty == 2;
+
+	ok = ok && vfs_disk_backend_test( drive, VFS_DISK_BACKEND_PREAD ) == VFS_ERROR_NONE;
+	ok = ok && vfs_cache_flush_all() == VFS_ERROR_NONE;
+	vfs_cache_sum( &stats );
+
+	ok = ok && stats.dirty == 0 && vfs_disk_read_no_cache( drive, page * VFS_PAGE_SIZE, sizeof(got), got ) && memcmp( got, data, sizeof(data) ) == 0;
+	ok = ok && vfs_disk_read_no_cache( drive, (page + 1) * VFS_PAGE_SIZE, sizeof(got), got ) && memcmp( got, data, sizeof(data) ) == 0;
+
+	vfs_debugf( "Write errors: failed write back and plugged write through stay dirty until the drive takes them: %s\n\n", ok ? "ok" : "FAILED" );
+}
+
+/**
+ * @brief Checks partial page writes, reads served from the valid range and completion of partly valid pages
+ * 
+ */
+void vfs_test_cache_ranges( void ) {
+	vfs_cache_counters stats;
+	uint64_t page = 1200;
+	uint64_t base = page * VFS_PAGE_SIZE;
+	uint8_t first[100];
+	uint8_t second[100];
+	bool ok = true;
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		vfs_debugf( "Cache ranges: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	uint8_t *orig = vfs_malloc( VFS_PAGE_SIZE * 2 );
+	uint8_t *expect = vfs_malloc( VFS_PAGE_SIZE * 2 );
+	uint8_t *buff = vfs_malloc( VFS_PAGE_SIZE * 2 );
+
+	// Start with neither page cached
+	vifs_cache_drop();
+
+	vfs_disk_read_no_cache( drive, base, VFS_PAGE_SIZE * 2, orig );
+	memcpy( expect, orig, VFS_PAGE_SIZE * 2 );
+
+	for( uint32_t i = 0; i < sizeof(first); i++ ) {
+		first[i] = ~orig[100 + i];
+		second[i] = ~orig[300 + i];
+	}
+
+	memcpy( expect + 100, first, sizeof(first) );
+	memcpy( expect + 300, second, sizeof(second) );
+	memcpy( expect + VFS_PAGE_SIZE + 500, first, sizeof(first) );
+
+	vfs_cache_sum( &stats );
+
+	uint64_t fills = stats.fills;
+	uint64_t partial_fills = stats.partial_fills;
+
+	// A partial write allocates the page without reading it, reads inside it hit
+	vfs_disk_write( drive, base + 100, sizeof(first), first );
+	vfs_disk_read( drive, base + 120, 60, buff );
+	vfs_cache_sum( &stats );
+
+	ok = ok && stats.fills == fills && stats.partial_fills == partial_fills && memcmp( buff, first + 20, 60 ) == 0;
+
+	// A write that doesn't touch the valid range reads in only what's missing
+	vfs_disk_write( drive, base + 300, sizeof(second), second );
+	vfs_disk_read( drive, base, VFS_PAGE_SIZE, buff );
+	vfs_cache_sum( &stats );
+
+	ok = ok && stats.fills == fills && stats.partial_fills == partial_fills + 1 && memcmp( buff, expect, VFS_PAGE_SIZE ) == 0;
+
+	// A page that is never completed writes back only its valid bytes
+	vfs_disk_write( drive, base + VFS_PAGE_SIZE + 500, sizeof(first), first );
+	vfs_cache_flush_all();
+	vfs_disk_read_no_cache( drive, base, VFS_PAGE_SIZE * 2, buff );
+	vfs_cache_sum( &stats );
+
+	ok = ok && stats.fills == fills && memcmp( buff, expect, VFS_PAGE_SIZE * 2 ) == 0;
+
+	vfs_disk_write( drive, base, VFS_PAGE_SIZE * 2, orig );
+	vfs_cache_flush_all();
+
+	vfs_debugf( "Cache ranges: %s\n\n", ok ? "ok" : "FAILED" );
+
+	vfs_free( buff );
+	vfs_free( expect );
+	vfs_free( orig );
+}
+
+/**
+ * @brief Reads every other page from first with the given cache class
+ * 
+ * @param drive 
+ * @param first page index
+ * @param pages 
+ * @param cache_class VFS_CACHE_CLASS_
+ * @return uint64_t cache misses taken
+ */
+static uint64_t vifs_read_pages_as( int drive, uint64_t first, uint64_t pages, uint8_t cache_class ) {
+	vfs_cache_counters stats;
+	uint8_t buff[64];
+
+	vfs_cache_sum( &stats );
+
+	uint64_t misses = stats.misses;
+	vfs_io_hint hint = vfs_io_hint_set( 0, VFS_IO_CLASS_OTHER, cache_class, 0 );
+
+	for( uint64_t p = first; p < first + pages * 2; p += 2 ) {
+		vfs_disk_read( drive, p * VFS_PAGE_SIZE, sizeof(buff), buff );
+	}
+
+	vfs_io_hint_restore( hint );
+	vfs_cache_sum( &stats );
+
+	return stats.misses - misses;
+}
+
+/**
+ * @brief Checks that pinned pages outlive a scan and that a streaming read evicts only its own pages
+ * 
+ */
+void vfs_test_cache_classes( void ) {
+	uint64_t budget = 256;
+	uint64_t scan = 1500;
+	bool ok = true;
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		vfs_debugf( "Cache classes: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	vfs_cache_flush_all();
+	vfs_cache_set_limit( 0 );
+	vfs_cache_set_limit( budget * VFS_PAGE_SIZE );
+
+	// Metadata read pinned survives a normal scan several times the cache
+	vifs_read_pages_as( drive, 1400, 16, VFS_CACHE_CLASS_PINNED );
+	vifs_read_pages_as( drive, 1500, scan, VFS_CACHE_CLASS_NORMAL );
+
+	ok = ok && vifs_read_pages_as( drive, 1400, 16, VFS_CACHE_CLASS_PINNED ) == 0;
+
+	// A streaming copy through the same cache leaves normal pages alone
+	vfs_cache_set_limit( 0 );
+	vfs_cache_set_limit( budget * VFS_PAGE_SIZE );
+
+	vifs_read_pages_as( drive, 1400, 64, VFS_CACHE_CLASS_NORMAL );
+	vifs_read_pages_as( drive, 1500, scan, VFS_CACHE_CLASS_STREAM );
+
+	ok = ok && vifs_read_pages_as( drive, 1400, 64, VFS_CACHE_CLASS_NORMAL ) == 0;
+
+	vfs_cache_counters stats;
+	vfs_cache_sum( &stats );
+
+	vfs_debugf( "Cache classes: %ld pinned, %ld stream after %ld pages through %ld: %s\n\n", stats.pinned, stats.streaming, scan, budget, ok ? "ok" : "FAILED" );
+
+	vfs_cache_set_limit( VFS_PAGE_CACHE_MAX_PAGES * VFS_PAGE_SIZE );
+}
+
+/**
+ * @brief Creates a file in the test's directory and writes size bytes of data to it
+ * 
+ * @param dir a directory right under /, created if missing
+ * @param name 
+ * @param data 
+ * @param size 
+ * @return inode_id the file, 0 on failure
+ */
+static inode_id vifs_test_file( char *dir, char *name, uint8_t *data, uint64_t size ) {
+	char path[VFS_NAME_MAX * 2 + 3];
+	inode_id parent = vfs_lookup_inode( dir );
+
+	if( parent == 0 ) {
+		int created = vfs_mkdir( vfs_lookup_inode( "/" ), "/", dir + 1 );
+		parent = created > 0 ? created : 0;
+	}
+
+	snprintf( path, sizeof(path), "%s/%s", dir, name );
+	inode_id id = parent != 0 ? vfs_lookup_inode( path ) : 0;
+
+	if( parent != 0 && id == 0 ) {
+		int created = vfs_create_at( parent, VFS_INODE_TYPE_FILE, name );
+		id = created > 0 ? created : 0;
+	}
+
+	if( id != 0 && vfs_write( id, data, size, 0 ) < 0 ) {
+		return 0;
+	}
+
+	return id;
+}
+
+/**
+ * @brief Checks that vfs_fsync writes back only its file's pages, and the write through and write around mount policies
+ * 
+ */
+void vfs_test_write_policy( void ) {
+	uint64_t size = VFS_PAGE_SIZE * 3;
+	uint8_t *data = vfs_malloc( size );
+	uint8_t *back = vfs_malloc( size );
+	vfs_cache_counters stats;
+	bool ok = true;
+
+	vfs_cache_flush_all();
+
+	// Two files written back, the first fsync leaves the second's data dirty
+	memset( data, 'a', size );
+	inode_id a = vifs_test_file( "/fsync", "fsync_a", data, size );
+	memset( data, 'b', size );
+	inode_id b = vifs_test_file( "/fsync", "fsync_b", data, size );
+
+	vfs_cache_sum( &stats );
+	uint64_t dirty = stats.dirty;
+
+	ok = ok && a != 0 && b != 0 && vfs_fsync( a ) == VFS_ERROR_NONE;
+	vfs_cache_sum( &stats );
+	ok = ok && stats.dirty != 0 && stats.dirty < dirty;
+
+	vfs_fsync( b );
+	vfs_cache_sum( &stats );
+	ok = ok && stats.dirty == 0;
+
+	// An RFS file's id doesn't carry its fs id, only a missing inode is an error
+	ok = ok && vfs_fsync( vfs_lookup_inode( "/proc/metrics" ) ) == VFS_ERROR_NONE && vfs_fsync( 0 ) == VFS_ERROR_FILE_NOT_FOUND;
+
+	// Write through leaves nothing dirty
+	uint8_t fs_id = VFS_INODE_ID_FS( a );
+
+	vfs_set_write_policy( fs_id, VFS_WRITE_THROUGH );
+	memset( data, 'c', size );
+	inode_id c = vifs_test_file( "/fsync", "fsync_c", data, size );
+	vfs_cache_sum( &stats );
+
+	ok = ok && c != 0 && stats.dirty == 0;
+
+	// Write around doesn't bring pages in, reads still see what it wrote
+	vifs_cache_drop();
+	vfs_set_write_policy( fs_id, VFS_WRITE_AROUND );
+	vfs_cache_sum( &stats );
+
+	uint64_t pages = stats.pages;
+
+	memset( data, 'd', size );
+	vfs_write( c, data, size, 0 );
+	vfs_cache_sum( &stats );
+
+	ok = ok && stats.pages == pages && stats.dirty == 0;
+	ok = ok && vfs_read( c, back, size, 0 ) == (int)size && memcmp( back, data, size ) == 0;
+
+	vfs_set_write_policy( fs_id, VFS_WRITE_BACK );
+
+	vfs_debugf( "Write policy: fsync of one file, write through, write around: %s\n\n", ok ? "ok" : "FAILED" );
+
+	vfs_free( back );
+	vfs_free( data );
+}
+
+/**
+ * @brief Page sized write through writes back to front across a file, each on its own and all under one plug
+ * 
+ */
+void vfs_bench_disk_plug( void ) {
+	uint64_t pages = 256;
+	uint64_t rounds = 8;
+	uint64_t size = pages * VFS_PAGE_SIZE;
+	uint8_t *data = vfs_malloc( size );
+
+	memset( data, 'p', size );
+
+	inode_id id = vifs_test_file( "/plug", "plug_bench", data, size );
+	uint8_t fs_id = VFS_INODE_ID_FS( id );
+	int handle = vfs_open( id );
+
+	if( id == 0 || handle < 0 ) {
+		printf( "Disk plug: could not create the test file\n\n" );
+		vfs_free( data );
+		return;
+	}
+
+	vfs_fsync( id );
+	vfs_set_write_policy( fs_id, VFS_WRITE_THROUGH );
+
+	printf( "Disk plug: %ld page write through file written back to front %ld times\n", pages, rounds );
+	printf( "    %8s %12s %12s %10s\n", "plug", "ms", "disk writes", "MiB/s" );
+
+	for( int plugged = 0; plugged < 2; plugged++ ) {
+		vfs_metric before;
+		vfs_metric after;
+
+		vfs_metrics_sum( VFS_METRICS_ALL, VFS_METRICS_ALL, VFS_METRIC_DISK_WRITE, &before );
+
+		uint64_t start = vifs_bench_now_ns();
+
+		for( uint64_t r = 0; r < rounds; r++ ) {
+			if( plugged ) {
+				vfs_disk_plug();
+			}
+
+			for( uint64_t p = pages; p > 0; p-- ) {
+				vfs_handle_seek( handle, (p - 1) * VFS_PAGE_SIZE );
+				vfs_handle_write( handle, data + (p - 1) * VFS_PAGE_SIZE, VFS_PAGE_SIZE );
+			}
+
+			if( plugged ) {
+				vfs_disk_unplug();
+			}
+		}
+
+		uint64_t ns = vifs_bench_now_ns() - start;
+
+		vfs_metrics_sum( VFS_METRICS_ALL, VFS_METRICS_ALL, VFS_METRIC_DISK_WRITE, &after );
+
+		printf( "    %8s %12.2f %12ld %10.1f\n", plugged ? "one" : "each", ns / 1e6, after.count - before.count, (rounds * size / 1048576.0) / (ns / 1e9) );
+	}
+
+	vfs_close( handle );
+	vfs_set_write_policy( fs_id, VFS_WRITE_BACK );
+	vfs_free( data );
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Checks that plugged write through writes are held as dirty pages and go out sorted and merged at the unplug
+ * 
+ */
+void vfs_test_disk_plug( void ) {
+	uint64_t pages = 4;
+	uint64_t size = VFS_PAGE_SIZE * pages;
+	uint8_t *data = vfs_malloc( size );
+	uint8_t *back = vfs_malloc( size );
+	vfs_cache_counters stats;
+	bool ok = true;
+
+	vfs_cache_flush_all();
+
+	memset( data, 'p', size );
+	inode_id id = vifs_test_file( "/plug", "plug_file", data, size );
+	uint8_t fs_id = VFS_INODE_ID_FS( id );
+
+	ok = id != 0 && vfs_fsync( id ) == VFS_ERROR_NONE;
+
+	vfs_set_write_policy( fs_id, VFS_WRITE_THROUGH );
+	vfs_cache_sum( &stats );
+
+	uint64_t flush_writes = stats.flush_writes;
+
+	// Page sized writes back to front, each one plugged again inside the outer plug
+	int handle = vfs_open( id );
+
+	vfs_disk_plug();
+
+	for( uint64_t p = pages; p > 0 && handle >= 0; p-- ) {
+		memset( data + (p - 1) * VFS_PAGE_SIZE, 'q' + p, VFS_PAGE_SIZE );
+		vfs_handle_seek( handle, (p - 1) * VFS_PAGE_SIZE );
+		ok = ok && vfs_handle_write( handle, data + (p - 1) * VFS_PAGE_SIZE, VFS_PAGE_SIZE ) == VFS_PAGE_SIZE;
+	}
+
+	vfs_cache_sum( &stats );
+	ok = ok && handle >= 0 && stats.dirty >= pages;
+	ok = vfs_disk_unplug() == VFS_ERROR_NONE && ok;
+
+	if( handle >= 0 ) {
+		vfs_close( handle );
+	}
+
+	vfs_cache_sum( &stats );
+
+	uint64_t writes = stats.flush_writes - flush_writes;
+
+	ok = ok && stats.dirty == 0 && writes < pages;
+
+	// What the image holds after the unplug
+	vifs_cache_drop();
+
+	ok = ok && vfs_read( id, back, size, 0 ) == (int)size && memcmp( back, data, size ) == 0;
+
+	vfs_set_write_policy( fs_id, VFS_WRITE_BACK );
+
+	vfs_debugf( "Disk plug: %ld write through writes back to front in %ld disk writes: %s\n\n", pages, writes, ok ? "ok" : "FAILED" );
+
+	vfs_free( back );
+	vfs_free( data );
+}
+
+/**
+ * @brief Checks that hits, misses and disk reads are counted for the caller's hint and show up in /proc/metrics
+ * 
+ */
+void vfs_test_metrics( void ) {
+	uint8_t mount = VFS_METRICS_MOUNTS - 1;	// no mount here gets this fs id, so only this test counts in it
+	uint64_t addr = 1300 * VFS_PAGE_SIZE;
+	vfs_metric hits;
+	vfs_metric misses;
+	vfs_metric reads;
+	uint8_t buff[64];
+	char want[64];
+	bool ok = true;
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		vfs_debugf( "Metrics: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	vifs_cache_drop();
+
+	vfs_io_hint hint = vfs_io_hint_set( mount, VFS_IO_CLASS_META, VFS_CACHE_CLASS_NORMAL, 0 );
+
+	vfs_disk_read( drive, addr, sizeof(buff), buff );
+	vfs_disk_read( drive, addr + 100, sizeof(buff), buff );
+
+	vfs_io_hint_restore( hint );
+
+	vfs_metrics_sum( mount, VFS_IO_CLASS_META, VFS_METRIC_HIT, &hits );
+	vfs_metrics_sum( mount, VFS_IO_CLASS_META, VFS_METRIC_MISS, &misses );
+	vfs_metrics_sum( mount, VFS_IO_CLASS_META, VFS_METRIC_DISK_READ, &reads );
+
+	ok = hits.count == 1 && hits.bytes == sizeof(buff) && misses.count == 1 && reads.count >= 1;
+
+	// The same numbers, read back through the generated file
+	char *text = vfs_malloc( RFS_GENERATED_MAX );
+	int handle = vfs_open( vfs_lookup_inode( "/proc/metrics" ) );
+	int n = handle >= 0 ? vfs_handle_read( handle, (uint8_t *)text, RFS_GENERATED_MAX - 1 ) : -1;
+
+	if( handle >= 0 ) {
+		vfs_close( handle );
+	}
+
+	text[n > 0 ? n : 0] = '\0';
+	snprintf( want, sizeof(want), "\n%d meta hit 1 %ld ", mount, sizeof(buff) );
+
+	ok = ok && n > 0 && strstr( text, want ) != NULL;
+	ok = ok && vfs_write( vfs_lookup_inode( "/proc/metrics" ), buff, sizeof(buff), 0 ) == VFS_ERROR_READ_ONLY;
+
+	vfs_debugf( "Metrics: %ld hit, %ld miss, %ld disk reads, /proc/metrics %d bytes: %s\n\n", hits.count, misses.count, reads.count, n, ok ? "ok" : "FAILED" );
+
+	vfs_free( text );
+}
+
+/**
+ * @brief Hit ratio of each replacement policy on a hot set mixed with a long scan
+ * 
+ */
+void vfs_bench_cache_policy( void ) {
+	uint8_t policies[] = { VFS_CACHE_POLICY_CLOCK, VFS_CACHE_POLICY_2Q };
+	uint64_t budget = 256;
+	uint64_t hot_pages = 192;
+	uint64_t scan_first = 1000;
+	uint64_t scan_pages = 3000;
+	uint64_t accesses = 200000;
+	uint8_t buff[64];
+
+	printf( "Cache policy: %ld page budget, %ld hot pages, scan over %ld pages\n", budget, hot_pages, scan_pages );
+	printf( "    %8s %10s %10s %10s %8s\n", "policy", "hits", "misses", "evictions", "hit %" );
+
+	for( uint32_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++ ) {
+		vfs_cache_counters before;
+		vfs_cache_counters after;
+		uint64_t seed = 88172645463325252ULL;
+		uint64_t scan = 0;
+
+		// Drop everything cached, then start this policy from an empty cache
+		vfs_cache_set_limit( 0 );
+		vfs_cache_set_policy( policies[p] );
+		vfs_cache_set_limit( budget * VFS_PAGE_SIZE );
+
+		vfs_cache_sum( &before );
+
+		for( uint64_t i = 0; i < accesses; i++ ) {
+			uint64_t page = 0;
+
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+
+			if( seed % 4 != 0 ) {
+				page = 1 + (seed >> 8) % hot_pages;
+			} else {
+				page = scan_first + scan;
+				scan = (scan + 1) % scan_pages;
+			}
+
+			vfs_disk_read( 0, page * VFS_PAGE_SIZE, sizeof(buff), buff );
+		}
+
+		vfs_cache_sum( &after );
+
+		uint64_t hits = after.hits - before.hits;
+		uint64_t misses = after.misses - before.misses;
+		uint64_t evictions = after.evictions - before.evictions;
+
+		printf( "    %8s %10ld %10ld %10ld %8.1f\n", vfs_cache_get()->policy->name, hits, misses, evictions, 100.0 * hits / (hits + misses) );
+	}
+
+	vfs_cache_set_policy( VFS_CACHE_POLICY_CLOCK );
+	vfs_cache_set_limit( VFS_PAGE_CACHE_MAX_PAGES * VFS_PAGE_SIZE );
+
+	printf( "\n" );
+}
+
+/**
+ * @brief Reads and rewrites pages through a small cache, checking data and dirty write back
+ * 
+ * @param policy VFS_CACHE_POLICY_
+ */
+void vfs_test_cache_policy( uint8_t policy ) {
+	uint64_t budget = 32;
+	uint64_t pages = 200;
+	uint8_t got[64];
+	uint8_t want[64];
+	uint8_t original[64];
+	int failed = 0;
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		vfs_debugf( "Cache policy: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	vfs_cache_flush_all();
+	vfs_cache_set_policy( policy );
+	vfs_cache_set_limit( budget * VFS_PAGE_SIZE );
+
+	vfs_page_cache *cache = vfs_cache_get();
+	vfs_cache_counters stats;
+
+	vfs_cache_sum( &stats );
+
+	uint64_t dirty_evictions = stats.dirty_evictions;
+
+	// Rewrite a page with what it already holds, so it's dirty but the image doesn't change
+	vfs_disk_read( drive, 3 * VFS_PAGE_SIZE + 100, sizeof(original), original );
+	vfs_disk_write( drive, 3 * VFS_PAGE_SIZE + 100, sizeof(original), original );
+
+	for( uint64_t pass = 0; pass < 2; pass++ ) {
+		for( uint64_t p = 4; p < 4 + pages; p++ ) {
+			vfs_disk_read( drive, p * VFS_PAGE_SIZE + 100, sizeof(got), got );
+			vfs_disk_read_no_cache( drive, p * VFS_PAGE_SIZE + 100, sizeof(want), want );
+
+			if( memcmp( got, want, sizeof(got) ) != 0 ) {
+				failed++;
+			}
+
+			vfs_cache_sum( &stats );
+
+			if( stats.pages > cache->max_pages ) {
+				failed++;
+			}
+		}
+	}
+
+	// The dirty page had to be written back on its way out
+	vfs_disk_read_no_cache( drive, 3 * VFS_PAGE_SIZE + 100, sizeof(want), want );
+	vfs_cache_sum( &stats );
+
+	if( stats.dirty_evictions == dirty_evictions || memcmp( original, want, sizeof(want) ) != 0 ) {
+		failed++;
+	}
+
+	// From an empty cache, a read spanning pages past the stream's first
+	// read waits on a readahead window, each of its pages is still a miss
+	uint8_t span[4 * VFS_PAGE_SIZE];
+
+	vfs_cache_set_limit( 0 );
+	vfs_cache_set_limit( budget * VFS_PAGE_SIZE );
+	vfs_disk_read( drive, 4 * VFS_PAGE_SIZE, sizeof(got), got );
+	vfs_cache_sum( &stats );
+
+	uint64_t misses = stats.misses;
+	uint64_t hits = stats.hits;
+
+	vfs_disk_read( drive, 5 * VFS_PAGE_SIZE, sizeof(span), span );
+	vfs_cache_sum( &stats );
+
+	if( stats.misses == misses || stats.hits + stats.misses - hits - misses != sizeof(span) / VFS_PAGE_SIZE ) {
+		failed++;
+	}
+
+	vfs_debugf( "Cache policy %s: %ld pages twice through %ld: %s\n\n", cache->policy->name, pages, budget, failed == 0 ? "ok" : "FAILED" );
+
+	vfs_cache_set_policy( VFS_CACHE_POLICY_CLOCK );
+	vfs_cache_set_limit( VFS_PAGE_CACHE_MAX_PAGES * VFS_PAGE_SIZE );
+}
+
+/**
+ * @brief Compares sequential read throughput through a handle against id based reads
+ * 
+ */
+void vfs_test_handle_throughput( void ) {
+	char *candidates[] = {
+		"/share/fonts/gomme10x20n.bdf",
+		"/share/test_data/picard_history.txt",
+		"/usr/share/test_data/picard_history.txt",
+		"/home/adam/magic"
+	};
+	char *pathname = NULL;
+	inode_id id = 0;
+	uint64_t chunk = 512;
+	uint64_t passes = 200;
+	uint8_t buff[512];
+	vfs_stat_data stats;
+
+	for( uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]) && id == 0; i++ ) {
+		id = vfs_lookup_inode( candidates[i] );
+		pathname = candidates[i];
+	}
+
+	if( id == 0 || vfs_stat( id, &stats ) != VFS_ERROR_NONE || stats.size == 0 ) {
+		vfs_debugf( "Handle throughput: no test file found, skipping.\n\n" );
+		return;
+	}
+
+	// id based: every call re-resolves the inode, fs and block mapping
+	uint64_t id_bytes = 0;
+	uint64_t start = vifs_bench_now_ns();
+
+	for( uint64_t p = 0; p < passes; p++ ) {
+		for( uint64_t offset = 0; offset < stats.size; offset = offset + chunk ) {
+			uint64_t len = chunk;
+
+			if( offset + len > stats.size ) {
+				len = stats.size - offset;
+			}
+
+			if( vfs_read( id, buff, len, offset ) < 0 ) {
+				vfs_panic( "Error when reading.\n" );
+				return;
+			}
+
+			id_bytes = id_bytes + len;
+		}
+	}
+
+	uint64_t id_ns = vifs_bench_now_ns() - start;
+
+	// handle based: resolved once at open
+	uint64_t handle_bytes = 0;
+	int handle = vfs_open( id );
+
+	if( handle < 0 ) {
+		vfs_panic( "Could not open %s\n", pathname );
+		return;
+	}
+
+	start = vifs_bench_now_ns();
+
+	for( uint64_t p = 0; p < passes; p++ ) {
+		int n = 0;
+
+		vfs_handle_seek( handle, 0 );
+
+		while( (n = vfs_handle_read( handle, buff, chunk )) > 0 ) {
+			handle_bytes = handle_bytes + n;
+		}
+
+		if( n < 0 ) {
+			vfs_panic( "Error when reading handle.\n" );
+			break;
+		}
+	}
+
+	uint64_t handle_ns = vifs_bench_now_ns() - start;
+
+	vfs_close( handle );
+
+	// borrowed: parsed in place out of the cache, nothing is copied
+	uint64_t ref_bytes = 0;
+	uint64_t ref_sum = 0;
+
+	start = vifs_bench_now_ns();
+
+	for( uint64_t p = 0; p < passes; p++ ) {
+		vfs_page_ref ref;
+		int n = 0;
+
+		for( uint64_t offset = 0; (n = vfs_read_ref( id, offset, stats.size, &ref )) > 0; offset = offset + n ) {
+			for( int i = 0; i < n; i = i + chunk ) {
+				ref_sum = ref_sum + ref.data[i];
+			}
+
+			vfs_read_unref( &ref );
+			ref_bytes = ref_bytes + n;
+		}
+
+		if( n < 0 ) {
+			vfs_panic( "Error when borrowing.\n" );
+			break;
+		}
+	}
+
+	uint64_t ref_ns = vifs_bench_now_ns() - start;
+
+	vfs_debugf( "Handle throughput: %s, %d bytes, %ld byte reads x %ld passes\n", pathname, stats.size, chunk, passes );
+	vfs_debugf( "    id:     %10ld bytes in %8.3f ms, %8.1f MiB/s\n", id_bytes, id_ns / 1e6, (id_bytes / 1048576.0) / (id_ns / 1e9) );
+	vfs_debugf( "    handle: %10ld bytes in %8.3f ms, %8.1f MiB/s\n", handle_bytes, handle_ns / 1e6, (handle_bytes / 1048576.0) / (handle_ns / 1e9) );
+	vfs_debugf( "    ref:    %10ld bytes in %8.3f ms, %8.1f MiB/s\n", ref_bytes, ref_ns / 1e6, (ref_bytes / 1048576.0) / (ref_ns / 1e9) );
+	vfs_debugf( "\n" );
+}
+
+/**
+ * @brief Checks borrowed reads against copies, that a lent page outlives eviction, and the copy RFS hands out
+ * 
+ */
+void vfs_test_read_ref( void ) {
+	inode_id id = vfs_lookup_inode( "/share/fonts/gomme10x20n.bdf" );
+	vfs_cache_counters stats;
+	vfs_stat_data file;
+	vfs_page_ref first;
+	vfs_page_ref ref;
+	uint64_t refs = 0;
+	int n = 0;
+	bool ok = true;
+
+	if( id == 0 || vfs_stat( id, &file ) != VFS_ERROR_NONE ) {
+		vfs_debugf( "Read ref: no test file found, skipping.\n\n" );
+		return;
+	}
+
+	uint8_t *copy = vfs_malloc( file.size );
+
+	vfs_read( id, copy, file.size, 0 );
+	vfs_cache_sum( &stats );
+
+	uint64_t lends = stats.lends;
+
+	for( uint64_t offset = 0; (n = vfs_read_ref( id, offset, file.size, &ref )) > 0; offset = offset + n ) {
+		ok = ok && ref.page != NULL && offset + n <= file.size && memcmp( ref.data, copy + offset, n ) == 0;
+		vfs_read_unref( &ref );
+		refs++;
+	}
+
+	vfs_cache_sum( &stats );
+	ok = ok && n == 0 && stats.lends - lends == refs;
+
+	// A lent page stays put while everything else is evicted
+	n = vfs_read_ref( id, 100, 64, &first );
+	vifs_cache_drop();
+
+	ok = ok && n == 64 && memcmp( first.data, copy + 100, 64 ) == 0;
+	vfs_read_unref( &first );
+
+	// RFS can't lend pages, it gives a copy
+	char magic[] = "NCC-1701-D";
+
+	n = vfs_read_ref( vfs_lookup_inode( "/proc/magic" ), 0, sizeof(magic), &ref );
+	ok = ok && n > 0 && ref.page == NULL && memcmp( ref.data, magic, n ) == 0;
+	vfs_read_unref( &ref );
+
+	vfs_debugf( "Read ref: %d bytes in %ld pages: %s\n\n", file.size, refs, ok ? "ok" : "FAILED" );
+
+	vfs_free( copy );
+}
+
+/**
+ * @brief Checks batched disk requests against a single read, then writes the last pages of the image in a batch and puts them back
+ * 
+ */
+void vfs_test_disk_queue( void ) {
+	uint64_t pages = 64;
+	vfs_disk_request requests[64];
+	bool ok = true;
+	int drive = vifs_scratch_drive();
+
+	if( drive < 0 ) {
+		vfs_debugf( "Disk queue: no scratch drive, skipping.\n\n" );
+		return;
+	}
+
+	uint64_t end = vfs_disk_size( drive ) >> VFS_PAGE_SHIFT;
+
+	if( end < pages * 4 ) {
+		vfs_debugf( "Disk queue: image too small, skipping.\n\n" );
+		return;
+	}
+
+	uint64_t base = (end - pages) * VFS_PAGE_SIZE;
+	uint8_t *want = vfs_malloc( pages * VFS_PAGE_SIZE );
+	uint8_t *got = vfs_malloc( pages * VFS_PAGE_SIZE );
+	uint8_t *check = vfs_malloc( pages * VFS_PAGE_SIZE );
+
+	vfs_disk_read_no_cache( drive, base, pages * VFS_PAGE_SIZE, want );
+
+	// One request a page, submitted back to front
+	for( uint64_t p = 0; p < pages; p++ ) {
+		uint64_t at = pages - 1 - p;
+
+		requests[p].drive = drive;
+		requests[p].offset = base + at * VFS_PAGE_SIZE;
+		requests[p].length = VFS_PAGE_SIZE;
+		requests[p].data = got + at * VFS_PAGE_SIZE;
+		requests[p].write = false;
+	}
+
+	ok = ok && vfs_disk_io( requests, pages ) == VFS_ERROR_NONE && memcmp( got, want, pages * VFS_PAGE_SIZE ) == 0;
+
+	for( uint64_t i = 0; i < pages * VFS_PAGE_SIZE; i++ ) {
+		got[i] = (uint8_t)(i * 7 + 3);
+	}
+
+	for( uint64_t p = 0; p < pages; p++ ) {
+		requests[p].write = true;
+	}
+
+	ok = ok && vfs_disk_io( requests, pages ) == VFS_ERROR_NONE;
+
+	vfs_disk_read_no_cache( drive, base, pages * VFS_PAGE_SIZE, check );
+	ok = ok && memcmp( check, got, pages * VFS_PAGE_SIZE ) == 0;
+
+	requests[0].offset = base;
+	requests[0].length = pages * VFS_PAGE_SIZE;
+	requests[0].data = want;
+
+	ok = vfs_disk_io( requests, 1 ) == VFS_ERROR_NONE && ok;
+
+	vfs_disk_read_no_cache( drive, base, pages * VFS_PAGE_SIZE, check );
+	ok = ok && memcmp( check, want, pages * VFS_PAGE_SIZE ) == 0;
+
+	vfs_debugf( "Disk queue: %ld requests at depth %d: %s\n\n", pages * 2 + 1, vfs_disk_queue_depth(), ok ? "ok" : "FAILED" );
+
+	vfs_free( check );
+	vfs_free( got );
+	vfs_free( want );
+}
+
+/**
+ * @brief Mounts a second AFS image from its own block device and checks the two mounts keep their files apart
+ * 
+ */
+void vfs_test_blockdevs( void ) {
+	uint64_t size = 1024 * AFS_DEFAULT_BLOCK_SIZE;
+	uint8_t a[100];
+	uint8_t b[100];
+	uint8_t got[100];
+	bool ok = true;
+	FILE *image = tmpfile();
+
+	if( image == NULL || ftruncate( fileno( image ), size ) != 0 ) {
+		vfs_debugf( "Block devices: no temp file, skipping.\n\n" );
+		return;
+	}
+
+	// A fresh image on the same backend as the first, it stays attached for good
+	afs_bootstrap( image, size );
+	fflush( image );
+
+	int drive = vfs_disk_attach_test( "afs1", image );
+
+	if( drive > 0 ) {
+		vfs_disk_backend_test( drive, vifs_disk_backend );
+	}
+
+	if( vfs_lookup_inode( "/mnt" ) == 0 ) {
+		vfs_mkdir( 1, "/", "mnt" );
+	}
+
+	// A failed mount leaves the directory to the fs it was on
+	vfs_dir_iter it;
+
+	ok = ok && vfs_mount( FS_TYPE_AFS, (uint8_t *)"nodev", "/mnt", VFS_WRITE_BACK ) == VFS_ERROR_NOT_A_DEVICE;
+	ok = ok && vfs_opendir( vfs_lookup_inode( "/mnt" ), &it ) == VFS_ERROR_NONE;
+
+	if( ok ) {
+		vfs_closedir( &it );
+	}
+
+	ok = ok && drive > 0 && vfs_mount( FS_TYPE_AFS, (uint8_t *)"afs1", "/mnt", VFS_WRITE_BACK ) == VFS_ERROR_NONE;
+
+	// The same name on both mounts, each has to find its own
+	memset( a, 'a', sizeof(a) );
+	memset( b, 'b', sizeof(b) );
+
+	inode_id first = vifs_test_file( "/blockdev", "blockdev_file", a, sizeof(a) );
+	int second = ok ? vfs_create( VFS_INODE_TYPE_FILE, "/mnt", "blockdev_file" ) : 0;
+
+	ok = ok && first != 0 && second > 0 && VFS_INODE_ID_FS( first ) != VFS_INODE_ID_FS( second );
+	ok = ok && vfs_write( second, b, sizeof(b), 0 ) == sizeof(b);
+	ok = ok && vfs_read( vfs_lookup_inode( "/blockdev/blockdev_file" ), got, sizeof(got), 0 ) == sizeof(got) && memcmp( got, a, sizeof(a) ) == 0;
+	ok = ok && vfs_read( vfs_lookup_inode( "/mnt/blockdev_file" ), got, sizeof(got), 0 ) == sizeof(got) && memcmp( got, b, sizeof(b) ) == 0;
+
+	// Once written back the second file is on the second image
+	vfs_sync();
+
+	memset( got, 0, sizeof(got) );
+	ok = ok && vfs_disk_read_no_cache( drive, VFS_INODE_ID_LOCAL( second ) * AFS_DEFAULT_BLOCK_SIZE, sizeof(got), got ) && memcmp( got, b, sizeof(b) ) == 0;
+
+	vfs_debugf( "Block devices: same name on %s and afs1: %s\n\n", VIFS_AFS_BLOCKDEV, ok ? "ok" : "FAILED" );
+}
+
+/**
+ * @brief Checks vectored reads against single reads, and vectored writes on RFS
+ * 
+ */
+void vfs_test_readv( void ) {
+	inode_id id = vfs_lookup_inode( "/share/fonts/gomme10x20n.bdf" );
+	vfs_iovec iov[24];
+	uint8_t got[24][100];
+	uint8_t want[100];
+	bool ok = true;
+
+	if( id != 0 ) {
+		// Scattered, out of order, some adjacent and some with gaps
+		for( int i = 0; i < 24; i++ ) {
+			iov[i].data = got[i];
+			iov[i].size = 100;
+			iov[i].offset = ((i * 7) % 24) * 150 + ((i % 3) * 1000);
+		}
+
+		int n = vfs_readv( id, iov, 24 );
+
+		for( int i = 0; i < 24; i++ ) {
+			vfs_read( id, want, 100, iov[i].offset );
+
+			if( memcmp( want, got[i], 100 ) != 0 ) {
+				ok = false;
+			}
+		}
+
+		vfs_debugf( "readv %d bytes in 24 segments: %s\n", n, ok ? "match" : "MISMATCH" );
+	}
+
+	int file_inode = vfs_create( VFS_INODE_TYPE_FILE, "/proc", "iov" );
+	char part_a[] = "vectored ";
+	char part_b[] = "writes";
+	char part_c[] = "RFS ";
+	char result[32];
+	vfs_iovec wiov[3] = {
+		{ (uint8_t *)part_b, 6, 13 },
+		{ (uint8_t *)part_a, 9, 0 },
+		{ (uint8_t *)part_c, 4, 9 }
+	};
+
+	memset( result, 0, 32 );
+	vfs_writev( file_inode, wiov, 3 );
+	vfs_read( file_inode, (uint8_t *)result, 19, 0 );
+	vfs_debugf( "writev: \"%s\"\n\n", result );
+}
+
+/**
+ * @brief Looks up everything in a few AFS directories with tiny inode and dentry limits
+ * 
+ * Evicted inodes must come back with the same id and size.
+ */
+void vfs_test_inode_eviction( void ) {
+	char *dirs[] = { "/share", "/share/fonts", "/share/test_data", "/home", "/home/adam" };
+	char paths[32][VFS_NAME_MAX * 2];
+	inode_id ids[32];
+	uint64_t sizes[32];
+	int count = 0;
+	bool ok = true;
+
+	vfs_inode_set_limits( 2, 2 );
+
+	for( uint32_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++ ) {
+		vfs_dir_iter it;
+		vfs_dirent *d = NULL;
+
+		if( vfs_opendir( vfs_lookup_inode( dirs[i] ), &it ) != VFS_ERROR_NONE ) {
+			continue;
+		}
+
+		while( (d = vfs_readdir( &it )) != NULL && count < 32 ) {
+			snprintf( paths[count], VFS_NAME_MAX * 2, "%s/%s", dirs[i], d->name );
+			count++;
+		}
+
+		vfs_closedir( &it );
+	}
+
+	for( int pass = 0; pass < 2; pass++ ) {
+		for( int i = 0; i < count; i++ ) {
+			vfs_stat_data stats;
+			inode_id id = vfs_lookup_inode( paths[i] );
+
+			stats.size = 0;
+			vfs_stat( id, &stats );
+
+			if( pass == 0 ) {
+				ids[i] = id;
+				sizes[i] = stats.size;
+			} else if( ids[i] != id || sizes[i] != stats.size ) {
+				ok = false;
+			}
+		}
+	}
+
+	vfs_inode_set_limits( VFS_INODE_UNUSED_MAX, VFS_DCACHE_MAX );
+
+	vfs_debugf( "Inode eviction: %d paths looked up twice: %s\n\n", count, ok ? "match" : "MISMATCH" );
+}
+
+/**
+ * @brief Checks relative lookups and creates against their absolute path equivalents
+ * 
+ */
+void vfs_test_lookup_at( void ) {
+	inode_id share = vfs_lookup_inode( "/share" );
+	inode_id proc = vfs_lookup_inode( "/proc" );
+	uint8_t data[] = "relative";
+	uint8_t got[sizeof(data)];
+	int checks = 0;
+	int failed = 0;
+
+	if( share == 0 || proc == 0 ) {
+		vfs_debugf( "Lookup at: no /share or /proc, skipping.\n\n" );
+		return;
+	}
+
+	#define LOOKUP_AT_CHECK( x ) do { checks++; if( !(x) ) { vfs_debugf( "    failed: %s\n", #x ); failed++; } } while( 0 )
+
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, "fonts/../test_data/picard_history.txt" ) == vfs_lookup_inode( "/share/test_data/picard_history.txt" ) );
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, "./fonts/" ) == vfs_lookup_inode( "/share/fonts" ) );
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, "/hi.txt" ) == vfs_lookup_inode( "/hi.txt" ) );
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, ".." ) == vfs_lookup_inode( "/" ) );
+	LOOKUP_AT_CHECK( vfs_lookup_at( vfs_lookup_inode( "/" ), "../.." ) == vfs_lookup_inode( "/" ) );
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, "missing" ) == 0 );
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, "fonts/gomme10x20n.bdf/." ) == 0 );
+	LOOKUP_AT_CHECK( vfs_lookup_at( share, "fonts/gomme10x20n.bdf/.." ) == 0 );
+
+	int at = vfs_create_at( proc, VFS_INODE_TYPE_DIR, "at" );
+	int file = at > 0 ? vfs_create_at( at, VFS_INODE_TYPE_FILE, "file" ) : at;
+
+	LOOKUP_AT_CHECK( at > 0 && file > 0 );
+	LOOKUP_AT_CHECK( vfs_write( file, data, sizeof(data), 0 ) >= 0 );
+	LOOKUP_AT_CHECK( vfs_lookup_at( proc, "at/../at/file" ) == (inode_id)file );
+	LOOKUP_AT_CHECK( at > 0 && vfs_lookup_at( at, ".." ) == proc );
+	LOOKUP_AT_CHECK( at > 0 && vfs_lookup_at( at, "." ) == (inode_id)at );
+	LOOKUP_AT_CHECK( vfs_read( vfs_lookup_inode( "/proc/at/file" ), got, sizeof(got), 0 ) >= 0 && memcmp( data, got, sizeof(data) ) == 0 );
+	LOOKUP_AT_CHECK( vfs_create_at( proc, VFS_INODE_TYPE_FILE, ".." ) == VFS_ERROR_BAD_NAME );
+	LOOKUP_AT_CHECK( vfs_create_at( proc, VFS_INODE_TYPE_FILE, "a/b" ) == VFS_ERROR_BAD_NAME );
+	LOOKUP_AT_CHECK( vfs_create_at( file, VFS_INODE_TYPE_FILE, "c" ) == VFS_ERROR_NOT_A_DIRECTORY );
+	LOOKUP_AT_CHECK( at > 0 && vfs_create_at( at, VFS_INODE_TYPE_FILE, "file" ) == VFS_ERROR_OBJECT_ALREADY_IN_USE );
+
+	#undef LOOKUP_AT_CHECK
+
+	vfs_debugf( "Lookup at: %d checks: %s\n\n", checks, failed == 0 ? "ok" : "FAILED" );
+}
+
+/**
+ * @brief 
+ * 
+ */
+void vfs_test_afs( void ) {
+	vfs_test_ls( "/" );
+	vfs_test_ls( "/share" );
+	vfs_test_ls( "/share/test_data" );
+	vfs_test_ls( "/home/adam" );
+	
+	vfs_test_cat( "/home/adam/magic" );
+	
+	//vfs_test_cat( "/share/test_data/picard_history.txt" );
+
+	vifs_mkdir( "/usr" );
+	vifs_mkdir( "/usr/bin" );
+	//vfs_test_cat( "/share/test_data/picard_history.txt" );
+
+	afs_dump_diagnostic_data( 0 );
+}
+
+/**
+ * @brief 
+ * 
+ */
+void vfs_test_ramfs( void ) {
+	char hello_data[] = "Hello, world!";
+	char hello_data_b[] = "Another testing file.\nMulti-line?\nWooho!\n";
+	char proc_build_num[] = "1984";
+	char proc_magic[] = "NCC-1701-D";
+	char ram0[] = "RAM file 0";
+	char ram1[] = "RAMM file 1";
+
+	vfs_test_create_file( "/dev", "ram0", ram0, sizeof(ram0) );
+	vfs_test_create_file( "/dev", "ram1", ram1, sizeof(ram1) );
+
+	vfs_test_create_file( "/proc", "test.txt", hello_data, sizeof(hello_data) );
+	vfs_test_create_file( "/proc", "test_2.txt", hello_data_b, sizeof(hello_data_b) );
+	vfs_test_create_dir( "/proc", "build" );
+	vfs_test_create_file( "/proc", "magic", proc_magic, sizeof(proc_magic) );
+	vfs_test_create_file( "/proc/build", "number", proc_build_num, sizeof(proc_build_num) );
+
+	vfs_test_ls( "/" );
+	vfs_test_ls( "/proc" );
+	vfs_test_ls( "/proc/build" );
+	vfs_test_ls( "/dev" );
+	
+	vfs_test_cat( "/proc/magic" );
+	vfs_test_cat( "/proc/build/number" );
+	vfs_test_cat( "/dev/ram0" );
+	vfs_test_cat( "/dev/ram1" );
+}
+
+/**
+ * @brief Copies a file from the host drive into the vifs drive (and writes to disk as apporpriate)
+ * 
+ * @param real_file_pathname 
+ * @param vifs_name 
+ * @param data 
+ * @param size 
+ */
+void vfs_test_cp_real_file( char *real_file_pathname, char *vifs_path, char *vifs_name ) {
+	vifs_cp_at( real_file_pathname, vfs_lookup_inode( vifs_path ), vifs_name );
+}
+
+/**
+ * @brief Copies a file from the host drive into the given vifs directory
+ * 
+ * @param real_file_pathname 
+ * @param dir vifs directory inode id
+ * @param vifs_name 
+ */
+void vifs_cp_at( char *real_file_pathname, uint64_t dir, char *vifs_name ) {
+	FILE *f = fopen( real_file_pathname, "r" );
+
+	if( f == NULL ) {
+		vfs_debugf( "Cannot copy %s, f returned NULL.\n", real_file_pathname );
+		return;
+	}
+
+	struct stat file_meta;
+	stat( real_file_pathname, &file_meta );
+
+	uint8_t *buff = vfs_malloc( file_meta.st_size );
+
+	if( fread( buff, file_meta.st_size, 1, f ) != 1 ) {
+		vfs_debugf( "Read failed on %s, fread returned not 1.\n", real_file_pathname );
+		return;
+	}
+
+	fclose( f );
+
+	int file_inode = vfs_create_at( dir, VFS_INODE_TYPE_FILE, vifs_name );
+	if( file_inode < 0 ) {
+		vfs_panic( "Could not create %s\n", vifs_name );
+	} else {
+		bool streaming = vfs_io_stream( true );
+
+		if( vfs_write( file_inode, buff, file_meta.st_size, 0 ) < 0 ) {
+			vfs_panic( "Error when writing.\n" );
+		}
+
+		vfs_io_stream( streaming );
+	}
+
+	vfs_free( buff );
+}
+
+/**
+ * @brief Test creating a file
+ * 
+ * @param path 
+ * @param name 
+ * @param data 
+ * @param size 
+ */
+void vfs_test_create_file( char *path, char *name, uint8_t *data, uint64_t size ) {
+	int file_inode = vfs_create( VFS_INODE_TYPE_FILE, path, name );
+	if( file_inode < 0 ) {
+		vfs_panic( "Could not create %s\n", name );
+	}
+
+	int write_err = vfs_write( file_inode, data, size, 0 );
+	if( write_err < 0 ) {
+		vfs_panic( "Error when writing.\n" );
+	}
+}
+
+/**
+ * @brief Test creating a directory
+ * 
+ * @param path 
+ * @param name 
+ */
+void vfs_test_create_dir( char *path, char *name ) {
+	int file_inode = vfs_mkdir( vfs_lookup_inode(path), path, name );
+	if( file_inode < 0 && file_inode != VFS_ERROR_OBJECT_ALREADY_IN_USE ) {
+		vfs_panic( "Could not create %s\n", name );
+	}
+}
+
+/**
+ * @brief Test listing a file
+ * 
+ * @param path 
+ */
+void vfs_test_ls( char *path ) {
+	char type_dir[] = "DIR ";
+	char type_file[] = "FILE";
+	char type_unknown[] = "????";
+
+	vfs_debugf( "Listing: %s\n", path );
+
+	vfs_dir_iter it;
+	vfs_dirent *d = NULL;
+
+	if( vfs_opendir( vfs_lookup_inode(path), &it ) != VFS_ERROR_NONE ) {
+		vfs_debugf( "    cannot list %s\n\n", path );
+		return;
+	}
+
+	while( (d = vfs_readdir( &it )) != NULL ) {
+		char *type = NULL;
+
+		switch( d->type ) {
+			case VFS_INODE_TYPE_DIR:
+				type = type_dir;
+				break;
+			case VFS_INODE_TYPE_FILE:
+				type = type_file;
+				break;
+			default:
+				type = type_unknown;
+		}
+
+		vfs_debugf( "    %03ld %s %s\n", d->id, type, d->name );
+	}
+
+	vfs_closedir( &it );
+
 	vfs_debugf( "\n" );
 }
 
@@ -743,7 +2965,7 @@ void vfs_test_cat( char *pathname ) {
 
 	vfs_stat( vfs_lookup_inode(pathname), &stats );
 
-	char *data = vfs_malloc( stats.size );
+	char *data = vfs_malloc( stats.size + 1 );
 	int read_err = vfs_read( vfs_lookup_inode(pathname), data, stats.size, 0 );
 	if( read_err < 0 ) {
 		vfs_panic( "Error when reading.\n" );